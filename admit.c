@@ -0,0 +1,186 @@
+/**
+ * @file  admit.c
+ *
+ * @brief Admission control of the yash shell daemon
+ *
+ * New connections are checked right after accept(), before a thread or any
+ * session state is allocated for them:
+ *
+ * 	- Each source (the client's IP address, or its UID on a Unix listener) has
+ * 	  a token bucket: it may open `source_burst` connections at once, then
+ * 	  `source_rate` per second.
+ * 	- The process runs at most `session_cap` sessions, across all its shards
+ * 	  and listeners.
+ *
+ * A rejected connection gets a `BUSY reason` line instead of the prompt, and is
+ * closed. The reasons are counted, and logged on SIGUSR1.
+ *
+ * The buckets live in a fixed table. A source takes the least recently used of
+ * the ADMIT_PROBE slots it hashes to, so a flood of sources can only evict
+ * each other, and the table never grows.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+static admit_source_t admit_sources[ADMIT_SOURCES];	//! Token buckets
+static pthread_mutex_t admit_lock = PTHREAD_MUTEX_INITIALIZER;	//! Bucket lock
+static uint64_t admit_admitted = 0;					//! Connections admitted
+static uint64_t admit_rejected[ADMIT_REASONS];		//! Rejections by reason
+
+//! Reasons sent in the busy line, indexed by ADMIT_REJECT_*
+static const char *ADMIT_REASON_NAMES[] = {"rate", "sessions", "full"};
+
+
+/**
+ * @brief Get the rate limiter key of a connection's source
+ *
+ * @param	ps		Client socket
+ * @param	addr	Client address
+ * @return	Key (never 0), or 0 if the source is unknown
+ */
+static uint64_t sourceKey(int ps, const struct sockaddr_storage *addr) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (addr->ss_family == AF_INET) {
+		return (1ULL << 32) |
+				((const struct sockaddr_in *) addr)->sin_addr.s_addr;
+	}
+	if (addr->ss_family == AF_UNIX &&
+			getsockopt(ps, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0) {
+		return (2ULL << 32) | (uint32_t) cred.uid;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Take a token from a source's bucket
+ *
+ * @param	key		Source key
+ * @param	rate	Tokens added per second
+ * @param	burst	Bucket size
+ * @return	True if the source had a token, false if it must be rejected
+ */
+static bool takeToken(uint64_t key, uint64_t rate, uint64_t burst) {
+	uint32_t hash = (uint32_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32);
+	uint64_t now = nowUs();
+	admit_source_t *src = NULL;
+	admit_source_t *slot;
+	bool ok;
+
+	pthread_mutex_lock(&admit_lock);
+
+	// Find the source's bucket, or recycle the least recently used slot
+	for (int i=0; i<ADMIT_PROBE; i++) {
+		slot = &admit_sources[(hash + i) % ADMIT_SOURCES];
+		if (slot->key == key) {
+			src = slot;
+			break;
+		}
+		if (src == NULL || slot->last < src->last) {
+			src = slot;
+		}
+	}
+	if (src->key != key) {
+		src->key = key;
+		src->tokens = burst * 1000000;
+	} else {
+		// Tokens are counted in millionths, so refills need no division
+		src->tokens += (now - src->last) * rate;
+		if (src->tokens > burst * 1000000) {
+			src->tokens = burst * 1000000;
+		}
+	}
+	src->last = now;
+
+	ok = src->tokens >= 1000000;
+	if (ok) {
+		src->tokens -= 1000000;
+	}
+
+	pthread_mutex_unlock(&admit_lock);
+
+	return ok;
+}
+
+
+/**
+ * @brief Check a new connection against the admission limits
+ *
+ * Rejected connections are closed with rejectConnection().
+ *
+ * @param	ps		Client socket
+ * @param	addr	Client address
+ * @return	True if the connection is admitted, false if it was rejected
+ */
+bool admitConnection(int ps, const struct sockaddr_storage *addr) {
+	const config_t *cfg = getConfig();
+	uint64_t key;
+
+	if (cfg->source_rate > 0 && (key = sourceKey(ps, addr)) != 0 &&
+			!takeToken(key, cfg->source_rate, cfg->source_burst)) {
+		rejectConnection(ps, ADMIT_REJECT_RATE);
+		return false;
+	}
+
+	// Only a first look, admitSession() takes the slot
+	if (cfg->session_cap > 0 &&
+			activeSessions() >= (uint32_t) cfg->session_cap) {
+		rejectConnection(ps, ADMIT_REJECT_CAP);
+		return false;
+	}
+
+	__atomic_fetch_add(&admit_admitted, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+/**
+ * @brief Reject a connection with a busy line, and close it
+ *
+ * The line is sent without blocking: a client that does not read it just sees
+ * the connection close.
+ *
+ * @param	ps		Client socket
+ * @param	reason	ADMIT_REJECT_RATE, ADMIT_REJECT_CAP or ADMIT_REJECT_FULL
+ */
+void rejectConnection(int ps, int reason) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char msg[32];
+	int n;
+
+	n = snprintf(msg, sizeof(msg), "%s%s\n", MSG_TYPE_BUSY,
+			ADMIT_REASON_NAMES[reason]);
+	send(ps, msg, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(ps);
+	__atomic_fetch_add(&admit_rejected[reason], 1, __ATOMIC_RELAXED);
+
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Rejected connection: %s\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				ADMIT_REASON_NAMES[reason]);
+	}
+}
+
+
+/**
+ * @brief Log the admission counters
+ */
+void logAdmitStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Admission: admitted: %lu, "
+			"rejected: rate: %lu, sessions: %lu, full: %lu\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			__atomic_load_n(&admit_admitted, __ATOMIC_RELAXED),
+			__atomic_load_n(&admit_rejected[ADMIT_REJECT_RATE], __ATOMIC_RELAXED),
+			__atomic_load_n(&admit_rejected[ADMIT_REJECT_CAP], __ATOMIC_RELAXED),
+			__atomic_load_n(&admit_rejected[ADMIT_REJECT_FULL], __ATOMIC_RELAXED));
+}
@@ -0,0 +1,224 @@
+/**
+ * @file  audit.c
+ *
+ * @brief Audit log of the yash shell daemon
+ *
+ * With `--audit FILE`, every command is appended to FILE, and made durable,
+ * before it runs. A writer thread group-commits the records: it waits up to
+ * `audit_window_us` (see config.c) for more records to arrive, writes them
+ * all, and covers them with one fdatasync(). The commands waiting on the batch
+ * are released together. Records keep arriving in the other buffer while a
+ * batch commits, and make the next batch, so the log keeps up with any number
+ * of sessions at a few fdatasync() per millisecond.
+ *
+ * The log fails closed: once a batch cannot be made durable, no more commands
+ * run until the daemon is restarted.
+ *
+ * Record format, one line per command:
+ *
+ * 	TIME SEQ CLIENT COMMAND
+ *
+ * TIME is UTC in ISO 8601 with microseconds, and SEQ counts the process'
+ * records from 1.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+static audit_t *audit = NULL;	//! Audit log, NULL if not auditing
+
+
+/**
+ * @brief Open the audit log and start its writer thread
+ *
+ * @param	path	Audit log path
+ * @return	0 on success, or -1 on error
+ */
+int startAudit(const char *path) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	pthread_attr_t attr;
+	pthread_t th;
+
+	if ((audit = calloc(1, sizeof(audit_t))) == NULL) {
+		perror("ERROR: Allocating audit log");
+		return -1;
+	}
+	if ((audit->fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			0600)) < 0) {
+		perror("ERROR: Opening audit log");
+		free(audit);
+		audit = NULL;
+		return -1;
+	}
+	pthread_mutex_init(&audit->lock, NULL);
+	pthread_cond_init(&audit->pending_cond, NULL);
+	pthread_cond_init(&audit->durable_cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&th, &attr, auditThread, NULL) != 0) {
+		perror("ERROR: Creating audit thread");
+		pthread_attr_destroy(&attr);
+		close(audit->fd);
+		free(audit);
+		audit = NULL;
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Auditing commands to %s\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), path);
+
+	return 0;
+}
+
+
+/**
+ * @brief Thread function to group-commit the audit records
+ *
+ * @param	thread_args	Unused
+ */
+void *auditThread(void *thread_args) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct timespec deadline;
+	uint64_t last;
+	uint64_t records;
+	size_t len;
+	int commit;
+	int rc;
+
+	pthread_mutex_lock(&audit->lock);
+	for (;;) {
+		while (audit->len == 0) {
+			pthread_cond_wait(&audit->pending_cond, &audit->lock);
+		}
+
+		// Let the records arriving within the window share the fdatasync()
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += getConfig()->audit_window_us * 1000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		while (audit->len < AUDIT_BUF_LEN / 2 &&
+				pthread_cond_timedwait(&audit->pending_cond, &audit->lock,
+						&deadline) != ETIMEDOUT);
+
+		// Commit the batch, new records go to the other buffer meanwhile
+		commit = audit->fill;
+		len = audit->len;
+		last = audit->queued_seq;
+		records = last - audit->durable_seq;
+		audit->fill ^= 1;
+		audit->len = 0;
+		pthread_cond_broadcast(&audit->durable_cond);	// Room for records
+		pthread_mutex_unlock(&audit->lock);
+
+		rc = 0;
+		for (size_t off = 0; off < len && rc >= 0; ) {
+			if ((rc = write(audit->fd, &audit->bufs[commit][off],
+					len - off)) > 0) {
+				off += rc;
+			} else if (rc < 0 && errno == EINTR) {
+				rc = 0;
+			}
+		}
+		if (rc >= 0) {
+			rc = fdatasync(audit->fd);
+		}
+
+		pthread_mutex_lock(&audit->lock);
+		if (rc < 0) {
+			fprintf(stderr, "%s yashd[daemon]: ERROR: Committing audit log: %s, "
+					"no more commands will run\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), strerror(errno));
+			audit->broken = true;
+		} else {
+			audit->durable_seq = last;
+			audit->commits++;
+			histAdd(&audit->batch, records);
+		}
+		pthread_cond_broadcast(&audit->durable_cond);
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Log a command to the audit log, and wait for it to be durable
+ *
+ * @param	shell_info	Shell info of the session running the command
+ * @param	cmd			Command
+ * @return	0 once the record is durable (or if not auditing), or -1 if it
+ * 			could not be logged and the command must not run
+ */
+int auditCommand(shell_info_t *shell_info, const char *cmd) {
+	char addr[INET_ADDRSTRLEN];
+	char ts[40];
+	struct timespec now;
+	struct tm tm;
+	uint64_t start = nowUs();
+	uint64_t seq;
+	int cmd_len;
+	int rc;
+
+	if (audit == NULL) {
+		return 0;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	gmtime_r(&now.tv_sec, &tm);
+	rc = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(&ts[rc], sizeof(ts) - rc, ".%06ldZ", now.tv_nsec / 1000);
+	inet_ntop(AF_INET, &shell_info->th_args.from.sin_addr, addr, sizeof(addr));
+	cmd_len = strcspn(cmd, "\r\n");	// One line per record
+
+	pthread_mutex_lock(&audit->lock);
+	while (!audit->broken && audit->len + AUDIT_MAX_RECORD > AUDIT_BUF_LEN) {
+		pthread_cond_wait(&audit->durable_cond, &audit->lock);
+	}
+	if (audit->broken) {
+		pthread_mutex_unlock(&audit->lock);
+		return -1;
+	}
+
+	seq = ++audit->queued_seq;
+	audit->len += snprintf(&audit->bufs[audit->fill][audit->len],
+			AUDIT_BUF_LEN - audit->len, "%s %lu %s:%d %.*s\n", ts, seq, addr,
+			ntohs(shell_info->th_args.from.sin_port), cmd_len, cmd);
+	pthread_cond_signal(&audit->pending_cond);
+
+	while (!audit->broken && audit->durable_seq < seq) {
+		pthread_cond_wait(&audit->durable_cond, &audit->lock);
+	}
+	rc = audit->durable_seq >= seq ? 0 : -1;
+	histAdd(&audit->latency, nowUs() - start);
+	pthread_mutex_unlock(&audit->lock);
+
+	return rc;
+}
+
+
+/**
+ * @brief Log the audit log counters and histograms
+ */
+void logAuditStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+
+	if (audit == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&audit->lock);
+	fprintf(stderr, "%s yashd[daemon]: INFO: Audit log: records: %lu, durable: "
+			"%lu, fdatasyncs: %lu%s\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), audit->queued_seq,
+			audit->durable_seq, audit->commits,
+			audit->broken ? ", FAILED" : "");
+	histLog("Audit commit latency (us)", &audit->latency);
+	histLog("Audit batch size (records)", &audit->batch);
+	pthread_mutex_unlock(&audit->lock);
+}
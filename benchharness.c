@@ -0,0 +1,240 @@
+/**
+ * @file  benchharness.c
+ *
+ * @brief Helpers shared by the tools that drive a daemon from the outside
+ *
+ * The daemon under test runs in the foreground on a local port, with the
+ * admission limiter off (all the load comes from one address) and a listen
+ * backlog deep enough for clients connecting at once. It logs to
+ * /tmp/TOOL-PORT.log, and is given its config in /tmp/TOOL-PORT.conf.
+ *
+ * Sessions are plain TCP connections in the text protocol: lines are sent
+ * whole, and replies are read until a marker (the prompt by default) shows up.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#define _GNU_SOURCE	// memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "benchharness.h"
+#include "yash_client.h"
+#include "yash_time.h"
+
+
+/**
+ * @brief Connect a session to the daemon under test
+ *
+ * @param	port	Port of the daemon
+ * @return	Socket, or -1 on error
+ */
+int connectDaemon(int port) {
+	struct sockaddr_in addr;
+	int one = 1;
+	int sd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+
+/**
+ * @brief Read from a session until a marker ends the input
+ *
+ * @param	sd		Socket
+ * @param	marker	Marker, or NULL for the prompt
+ * @param	timeout	Max milliseconds between reads
+ * @param	bytes	Bytes read are added to it, if not NULL
+ * @return	0 once the marker is read, or -1 on error or timeout
+ */
+int waitFor(int sd, const char *marker, int timeout, uint64_t *bytes) {
+	static __thread char buf[65536];
+	char tail[64];
+	size_t mlen;
+	size_t tlen = 0;
+	struct pollfd pfd = {sd, POLLIN, 0};
+	ssize_t n;
+	bool prompt = (marker == NULL);
+
+	if (prompt) {
+		marker = YASH_PROMPT;
+	}
+	mlen = strlen(marker);
+
+	while (1) {
+		if (poll(&pfd, 1, timeout) <= 0 ||
+				(n = read(sd, buf, sizeof(buf))) <= 0) {
+			return -1;
+		}
+		if (bytes != NULL) {
+			*bytes += n;
+		}
+
+		// Keep the last bytes read, the marker may span reads
+		if ((size_t) n >= sizeof(tail) - 1) {
+			memcpy(tail, &buf[n - (sizeof(tail) - 1)], sizeof(tail) - 1);
+			tlen = sizeof(tail) - 1;
+		} else {
+			if (tlen + n > sizeof(tail) - 1) {
+				memmove(tail, &tail[tlen + n - (sizeof(tail) - 1)],
+						sizeof(tail) - 1 - n);
+				tlen = sizeof(tail) - 1 - n;
+			}
+			memcpy(&tail[tlen], buf, n);
+			tlen += n;
+		}
+
+		// The prompt must end the input, other markers can be anywhere
+		if (prompt) {
+			if (tlen >= mlen && !memcmp(&tail[tlen - mlen], marker, mlen)) {
+				return 0;
+			}
+		} else if (memmem(tail, tlen, marker, mlen) != NULL) {
+			return 0;
+		}
+	}
+}
+
+
+/**
+ * @brief Discard what a session sent, once it is quiet
+ *
+ * @param	sd		Socket
+ */
+void drainSession(int sd) {
+	char buf[4096];
+	struct pollfd pfd = {sd, POLLIN, 0};
+
+	while (poll(&pfd, 1, 20) > 0 && read(sd, buf, sizeof(buf)) > 0);
+}
+
+
+/**
+ * @brief Send a line to a session
+ *
+ * @param	sd		Socket
+ * @param	line	Line, with its newline
+ * @return	0 on success, or -1 on error
+ */
+int sendLine(int sd, const char *line) {
+	size_t len = strlen(line);
+
+	return (send(sd, line, len, MSG_NOSIGNAL) == (ssize_t) len) ? 0 : -1;
+}
+
+
+/**
+ * @brief Start the daemon under test in the foreground
+ *
+ * The daemon is up once a session on it gets its prompt.
+ *
+ * @param	daemon	Daemon binary
+ * @param	tool	Name of the tool, for the config and log paths
+ * @param	port	Port of the daemon
+ * @param	extra	More arguments of the daemon, NULL terminated, or NULL
+ * @param	log		Path of the daemon's log, on return
+ * @param	log_len	Size of `log`
+ * @return	PID of the daemon, or -1 on error
+ */
+pid_t startDaemon(const char *daemon, const char *tool, int port,
+		const char **extra, char *log, size_t log_len) {
+	const char *argv[BENCH_MAX_ARGS + 10];
+	char conf[64];
+	char port_str[8];
+	uint64_t deadline;
+	pid_t pid;
+	FILE *f;
+	int argc = 0;
+	int fd;
+	int sd;
+
+	snprintf(conf, sizeof(conf), "/tmp/%s-%d.conf", tool, port);
+	snprintf(log, log_len, "/tmp/%s-%d.log", tool, port);
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	if ((f = fopen(conf, "w")) == NULL) {
+		perror(conf);
+		return -1;
+	}
+	// Clients connecting at once would overflow the default backlog, and have
+	// their handshakes dropped
+	fprintf(f, "# Written by %s\nsource_rate = 0\nmax_clients = 50\n"
+			"connect_queue = 64\n", tool);
+	fclose(f);
+
+	argv[argc++] = daemon;
+	argv[argc++] = "-f";
+	argv[argc++] = "-p";
+	argv[argc++] = port_str;
+	argv[argc++] = "-s";
+	argv[argc++] = BENCH_SHARDS;
+	argv[argc++] = "-c";
+	argv[argc++] = conf;
+	for (int i=0; extra != NULL && extra[i] != NULL && i<BENCH_MAX_ARGS; i++) {
+		argv[argc++] = extra[i];
+	}
+	argv[argc] = NULL;
+
+	if ((pid = fork()) < 0) {
+		perror("ERROR: Starting daemon");
+		return -1;
+	} else if (pid == 0) {
+		if ((fd = open("/dev/null", O_RDWR)) >= 0) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+		}
+		if ((fd = open(log, O_WRONLY|O_CREAT|O_TRUNC, 0644)) >= 0) {
+			dup2(fd, STDERR_FILENO);
+		}
+		execv(daemon, (char **) argv);
+		perror(daemon);
+		_exit(EXIT_FAILURE);
+	}
+
+	// Wait for the daemon to take connections
+	deadline = nowUs() + BENCH_START_MS * 1000;
+	while (nowUs() < deadline) {
+		if (waitpid(pid, NULL, WNOHANG) == pid) {
+			fprintf(stderr, "ERROR: Daemon exited, see %s\n", log);
+			return -1;
+		}
+		if ((sd = connectDaemon(port)) >= 0) {
+			if (waitFor(sd, NULL, BENCH_PROMPT_MS, NULL) == 0) {
+				close(sd);
+				return pid;
+			}
+			close(sd);
+		}
+		usleep(20000);
+	}
+
+	fprintf(stderr, "ERROR: Daemon did not start, see %s\n", log);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
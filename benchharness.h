@@ -0,0 +1,37 @@
+/**
+ * @file  benchharness.h
+ *
+ * @brief Helpers shared by the tools that drive a daemon from the outside
+ *
+ * yashd-perf and yashd-soak both start a daemon in the foreground on a local
+ * port, and talk to it over TCP, in the text protocol. See benchharness.c.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef BENCHHARNESS_H_
+#define BENCHHARNESS_H_
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define BENCH_SHARDS "2"		//! Shards of the daemon under test
+#define BENCH_START_MS 5000		//! Max milliseconds for the daemon to start
+#define BENCH_PROMPT_MS 10000	//! Max milliseconds for the first prompt
+#define BENCH_MAX_ARGS 16		//! Max extra arguments of the daemon
+
+
+// Functions
+int connectDaemon(int port);
+int waitFor(int sd, const char *marker, int timeout, uint64_t *bytes);
+void drainSession(int sd);
+int sendLine(int sd, const char *line);
+pid_t startDaemon(const char *daemon, const char *tool, int port,
+		const char **extra, char *log, size_t log_len);
+
+
+#endif /* BENCHHARNESS_H_ */
@@ -0,0 +1,316 @@
+/**
+ * @file  config.c
+ *
+ * @brief Runtime configuration of the yash shell daemon
+ *
+ * With `--config FILE`, the limits, timeouts and log path are read from FILE
+ * instead of being fixed at their compile-time defaults. FILE has one
+ * `KEY = VALUE` pair per line, and `#` starts a comment:
+ *
+ * 	# Sessions per process, and jobs per session
+ * 	max_clients = 40
+ * 	max_jobs = 10
+ *
+ * `SIGHUP` reloads FILE and reopens the log, so logs can be rotated. A config
+ * is published as an immutable snapshot, RCU style: the new snapshot is
+ * filled in, then a release store swaps the pointer, and readers take no
+ * lock. The snapshot replaced is retired but never freed, since there is no
+ * way to tell when its last reader is done with it: snapshots are small and
+ * reloads rare, so the retired ones are just chained to the current one. A
+ * file with errors is rejected as a whole, and the running config stays.
+ *
+ * The compile-time limits in yashd.h size the tables, so they bound the
+ * values of the config. `listen` may be repeated, see listener.c.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <stddef.h>
+#include "yashd.h"
+
+
+/**
+ * \brief Struct for an integer key of the config file
+ */
+typedef struct _config_key {
+	const char *name;	// Key
+	size_t offset;		// Offset of the value in config_t
+	int min;			// Min value
+	int max;			// Max value
+} config_key_t;
+
+
+// Globals
+static config_t *config = NULL;		//! Current snapshot
+static char config_path[PATHMAX+1];	//! Config file, or empty
+
+static const config_key_t config_keys[] = {
+	{"max_clients", offsetof(config_t, max_clients), 1, MAX_CONCURRENT_CLIENTS},
+	{"max_jobs", offsetof(config_t, max_jobs), 1, MAX_CONCURRENT_JOBS},
+	{"connect_queue", offsetof(config_t, connect_queue), 1, 4096},
+	{"worker_respawn_delay", offsetof(config_t, worker_respawn_delay), 0, 3600},
+	{"registry_heartbeat", offsetof(config_t, registry_heartbeat), 1, 3600},
+	{"registry_stale", offsetof(config_t, registry_stale), 1, 3600},
+	{"record_flush", offsetof(config_t, record_flush), 1, 3600},
+	{"relay_len", offsetof(config_t, relay_len), 1, RECORD_RELAY_LEN},
+	{"audit_window_us", offsetof(config_t, audit_window_us), 0, 1000000},
+	{"source_rate", offsetof(config_t, source_rate), 0, 1000000},
+	{"source_burst", offsetof(config_t, source_burst), 1, 1000000},
+	{"session_cap", offsetof(config_t, session_cap), 0,
+			MAX_SHARDS * MAX_CONCURRENT_CLIENTS},
+	{"idle_timeout", offsetof(config_t, idle_timeout), 0, 1000000},
+	{"keepalive", offsetof(config_t, keepalive), 0, 32767},
+};
+
+
+/**
+ * @brief Load a config file into a new snapshot
+ *
+ * Keys not in the file keep their compile-time default. Errors are logged to
+ * stderr with their line number.
+ *
+ * @param	path	Config file, or empty for the defaults
+ * @return	New snapshot, or NULL if the file could not be read or has errors
+ */
+config_t *loadConfig(const char *path) {
+	char line[PATHMAX+64];
+	char *key;
+	char *value;
+	char *end;
+	char *save;
+	char *opt;
+	config_t *cfg;
+	listener_conf_t *lconf;
+	FILE *f = NULL;
+	int lineno = 0;
+	int errors = 0;
+	long n;
+	size_t k;
+
+	if ((cfg = malloc(sizeof(config_t))) == NULL) {
+		perror("ERROR: Allocating config");
+		return NULL;
+	}
+	*cfg = (config_t) {
+		MAX_CONCURRENT_CLIENTS,		// max_clients
+		MAX_CONCURRENT_JOBS,		// max_jobs
+		MAX_CONNECT_QUEUE,			// connect_queue
+		WORKER_RESPAWN_DELAY,		// worker_respawn_delay
+		REGISTRY_HEARTBEAT,			// registry_heartbeat
+		REGISTRY_STALE,				// registry_stale
+		RECORD_FLUSH,				// record_flush
+		RECORD_RELAY_LEN,			// relay_len
+		AUDIT_WINDOW_US,			// audit_window_us
+		ADMIT_RATE,					// source_rate
+		ADMIT_BURST,				// source_burst
+		0,							// session_cap
+		IDLE_TIMEOUT,				// idle_timeout
+		KEEPALIVE,					// keepalive
+		EMPTY_STR,					// log
+		1							// listener_count
+	};
+	if (args.port == DEFAULT_TCP_PORT) {
+		strcpy(cfg->log, DAEMON_LOG_PATH);
+	} else {
+		snprintf(cfg->log, sizeof(cfg->log), DAEMON_LOG_PATH_PORT, args.port);
+	}
+	snprintf(line, sizeof(line), "*:%d", args.port);
+	parseListener(line, &cfg->listeners[0]);
+	cfg->listeners[0].backlog = -1;	// connect_queue
+
+	if (path[0] == '\0') {
+		cfg->listeners[0].backlog = cfg->connect_queue;
+		return cfg;
+	}
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "ERROR: Opening config file %s: %s\n", path,
+				strerror(errno));
+		free(cfg);
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+		if ((key = strtok_r(line, " \t=", &save)) == NULL) {
+			continue;	// Blank or comment
+		}
+		value = strtok_r(NULL, " \t=", &save);
+		if (value != NULL && !strcmp(key, "listen")) {
+			if (cfg->listener_count >= MAX_LISTENERS) {
+				fprintf(stderr, "ERROR: %s:%d: more than %d listeners\n", path,
+						lineno, MAX_LISTENERS);
+				errors++;
+				continue;
+			}
+			lconf = &cfg->listeners[cfg->listener_count++];
+			if (parseListener(value, lconf) < 0) {
+				fprintf(stderr, "ERROR: %s:%d: listen address must be ADDR:PORT "
+						"or unix:PATH\n", path, lineno);
+				errors++;
+			}
+			lconf->backlog = -1;
+			while ((opt = strtok_r(NULL, " \t", &save)) != NULL) {
+				if (!strncmp(opt, "max_clients=", 12) &&
+						(n = strtol(&opt[12], &end, 10)) >= 0 && *end == '\0' &&
+						n <= MAX_SHARDS * MAX_CONCURRENT_CLIENTS) {
+					lconf->max_clients = (int) n;
+				} else if (!strncmp(opt, "backlog=", 8) &&
+						(n = strtol(&opt[8], &end, 10)) > 0 && *end == '\0' &&
+						n <= 4096) {
+					lconf->backlog = (int) n;
+				} else if (!strcmp(opt, "priority=high")) {
+					lconf->priority = LISTENER_HIGH;
+				} else if (!strcmp(opt, "priority=normal")) {
+					lconf->priority = LISTENER_NORMAL;
+				} else {
+					fprintf(stderr, "ERROR: %s:%d: unknown listen option: %s\n",
+							path, lineno, opt);
+					errors++;
+				}
+			}
+			continue;
+		}
+		if (value == NULL || strtok_r(NULL, " \t", &save) != NULL) {
+			fprintf(stderr, "ERROR: %s:%d: expected KEY = VALUE\n", path,
+					lineno);
+			errors++;
+			continue;
+		}
+
+		if (!strcmp(key, "log")) {
+			if (value[0] != '/' || strlen(value) >= sizeof(cfg->log)) {
+				fprintf(stderr, "ERROR: %s:%d: log must be an absolute path "
+						"shorter than %d\n", path, lineno, PATHMAX);
+				errors++;
+			} else {
+				strcpy(cfg->log, value);
+			}
+			continue;
+		}
+
+		for (k=0; k<sizeof(config_keys)/sizeof(config_keys[0]); k++) {
+			if (!strcmp(key, config_keys[k].name)) {
+				break;
+			}
+		}
+		if (k >= sizeof(config_keys)/sizeof(config_keys[0])) {
+			fprintf(stderr, "ERROR: %s:%d: unknown key: %s\n", path, lineno,
+					key);
+			errors++;
+			continue;
+		}
+		n = strtol(value, &end, 10);
+		if (*end != '\0' || n < config_keys[k].min || n > config_keys[k].max) {
+			fprintf(stderr, "ERROR: %s:%d: %s must be an integer between %d "
+					"and %d\n", path, lineno, key, config_keys[k].min,
+					config_keys[k].max);
+			errors++;
+			continue;
+		}
+		*(int *) ((char *) cfg + config_keys[k].offset) = (int) n;
+	}
+	fclose(f);
+
+	// Listeners without a backlog of their own use connect_queue
+	for (int i=0; i<cfg->listener_count; i++) {
+		if (cfg->listeners[i].backlog <= 0) {
+			cfg->listeners[i].backlog = cfg->connect_queue;
+		}
+	}
+
+	if (errors > 0) {
+		free(cfg);
+		return NULL;
+	}
+
+	return cfg;
+}
+
+
+/**
+ * @brief Load the config file, and publish it as the first snapshot
+ *
+ * Called before the daemon detaches, so errors reach the terminal.
+ *
+ * @param	path	Config file, or empty for the defaults
+ * @return	0 on success, or -1 on error
+ */
+int startConfig(const char *path) {
+	config_t *cfg;
+
+	strcpy(config_path, path);
+	if ((cfg = loadConfig(config_path)) == NULL) {
+		return -1;
+	}
+	__atomic_store_n(&config, cfg, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+
+/**
+ * @brief Get the current config snapshot
+ *
+ * @return	Current snapshot, never freed, but stale after a reload
+ */
+const config_t *getConfig() {
+	return __atomic_load_n(&config, __ATOMIC_ACQUIRE);
+}
+
+
+/**
+ * @brief Reload the config file, and reopen the log
+ *
+ * Reloads are not reentrant: one thread of each process does them.
+ *
+ * @return	0 on success, or -1 if the running config was kept
+ */
+int reloadConfig() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	config_t *cfg;
+	int fd;
+
+	if ((cfg = loadConfig(config_path)) == NULL) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Could not reload %s, keeping "
+				"the running config\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				config_path);
+		return -1;
+	}
+
+	// The listening sockets are only opened at start
+	for (int i=0; i<cfg->listener_count || i<config->listener_count; i++) {
+		if (cfg->listener_count != config->listener_count ||
+				strcmp(cfg->listeners[i].spec, config->listeners[i].spec)) {
+			fprintf(stderr, "%s yashd[daemon]: ERROR: Could not reload %s, the "
+					"listeners changed, restart the daemon to change them\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), config_path);
+			free(cfg);
+			return -1;
+		}
+	}
+
+	// Readers may still hold the old snapshot, so it is kept for good
+	cfg->retired = config;
+	__atomic_store_n(&config, cfg, __ATOMIC_RELEASE);
+
+	// Reopen the log, it may have been rotated or moved
+	if (args.foreground) {
+		// Logging to stderr
+	} else if ((fd = open(cfg->log, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			0644)) < 0) {
+		perror("ERROR: Reopening log");
+	} else {
+		dup2(fd, STDERR_FILENO);
+		close(fd);
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Reloaded config%s%s: max_clients: "
+			"%d, max_jobs: %d, connect_queue: %d, relay_len: %d, log: %s\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			config_path[0] ? " from " : "", config_path, cfg->max_clients,
+			cfg->max_jobs, cfg->connect_queue, cfg->relay_len, cfg->log);
+
+	return 0;
+}
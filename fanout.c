@@ -0,0 +1,222 @@
+/**
+ * @file fanout.c
+ *
+ * @brief Yash shell client fan-out mode
+ *
+ * Run one command on many yashd hosts at once. The event driven client of
+ * yash_client.h drives all the connections from a single poll() loop, and the
+ * output streams back line by line, prefixed with the host. The next host in
+ * the list starts as soon as one finishes, so no more than the concurrency cap
+ * are open at a time, and a host that does not finish in time is dropped. The
+ * exit code aggregates the exit codes the command had on the hosts.
+ *
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ */
+
+#include "yash.h"
+
+
+/**
+ * @brief Load the host list
+ *
+ * One HOST or HOST:PORT per line. Blank lines and lines starting with # are
+ * skipped.
+ *
+ * @param	path	Host list path
+ * @param	port	Port for the hosts that do not give one
+ * @param	count	Number of hosts loaded
+ * @return	Heap allocated array of hosts, or NULL on error
+ */
+fanout_host_t *loadHosts(char *path, int port, int *count) {
+	fanout_host_t *hosts = NULL;
+	fanout_host_t *tmp;
+	char line[MAX_HOSTNAME_LEN+16];
+	int size = 0;
+	char *start, *end, *sep;
+	FILE *f;
+
+	*count = 0;
+	if ((f = fopen(path, "r")) == NULL) {
+		perror("-yash: opening host list");
+		return NULL;
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		// Trim the line
+		for (start = line; isspace(*start); start++);
+		for (end = start + strlen(start); end > start && isspace(end[-1]); end--);
+		*end = '\0';
+		if (*start == '\0' || *start == '#') {
+			continue;
+		}
+
+		if (*count >= size) {
+			size = size ? size * 2 : 64;
+			if ((tmp = realloc(hosts, size * sizeof(fanout_host_t))) == NULL) {
+				perror("-yash: loading host list");
+				free(hosts);
+				fclose(f);
+				return NULL;
+			}
+			hosts = tmp;
+		}
+
+		memset(&hosts[*count], 0, sizeof(fanout_host_t));
+		hosts[*count].port = port;
+		hosts[*count].result = YASH_ERR_DISCONNECT;
+		if ((sep = strrchr(start, ':')) != NULL && isNumber(sep+1) &&
+				sep[1] != '\0') {
+			*sep = '\0';
+			hosts[*count].port = atoi(sep+1);
+		}
+		strncpy(hosts[*count].host, start, MAX_HOSTNAME_LEN-1);
+		(*count)++;
+	}
+	fclose(f);
+
+	if (*count == 0) {
+		fprintf(stderr, "-yash: no hosts in host list\n");
+		free(hosts);
+		return NULL;
+	}
+
+	return hosts;
+}
+
+
+/**
+ * @brief Print a host's output line, prefixed with the host
+ *
+ * @param	fh	Fan-out host
+ */
+void flushHostLine(fanout_host_t *fh) {
+	printf("%s: %.*s\n", fh->host, (int) fh->line_len, fh->line);
+	fh->line_len = 0;
+}
+
+
+/**
+ * @brief Split a host's output into lines as it arrives
+ *
+ * @param	cmd		Command running on the host
+ * @param	data	Output
+ * @param	len		Output length
+ * @param	ctx		Fan-out host
+ */
+void onHostOutput(yash_cmd_t *cmd, const char *data, size_t len, void *ctx) {
+	fanout_host_t *fh = ctx;
+
+	for (size_t i=0; i<len; i++) {
+		if (data[i] == '\n' || fh->line_len == FANOUT_LINE_LEN) {
+			flushHostLine(fh);
+			if (data[i] == '\n') {
+				continue;
+			}
+		}
+		fh->line[fh->line_len++] = data[i];
+	}
+}
+
+
+/**
+ * @brief Record a host's result, and report it if it failed
+ *
+ * @param	cmd		Command that ran on the host
+ * @param	status	Command status
+ * @param	ex		Exit status of the command's job, NULL if unknown
+ * @param	ctx		Fan-out host
+ */
+void onHostDone(yash_cmd_t *cmd, int status, const yash_exit_t *ex, void *ctx) {
+	fanout_host_t *fh = ctx;
+
+	if (fh->line_len > 0) {
+		flushHostLine(fh);
+	}
+	fh->result = status;
+	if (ex != NULL) {
+		fh->exit_code = ex->signaled ? 128 + ex->code : ex->code;
+	}
+
+	if (status != YASH_OK) {
+		fflush(stdout);
+		fprintf(stderr, "%s: -yash: %s\n", fh->host, yashStatusStr(status));
+	} else if (fh->exit_code > 0) {
+		fflush(stdout);
+		fprintf(stderr, "%s: -yash: exit %d\n", fh->host, fh->exit_code);
+	}
+}
+
+
+/**
+ * @brief Run the command on every host in the host list
+ *
+ * @param	args	Command line arguments
+ * @return	EXIT_ERR_SOCKET if some host could not be reached. Otherwise the
+ * 			highest exit code the command had on a host (128 plus the signal
+ * 			number if a signal ended it), or EXIT_ERR_CMD if it exited with 0
+ * 			everywhere but some host reported an error.
+ */
+int runFanout(cmd_args_t *args) {
+	int results[YASH_ERR_BUSY+1] = {0};
+	yash_client_t *client;
+	fanout_host_t *hosts;
+	int count, rc;
+	int failed = 0;
+	int code = 0;
+
+	if ((hosts = loadHosts(args->hosts, args->port, &count)) == NULL) {
+		return EXIT_ERR_ARG;
+	}
+	if (args->concurrency > count) {
+		args->concurrency = count;
+	}
+	if ((client = yashClientNew(args->concurrency, args->timeout)) == NULL) {
+		perror("-yash: allocating fan-out client");
+		exit(EXIT_ERR);
+	}
+
+	for (int i=0; i<count; i++) {
+		if (yashRun(client, hosts[i].host, hosts[i].port, args->command,
+				onHostOutput, onHostDone, &hosts[i]) == NULL) {
+			perror("-yash: queueing fan-out command");
+			exit(EXIT_ERR);
+		}
+	}
+	while ((rc = yashPoll(client, -1)) > 0);
+	if (rc < 0) {
+		perror("-yash: polling hosts");
+	}
+	yashClientFree(client);
+	fflush(stdout);
+
+	// Aggregate the results
+	for (int i=0; i<count; i++) {
+		results[hosts[i].result]++;
+		if (hosts[i].exit_code > 0) {
+			failed++;
+		}
+		if (hosts[i].exit_code > code) {
+			code = hosts[i].exit_code;
+		}
+	}
+	fprintf(stderr, "-yash: %d hosts", count);
+	for (int r=0; r<=YASH_ERR_BUSY; r++) {
+		if (results[r] > 0) {
+			fprintf(stderr, ", %s: %d", yashStatusStr(r), results[r]);
+		}
+	}
+	if (failed > 0) {
+		fprintf(stderr, ", nonzero exit: %d", failed);
+	}
+	fprintf(stderr, "\n");
+
+	free(hosts);
+
+	if (results[YASH_ERR_CMD] + results[YASH_OK] < count) {
+		return EXIT_ERR_SOCKET;
+	} else if (code == 0 && results[YASH_ERR_CMD] > 0) {
+		return EXIT_ERR_CMD;
+	}
+	return code;
+}
@@ -0,0 +1,174 @@
+/**
+ * @file  frame.c
+ *
+ * @brief Binary frames of the yashd multiplexed protocol
+ *
+ * Shared by the daemon and the client library.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "frame.h"
+
+
+/**
+ * @brief Send a whole buffer, retrying partial sends
+ *
+ * @param	sd	Socket
+ * @param	buf	Buffer
+ * @param	len	Buffer length
+ * @return	0 on success, or -1 on error
+ */
+int sendAll(int sd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = send(sd, p, len, MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Receive a whole buffer, retrying partial receives
+ *
+ * @param	sd	Socket
+ * @param	buf	Buffer
+ * @param	len	Bytes to receive
+ * @return	1 on success, 0 on EOF, or -1 on error
+ */
+int recvAll(int sd, void *buf, size_t len) {
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = recv(sd, p, len, 0)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		} else if (n == 0) {
+			return 0;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 1;
+}
+
+
+/**
+ * @brief Send a frame
+ *
+ * The header and the payload go out in one send when they fit the header
+ * buffer, so small frames take a single segment.
+ *
+ * @param	sd		Socket
+ * @param	type	Frame type
+ * @param	flags	Frame flags
+ * @param	stream	Stream ID
+ * @param	payload	Payload, may be NULL if len is 0
+ * @param	len		Payload length
+ * @return	0 on success, or -1 on error
+ */
+int sendFrame(int sd, uint8_t type, uint8_t flags, uint16_t stream,
+		const void *payload, uint32_t len) {
+	char buf[FRAME_HDR_LEN + 512];
+	uint16_t n_stream = htons(stream);
+	uint32_t n_len = htonl(len);
+
+	if (len > FRAME_MAX_PAYLOAD) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	buf[0] = type;
+	buf[1] = flags;
+	memcpy(&buf[2], &n_stream, sizeof(n_stream));
+	memcpy(&buf[4], &n_len, sizeof(n_len));
+
+	if (len <= sizeof(buf) - FRAME_HDR_LEN) {
+		if (len > 0) {
+			memcpy(&buf[FRAME_HDR_LEN], payload, len);
+		}
+		return sendAll(sd, buf, FRAME_HDR_LEN + len);
+	}
+
+	if (sendAll(sd, buf, FRAME_HDR_LEN) < 0) {
+		return -1;
+	}
+	return sendAll(sd, payload, len);
+}
+
+
+/**
+ * @brief Decode a frame header
+ *
+ * @param	buf		FRAME_HDR_LEN bytes of header
+ * @param	hdr		Decoded header
+ * @param	max		Payload buffer size
+ * @return	0 on success, or -1 if the payload is larger than the buffer or
+ * 			FRAME_MAX_PAYLOAD
+ */
+int decodeFrameHdr(const void *buf, frame_hdr_t *hdr, size_t max) {
+	const unsigned char *p = buf;
+	uint16_t n_stream;
+	uint32_t n_len;
+
+	hdr->type = p[0];
+	hdr->flags = p[1];
+	memcpy(&n_stream, &p[2], sizeof(n_stream));
+	memcpy(&n_len, &p[4], sizeof(n_len));
+	hdr->stream = ntohs(n_stream);
+	hdr->len = ntohl(n_len);
+
+	if (hdr->len > max || hdr->len > FRAME_MAX_PAYLOAD) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Receive a frame
+ *
+ * @param	sd		Socket
+ * @param	hdr		Decoded header
+ * @param	payload	Buffer for the payload
+ * @param	max		Payload buffer size
+ * @return	1 on success, 0 on EOF, or -1 on error (including a payload larger
+ * 			than the buffer, after which the connection is out of sync)
+ */
+int recvFrame(int sd, frame_hdr_t *hdr, void *payload, size_t max) {
+	unsigned char buf[FRAME_HDR_LEN];
+	int rc;
+
+	if ((rc = recvAll(sd, buf, FRAME_HDR_LEN)) <= 0) {
+		return rc;
+	}
+	if (decodeFrameHdr(buf, hdr, max) < 0) {
+		return -1;
+	}
+	if (hdr->len == 0) {
+		return 1;
+	}
+
+	return recvAll(sd, payload, hdr->len);
+}
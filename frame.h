@@ -0,0 +1,74 @@
+/**
+ * @file  frame.h
+ *
+ * @brief Binary frames of the yashd multiplexed protocol
+ *
+ * A connection starts in the text protocol. The client switches it to frames
+ * by sending the `MUX` line, and the server confirms with a MUX frame. From
+ * then on, every message is a frame carrying the stream (session) it belongs
+ * to, so one connection carries many independent sessions.
+ *
+ * Frame layout (integers in network byte order):
+ *
+ * 	| type (1) | flags (1) | stream (2) | length (4) | payload (length) |
+ *
+ * Compression is negotiated when switching: the server's MUX frame offers
+ * the codecs it has in its flags, and the client enables the ones it wants by
+ * sending a MUX frame back with their flags. Servers and clients that predate
+ * a codec ignore its flag, and a HELLO without a codec's feature bit (see
+ * yashd_defs.h) turns its offer off. Once FRAME_FLAG_LZ is enabled, the server may send
+ * DATA frames with the flag set, whose payload is an lz.h block. It only does
+ * so for payloads of at least FRAME_LZ_MIN bytes that shrink by at least
+ * 1/FRAME_LZ_GAIN, and backs off on output that does not compress.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef FRAME_H_
+#define FRAME_H_
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+
+#define MSG_TYPE_MUX "MUX\n"		//! Text line switching a connection to frames
+
+#define FRAME_HDR_LEN 8				//! Frame header length
+#define FRAME_MAX_PAYLOAD 65536		//! Max frame payload length
+#define MUX_MAX_STREAMS 64			//! Max streams open on one connection
+
+#define FRAME_MUX 0		//! Frame type: connection switched to frames (server)
+#define FRAME_OPEN 1	//! Frame type: open a stream (client), stream opened (server)
+#define FRAME_DATA 2	//! Frame type: CMD/CTL lines (client), session output (server)
+#define FRAME_CLOSE 3	//! Frame type: close a stream (client), stream closed (server)
+
+#define FRAME_FLAG_LZ 0x01	//! Frame flag: lz.h codec offered/enabled (MUX), payload compressed (DATA)
+#define FRAME_LZ_MIN 512	//! Smallest payload compressed
+#define FRAME_LZ_GAIN 8		//! Min saving for a payload to be sent compressed (1/8th)
+#define FRAME_LZ_BACKOFF 6	//! Log2 of the max payloads sent raw after one failed to compress
+
+
+/**
+ * @brief Struct for a decoded frame header
+ */
+typedef struct _frame_hdr {
+	uint8_t type;		// FRAME_*
+	uint8_t flags;		// Frame flags
+	uint16_t stream;	// Stream the frame belongs to
+	uint32_t len;		// Payload length
+} frame_hdr_t;
+
+
+// Functions
+int sendAll(int sd, const void *buf, size_t len);
+int recvAll(int sd, void *buf, size_t len);
+int sendFrame(int sd, uint8_t type, uint8_t flags, uint16_t stream,
+		const void *payload, uint32_t len);
+int decodeFrameHdr(const void *buf, frame_hdr_t *hdr, size_t max);
+int recvFrame(int sd, frame_hdr_t *hdr, void *payload, size_t max);
+
+
+#endif /* FRAME_H_ */
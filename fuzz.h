@@ -0,0 +1,45 @@
+/**
+ * @file  fuzz.h
+ *
+ * @brief Fuzzing harnesses of the protocol and parser entry points
+ *
+ * Each yashd-fuzz-* harness defines LLVMFuzzerTestOneInput(), so it links
+ * against libFuzzer (clang -fsanitize=fuzzer) as is. Plain gcc builds link it
+ * against the standalone driver in fuzzmain.c instead, which runs a corpus and
+ * random mutations of it. A harness aborts if an invariant of the code under
+ * test does not hold, so either engine keeps the input.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef FUZZ_H_
+#define FUZZ_H_
+
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+#define FUZZ_MAX_LEN 4096	//! Default max length of the inputs the driver makes
+
+
+/**
+ * @brief Abort if an invariant does not hold
+ */
+#define FUZZ_CHECK(cond) do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+					#cond); \
+			abort(); \
+		} \
+	} while (0)
+
+
+// Functions
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+
+#endif /* FUZZ_H_ */
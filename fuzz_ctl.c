@@ -0,0 +1,83 @@
+/**
+ * @file  fuzz_ctl.c
+ *
+ * @brief Fuzzing harness of the CTL dispatch
+ *
+ * The input is what a servant thread reads from a client at once. The signal
+ * lines are taken out of it with takeCtlLines(), as takeSignals() does, and
+ * the complete lines left are cut and parsed as the servant does, down to the
+ * CTL argument handleCTLMessages() would get.
+ *
+ * 	make fuzz
+ * 	./yashd-fuzz-ctl [-runs=RUNS] fuzz_corpus/ctl
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include "fuzz.h"
+
+
+/**
+ * @brief Count a signal line taken out of the input
+ *
+ * @param	arg	CTL message argument
+ * @param	ctx	Signal counter
+ */
+static void countSignal(char arg, void *ctx) {
+	FUZZ_CHECK(arg == MSG_CTL_SIGINT || arg == MSG_CTL_SIGTSTP);
+	(*(size_t *) ctx)++;
+}
+
+
+/**
+ * @brief Dispatch one read of client input
+ *
+ * @param	data	Input bytes
+ * @param	size	Input length, at most what the servant reads at once
+ * @return	0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char msg[MAX_CMD_LEN+5];
+	size_t line_len = strlen(MSG_TYPE_CTL) + 3;	// "CTL c\n"
+	size_t signals = 0;
+	size_t again = 0;
+	size_t len, start, end, n;
+	msg_args_t parsed;
+	char *buf, *nl;
+
+	if (size > SERVANT_INPUT_LEN) {
+		return 0;	// More than the servant reads
+	}
+	buf = malloc(size > 0 ? size : 1);	// Exact size, so overreads are caught
+	memcpy(buf, data, size);
+
+	// Signals first, the rest is kept in order
+	len = takeCtlLines(buf, size, countSignal, &signals);
+	FUZZ_CHECK(len + signals * line_len == size);
+	FUZZ_CHECK(takeCtlLines(buf, len, countSignal, &again) == len);
+	FUZZ_CHECK(again == 0);
+
+	// Then the complete lines, a line filling the whole buffer cut down to a
+	// message
+	for (start = 0; start < len; start = end) {
+		nl = memchr(&buf[start], '\n', len - start);
+		if (nl == NULL) {
+			break;	// Partial line, waits for more input
+		}
+		end = nl - buf + 1;
+		n = (end - start < sizeof(msg)) ? end - start : sizeof(msg) - 1;
+		memcpy(msg, &buf[start], n);
+		msg[n] = '\0';
+
+		parsed = parseMessage(msg);
+		if (!strcmp(parsed.type, MSG_TYPE_CTL)) {
+			// handleCTLMessages() switches on the first char of the arguments
+			FUZZ_CHECK(strlen(parsed.args) < n);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
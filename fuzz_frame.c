@@ -0,0 +1,72 @@
+/**
+ * @file  fuzz_frame.c
+ *
+ * @brief Fuzzing harness of the frame decoding
+ *
+ * The input is what a peer sends after switching a connection to frames.
+ * Frames are decoded in order with decodeFrameHdr(), as recvFrame() does,
+ * until one is out of sync or cut short. The payload of a compressed DATA
+ * frame goes through lzDecompress(), as the client library does, and any
+ * other payload through an lzCompress() round trip.
+ *
+ * 	make fuzz
+ * 	./yashd-fuzz-frame [-runs=RUNS] fuzz_corpus/frame
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <string.h>
+#include "frame.h"
+#include "lz.h"
+#include "fuzz.h"
+
+
+// Globals
+static uint8_t out[FRAME_MAX_PAYLOAD];				//! Decompressed payload
+static uint8_t comp[lzBound(FRAME_MAX_PAYLOAD)];	//! Compressed payload
+
+
+/**
+ * @brief Decode the frames of one input
+ *
+ * @param	data	Frames sent by the peer
+ * @param	size	Bytes sent
+ * @return	0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	frame_hdr_t hdr;
+	size_t off = 0;
+	uint8_t *payload;
+	int n, c;
+
+	while (size - off >= FRAME_HDR_LEN) {
+		if (decodeFrameHdr(&data[off], &hdr, FRAME_MAX_PAYLOAD) < 0) {
+			FUZZ_CHECK(hdr.len > FRAME_MAX_PAYLOAD);
+			break;	// Out of sync, the connection is dropped
+		}
+		FUZZ_CHECK(hdr.len <= FRAME_MAX_PAYLOAD);
+		off += FRAME_HDR_LEN;
+		if (hdr.len > size - off) {
+			break;	// EOF in the payload
+		}
+
+		// Exact size, so overreads are caught
+		payload = malloc(hdr.len > 0 ? hdr.len : 1);
+		memcpy(payload, &data[off], hdr.len);
+		off += hdr.len;
+
+		if (hdr.type == FRAME_DATA && (hdr.flags & FRAME_FLAG_LZ)) {
+			n = lzDecompress(payload, hdr.len, out, sizeof(out));
+			FUZZ_CHECK(n >= -1 && n <= (int) sizeof(out));
+		} else {
+			c = lzCompress(payload, hdr.len, comp, sizeof(comp));
+			FUZZ_CHECK(c >= 0 && c <= (int) lzBound(hdr.len));
+			n = lzDecompress(comp, c, out, sizeof(out));
+			FUZZ_CHECK(n == (int) hdr.len && !memcmp(out, payload, n));
+		}
+		free(payload);
+	}
+
+	return 0;
+}
@@ -0,0 +1,109 @@
+/**
+ * @file  fuzz_job.c
+ *
+ * @brief Fuzzing harness of tokenizeString() and parseJob()
+ *
+ * The input is the argument of a CMD message, as handleNewJob() hands it to
+ * parseJob(). It is parsed into a job reset as handleNewJob() does, after the
+ * ignoreInput() check the shell makes first. The input is also tokenized on
+ * its own, straight from the job's command string.
+ *
+ * 	make fuzz
+ * 	./yashd-fuzz-job [-runs=RUNS] fuzz_corpus/job
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include "fuzz.h"
+
+
+// Globals
+static shell_info_t shell_info;	//! Session, its first job is parsed (too big for the stack)
+
+
+/**
+ * @brief Reset the session's first job, as handleNewJob() does
+ *
+ * @return	The job
+ */
+static job_info_t *resetJob() {
+	job_info_t *job = &shell_info.job_table[0];
+
+	memset(job, 0, sizeof(job_info_t));
+	job->cmd_tok[0] = EMPTY_STR;
+	job->cmd1[0] = EMPTY_STR;
+	job->cmd2[0] = EMPTY_STR;
+	shell_info.job_table_idx = 1;
+	return job;
+}
+
+
+/**
+ * @brief Check the tokens of a job point into its command string
+ *
+ * @param	job	Job tokenized
+ */
+static void checkTokens(job_info_t *job) {
+	const char *end = &job->cmd_str[sizeof(job->cmd_str)];
+
+	FUZZ_CHECK(job->cmd_tok_len < MAX_TOKEN_NUM);
+	FUZZ_CHECK(job->cmd_tok[job->cmd_tok_len] == NULL);
+	for (uint32_t i=0; i<job->cmd_tok_len; i++) {
+		FUZZ_CHECK(job->cmd_tok[i] >= job->cmd_str && job->cmd_tok[i] < end);
+		FUZZ_CHECK(job->cmd_tok[i][0] != '\0');
+		FUZZ_CHECK(strchr(job->cmd_tok[i], ' ') == NULL);
+	}
+}
+
+
+/**
+ * @brief Parse one command line
+ *
+ * @param	data	Command line bytes, cut at the first '\0' as a C string
+ * @param	size	Command line length
+ * @return	0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char *line = malloc(size + 1);	// Exact size, so overreads are caught
+	job_info_t *job;
+
+	memcpy(line, data, size);
+	line[size] = '\0';
+
+	// tokenizeString() of a command string that fits
+	if (strlen(line) <= MAX_CMD_LEN) {
+		job = resetJob();
+		strcpy(job->cmd_str, line);
+		tokenizeString(job);
+		if (job->err_msg[0] == '\0') {
+			checkTokens(job);
+		}
+	}
+
+	// parseJob() of the whole line
+	if (!ignoreInput(line)) {
+		job = resetJob();
+		parseJob(line, &shell_info);
+
+		FUZZ_CHECK(memchr(job->err_msg, '\0', MAX_ERROR_LEN) != NULL);
+		FUZZ_CHECK(strlen(job->in1) <= MAX_TOKEN_LEN);
+		FUZZ_CHECK(strlen(job->out1) <= MAX_TOKEN_LEN);
+		FUZZ_CHECK(strlen(job->err1) <= MAX_TOKEN_LEN);
+		FUZZ_CHECK(strlen(job->in2) <= MAX_TOKEN_LEN);
+		FUZZ_CHECK(strlen(job->out2) <= MAX_TOKEN_LEN);
+		FUZZ_CHECK(strlen(job->err2) <= MAX_TOKEN_LEN);
+		if (job->err_msg[0] == '\0') {
+			checkTokens(job);
+			FUZZ_CHECK(job->cmd1[MAX_TOKEN_NUM-1] == NULL);
+			FUZZ_CHECK(job->cmd2[MAX_TOKEN_NUM-1] == NULL);
+			FUZZ_CHECK(!job->bg ||
+					!strcmp(job->cmd_tok[job->cmd_tok_len-1], "&"));
+			FUZZ_CHECK(!job->pipe || job->cmd2[0][0] != '\0');
+		}
+	}
+
+	free(line);
+	return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file  fuzz_msg.c
+ *
+ * @brief Fuzzing harness of parseMessage()
+ *
+ * The input is one message as the servant thread hands it to parseMessage():
+ * a line of at most MAX_CMD_LEN+4 bytes, maybe without its newline. Longer
+ * inputs are parsed too, since the parser must reject them on its own.
+ *
+ * 	make fuzz
+ * 	./yashd-fuzz-msg [-runs=RUNS] fuzz_corpus/msg
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include "fuzz.h"
+
+
+/**
+ * @brief Parse one message
+ *
+ * @param	data	Message bytes, cut at the first '\0' as a C string
+ * @param	size	Message length
+ * @return	0
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	char *msg = malloc(size + 1);	// Exact size, so overreads are caught
+	msg_args_t parsed;
+	size_t len;
+
+	memcpy(msg, data, size);
+	msg[size] = '\0';
+	len = strlen(msg);
+
+	parsed = parseMessage(msg);
+
+	// Both fields are strings within their arrays, and parts of the message
+	FUZZ_CHECK(memchr(parsed.type, '\0', sizeof(parsed.type)) != NULL);
+	FUZZ_CHECK(memchr(parsed.args, '\0', sizeof(parsed.args)) != NULL);
+	FUZZ_CHECK(strlen(msg) <= len);
+	if (parsed.type[0] == '\0') {
+		FUZZ_CHECK(parsed.args[0] == '\0');
+	} else {
+		FUZZ_CHECK(strchr(parsed.type, ' ') == NULL);
+		FUZZ_CHECK(strstr(msg, parsed.type) != NULL);
+		FUZZ_CHECK(strlen(parsed.type) + 1 + strlen(parsed.args) <= len);
+	}
+
+	free(msg);
+	return 0;
+}
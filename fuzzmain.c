@@ -0,0 +1,358 @@
+/**
+ * @file  fuzzmain.c
+ *
+ * @brief Standalone driver of the fuzzing harnesses
+ *
+ * Runs a harness of fuzz.h without libFuzzer, for plain gcc builds: every
+ * file given (or found in a directory given) is run once, then RUNS random
+ * mutations of them. Mutations flip bits, overwrite, insert and delete bytes,
+ * insert protocol tokens, and splice two inputs. There is no coverage
+ * feedback, so for long campaigns build the harnesses with libFuzzer.
+ *
+ * The options take libFuzzer's syntax, so the same command runs either build:
+ *
+ * 	make fuzz
+ * 	./yashd-fuzz-msg [-runs=RUNS] [-seed=SEED] [-max_len=LEN] PATH...
+ *
+ * If a harness crashes or aborts, its input is written to `crash-NAME` in the
+ * working directory, NAME being the harness name. Run the file again to
+ * reproduce it.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "fuzz.h"
+#include "yash_time.h"
+
+
+#define FUZZ_MAX_FILE (1 << 20)	//! Max size of a corpus file read
+#define FUZZ_MAX_MUTATIONS 4	//! Max mutations stacked on one input
+
+
+/**
+ * \brief Struct for an input of the corpus
+ */
+typedef struct _fuzz_input {
+	uint8_t *data;	// Input bytes
+	size_t size;	// Input length
+} fuzz_input_t;
+
+
+// Globals
+static fuzz_input_t *corpus = NULL;		//! Inputs read
+static size_t corpus_len = 0;			//! Inputs in the corpus
+static size_t corpus_cap = 0;			//! Inputs the corpus array holds
+static const uint8_t *cur_data = NULL;	//! Input being run
+static size_t cur_size = 0;				//! Length of the input being run
+static char crash_path[256];			//! Where a crashing input is written
+static uint64_t rng;					//! Mutation PRNG state
+
+//! Protocol tokens inserted by the mutator, some with zero bytes
+#define FUZZ_TOKEN(s) { s, sizeof(s) - 1 }
+static const struct {
+	const char *data;
+	size_t size;
+} tokens[] = {
+	FUZZ_TOKEN("CMD "), FUZZ_TOKEN("CTL c\n"), FUZZ_TOKEN("CTL z\n"),
+	FUZZ_TOKEN("CTL d\n"), FUZZ_TOKEN("HELLO 1 7 65536\n"), FUZZ_TOKEN("MUX\n"),
+	FUZZ_TOKEN("\n"), FUZZ_TOKEN(" "), FUZZ_TOKEN("|"), FUZZ_TOKEN("<"),
+	FUZZ_TOKEN(">"), FUZZ_TOKEN("2>"), FUZZ_TOKEN("&"), FUZZ_TOKEN("\x02\x02"),
+	FUZZ_TOKEN("\x03\x03"),
+	FUZZ_TOKEN("\x02\x00\x00\x01\x00\x00\x00\x10"),	// DATA frame header
+	FUZZ_TOKEN("\x02\x01\x00\x01\x00\x00\x00\x10"),	// Compressed DATA
+	FUZZ_TOKEN("\x01\x00\x00\x01\x00\x00\x00\x00"),	// OPEN frame
+	FUZZ_TOKEN("\xff\xff\xff\xff"), FUZZ_TOKEN("\xf0\xff\xff"),
+};
+
+
+/**
+ * @brief Get a pseudo-random number (xorshift64)
+ *
+ * @return	Next number of the sequence
+ */
+static uint64_t nextRand() {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+
+/**
+ * @brief Write the input being run, when the harness crashes
+ *
+ * @param	sig	Signal number
+ */
+static void crashHandler(int sig) {
+	int fd = open(crash_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd >= 0) {
+		if (write(fd, cur_data, cur_size) < 0) {
+			// Nothing else to do in a signal handler
+		}
+		close(fd);
+	}
+	if (write(STDERR_FILENO, "crash input written to ", 23) < 0 ||
+			write(STDERR_FILENO, crash_path, strlen(crash_path)) < 0 ||
+			write(STDERR_FILENO, "\n", 1) < 0) {
+		// Same
+	}
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+
+/**
+ * @brief Run one input through the harness
+ *
+ * @param	data	Input bytes
+ * @param	size	Input length
+ */
+static void runInput(const uint8_t *data, size_t size) {
+	cur_data = data;
+	cur_size = size;
+	LLVMFuzzerTestOneInput(data, size);
+}
+
+
+/**
+ * @brief Add a file to the corpus
+ *
+ * @param	path	File path
+ * @return	0 on success, or -1 on error
+ */
+static int addFile(const char *path) {
+	struct stat st;
+	uint8_t *data;
+	ssize_t n = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	if (st.st_size > FUZZ_MAX_FILE) {
+		fprintf(stderr, "%s: larger than %d bytes, skipped\n", path,
+				FUZZ_MAX_FILE);
+		close(fd);
+		return 0;
+	}
+
+	data = malloc(st.st_size + 1);
+	while (n < st.st_size) {
+		ssize_t rc = read(fd, &data[n], st.st_size - n);
+		if (rc <= 0) {
+			break;
+		}
+		n += rc;
+	}
+	close(fd);
+
+	if (corpus_len == corpus_cap) {
+		corpus_cap = (corpus_cap > 0) ? 2 * corpus_cap : 64;
+		corpus = realloc(corpus, corpus_cap * sizeof(fuzz_input_t));
+	}
+	corpus[corpus_len].data = data;
+	corpus[corpus_len].size = n;
+	corpus_len++;
+	return 0;
+}
+
+
+/**
+ * @brief Add a file, or the files in a directory, to the corpus
+ *
+ * @param	path	File or directory path
+ * @return	0 on success, or -1 on error
+ */
+static int addPath(const char *path) {
+	char file[4096];
+	struct dirent *ent;
+	struct stat st;
+	DIR *dir;
+	int rc = 0;
+
+	if (stat(path, &st) < 0) {
+		perror(path);
+		return -1;
+	}
+	if (!S_ISDIR(st.st_mode)) {
+		return addFile(path);
+	}
+
+	if ((dir = opendir(path)) == NULL) {
+		perror(path);
+		return -1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+		if (ent->d_name[0] != '.' && stat(file, &st) == 0 &&
+				S_ISREG(st.st_mode) && addFile(file) < 0) {
+			rc = -1;
+		}
+	}
+	closedir(dir);
+	return rc;
+}
+
+
+/**
+ * @brief Make a mutation of a corpus input
+ *
+ * @param	buf		Output
+ * @param	max_len	Output capacity
+ * @return	Mutated input length
+ */
+static size_t mutate(uint8_t *buf, size_t max_len) {
+	size_t size = 0;
+	int count = 1 + nextRand() % FUZZ_MAX_MUTATIONS;
+
+	if (corpus_len > 0) {
+		fuzz_input_t *in = &corpus[nextRand() % corpus_len];
+		size = (in->size < max_len) ? in->size : max_len;
+		memcpy(buf, in->data, size);
+	}
+
+	for (int i=0; i<count; i++) {
+		size_t pos = (size > 0) ? nextRand() % size : 0;
+		size_t n;
+
+		switch (nextRand() % 7) {
+		case 0:	// Flip a bit
+			if (size > 0) {
+				buf[pos] ^= 1 << (nextRand() % 8);
+			}
+			break;
+		case 1:	// Overwrite a byte
+			if (size > 0) {
+				buf[pos] = nextRand();
+			}
+			break;
+		case 2:	// Insert random bytes
+			n = 1 + nextRand() % 8;
+			if (size + n <= max_len) {
+				memmove(&buf[pos + n], &buf[pos], size - pos);
+				for (size_t j=0; j<n; j++) {
+					buf[pos + j] = nextRand();
+				}
+				size += n;
+			}
+			break;
+		case 3:	// Delete bytes
+			if (size > 0) {
+				n = 1 + nextRand() % (size - pos);
+				memmove(&buf[pos], &buf[pos + n], size - pos - n);
+				size -= n;
+			}
+			break;
+		case 4:	// Insert a protocol token
+		case 5:
+			n = nextRand() % (sizeof(tokens) / sizeof(tokens[0]));
+			if (size + tokens[n].size <= max_len) {
+				memmove(&buf[pos + tokens[n].size], &buf[pos], size - pos);
+				memcpy(&buf[pos], tokens[n].data, tokens[n].size);
+				size += tokens[n].size;
+			}
+			break;
+		default:	// Splice the tail of another input
+			if (corpus_len > 0) {
+				fuzz_input_t *in = &corpus[nextRand() % corpus_len];
+				size_t from = (in->size > 0) ? nextRand() % in->size : 0;
+				n = in->size - from;
+				if (pos + n > max_len) {
+					n = max_len - pos;
+				}
+				memcpy(&buf[pos], &in->data[from], n);
+				size = pos + n;
+			}
+			break;
+		}
+	}
+
+	return size;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Argument count
+ * @param	argv	Arguments
+ * @return	EXIT_SUCCESS, or EXIT_FAILURE on a bad argument
+ */
+int main(int argc, char **argv) {
+	unsigned long runs = 0;
+	unsigned long seed = time(NULL);
+	size_t max_len = FUZZ_MAX_LEN;
+	uint64_t start;
+	uint8_t *buf;
+
+	snprintf(crash_path, sizeof(crash_path), "crash-%s", basename(argv[0]));
+	signal(SIGSEGV, crashHandler);
+	signal(SIGBUS, crashHandler);
+	signal(SIGFPE, crashHandler);
+	signal(SIGILL, crashHandler);
+	signal(SIGABRT, crashHandler);
+
+	for (int i=1; i<argc; i++) {
+		if (!strncmp(argv[i], "-runs=", 6)) {
+			runs = strtoul(&argv[i][6], NULL, 10);
+		} else if (!strncmp(argv[i], "-seed=", 6)) {
+			seed = strtoul(&argv[i][6], NULL, 10);
+		} else if (!strncmp(argv[i], "-max_len=", 9)) {
+			max_len = strtoul(&argv[i][9], NULL, 10);
+		} else if (argv[i][0] == '-') {
+			fprintf(stderr, "Usage: %s [-runs=RUNS] [-seed=SEED] "
+					"[-max_len=LEN] PATH...\n", argv[0]);
+			return EXIT_FAILURE;
+		} else if (addPath(argv[i]) < 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	if (max_len == 0) {
+		max_len = 1;
+	}
+	rng = (seed != 0) ? seed : 1;
+
+	start = nowUs();
+
+	// The corpus as is
+	for (size_t i=0; i<corpus_len; i++) {
+		runInput(corpus[i].data, corpus[i].size);
+	}
+
+	// Mutations of it. Each goes in a buffer of its exact size, so a sanitizer
+	// catches reads past its end.
+	buf = malloc(max_len);
+	for (unsigned long r=0; r<runs; r++) {
+		size_t size = mutate(buf, max_len);
+		uint8_t *in = malloc(size > 0 ? size : 1);
+
+		memcpy(in, buf, size);
+		runInput(in, size);
+		free(in);
+	}
+	free(buf);
+
+	printf("%s: %zu corpus inputs, %lu mutations, seed %lu, %.1f s\n",
+			basename(argv[0]), corpus_len, runs, seed,
+			(nowUs() - start) / 1e6);
+
+	for (size_t i=0; i<corpus_len; i++) {
+		free(corpus[i].data);
+	}
+	free(corpus);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file  hist.c
+ *
+ * @brief Log2 histograms for the yash shell daemon's stats
+ *
+ * Bucket i counts the values below 2^i not counted by a lower bucket, so a
+ * histogram covers 1 to 2^HIST_BUCKETS in a few hundred bytes, with at most a
+ * factor of 2 of error. Histograms are not locked: the caller serializes the
+ * updates.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+/**
+ * @brief Add a value to a histogram
+ *
+ * @param	hist	Histogram
+ * @param	value	Value
+ */
+void histAdd(hist_t *hist, uint64_t value) {
+	int bucket = value ? 64 - __builtin_clzll(value) : 0;
+
+	if (bucket >= HIST_BUCKETS) {
+		bucket = HIST_BUCKETS - 1;
+	}
+	hist->buckets[bucket]++;
+	hist->count++;
+	hist->sum += value;
+	if (value > hist->max) {
+		hist->max = value;
+	}
+}
+
+
+/**
+ * @brief Estimate a percentile of a histogram
+ *
+ * @param	hist	Histogram
+ * @param	pct		Percentile [0-100]
+ * @return	Upper bound of the bucket holding the percentile, capped at the
+ * 			largest value seen, or 0 if the histogram is empty
+ */
+uint64_t histPercentile(const hist_t *hist, int pct) {
+	uint64_t target = (hist->count * pct + 99) / 100;
+	uint64_t seen = 0;
+
+	for (int i=0; i<HIST_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target && seen > 0) {
+			uint64_t bound = (1ULL << i) - 1;
+
+			// The top bucket has no bound, and no bucket goes past the max
+			return (i == HIST_BUCKETS - 1 || bound > hist->max) ?
+					hist->max : bound;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Log a histogram to stderr
+ *
+ * One line with the summary, and the non-empty buckets as `<LIMIT:COUNT`.
+ *
+ * @param	name	Name of the histogram, with its unit
+ * @param	hist	Histogram
+ */
+void histLog(const char *name, const hist_t *hist) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char line[HIST_BUCKETS * 32];
+	int len = 0;
+
+	line[0] = '\0';
+	for (int i=0; i<HIST_BUCKETS; i++) {
+		if (hist->buckets[i] > 0) {
+			len += snprintf(&line[len], sizeof(line) - len, " <%llu:%lu",
+					1ULL << i, hist->buckets[i]);
+		}
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: %s: count: %lu, mean: %lu, p50: "
+			"%lu, p99: %lu, max: %lu, buckets:%s\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), name, hist->count,
+			hist->count ? hist->sum / hist->count : 0,
+			histPercentile(hist, 50), histPercentile(hist, 99), hist->max, line);
+}
@@ -0,0 +1,550 @@
+/**
+ * @file  jobreg.c
+ *
+ * @brief Crash-recoverable job registry of the yash shell daemon
+ *
+ * Every running job is mirrored into a fixed-layout file mapped in memory
+ * (`yashd-jobs.reg`, or `yashd-jobs-PORT.reg` on other ports), so the jobs of
+ * a daemon that crashes are not lost track of: the mapping is
+ * shared, so the kernel keeps what was written even if the process dies
+ * mid-job. Registering and releasing a job are a few stores into the
+ * mapping, ordered by the entry's state word (claimed with a CAS, published
+ * with a release store), and take no system calls.
+ *
+ * The file is kept in a directory private to the daemon's user: `--jobs DIR`,
+ * or else `$XDG_RUNTIME_DIR`, or else `/tmp/yashd-UID`. Since the registry
+ * names process groups to kill, a directory or file that another user could
+ * write is refused.
+ *
+ * When a daemon starts, it scans the registry for jobs whose daemon is gone:
+ * 	- Jobs whose process group is gone are forgotten.
+ * 	- Background jobs still running are adopted: they keep running, now
+ * 	  owned by this daemon, and are reported to their client.
+ * 	- Foreground jobs still running are killed, since their session and its
+ * 	  input are gone, and are reported to their client. A group is only
+ * 	  killed if its leader is still the job's: same user, same session as the
+ * 	  daemon that started it, and started when the job was.
+ *
+ * A session's token carries its client's address, or its client's user on a
+ * Unix socket, so a client reconnecting from the same host (or as the same
+ * user) is told about the orphaned jobs of its earlier sessions before its
+ * first prompt.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+static jobreg_hdr_t *jobreg = NULL;		//! Registry mapping, NULL if unavailable
+static jobreg_entry_t *jobreg_entries = NULL;	//! Registry entries
+static uint32_t jobreg_hint = 0;		//! Next slot to try when registering
+static uint32_t session_tokens = 0;		//! Sessions given a token
+static pid_t jobreg_pid = 0;			//! This daemon's process
+static pid_t jobreg_sid = 0;			//! This daemon's session
+
+
+/**
+ * @brief FNV-1a hash of a command line
+ */
+static uint64_t hashCmd(const char *cmd) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *cmd != '\0'; cmd++) {
+		h ^= (uint8_t) *cmd;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+/**
+ * @brief Check whether a process is a running yashd
+ *
+ * @param	pid	Process ID
+ * @return	True if the process exists, runs yashd, and is not a zombie
+ */
+static bool isDaemon(pid_t pid) {
+	char path[PATHMAX];
+	char line[256];
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+
+	// Line starts with "PID (COMM) STATE"
+	if (p == NULL || (p = strchr(line, '(')) == NULL ||
+			strncmp(p, "(yashd)", 7) || p[8] == 'Z') {
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * @brief Read the process group, session and start time of a process
+ *
+ * @param	pid		Process ID
+ * @param	pgrp	Process group, on return
+ * @param	sid		Session, on return
+ * @param	start	Start time (seconds since the epoch), on return
+ * @return	0 on success, or -1 if the process is gone or its stat unreadable
+ */
+static int readProcStat(pid_t pid, pid_t *pgrp, pid_t *sid, time_t *start) {
+	static time_t btime = 0;
+	char path[PATHMAX];
+	char line[1024];
+	unsigned long long ticks;
+	char *p;
+	FILE *f;
+
+	// Boot time, to turn the start time into a date
+	if (btime == 0 && (f = fopen("/proc/stat", "r")) != NULL) {
+		while (fgets(line, sizeof(line), f) != NULL) {
+			if (sscanf(line, "btime %ld", &btime) == 1) {
+				break;
+			}
+		}
+		fclose(f);
+	}
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+
+	// Fields after "PID (COMM)": state ppid pgrp session ... starttime (22nd)
+	if (p == NULL || btime == 0 || (p = strrchr(line, ')')) == NULL ||
+			sscanf(p + 2, "%*c %*d %d %d %*d %*d %*u %*u %*u %*u %*u %*u "
+					"%*u %*d %*d %*d %*d %*d %*d %llu", pgrp, sid, &ticks) != 3) {
+		return -1;
+	}
+
+	*start = btime + ticks / sysconf(_SC_CLK_TCK);
+	return 0;
+}
+
+
+/**
+ * @brief Check whether a job's process group still runs, and is still the
+ * job's (its number was not reused)
+ *
+ * @param	entry	Registry entry of the job
+ * @return	True if the job's process group is alive
+ */
+static bool isJobAlive(jobreg_entry_t *entry) {
+	pid_t pgrp, sid;
+	time_t start;
+
+	if (entry->pgid <= 0 || (kill(-entry->pgid, 0) < 0 && errno == ESRCH)) {
+		return false;
+	}
+
+	// Without its leader, the group number cannot have been reused
+	if (readProcStat(entry->pgid, &pgrp, &sid, &start) < 0) {
+		return true;
+	}
+
+	return llabs((long long) start - (long long) (entry->start / 1000000)) <=
+			JOBREG_START_SLACK;
+}
+
+
+/**
+ * @brief Check whether a job's process group is safe to kill
+ *
+ * The group's leader must still be the job's: run by this user, in the
+ * session of the daemon that registered the job, and started when the job
+ * was. A group whose leader is gone cannot be checked, so it is not killed.
+ *
+ * @param	entry	Registry entry of the job
+ * @return	True if the group is the job's
+ */
+static bool isJobOurs(jobreg_entry_t *entry) {
+	char path[PATHMAX];
+	struct stat st;
+	pid_t pgrp, sid;
+	time_t start;
+
+	snprintf(path, sizeof(path), "/proc/%d", entry->pgid);
+	if (entry->pgid <= 0 || stat(path, &st) < 0 || st.st_uid != geteuid() ||
+			readProcStat(entry->pgid, &pgrp, &sid, &start) < 0) {
+		return false;
+	}
+
+	return pgrp == entry->pgid && entry->sid > 0 && sid == entry->sid &&
+			llabs((long long) start - (long long) (entry->start / 1000000)) <=
+			JOBREG_START_SLACK;
+}
+
+
+/**
+ * @brief Adopt or kill the jobs of daemons that are gone
+ */
+static void recoverJobs() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	pid_t self = jobreg_pid;
+	int adopted = 0;
+	int killed = 0;
+	int gone = 0;
+
+	for (uint32_t i=0; i<jobreg->slots; i++) {
+		jobreg_entry_t *entry = &jobreg_entries[i];
+		uint32_t state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+		if ((state != JOBREG_LIVE && state != JOBREG_ORPHAN) ||
+				entry->owner == self || isDaemon(entry->owner)) {
+			continue;
+		}
+		// Claim it, another daemon starting may be recovering too
+		if (!__atomic_compare_exchange_n(&entry->state, &state, JOBREG_BUSY,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (state == JOBREG_ORPHAN) {
+			__atomic_fetch_sub(&jobreg->orphans, 1, __ATOMIC_RELAXED);
+		}
+
+		if (!isJobAlive(entry)) {
+			gone++;
+			__atomic_store_n(&entry->state, JOBREG_FREE, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		if (entry->bg) {
+			adopted++;
+			state = JOBREG_ORPHAN;
+		} else if (isJobOurs(entry)) {
+			killed++;
+			kill(-entry->pgid, SIGKILL);
+			state = JOBREG_KILLED;
+		} else {
+			fprintf(stderr, "%s yashd[daemon]: WARN: Left orphaned job [%d] "
+					"of daemon %d alone, it is not a job of ours anymore: %s\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), entry->pgid,
+					entry->owner, entry->cmd);
+			gone++;
+			__atomic_store_n(&entry->state, JOBREG_FREE, __ATOMIC_RELEASE);
+			continue;
+		}
+		fprintf(stderr, "%s yashd[daemon]: WARN: %s orphaned job [%d] of "
+				"daemon %d: %s\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				state == JOBREG_ORPHAN ? "Adopted" : "Killed", entry->pgid,
+				entry->owner, entry->cmd);
+		entry->owner = self;
+		__atomic_fetch_add(&jobreg->orphans, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->state, state, __ATOMIC_RELEASE);
+	}
+
+	if (adopted + killed + gone > 0) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Recovered job registry: %d "
+				"adopted, %d killed, %d already gone\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), adopted, killed, gone);
+	}
+}
+
+
+/**
+ * @brief Open the directory of the job registry, creating the default one
+ *
+ * The directory must be owned by this user, and only writable by it.
+ *
+ * @return	Directory fd, or -1 on error
+ */
+static int openJobRegistryDir() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char path[PATHMAX+1];
+	char *dir = getenv("XDG_RUNTIME_DIR");
+	struct stat st;
+	int fd;
+
+	if (args.jobs[0] != '\0') {
+		strcpy(path, args.jobs);
+	} else if (dir != NULL && dir[0] == '/' && strlen(dir) <= PATHMAX) {
+		strcpy(path, dir);
+	} else {
+		snprintf(path, sizeof(path), JOBREG_DIR, (unsigned int) geteuid());
+		mkdir(path, 0700);
+	}
+
+	if ((fd = open(path, O_RDONLY|O_DIRECTORY|O_NOFOLLOW|O_CLOEXEC)) < 0) {
+		perror("ERROR: Opening job registry directory");
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() ||
+			(st.st_mode & (S_IWGRP|S_IWOTH))) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Job registry directory %s is "
+				"not owned by this user, or others can write it\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * @brief Map the job registry, creating it if needed, and recover the jobs of
+ * daemons that are gone
+ *
+ * @param	port	Server port
+ * @return	0 on success, or -1 on error
+ */
+int startJobRegistry(int port) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char name[PATHMAX];
+	size_t size = sizeof(jobreg_hdr_t) + JOBREG_SLOTS * sizeof(jobreg_entry_t);
+	struct stat st;
+	int dir_fd;
+	int fd;
+
+	if (port == DEFAULT_TCP_PORT) {
+		strcpy(name, JOBREG_FILE);
+	} else {
+		snprintf(name, sizeof(name), JOBREG_FILE_PORT, port);
+	}
+
+	if ((dir_fd = openJobRegistryDir()) < 0) {
+		return -1;
+	}
+	fd = openat(dir_fd, name, O_RDWR|O_CREAT|O_NOFOLLOW|O_CLOEXEC, 0600);
+	close(dir_fd);
+	if (fd < 0) {
+		perror("ERROR: Opening job registry");
+		return -1;
+	}
+	// Only trust a registry this user wrote
+	if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+			st.st_uid != geteuid() || (st.st_mode & 0777) != 0600) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Job registry %s is not "
+				"owned by this user with mode 0600\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), name);
+		close(fd);
+		return -1;
+	}
+	// A registry of another layout is started over
+	if (st.st_size != (off_t) size &&
+			(ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0)) {
+		perror("ERROR: Sizing job registry");
+		close(fd);
+		return -1;
+	}
+	jobreg = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (jobreg == MAP_FAILED) {
+		perror("ERROR: Mapping job registry");
+		jobreg = NULL;
+		return -1;
+	}
+	jobreg_entries = (jobreg_entry_t *) (jobreg + 1);
+	// Registering a job takes no system calls, so look these up once. A
+	// prefork worker starts its own registry after it forks.
+	jobreg_pid = getpid();
+	jobreg_sid = getsid(0);
+
+	// Fresh file (all zeros): publish the layout
+	if (jobreg->magic != JOBREG_MAGIC || jobreg->slots != JOBREG_SLOTS ||
+			jobreg->entry_size != sizeof(jobreg_entry_t)) {
+		memset(jobreg, 0, size);
+		jobreg->slots = JOBREG_SLOTS;
+		jobreg->entry_size = sizeof(jobreg_entry_t);
+		__atomic_store_n(&jobreg->magic, JOBREG_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	recoverJobs();
+
+	return 0;
+}
+
+
+/**
+ * @brief Give a new session its token
+ *
+ * The client's address goes in the high half, so the orphaned jobs of a
+ * client's sessions can be reported when it reconnects. Clients on a Unix
+ * socket have no address, so their user ID (SO_PEERCRED) goes there instead,
+ * which no TCP client has: it falls in 0.0.0.0/8. Streams of a multiplexed
+ * connection keep the connection's address.
+ *
+ * @param	shell_info	Shell info of the session
+ */
+void newSessionToken(shell_info_t *shell_info) {
+	uint32_t client = ntohl(shell_info->th_args.from.sin_addr.s_addr);
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	struct ucred cred;
+	socklen_t cred_len = sizeof(cred);
+
+	if (!shell_info->th_args.stream &&
+			getsockname(shell_info->th_args.ps, (struct sockaddr *) &addr,
+					&addr_len) == 0 && addr.ss_family == AF_UNIX &&
+			getsockopt(shell_info->th_args.ps, SOL_SOCKET, SO_PEERCRED, &cred,
+					&cred_len) == 0) {
+		client = cred.uid;
+	}
+
+	shell_info->token = ((uint64_t) client << 32) |
+			__atomic_add_fetch(&session_tokens, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Register a job that was just started
+ *
+ * @param	shell_info	Shell info of the session running the job
+ * @param	job			Job, with its process group set
+ * @param	pid			PID of the job's last process
+ */
+void jobRegAdd(shell_info_t *shell_info, job_info_t *job, pid_t pid) {
+	char cmd[MAX_CMD_LEN+1];
+	uint32_t start;
+	size_t len;
+
+	job->reg_slot = EMPTY_ARRAY;
+	if (jobreg == NULL) {
+		return;
+	}
+
+	start = __atomic_fetch_add(&jobreg_hint, 1, __ATOMIC_RELAXED);
+	for (uint32_t n=0; n<JOBREG_SLOTS; n++) {
+		uint32_t i = (start + n) % JOBREG_SLOTS;
+		jobreg_entry_t *entry = &jobreg_entries[i];
+		uint32_t state = JOBREG_FREE;
+
+		if (__atomic_load_n(&entry->state, __ATOMIC_RELAXED) != JOBREG_FREE ||
+				!__atomic_compare_exchange_n(&entry->state, &state,
+						JOBREG_BUSY, false, __ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		// Fill in the entry, then publish it
+		entry->owner = jobreg_pid;
+		entry->pgid = job->gpid;
+		entry->pid = pid;
+		entry->bg = job->bg;
+		entry->sid = jobreg_sid;
+		entry->token = shell_info->token;
+		entry->start = wallUs();
+		// The command string is tokenized in place, join the tokens back
+		len = 0;
+		for (uint32_t j=0; j<job->cmd_tok_len; j++) {
+			len += snprintf(&cmd[len], sizeof(cmd) - len, "%s%s", j ? " " : "",
+					job->cmd_tok[j]);
+			if (len >= sizeof(cmd)) {
+				break;
+			}
+		}
+		entry->cmd_hash = hashCmd(cmd);
+		strncpy(entry->cmd, cmd, JOBREG_CMD_LEN - 1);
+		entry->cmd[JOBREG_CMD_LEN - 1] = '\0';
+		__atomic_store_n(&entry->state, JOBREG_LIVE, __ATOMIC_RELEASE);
+
+		job->reg_slot = i;
+		return;
+	}
+
+	__atomic_fetch_add(&jobreg->full, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Release the registry entry of a job that finished or was killed
+ *
+ * @param	job	Job
+ */
+void jobRegRemove(job_info_t *job) {
+	if (jobreg == NULL || job->reg_slot < 0) {
+		return;
+	}
+
+	__atomic_store_n(&jobreg_entries[job->reg_slot].state, JOBREG_FREE,
+			__ATOMIC_RELEASE);
+	job->reg_slot = EMPTY_ARRAY;
+}
+
+
+/**
+ * @brief Tell a new session about the orphaned jobs of its client's earlier
+ * sessions
+ *
+ * Killed jobs are reported once. Adopted jobs are reported until they finish.
+ *
+ * @param	shell_info	Shell info of the session
+ */
+void reportOrphanJobs(shell_info_t *shell_info) {
+	char msg[JOBREG_CMD_LEN + 96];
+	uint32_t client = (uint32_t) (shell_info->token >> 32);
+
+	if (jobreg == NULL ||
+			__atomic_load_n(&jobreg->orphans, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	for (uint32_t i=0; i<jobreg->slots; i++) {
+		jobreg_entry_t *entry = &jobreg_entries[i];
+		uint32_t state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+		bool alive;
+
+		if ((state != JOBREG_ORPHAN && state != JOBREG_KILLED) ||
+				(uint32_t) (entry->token >> 32) != client ||
+				!__atomic_compare_exchange_n(&entry->state, &state,
+						JOBREG_BUSY, false, __ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		alive = state == JOBREG_ORPHAN && isJobAlive(entry);
+		snprintf(msg, sizeof(msg), "-yash: job [%d] of a previous daemon %s: "
+				"%s\n", entry->pgid, state == JOBREG_KILLED ? "was killed" :
+				alive ? "is still running" : "has finished", entry->cmd);
+		send(shell_info->th_args.ps, msg, strlen(msg), MSG_NOSIGNAL);
+
+		if (alive) {
+			__atomic_store_n(&entry->state, JOBREG_ORPHAN, __ATOMIC_RELEASE);
+		} else {
+			__atomic_fetch_sub(&jobreg->orphans, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&entry->state, JOBREG_FREE, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+
+/**
+ * @brief Log the job registry counters
+ */
+void logJobRegStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	uint32_t live = 0;
+	uint32_t mine = 0;
+
+	if (jobreg == NULL) {
+		return;
+	}
+
+	for (uint32_t i=0; i<jobreg->slots; i++) {
+		if (__atomic_load_n(&jobreg_entries[i].state, __ATOMIC_RELAXED) ==
+				JOBREG_LIVE) {
+			live++;
+			mine += jobreg_entries[i].owner == jobreg_pid;
+		}
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Job registry: running jobs: %u "
+			"(%u in this process), orphaned jobs: %u, registry full: %u\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), live, mine,
+			__atomic_load_n(&jobreg->orphans, __ATOMIC_RELAXED),
+			__atomic_load_n(&jobreg->full, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,277 @@
+/**
+ * @file  listener.c
+ *
+ * @brief Listeners of the yash shell daemon
+ *
+ * Besides the server port, the daemon can listen on more endpoints, each
+ * declared in the config file with its own limits and priority class:
+ *
+ * 	listen = 127.0.0.1:3827 max_clients=10 priority=high
+ * 	listen = unix:/tmp/yashd.sock backlog=32
+ *
+ * Options:
+ * 	- max_clients: max sessions from the listener (0, the default, for no
+ * 	  limit of its own)
+ * 	- backlog: listen() backlog (`connect_queue` by default)
+ * 	- priority: `normal` (default) or `high`
+ *
+ * Every shard polls all the listeners. Connections on high priority listeners
+ * are accepted first, in bursts, and are not counted against the shard's
+ * share of `max_clients` nor redirected to peers, so agents on a high
+ * priority listener still get in while interactive users fill up the daemon.
+ * Keep `max_clients` below MAX_CONCURRENT_CLIENTS to leave them room in the
+ * session tables.
+ *
+ * The set of listeners is fixed when the daemon starts. Their options are
+ * reloaded with the rest of the config.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+listener_t listeners[MAX_LISTENERS];	//! Counters of the listeners
+int listener_count = 0;					//! Number of listeners
+static uint32_t sessions_active = 0;	//! Sessions running, on all listeners
+
+
+/**
+ * @brief Parse the address of a listener
+ *
+ * @param	spec	`ADDR:PORT` (`*` for any address) or `unix:PATH`
+ * @param	conf	Listener config to fill in
+ * @return	0 on success, or -1 if the address is not valid
+ */
+int parseListener(const char *spec, listener_conf_t *conf) {
+	char addr[INET_ADDRSTRLEN];
+	const char *colon;
+	char *end;
+	long port;
+
+	if (strlen(spec) >= sizeof(conf->spec)) {
+		return -1;
+	}
+	strcpy(conf->spec, spec);
+
+	if (!strncmp(spec, "unix:", 5)) {
+		conf->family = AF_UNIX;
+		if (spec[5] != '/' || strlen(&spec[5]) >= sizeof(conf->path)) {
+			return -1;
+		}
+		strcpy(conf->path, &spec[5]);
+		return 0;
+	}
+
+	conf->family = AF_INET;
+	memset(&conf->in, 0, sizeof(conf->in));
+	conf->in.sin_family = AF_INET;
+	if ((colon = strrchr(spec, ':')) == NULL ||
+			colon - spec >= (long) sizeof(addr)) {
+		return -1;
+	}
+	port = strtol(colon + 1, &end, 10);
+	if (*end != '\0' || port < TCP_PORT_LOWER_LIM || port > TCP_PORT_HIGHER_LIM) {
+		return -1;
+	}
+	conf->in.sin_port = htons(port);
+
+	memcpy(addr, spec, colon - spec);
+	addr[colon - spec] = '\0';
+	if (!strcmp(addr, "*")) {
+		conf->in.sin_addr.s_addr = htonl(INADDR_ANY);
+	} else if (inet_pton(AF_INET, addr, &conf->in.sin_addr) != 1) {
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Create the socket of a listener
+ *
+ * TCP listeners are bound with SO_REUSEPORT, so each shard can bind its own.
+ * A stale Unix socket file is replaced.
+ *
+ * @param	idx	Listener index (0 is the server port)
+ * @return	Listening socket, or -1 on error
+ */
+int createListener(int idx) {
+	const listener_conf_t *conf = &getConfig()->listeners[idx];
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct sockaddr_un un;
+	struct stat st;
+	int sd;
+
+	if (idx == 0) {
+		return createSocket(args.port);
+	}
+
+	if (conf->family == AF_UNIX) {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		strcpy(un.sun_path, conf->path);
+		if (lstat(conf->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+			unlink(conf->path);
+		}
+		if ((sd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+				bind(sd, (struct sockaddr *) &un, sizeof(un)) < 0 ||
+				chmod(conf->path, 0600) < 0) {
+			perror("ERROR: Creating Unix listener");
+			if (sd >= 0) {
+				close(sd);
+			}
+			return -1;
+		}
+	} else {
+		if ((sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP)) < 0) {
+			perror("ERROR: Creating TCP listener");
+			return -1;
+		}
+		reusePort(sd);
+		if (bind(sd, (struct sockaddr *) &conf->in, sizeof(conf->in)) < 0) {
+			perror("ERROR: Binding TCP listener");
+			close(sd);
+			return -1;
+		}
+	}
+
+	if (listen(sd, conf->backlog) < 0) {
+		perror("ERROR: Listening");
+		close(sd);
+		return -1;
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Listening on %s (%s priority)\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), conf->spec,
+			conf->priority == LISTENER_HIGH ? "high" : "normal");
+
+	return sd;
+}
+
+
+/**
+ * @brief Create the sockets of all the listeners
+ *
+ * Unix listeners cannot be bound more than once, so the ones in `shared` are
+ * created once and dup()ed for every caller.
+ *
+ * @param	sds		Array to store the listening sockets in
+ * @param	shared	Sockets to dup() (for all listeners if `all` is true,
+ * 					else only for Unix listeners), -1 entries to create them
+ * @param	all		Dup all the shared sockets, not only the Unix ones
+ * @return	0 on success, or -1 on error
+ */
+int openListeners(int *sds, int *shared, bool all) {
+	listener_count = getConfig()->listener_count;
+
+	for (int i=0; i<listener_count; i++) {
+		bool share = all || getConfig()->listeners[i].family == AF_UNIX;
+
+		if (share && shared[i] >= 0) {
+			sds[i] = dup(shared[i]);
+		} else {
+			sds[i] = createListener(i);
+			if (share) {
+				shared[i] = sds[i];
+			}
+		}
+		if (sds[i] < 0) {
+			return -1;
+		}
+		fcntl(sds[i], F_SETFL, O_NONBLOCK);
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Accept a session from a listener, if it has room
+ *
+ * Called with the shard's thread table locked. The listener's slot and the
+ * process' `session_cap` slot are taken first, and given back if either is
+ * over its limit, so shards admitting sessions at the same time cannot both
+ * take the last one.
+ *
+ * @param	idx		Listener index
+ * @param	active	Sessions running on the shard
+ * @param	reason	Rejection reason (ADMIT_REJECT_*), on return, if rejected
+ * @return	True if the session is admitted, false if it must be rejected
+ */
+bool admitSession(int idx, int active, int *reason) {
+	const config_t *cfg = getConfig();
+	const listener_conf_t *conf = &cfg->listeners[idx];
+	listener_t *listener = &listeners[idx];
+	uint32_t listener_active;
+	uint32_t process_active;
+
+	*reason = ADMIT_REJECT_FULL;
+	if (conf->priority != LISTENER_HIGH && active >= shardMaxClients()) {
+		__atomic_fetch_add(&listener->rejected, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	listener_active =
+			__atomic_add_fetch(&listener->active, 1, __ATOMIC_RELAXED);
+	process_active = __atomic_add_fetch(&sessions_active, 1, __ATOMIC_RELAXED);
+	if ((conf->max_clients > 0 &&
+			listener_active > (uint32_t) conf->max_clients) ||
+			(cfg->session_cap > 0 &&
+			process_active > (uint32_t) cfg->session_cap)) {
+		if (conf->max_clients == 0 ||
+				listener_active <= (uint32_t) conf->max_clients) {
+			*reason = ADMIT_REJECT_CAP;
+		}
+		releaseSession(idx);
+		__atomic_fetch_add(&listener->rejected, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	__atomic_fetch_add(&listener->sessions, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+
+/**
+ * @brief Release the slot of a session that ended
+ *
+ * @param	idx	Listener index
+ */
+void releaseSession(int idx) {
+	__atomic_fetch_sub(&listeners[idx].active, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&sessions_active, 1, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Get the number of sessions running, on all listeners
+ *
+ * @return	Sessions running
+ */
+uint32_t activeSessions() {
+	return __atomic_load_n(&sessions_active, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Log the listener counters
+ */
+void logListenerStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	const config_t *cfg = getConfig();
+
+	for (int i=0; i<listener_count; i++) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Listener %d (%s, %s "
+				"priority): active: %u, sessions: %lu, rejected: %lu\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), i,
+				cfg->listeners[i].spec,
+				cfg->listeners[i].priority == LISTENER_HIGH ? "high" : "normal",
+				__atomic_load_n(&listeners[i].active, __ATOMIC_RELAXED),
+				__atomic_load_n(&listeners[i].sessions, __ATOMIC_RELAXED),
+				__atomic_load_n(&listeners[i].rejected, __ATOMIC_RELAXED));
+	}
+}
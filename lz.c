@@ -0,0 +1,239 @@
+/**
+ * @file  lz.c
+ *
+ * @brief LZ77 block codec
+ *
+ * Shared by the daemon and its tools.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <string.h>
+#include "lz.h"
+
+
+/**
+ * @brief Read 4 bytes at any alignment
+ */
+static inline uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+
+/**
+ * @brief Hash of the 4 bytes starting a candidate match
+ */
+static inline uint32_t hash32(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+
+/**
+ * @brief Write the extra bytes of a length whose nibble is 15
+ *
+ * @param	dst	Output buffer
+ * @param	op	Output position, advanced past the bytes written
+ * @param	len	Length minus 15
+ */
+static inline void putLen(uint8_t *dst, int *op, int len) {
+	while (len >= 255) {
+		dst[(*op)++] = 255;
+		len -= 255;
+	}
+	dst[(*op)++] = (uint8_t) len;
+}
+
+
+/**
+ * @brief Read the extra bytes of a length whose nibble is 15
+ *
+ * @param	src	Input buffer
+ * @param	len	Input length
+ * @param	ip	Input position, advanced past the bytes read
+ * @return	Length to add to 15, or -1 if the input ends early
+ */
+static inline int getLen(const uint8_t *src, int len, int *ip) {
+	int n = 0;
+	uint8_t b;
+
+	do {
+		if (*ip >= len || n > (1 << 30)) {	// Also stops overflows
+			return -1;
+		}
+		b = src[(*ip)++];
+		n += b;
+	} while (b == 255);
+
+	return n;
+}
+
+
+/**
+ * @brief Emit one sequence
+ *
+ * @param	dst		Output buffer
+ * @param	cap		Output buffer capacity
+ * @param	op		Output position, advanced past the sequence
+ * @param	lit		Literals
+ * @param	lit_len	Number of literals
+ * @param	offset	Match offset (ignored if there is no match)
+ * @param	mlen	Match length, or 0 for the last sequence
+ * @return	0 on success, or -1 if the sequence does not fit
+ */
+static int putSeq(uint8_t *dst, int cap, int *op, const uint8_t *lit,
+		int lit_len, int offset, int mlen) {
+	int ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+	int need = 1 + lit_len + lit_len / 255 + 1 + (mlen ? 2 + ml / 255 + 1 : 0);
+	uint8_t *token;
+
+	if (*op + need > cap) {
+		return -1;
+	}
+
+	token = &dst[(*op)++];
+	*token = (uint8_t) ((lit_len < 15 ? lit_len : 15) << 4);
+	if (lit_len >= 15) {
+		putLen(dst, op, lit_len - 15);
+	}
+	memcpy(&dst[*op], lit, lit_len);
+	*op += lit_len;
+
+	if (mlen) {
+		dst[(*op)++] = (uint8_t) (offset & 0xff);
+		dst[(*op)++] = (uint8_t) (offset >> 8);
+		*token |= (uint8_t) (ml < 15 ? ml : 15);
+		if (ml >= 15) {
+			putLen(dst, op, ml - 15);
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Compress a block
+ *
+ * Greedy parse: the hash table keeps the last position of each 4-byte prefix,
+ * and every hit is extended as far as it goes. The scan speeds up over runs of
+ * misses, so incompressible data costs little.
+ *
+ * @param	src	Input
+ * @param	len	Input length
+ * @param	dst	Output
+ * @param	cap	Output capacity, lzBound(len) always fits
+ * @return	Compressed length, or -1 if it does not fit in cap
+ */
+int lzCompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+	uint32_t table[1 << LZ_HASH_BITS];
+	int ip = 0;
+	int anchor = 0;
+	int op = 0;
+	int misses = 0;
+
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= len) {
+		uint32_t seq = read32(&src[ip]);
+		uint32_t h = hash32(seq);
+		int ref = (int) table[h];
+
+		table[h] = (uint32_t) ip;
+		if (ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(&src[ref]) == seq) {
+			int mlen = LZ_MIN_MATCH;
+
+			while (ip + mlen < len && src[ref + mlen] == src[ip + mlen]) {
+				mlen++;
+			}
+			if (putSeq(dst, cap, &op, &src[anchor], ip - anchor, ip - ref,
+					mlen) < 0) {
+				return -1;
+			}
+			ip += mlen;
+			anchor = ip;
+			misses = 0;
+		} else {
+			ip += 1 + (misses++ >> 5);
+		}
+	}
+
+	if (putSeq(dst, cap, &op, &src[anchor], len - anchor, 0, 0) < 0) {
+		return -1;
+	}
+
+	return op;
+}
+
+
+/**
+ * @brief Decompress a block
+ *
+ * Every length and offset is checked against the buffers, so a corrupt block
+ * fails instead of reading or writing out of bounds.
+ *
+ * @param	src	Compressed block
+ * @param	len	Compressed length
+ * @param	dst	Output
+ * @param	cap	Output capacity
+ * @return	Decompressed length, or -1 if the block is malformed or does not
+ * 			fit in cap
+ */
+int lzDecompress(const uint8_t *src, int len, uint8_t *dst, int cap) {
+	int ip = 0;
+	int op = 0;
+
+	while (ip < len) {
+		uint8_t token = src[ip++];
+		int lit_len = token >> 4;
+		int mlen = token & 0x0f;
+		int offset;
+		int n;
+
+		// Literals
+		if (lit_len == 15) {
+			if ((n = getLen(src, len, &ip)) < 0) {
+				return -1;
+			}
+			lit_len += n;
+		}
+		if (lit_len > len - ip || lit_len > cap - op) {
+			return -1;
+		}
+		memcpy(&dst[op], &src[ip], lit_len);
+		ip += lit_len;
+		op += lit_len;
+
+		// The last sequence has no match
+		if (ip == len) {
+			break;
+		}
+
+		// Match
+		if (len - ip < 2) {
+			return -1;
+		}
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (mlen == 15) {
+			if ((n = getLen(src, len, &ip)) < 0) {
+				return -1;
+			}
+			mlen += n;
+		}
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || mlen > cap - op) {
+			return -1;
+		}
+
+		// Byte by byte, since the match may overlap its own output
+		for (int i=0; i<mlen; i++, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+
+	return op;
+}
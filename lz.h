@@ -0,0 +1,47 @@
+/**
+ * @file  lz.h
+ *
+ * @brief LZ77 block codec
+ *
+ * A small byte-oriented LZ77 codec in the style of LZ4, tuned for speed over
+ * ratio: shell output is repetitive enough that a greedy matcher with a small
+ * hash table gets most of the gain at a few hundred MB/s.
+ *
+ * A compressed block is a list of sequences:
+ *
+ * 	| token (1) | literal length (0+) | literals | offset (2) | match length (0+) |
+ *
+ * The high nibble of the token is the literal length and the low nibble the
+ * match length minus LZ_MIN_MATCH. A nibble of 15 is continued by extra bytes
+ * added to it, each 255 meaning another byte follows. The offset is a little
+ * endian distance back into the output. The last sequence has literals only,
+ * and ends the block.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef LZ_H_
+#define LZ_H_
+
+
+#include <stdint.h>
+
+
+#define LZ_MIN_MATCH 4		//! Shortest match encoded
+#define LZ_MAX_OFFSET 65535	//! Farthest match encoded
+#define LZ_HASH_BITS 12		//! Log2 of the match finder's hash table size
+
+
+/**
+ * @brief Worst case compressed size of a block of n bytes
+ */
+#define lzBound(n) ((n) + (n) / 255 + 16)
+
+
+// Functions
+int lzCompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+int lzDecompress(const uint8_t *src, int len, uint8_t *dst, int cap);
+
+
+#endif /* LZ_H_ */
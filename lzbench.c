@@ -0,0 +1,218 @@
+/**
+ * @file  lzbench.c
+ *
+ * @brief Benchmark of the output compression of multiplexed connections
+ *
+ * Splits typical shell outputs (listings, logs, process tables, build output,
+ * and random bytes as the worst case) into frames, and runs them through the
+ * same rule as the daemon (see frame.h): frames below FRAME_LZ_MIN are sent
+ * raw, and frames that do not shrink by 1/FRAME_LZ_GAIN are sent raw after
+ * paying for the attempt. Backing off is left out, so the random corpus shows
+ * the full cost of a failed attempt.
+ *
+ * For each corpus it prints the bandwidth saved, the CPU spent on both ends,
+ * and the link speed below which compressing is faster than sending raw: the
+ * time to send the bytes saved must exceed the time to compress and
+ * decompress them. Files given on the command line are benchmarked too.
+ *
+ * 	make bench
+ * 	./yashd-lzbench [-s FRAME_SIZE] [FILE...]
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include "frame.h"
+#include "yash_time.h"
+#include "lz.h"
+
+
+#define CORPUS_LEN (4 << 20)	//! Bytes of each generated corpus
+#define BENCH_MIN_NS 200000000	//! Min nanoseconds each corpus is timed for
+
+
+/**
+ * @brief Get the next number of a reproducible pseudo-random sequence
+ *
+ * @param	seed	State of the sequence
+ * @return	Number between 0 and 65535
+ */
+static uint32_t nextRand(uint32_t *seed) {
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 8) & 0xffff;
+}
+
+
+/**
+ * @brief Generate a corpus of typical shell output
+ *
+ * @param	kind	"listing", "log", "table", "build" or "random"
+ * @param	buf		Output buffer, CORPUS_LEN bytes
+ * @return	Corpus length
+ */
+static int genCorpus(const char *kind, char *buf) {
+	static const char *users[] = {"root", "carlos", "utkarsh", "www-data"};
+	static const char *exts[] = {".c", ".h", ".o", ".log", ".txt", ""};
+	static const char *units[] = {"sshd", "cron", "kernel", "yashd", "nginx"};
+	static const char *words[] = {"connection", "from", "accepted", "closed",
+			"session", "opened", "for", "user", "error", "timeout", "request",
+			"GET", "/index.html", "200", "retrying", "disk", "usage"};
+	uint32_t seed = 12345;
+	int len = 0;
+
+	while (len < CORPUS_LEN - 256) {
+		int n = 0;
+
+		if (!strcmp(kind, "listing")) {
+			n = sprintf(&buf[len], "-rw-r--r-- 1 %s %s %8u Oct %2u %02u:%02u "
+					"file_%04u%s\n",
+					users[nextRand(&seed) % 4], users[nextRand(&seed) % 4],
+					nextRand(&seed) * 7, nextRand(&seed) % 31 + 1,
+					nextRand(&seed) % 24, nextRand(&seed) % 60,
+					nextRand(&seed) % 10000, exts[nextRand(&seed) % 6]);
+		} else if (!strcmp(kind, "log")) {
+			n = sprintf(&buf[len], "Oct %2u %02u:%02u:%02u host %s[%u]: ",
+					nextRand(&seed) % 31 + 1, nextRand(&seed) % 24,
+					nextRand(&seed) % 60, nextRand(&seed) % 60,
+					units[nextRand(&seed) % 5], nextRand(&seed) % 32768);
+			for (int w=nextRand(&seed) % 8 + 3; w>0; w--) {
+				n += sprintf(&buf[len + n], "%s ", words[nextRand(&seed) % 17]);
+			}
+			buf[len + n - 1] = '\n';
+		} else if (!strcmp(kind, "table")) {
+			n = sprintf(&buf[len], "%-8s %5u %4.1f %4.1f %7u %6u pts/%u    S+ "
+					"%02u:%02u   0:%02u /usr/bin/%s --verbose\n",
+					users[nextRand(&seed) % 4], nextRand(&seed) % 32768,
+					(nextRand(&seed) % 1000) / 10.0,
+					(nextRand(&seed) % 100) / 10.0, nextRand(&seed) * 3,
+					nextRand(&seed), nextRand(&seed) % 8, nextRand(&seed) % 24,
+					nextRand(&seed) % 60, nextRand(&seed) % 60,
+					units[nextRand(&seed) % 5]);
+		} else if (!strcmp(kind, "build")) {
+			n = sprintf(&buf[len], "gcc -std=gnu11 -Wall -Werror   -c -o "
+					"module_%u.o module_%u.c\n", nextRand(&seed) % 300,
+					nextRand(&seed) % 300);
+		} else {
+			for (n=0; n<64; n++) {
+				buf[len + n] = (char) nextRand(&seed);
+			}
+		}
+		len += n;
+	}
+
+	return len;
+}
+
+
+/**
+ * @brief Benchmark one corpus, and print its results
+ *
+ * @param	name	Corpus name
+ * @param	buf		Corpus
+ * @param	len		Corpus length
+ * @param	frame	Frame size
+ */
+static void benchCorpus(const char *name, const char *buf, int len, int frame) {
+	uint8_t *comp = malloc(lzBound(FRAME_MAX_PAYLOAD));
+	uint8_t *out = malloc(FRAME_MAX_PAYLOAD);
+	uint64_t raw = 0, sent = 0, packed = 0;
+	uint64_t comp_ns = 0, decomp_ns = 0;
+	uint64_t start;
+	int rounds = 0;
+	double cpu_s, saved;
+
+	do {
+		raw = sent = packed = 0;
+		rounds++;
+		for (int off=0; off<len; off+=frame) {
+			int n = (len - off < frame) ? len - off : frame;
+			int c = -1;
+
+			if (n >= FRAME_LZ_MIN) {
+				start = nowNs();
+				c = lzCompress((const uint8_t *) &buf[off], n, comp,
+						n - n / FRAME_LZ_GAIN);
+				comp_ns += nowNs() - start;
+			}
+			if (c >= 0) {
+				start = nowNs();
+				if (lzDecompress(comp, c, out, FRAME_MAX_PAYLOAD) != n ||
+						memcmp(out, &buf[off], n)) {
+					fprintf(stderr, "ERROR: %s: frame at %d does not round "
+							"trip\n", name, off);
+					exit(EXIT_FAILURE);
+				}
+				decomp_ns += nowNs() - start;
+				packed++;
+			}
+			raw += n;
+			sent += (c >= 0) ? c : n;
+		}
+	} while (comp_ns + decomp_ns < BENCH_MIN_NS);
+
+	cpu_s = (comp_ns + decomp_ns) / 1e9 / rounds;
+	saved = raw - sent;
+	printf("%-10s %6d %6.2f %5.1f%% %9.0f %9.0f %11.1f %12.0f\n", name, frame,
+			(double) raw / sent, 100.0 * packed / ((raw + frame - 1) / frame),
+			raw / (comp_ns / 1e9 / rounds) / 1e6,
+			packed ? raw / (decomp_ns / 1e9 / rounds) / 1e6 : 0.0,
+			cpu_s * 1e6 / (raw / 1048576.0),
+			saved > 0 ? saved * 8 / cpu_s / 1e6 : 0.0);
+
+	free(comp);
+	free(out);
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	static const char *kinds[] = {"listing", "log", "table", "build", "random"};
+	char *buf = malloc(CORPUS_LEN);
+	int frame = 4096;
+	int first = 1;
+	FILE *f;
+	int len;
+
+	if (argc > 2 && !strcmp(argv[1], "-s")) {
+		frame = atoi(argv[2]);
+		first = 3;
+	}
+	if (buf == NULL || frame < 1 || frame > FRAME_MAX_PAYLOAD) {
+		fprintf(stderr, "Usage: %s [-s FRAME_SIZE] [FILE...]\n"
+				"FRAME_SIZE must be between 1 and %d\n", argv[0],
+				FRAME_MAX_PAYLOAD);
+		return EXIT_FAILURE;
+	}
+
+	printf("%-10s %6s %6s %6s %9s %9s %11s %12s\n", "corpus", "frame", "ratio",
+			"packed", "comp MB/s", "dec MB/s", "CPU us/MiB", "pays <Mbit/s");
+	for (size_t k=0; k<sizeof(kinds)/sizeof(kinds[0]); k++) {
+		len = genCorpus(kinds[k], buf);
+		benchCorpus(kinds[k], buf, len, frame);
+	}
+	for (int i=first; i<argc; i++) {
+		if ((f = fopen(argv[i], "r")) == NULL) {
+			perror(argv[i]);
+			continue;
+		}
+		len = fread(buf, 1, CORPUS_LEN, f);
+		fclose(f);
+		if (len > 0) {
+			benchCorpus(argv[i], buf, len, frame);
+		}
+	}
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,275 @@
+/**
+ * @file  msg.c
+ *
+ * @brief Messages of the yash protocol
+ *
+ * Parsing of the messages clients send (`TYPE arguments`), and the framed
+ * message I/O of the original protocol. Kept apart from the daemon, so the
+ * parsers can be benchmarked and fuzzed on their own.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+/**
+ * \brief Clean an array buffer by setting all entries to '\0'
+ *
+ * \param	buffer	Buffer
+ * \param	size	Number of entries in buffer array
+ */
+static void cleanBuffer(char *buffer, int size) {
+	for (int i=0; i<size; i++) {
+		buffer[i] = '\0';
+	}
+}
+
+
+/**
+ * \name Message Communication Protocol
+ *
+ * The messages sent between the server and client are expected to be
+ * ASCII strings encapsulated between a start-message delimiter and a
+ * end-message. The start-message delimiter is 2 bytes of value `0x02` (STX or
+ * start of text ASCII control code), and the end-message delimiter is 2 bytes
+ * of value `0x03` (ETX or end of text ASCII control code). We don't expect to
+ * see any ASCII control codes in the messages except horizontal tabs (`0x09`)
+ * and new lines (`0x0A`). See below for examples of messages:
+ *
+ * ```console
+ * (STX)(STX)CMD ls -l(ETX)(ETX)
+ * (STX)(STX)CTL c(ETX)(ETX)
+ * (STX)(STX)This is text output from a command.\n\tIt can have tabs and new lines(ETX)(ETX)
+ * ```
+ *
+ * The recvMsg() and sendMsg() functions will try to receive and send a full
+ * message respectively from a non-blocking socket.
+ */
+///@{
+/**
+ * @brief Receive encapsulated message over non-blocking socket
+ *
+ * \param	socket	Socket file descriptor
+ * \param	buffer	Buffer to store the message
+ * \return	Size in bytes of the received message, or -1 on error, EOF or a
+ * 			message too long for the buffer
+ */
+int recvMsg(int socket, msg_t *buffer) {
+	bool receiving = false;
+	ssize_t rc = 0;
+	char buf;
+
+	buffer->msg_size = 0;
+	cleanBuffer(buffer->msg, MAX_CMD_LEN+5);	// Start with a fresh buffer
+
+	// Read socket byte-by-byte until we get the start-message delimiter
+	while (!receiving) {
+		rc = recv(socket, &buf, 1, 0);
+
+		// Check if we received anything
+		if (rc < 0) {
+			// Nothing to receive or error
+			// TODO: handle errors
+			perror("ERROR: Receiving stream message");
+			return -1;
+		} else if (rc == 0) {
+			// Socket closed
+			// TODO: disconnect client
+			perror("ERROR: Receiving stream message");
+			return -1;
+		} else if (buf == MSG_START_DELIMITER) {
+			// First start-message delimiter detected
+			// Check for second delimiter
+			rc = recv(socket, &buf, 1, 0);
+
+			// Check if we received anything
+			if (rc < 0) {
+				// Nothing to receive or error
+				// TODO: handle errors
+				perror("ERROR: Receiving stream message");
+				return -1;
+			} else if (rc == 0) {
+				// Socket closed
+				// TODO: disconnect client
+				perror("ERROR: Receiving stream message");
+				return -1;
+			} else if (buf == MSG_START_DELIMITER) {
+				// Second start-message delimiter found
+				receiving = true;
+			}
+		} else {
+			// Ignore it garbage
+		}
+	}
+
+	// Read socket byte-by-byte until we get the end-message delimiter
+	while (receiving) {
+		rc = recv(socket, &buf, 1, 0);
+
+		// Check if we received anything
+		if (rc < 0) {
+			// Nothing to receive or error
+			// TODO: handle errors
+			return -1;
+		} else if (rc == 0) {
+			// Socket closed
+			// TODO: disconnect client
+			return -1;
+		} else if (buf == MSG_END_DELIMITER) {
+			// First end-message delimiter detected
+			// Check for second delimiter
+			rc = recv(socket, &buf, 1, 0);
+
+			// Check if we received anything
+			if (rc < 0) {
+				// Nothing to receive or error
+				// TODO: handle errors
+				perror("ERROR: Receiving stream message");
+				return -1;
+			} else if (rc == 0) {
+				// Socket closed
+				// TODO: disconnect client
+				perror("ERROR: Receiving stream message");
+				return -1;
+			} else if (buf == MSG_END_DELIMITER) {
+				// Second end-message delimiter found
+				receiving = false;
+			}
+		} else if (buffer->msg_size >= MAX_CMD_LEN+4) {
+			// Too long for the buffer, and its '\0'
+			return -1;
+		} else {
+			// Save message chunk to buffer
+			buffer->msg[buffer->msg_size] = buf;
+			buffer->msg_size++;
+		}
+	}
+
+	// Add '\0' to end of buffer
+	//buffer->msg[buffer->msg_size] = '\0';
+
+	return buffer->msg_size;
+}
+
+
+/**
+ * \brief Send encapsulated message over non-blocking socket
+ *
+ * \param	socket	Socket file descriptor
+ * \param	buffer	Buffer with the message
+ * \param	size	Size in bytes of the message
+ * \return	Size in bytes of the sent message
+ */
+int sendMsg(int socket, msg_t *buffer) {
+	int idx;
+	// Create a buffer larger than the original to fit the delimiters
+	char *buf;
+	buf = (char *) malloc(buffer->msg_size+4);
+
+	// Add start-message delimiters
+	buf[0] = MSG_START_DELIMITER;
+	buf[1] = MSG_START_DELIMITER;
+
+	// Add message to buffer
+	for (idx=2; idx<buffer->msg_size+2; idx++) {
+		buf[idx] = buffer->msg[idx-2];
+	}
+
+	// Add end-message delimiters and increase index
+	buf[idx] = MSG_END_DELIMITER;
+	idx++;
+	buf[idx] = MSG_END_DELIMITER;
+	idx++;
+
+	idx = send(socket, buf, idx, 0);
+
+	free(buf);
+
+	return idx;
+}
+///@}
+
+
+/**
+ * @brief Separate the message type and arguments
+ *
+ * If the message is malformed (empty, without arguments, with a type longer
+ * than a msg_args_t holds, or longer than a servant's message buffer), this
+ * function returns an empty msg_args_t struct. Leading blanks before the type
+ * are skipped.
+ *
+ * @param	msg	Raw message string, its final newline is removed
+ * @return	Struct with the parsed message
+ */
+msg_args_t parseMessage(char *msg) {
+	msg_args_t msg_parsed = { EMPTY_STR, EMPTY_STR };
+	size_t len_orig, start, type_len;
+
+	// Remove final newline char and replace with NULL char
+	len_orig = strlen(msg);
+	if (len_orig > 0 && msg[len_orig-1] == '\n') {
+		msg[len_orig-1] = '\0';
+	}
+
+	// Check the message is not empty (larger than "CMD \0"), and fits
+	if (len_orig <= 5 || len_orig >= MAX_CMD_LEN+5) {
+		return msg_parsed;
+	}
+
+	// The msg type is the first word, the arguments all after its delimiter
+	start = strspn(msg, MSG_TYPE_DELIM);
+	type_len = strcspn(&msg[start], MSG_TYPE_DELIM);
+	if (type_len == 0 || type_len >= sizeof(msg_parsed.type) ||
+			msg[start + type_len] == '\0' ||
+			strlen(&msg[start + type_len + 1]) >= sizeof(msg_parsed.args)) {
+		return msg_parsed;
+	}
+	memcpy(msg_parsed.type, &msg[start], type_len);
+	msg_parsed.type[type_len] = '\0';
+	strcpy(msg_parsed.args, &msg[start + type_len + 1]);
+
+	return msg_parsed;
+}
+
+
+/**
+ * @brief Take the signal lines out of a client's input
+ *
+ * `CTL c` and `CTL z` lines are passed to `on_signal`, in the order they were
+ * read, and taken out of the input. Every other line, `CTL d` included, and a
+ * partial line at the end are kept in order.
+ *
+ * @param	buf		Input read, complete lines and maybe a partial one
+ * @param	len		Input length
+ * @param	on_signal	Called with the CTL argument of each signal line
+ * @param	ctx		Passed to `on_signal`
+ * @return	Input length, without the signal lines
+ */
+size_t takeCtlLines(char *buf, size_t len, void (*on_signal)(char, void *),
+		void *ctx) {
+	size_t line_len = strlen(MSG_TYPE_CTL) + 3;	// "CTL c\n"
+	size_t kept = 0;
+	size_t start = 0;
+	char *nl;
+
+	while (start < len && (nl = memchr(&buf[start], '\n', len - start)) != NULL) {
+		size_t end = nl - buf + 1;
+
+		if (end - start == line_len &&
+				!strncmp(&buf[start], MSG_TYPE_CTL, strlen(MSG_TYPE_CTL)) &&
+				buf[start + 3] == ' ' && (buf[start + 4] == MSG_CTL_SIGINT ||
+				buf[start + 4] == MSG_CTL_SIGTSTP)) {
+			on_signal(buf[start + 4], ctx);
+		} else {
+			memmove(&buf[kept], &buf[start], end - start);
+			kept += end - start;
+		}
+		start = end;
+	}
+
+	// Partial line at the end
+	memmove(&buf[kept], &buf[start], len - start);
+	return kept + len - start;
+}
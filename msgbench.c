@@ -0,0 +1,366 @@
+/**
+ * @file  msgbench.c
+ *
+ * @brief Microbenchmarks of the per-command CPU work
+ *
+ * Times the parsers every command goes through, parseMessage(), then
+ * tokenizeString() and parseJob(), over a corpus of command lines (short,
+ * long, many tokens, pipes, redirections), and the framed message I/O,
+ * sendMsg() and recvMsg(), over a socket pair.
+ *
+ * For each function and command line it prints the time per call, the heap
+ * allocations per call, and the CPU cycles per byte of input (TSC cycles, on
+ * x86 only). Each op includes what the caller does around the call: copying
+ * the line into the buffer the parser modifies, or the write() or read() on
+ * the other end of the socket pair.
+ *
+ * With `-j FILE`, the results are also written as JSON to FILE (`-` for
+ * stdout), to be tracked over time.
+ *
+ * 	make bench
+ * 	./yashd-msgbench [-j FILE]
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#endif
+
+
+#define BENCH_MIN_NS 100000000	//! Min nanoseconds each benchmark is timed for
+#define BENCH_BATCH 256			//! Calls timed together
+#define BENCH_MANY_TOKENS 200	//! Arguments of the many tokens command line
+
+
+/**
+ * \brief Struct for the state of the benchmarks of a command line
+ */
+typedef struct _bench_ctx {
+	const char *line;				// Command line
+	size_t line_len;				// Command line length
+	char msg[MAX_CMD_LEN+5];		// Message, as the servant gets it
+	size_t msg_len;					// Message length
+	char buf[MAX_CMD_LEN+5];		// Copy of the message, parsed in place
+	char framed[MAX_CMD_LEN+9];		// Message between delimiters
+	size_t framed_len;				// Framed message length
+	char drain[MAX_CMD_LEN+9];		// Framed messages read back
+	shell_info_t *shell_info;		// Session, its first job is parsed
+	msg_t out;						// Message sent
+	msg_t in;						// Message received
+	int sv[2];						// Socket pair
+} bench_ctx_t;
+
+
+/**
+ * \brief Struct for a benchmark of a function
+ */
+typedef struct _bench {
+	const char *name;				// Function
+	void (*op)(bench_ctx_t *ctx);	// One call
+	size_t (*bytes)(bench_ctx_t *ctx);	// Bytes of input per call
+} bench_t;
+
+
+/**
+ * \brief Struct for the results of a benchmark
+ */
+typedef struct _bench_result {
+	const char *name;				// Function
+	const char *corpus;				// Command line name
+	size_t bytes;					// Bytes of input per call
+	double ns;						// Nanoseconds per call
+	double allocs;					// Heap allocations per call
+	double cycles;					// Cycles per byte, or -1 if unknown
+} bench_result_t;
+
+
+// Globals
+static uint64_t allocs = 0;			//! Heap allocations so far
+static volatile size_t sink;		//! Results, so calls are not optimized out
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+
+/**
+ * @brief Count the heap allocations, by wrapping the allocator
+ */
+void *malloc(size_t size) {
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+
+/**
+ * @brief Get the CPU cycle counter
+ *
+ * @return	Cycles since an arbitrary point, or 0 if unknown
+ */
+static uint64_t nowCycles() {
+#ifdef BENCH_HAS_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+/**
+ * @brief parseMessage() of a message copied into the servant's buffer
+ */
+static void opParseMessage(bench_ctx_t *ctx) {
+	msg_args_t msg;
+
+	memcpy(ctx->buf, ctx->msg, ctx->msg_len + 1);
+	msg = parseMessage(ctx->buf);
+	sink += msg.args[0];
+}
+
+
+/**
+ * @brief tokenizeString() of a command line copied into a job
+ */
+static void opTokenize(bench_ctx_t *ctx) {
+	job_info_t *job = &ctx->shell_info->job_table[0];
+
+	memcpy(job->cmd_str, ctx->line, ctx->line_len + 1);
+	tokenizeString(job);
+	sink += job->cmd_tok_len;
+}
+
+
+/**
+ * @brief parseJob() of a command line, into a job reset as handleNewJob() does
+ *
+ * Only the fields parseJob() looks at are reset.
+ */
+static void opParseJob(bench_ctx_t *ctx) {
+	job_info_t *job = &ctx->shell_info->job_table[0];
+
+	job->pipe = false;
+	job->bg = false;
+	job->in1[0] = job->out1[0] = job->err1[0] = '\0';
+	job->in2[0] = job->out2[0] = job->err2[0] = '\0';
+	job->err_msg[0] = '\0';
+	parseJob((char *) ctx->line, ctx->shell_info);
+	sink += job->cmd_tok_len;
+}
+
+
+/**
+ * @brief sendMsg() of a message, read back on the other end
+ */
+static void opSendMsg(bench_ctx_t *ctx) {
+	ssize_t n = sendMsg(ctx->sv[0], &ctx->out);
+
+	while (n > 0) {
+		n -= read(ctx->sv[1], ctx->drain, n);
+	}
+}
+
+
+/**
+ * @brief recvMsg() of a message written on the other end
+ */
+static void opRecvMsg(bench_ctx_t *ctx) {
+	if (write(ctx->sv[0], ctx->framed, ctx->framed_len) < 0) {
+		perror("ERROR: Writing message");
+		exit(EXIT_FAILURE);
+	}
+	sink += recvMsg(ctx->sv[1], &ctx->in);
+}
+
+
+static size_t bytesMsg(bench_ctx_t *ctx) {
+	return ctx->msg_len;
+}
+
+static size_t bytesLine(bench_ctx_t *ctx) {
+	return ctx->line_len;
+}
+
+static size_t bytesFramed(bench_ctx_t *ctx) {
+	return ctx->framed_len;
+}
+
+
+/**
+ * @brief Set up the benchmarks of a command line
+ *
+ * @param	ctx		Context to fill in, its session and sockets already set
+ * @param	line	Command line
+ */
+static void setLine(bench_ctx_t *ctx, const char *line) {
+	ctx->line = line;
+	ctx->line_len = strlen(line);
+	ctx->msg_len = snprintf(ctx->msg, sizeof(ctx->msg), "%s %s\n",
+			MSG_TYPE_CMD, line);
+
+	ctx->out.msg_size = ctx->msg_len;
+	memcpy(ctx->out.msg, ctx->msg, ctx->msg_len);
+	ctx->framed[0] = ctx->framed[1] = MSG_START_DELIMITER;
+	memcpy(&ctx->framed[2], ctx->msg, ctx->msg_len);
+	ctx->framed[ctx->msg_len + 2] = MSG_END_DELIMITER;
+	ctx->framed[ctx->msg_len + 3] = MSG_END_DELIMITER;
+	ctx->framed_len = ctx->msg_len + 4;
+}
+
+
+/**
+ * @brief Run a benchmark of a command line
+ *
+ * @param	bench	Benchmark
+ * @param	ctx		Context, set up for the command line
+ * @param	corpus	Command line name
+ * @return	Results
+ */
+static bench_result_t runBench(const bench_t *bench, bench_ctx_t *ctx,
+		const char *corpus) {
+	bench_result_t res = {bench->name, corpus, bench->bytes(ctx), 0, 0, -1};
+	uint64_t ops = 0, ns = 0, cycles = 0, allocated = 0;
+	uint64_t start_ns, start_cycles, start_allocs;
+
+	bench->op(ctx);	// Warm up
+	do {
+		start_allocs = allocs;
+		start_cycles = nowCycles();
+		start_ns = nowNs();
+		for (int i=0; i<BENCH_BATCH; i++) {
+			bench->op(ctx);
+		}
+		ns += nowNs() - start_ns;
+		cycles += nowCycles() - start_cycles;
+		allocated += allocs - start_allocs;
+		ops += BENCH_BATCH;
+	} while (ns < BENCH_MIN_NS);
+
+	res.ns = (double) ns / ops;
+	res.allocs = (double) allocated / ops;
+#ifdef BENCH_HAS_TSC
+	res.cycles = (double) cycles / ops / res.bytes;
+#endif
+
+	return res;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	static const bench_t benches[] = {
+		{"parseMessage", opParseMessage, bytesMsg},
+		{"tokenizeString", opTokenize, bytesLine},
+		{"parseJob", opParseJob, bytesLine},
+		{"sendMsg", opSendMsg, bytesFramed},
+		{"recvMsg", opRecvMsg, bytesFramed},
+	};
+	static const char *names[] = {"short", "typical", "long", "many_tokens",
+			"pipe", "redirections", "pipe_redir_bg"};
+	static char many[MAX_CMD_LEN+1] = "echo";
+	const char *lines[] = {
+		"ls",
+		"ls -l /var/log",
+		"gcc -std=gnu11 -Wall -Werror -O2 -I/usr/local/include -DNDEBUG "
+				"-DVERSION=1.2.3 -c very_long_source_file_name.c -o "
+				"very_long_source_file_name.o",
+		many,
+		"ps aux | grep yashd",
+		"sort -u < in.txt > out.txt 2> err.txt",
+		"grep -v debug < app.log | sort -r > sorted.log &",
+	};
+	static shell_info_t shell_info;	// Too big for the stack
+	static bench_ctx_t ctx;
+	bench_result_t results[sizeof(benches)/sizeof(benches[0]) *
+			sizeof(lines)/sizeof(lines[0])];
+	const char *json = NULL;
+	size_t count = 0;
+	FILE *f;
+
+	if (argc == 3 && !strcmp(argv[1], "-j")) {
+		json = argv[2];
+	} else if (argc != 1) {
+		fprintf(stderr, "Usage: %s [-j FILE]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i=0; i<BENCH_MANY_TOKENS; i++) {
+		snprintf(&many[strlen(many)], sizeof(many) - strlen(many), " a%d", i);
+	}
+	shell_info.job_table_idx = 1;
+	ctx.shell_info = &shell_info;
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.sv) < 0) {
+		perror("ERROR: Creating socket pair");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-15s %-14s %6s %10s %10s %8s\n", "function", "corpus", "bytes",
+			"ns/op", "allocs/op", "cyc/B");
+	for (size_t b=0; b<sizeof(benches)/sizeof(benches[0]); b++) {
+		for (size_t l=0; l<sizeof(lines)/sizeof(lines[0]); l++) {
+			setLine(&ctx, lines[l]);
+			results[count] = runBench(&benches[b], &ctx, names[l]);
+			if (benches[b].op == opParseJob && shell_info.job_table[0].err_msg[0]) {
+				fprintf(stderr, "ERROR: %s: %s\n", names[l],
+						shell_info.job_table[0].err_msg);
+				return EXIT_FAILURE;
+			}
+			printf("%-15s %-14s %6zu %10.1f %10.2f ", results[count].name,
+					results[count].corpus, results[count].bytes,
+					results[count].ns, results[count].allocs);
+			if (results[count].cycles < 0) {
+				printf("%8s\n", "-");
+			} else {
+				printf("%8.2f\n", results[count].cycles);
+			}
+			count++;
+		}
+	}
+
+	if (json != NULL) {
+		if ((f = strcmp(json, "-") ? fopen(json, "w") : stdout) == NULL) {
+			perror(json);
+			return EXIT_FAILURE;
+		}
+		fprintf(f, "{\"benchmark\": \"yashd-msgbench\", \"time\": %ld, "
+				"\"results\": [", (long) time(NULL));
+		for (size_t i=0; i<count; i++) {
+			fprintf(f, "%s\n  {\"function\": \"%s\", \"corpus\": \"%s\", "
+					"\"bytes\": %zu, \"ns_per_op\": %.1f, \"allocs_per_op\": "
+					"%.2f, ", i ? "," : "", results[i].name, results[i].corpus,
+					results[i].bytes, results[i].ns, results[i].allocs);
+			if (results[i].cycles < 0) {
+				fprintf(f, "\"cycles_per_byte\": null}");
+			} else {
+				fprintf(f, "\"cycles_per_byte\": %.2f}", results[i].cycles);
+			}
+		}
+		fprintf(f, "\n]}\n");
+		if (f != stdout) {
+			fclose(f);
+		}
+	}
+
+	close(ctx.sv[0]);
+	close(ctx.sv[1]);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/**
+ * @file  mux.c
+ *
+ * @brief Multiplexed sessions of the yash shell daemon
+ *
+ * A client can carry many independent sessions (streams) over one connection
+ * by switching it to frames (see frame.h). Each stream is a regular session:
+ * it gets its own servant thread and shell info, serving one end of a socket
+ * pair instead of a TCP socket. The connection's servant thread becomes the
+ * multiplexer: it routes the payload of the client's DATA frames to the
+ * stream's socket pair, and wraps everything the session writes on it
+ * (command output, prompts) in DATA frames back to the client. It is the only
+ * thread writing to the connection, so frames never interleave.
+ *
+ * The multiplexer never blocks on a stream. Input a session does not take
+ * right away is held in the stream's pending buffer, and written when its
+ * socket pair drains. Only when a stream holds back more than
+ * MUX_PENDING_MAX bytes does the multiplexer stop reading frames, which pushes
+ * back on the client; the other streams' output keeps flowing meanwhile.
+ *
+ * Output is compressed when the client enabled it, see frame.h. Short output
+ * (prompts, one-liners) is sent as is, and output that does not compress
+ * (already compressed data) makes the multiplexer back off exponentially, so
+ * it costs little CPU when it does not pay off.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include "lz.h"
+
+
+/**
+ * @brief Search a stream in the stream table
+ *
+ * @param	streams	Stream table
+ * @param	count	Number of streams in the table
+ * @param	id		Stream ID
+ * @return	Index of the stream, or -1 if it is not open
+ */
+static int searchStream(mux_stream_t *streams, int count, uint16_t id) {
+	for (int i=0; i<count; i++) {
+		if (streams[i].id == id) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * @brief Open a stream, starting a session on a new socket pair
+ *
+ * @param	shell_info	Shell info of the multiplexed connection
+ * @param	streams		Stream table
+ * @param	count		Number of streams in the table
+ * @param	id			Stream ID
+ * @return	0 on success, or -1 if the stream could not be opened
+ */
+int openStream(shell_info_t *shell_info, mux_stream_t *streams, int *count,
+		uint16_t id) {
+	int sp[2];
+
+	if (id == 0 || *count >= MUX_MAX_STREAMS ||
+			searchStream(streams, *count, id) >= 0) {
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+		return -1;
+	}
+	// Only the multiplexer's end, the session reads its end blocking
+	if (fcntl(sp[0], F_SETFL, O_NONBLOCK) < 0) {
+		close(sp[0]);
+		close(sp[1]);
+		return -1;
+	}
+
+	// The session owns sp[1] from here on, and closes it if it is rejected
+	if (startServantThread(shell_info->th_args.shard, sp[1],
+			shell_info->th_args.from, shell_info->th_args.listener, true) < 0) {
+		close(sp[0]);
+		return -1;
+	}
+
+	streams[*count].id = id;
+	streams[*count].fd = sp[0];
+	streams[*count].pending = NULL;
+	streams[*count].pending_len = 0;
+	(*count)++;
+
+	return 0;
+}
+
+
+/**
+ * @brief Close a stream, which ends its session
+ *
+ * @param	streams	Stream table
+ * @param	count	Number of streams in the table
+ * @param	idx		Index of the stream
+ */
+void closeStream(mux_stream_t *streams, int *count, int idx) {
+	close(streams[idx].fd);
+	free(streams[idx].pending);
+	(*count)--;
+	streams[idx] = streams[*count];
+}
+
+
+/**
+ * @brief Write as much of a stream's pending input as its session takes
+ *
+ * @param	stream	Stream
+ * @return	0 on success, even if input is left pending, or -1 on error
+ */
+static int flushStream(mux_stream_t *stream) {
+	ssize_t n;
+
+	while (stream->pending_len > 0) {
+		n = send(stream->fd, stream->pending, stream->pending_len,
+				MSG_NOSIGNAL);
+		if (n < 0) {
+			return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+		}
+		stream->pending_len -= n;
+		memmove(stream->pending, &stream->pending[n], stream->pending_len);
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Queue client input for a stream's session, and write what it takes
+ *
+ * @param	stream	Stream
+ * @param	data	Input
+ * @param	len		Input length, at most FRAME_MAX_PAYLOAD
+ * @return	0 on success, or -1 on error
+ */
+static int writeStream(mux_stream_t *stream, const char *data, size_t len) {
+	if (stream->pending == NULL &&
+			(stream->pending = malloc(MUX_PENDING_MAX)) == NULL) {
+		return -1;
+	}
+	// The multiplexer stops reading frames before a stream can overflow
+	memcpy(&stream->pending[stream->pending_len], data, len);
+	stream->pending_len += len;
+
+	return flushStream(stream);
+}
+
+
+/**
+ * @brief Send session output to the client, compressed if it pays off
+ *
+ * @param	shell_info	Shell info of the multiplexed connection
+ * @param	lz			Compression state of the connection
+ * @param	stream		Stream ID
+ * @param	payload		Output
+ * @param	len			Output length
+ * @return	0 on success, or -1 on error
+ */
+static int sendOutput(shell_info_t *shell_info, mux_lz_t *lz, uint16_t stream,
+		const char *payload, int len) {
+	shard_t *shard = shell_info->th_args.shard;
+	uint8_t comp[lzBound(FRAME_MAX_PAYLOAD)];
+	int n = -1;
+
+	if (!lz->enabled || len < FRAME_LZ_MIN) {
+		return sendFrame(shell_info->th_args.ps, FRAME_DATA, 0, stream,
+				payload, len);
+	}
+	if (lz->skip > 0) {
+		lz->skip--;
+	} else {
+		// Only keep the block if it saves at least 1/FRAME_LZ_GAIN
+		n = lzCompress((const uint8_t *) payload, len, comp,
+				len - len / FRAME_LZ_GAIN);
+		if (n < 0) {
+			if (lz->fails < FRAME_LZ_BACKOFF) {
+				lz->fails++;
+			}
+			lz->skip = (1 << lz->fails) - 1;
+		} else {
+			lz->fails = 0;
+		}
+	}
+	if (n < 0) {
+		return sendFrame(shell_info->th_args.ps, FRAME_DATA, 0, stream,
+				payload, len);
+	}
+
+	__atomic_fetch_add(&shard->lz_raw, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->lz_sent, n, __ATOMIC_RELAXED);
+	return sendFrame(shell_info->th_args.ps, FRAME_DATA, FRAME_FLAG_LZ, stream,
+			comp, n);
+}
+
+
+/**
+ * @brief Serve a connection switched to frames, until the client hangs up
+ *
+ * @param	shell_info	Shell info of the connection's servant thread
+ */
+void runMux(shell_info_t *shell_info) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char payload[FRAME_MAX_PAYLOAD];
+	mux_stream_t streams[MUX_MAX_STREAMS];
+	struct pollfd pollfds[MUX_MAX_STREAMS+1];
+	shard_t *shard = shell_info->th_args.shard;
+	int ps = shell_info->th_args.ps;
+	struct sockaddr_in from = shell_info->th_args.from;
+	frame_hdr_t hdr;
+	mux_lz_t lz = {false, 0, 0};
+	int count = 0;
+	bool run = true;
+	bool stalled;
+	ssize_t n;
+	int idx;
+
+	// Offer compression, the client enables it with a MUX frame
+	if (sendFrame(ps, FRAME_MUX,
+			(shell_info->features & PROTO_FEAT_LZ) ? FRAME_FLAG_LZ : 0, 0,
+			NULL, 0) < 0) {
+		return;
+	}
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[%s:%d]: INFO: Multiplexing connection\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+	}
+
+	while (run && shard->servant_th_table[shell_info->th_args.idx].run) {
+		// Stop reading frames while a stream could not hold another one
+		stalled = false;
+		for (int i=0; i<count; i++) {
+			pollfds[i+1].fd = streams[i].fd;
+			pollfds[i+1].events = POLLIN;
+			if (streams[i].pending_len > 0) {
+				pollfds[i+1].events |= POLLOUT;
+			}
+			if (streams[i].pending_len > MUX_PENDING_MAX - FRAME_MAX_PAYLOAD) {
+				stalled = true;
+			}
+		}
+		pollfds[0].fd = ps;
+		pollfds[0].events = stalled ? 0 : POLLIN;
+
+		// Stopping the thread shuts the connection down, which wakes it up
+		if (poll(pollfds, count+1, -1) <= 0) {
+			continue;
+		}
+		touchSession(shard, shell_info->th_args.idx);
+
+		// Session output, wrapped in frames for the client. Walk backwards,
+		// since closing a stream moves the last one into its slot.
+		for (int i=count-1; i>=0; i--) {
+			if (!pollfds[i+1].revents) {
+				continue;
+			}
+			if ((pollfds[i+1].revents & POLLOUT) && flushStream(&streams[i]) < 0) {
+				sendFrame(ps, FRAME_CLOSE, 0, streams[i].id, NULL, 0);
+				closeStream(streams, &count, i);
+				continue;
+			}
+			if (!(pollfds[i+1].revents & (POLLIN | POLLHUP | POLLERR))) {
+				continue;
+			}
+			if ((n = recv(streams[i].fd, payload, shell_info->max_frame, 0)) > 0) {
+				if (sendOutput(shell_info, &lz, streams[i].id, payload, n) < 0) {
+					run = false;
+				}
+			} else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				// Session ended
+				sendFrame(ps, FRAME_CLOSE, 0, streams[i].id, NULL, 0);
+				closeStream(streams, &count, i);
+			}
+		}
+
+		if (pollfds[0].revents & (POLLHUP | POLLERR)) {
+			if (stalled) {
+				break;	// Client hung up, its held back input is moot
+			}
+		} else if (!(pollfds[0].revents & POLLIN)) {
+			continue;
+		}
+
+		// Frame from the client
+		if (recvFrame(ps, &hdr, payload, sizeof(payload)) <= 0) {
+			break;	// Client hung up, or the connection is out of sync
+		}
+		idx = searchStream(streams, count, hdr.stream);
+
+		switch (hdr.type) {
+		case FRAME_MUX:
+			lz.enabled = (hdr.flags & FRAME_FLAG_LZ) &&
+					(shell_info->features & PROTO_FEAT_LZ);
+			break;
+		case FRAME_OPEN:
+			if (openStream(shell_info, streams, &count, hdr.stream) < 0) {
+				sendFrame(ps, FRAME_CLOSE, 0, hdr.stream, NULL, 0);
+			} else {
+				sendFrame(ps, FRAME_OPEN, 0, hdr.stream, NULL, 0);
+			}
+			break;
+		case FRAME_DATA:
+			if (idx < 0) {
+				sendFrame(ps, FRAME_CLOSE, 0, hdr.stream, NULL, 0);
+			} else if (writeStream(&streams[idx], payload, hdr.len) < 0) {
+				sendFrame(ps, FRAME_CLOSE, 0, hdr.stream, NULL, 0);
+				closeStream(streams, &count, idx);
+			}
+			break;
+		case FRAME_CLOSE:
+			if (idx >= 0) {
+				closeStream(streams, &count, idx);
+				sendFrame(ps, FRAME_CLOSE, 0, hdr.stream, NULL, 0);
+			}
+			break;
+		default:
+			fprintf(stderr, "%s yashd[%s:%d]: ERROR: Unknown frame type: %d\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+					inet_ntoa(from.sin_addr), ntohs(from.sin_port), hdr.type);
+			break;
+		}
+	}
+
+	// End every session carried by the connection
+	while (count > 0) {
+		closeStream(streams, &count, count-1);
+	}
+}
@@ -0,0 +1,690 @@
+/**
+ * @file  perfbench.c
+ *
+ * @brief End-to-end benchmarks of the yash shell daemon, with a regression gate
+ *
+ * Starts a daemon in the foreground on a local port, and measures it from the
+ * outside, over TCP:
+ *
+ * 	- Connection storm: PERF_STORM_THREADS clients connecting, waiting for
+ * 	  the prompt and hanging up, back to back (connections/s, and the p99 of
+ * 	  connect to prompt).
+ * 	- Command throughput: 1, 4 and 16 sessions running `true` back to back
+ * 	  (commands/s).
+ * 	- Output bandwidth: a session reading PERF_OUTPUT_BYTES of job output
+ * 	  (MB/s), and the daemon's CPU time per MB relayed (us/MB, summed over
+ * 	  its threads from /proc/PID/task/TID/schedstat).
+ * 	- Signal latency: `CTL c` to the EXIT line of the job it killed (p50 and
+ * 	  p99).
+ * 	- Memory per session: RSS of the daemon with PERF_IDLE_SESSIONS idle
+ * 	  sessions, less its RSS before them.
+ *
+ * The storm, command and output tests run PERF_ROUNDS times and report the
+ * median round, so one slow or fast round on a busy machine does not move the
+ * result.
+ *
+ * With `-T DIR`, the daemon records its sessions in DIR (`--record DIR`), so
+ * the results against a baseline of a daemon that does not record are the
+ * recorder's overhead.
+ *
+ * With `-b FILE`, the results are compared against the baseline in FILE, and
+ * the exit code is an error if any of them regressed beyond its tolerance.
+ * With `-u FILE`, the results are written to FILE as the new baseline. A
+ * baseline has one `METRIC VALUE TOLERANCE_PCT` line per metric, and `#`
+ * starts a comment; edit the tolerances to suit the machines it runs on.
+ *
+ * 	make perfcheck
+ * 	./yashd-perf [-d DAEMON] [-p PORT] [-T DIR] [-b BASELINE] [-u BASELINE]
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "benchharness.h"
+#include "yash_client.h"
+#include "yash_time.h"
+
+
+#define PERF_PORT 4826			//! Default port of the daemon under test
+#define PERF_DAEMON "./yashd"	//! Default daemon binary
+#define PERF_TIMEOUT_MS 10000	//! Max milliseconds to wait for a reply
+#define PERF_RUN_MS 1000		//! Milliseconds each throughput level runs
+#define PERF_ROUNDS 5			//! Rounds of the storm, command and output tests
+#define PERF_STORM_THREADS 8	//! Clients of the connection storm
+#define PERF_STORM_CONNS 50		//! Connections per client of the storm
+#define PERF_OUTPUT_BYTES (64 << 20)	//! Bytes of output read
+#define PERF_SIGNALS 20			//! Signals timed
+#define PERF_IDLE_SESSIONS 20	//! Sessions held open for the memory metric
+#define PERF_MAX_SAMPLES (PERF_STORM_THREADS * PERF_STORM_CONNS)	//! Latency samples
+#define PERF_METRICS 10			//! Metrics measured
+#define PERF_CMD "CMD "			//! Command line prefix
+#define PERF_CTL "CTL "			//! Control line prefix
+
+#define PERF_HIGHER 1			//! Metric direction: higher is better
+#define PERF_LOWER 0			//! Metric direction: lower is better
+
+
+/**
+ * \brief Struct for a metric, and its result
+ */
+typedef struct _perf_metric {
+	const char *name;	// Name in the baseline
+	const char *unit;	// Unit
+	int better;			// PERF_HIGHER or PERF_LOWER
+	int tolerance;		// Default tolerance (percent) of new baselines
+	double value;		// Result
+} perf_metric_t;
+
+
+/**
+ * \brief Struct for a client thread
+ */
+typedef struct _perf_client {
+	pthread_t tid;
+	uint64_t deadline;			// Time to stop (nowUs())
+	uint64_t count;				// Operations done
+	uint64_t *samples;			// Latencies (us), for the storm
+	int errors;					// Operations that failed
+} perf_client_t;
+
+
+// Globals
+static int port = PERF_PORT;	//! Port of the daemon under test
+
+static perf_metric_t metrics[PERF_METRICS] = {
+	{"storm_rate", "conn/s", PERF_HIGHER, 50, 0},
+	{"storm_p99", "us", PERF_LOWER, 200, 0},
+	{"cmd_rate_1", "cmd/s", PERF_HIGHER, 30, 0},
+	{"cmd_rate_4", "cmd/s", PERF_HIGHER, 30, 0},
+	{"cmd_rate_16", "cmd/s", PERF_HIGHER, 30, 0},
+	{"output_rate", "MB/s", PERF_HIGHER, 40, 0},
+	{"output_cpu", "us/MB", PERF_LOWER, 400, 0},	// A few us/MB, mostly noise
+	{"signal_p50", "us", PERF_LOWER, 50, 0},
+	{"signal_p99", "us", PERF_LOWER, 200, 0},
+	{"session_rss", "KB", PERF_LOWER, 15, 0},
+};
+
+
+/**
+ * @brief Set a metric's result
+ *
+ * @param	name	Metric name
+ * @param	value	Result
+ */
+static void setMetric(const char *name, double value) {
+	for (int i=0; i<PERF_METRICS; i++) {
+		if (!strcmp(metrics[i].name, name)) {
+			metrics[i].value = value;
+		}
+	}
+}
+
+
+/**
+ * @brief Connect a session, and wait for its prompt
+ *
+ * @return	Socket, or -1 on error
+ */
+static int openSession() {
+	int sd;
+
+	if ((sd = connectDaemon(port)) < 0) {
+		return -1;
+	}
+	if (waitFor(sd, NULL, PERF_TIMEOUT_MS, NULL) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+
+/**
+ * @brief Compare latencies, for qsort()
+ */
+static int cmpU64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Get a percentile of latency samples
+ *
+ * @param	samples	Samples, sorted
+ * @param	count	Number of samples
+ * @param	pct		Percentile [0-100]
+ * @return	Percentile, or 0 without samples
+ */
+static uint64_t percentile(const uint64_t *samples, int count, int pct) {
+	if (count == 0) {
+		return 0;
+	}
+	return samples[(count - 1) * pct / 100];
+}
+
+
+/**
+ * @brief Get the median of some rounds' results
+ *
+ * @param	values	Results, sorted in place
+ * @param	count	Number of results, at least 1
+ * @return	Median
+ */
+static double median(double *values, int count) {
+	for (int i=1; i<count; i++) {
+		for (int j=i; j>0 && values[j-1] > values[j]; j--) {
+			double v = values[j];
+			values[j] = values[j-1];
+			values[j-1] = v;
+		}
+	}
+	return values[count / 2];
+}
+
+
+/**
+ * @brief Connection storm client: connect, wait for the prompt, hang up
+ */
+static void *stormClient(void *arg) {
+	perf_client_t *client = arg;
+	uint64_t start;
+	int sd;
+
+	for (int i=0; i<PERF_STORM_CONNS; i++) {
+		start = nowUs();
+		if ((sd = openSession()) < 0) {
+			client->errors++;
+			continue;
+		}
+		client->samples[client->count++] = nowUs() - start;
+		close(sd);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief Command throughput client: run `true` until the deadline
+ */
+static void *cmdClient(void *arg) {
+	perf_client_t *client = arg;
+	int sd;
+
+	if ((sd = openSession()) < 0) {
+		client->errors++;
+		return NULL;
+	}
+	while (nowUs() < client->deadline) {
+		if (sendLine(sd, PERF_CMD "true\n") < 0 ||
+				waitFor(sd, NULL, PERF_TIMEOUT_MS, NULL) < 0) {
+			client->errors++;
+			break;
+		}
+		client->count++;
+	}
+	close(sd);
+
+	return NULL;
+}
+
+
+/**
+ * @brief Measure the connection storm
+ *
+ * @return	Number of errors
+ */
+static int runStorm() {
+	static uint64_t samples[PERF_MAX_SAMPLES];
+	perf_client_t clients[PERF_STORM_THREADS];
+	double rates[PERF_ROUNDS];
+	double p99s[PERF_ROUNDS];
+	uint64_t start, elapsed;
+	int count;
+	int errors = 0;
+
+	for (int r=0; r<PERF_ROUNDS; r++) {
+		memset(clients, 0, sizeof(clients));
+		start = nowUs();
+		for (int i=0; i<PERF_STORM_THREADS; i++) {
+			clients[i].samples = &samples[i * PERF_STORM_CONNS];
+			pthread_create(&clients[i].tid, NULL, stormClient, &clients[i]);
+		}
+		for (int i=0; i<PERF_STORM_THREADS; i++) {
+			pthread_join(clients[i].tid, NULL);
+			errors += clients[i].errors;
+		}
+		elapsed = nowUs() - start;
+
+		// Pack the samples of all the clients
+		count = 0;
+		for (int i=0; i<PERF_STORM_THREADS; i++) {
+			memmove(&samples[count], clients[i].samples,
+					clients[i].count * sizeof(uint64_t));
+			count += clients[i].count;
+		}
+		qsort(samples, count, sizeof(uint64_t), cmpU64);
+
+		rates[r] = count * 1e6 / elapsed;
+		p99s[r] = percentile(samples, count, 99);
+	}
+
+	setMetric("storm_rate", median(rates, PERF_ROUNDS));
+	setMetric("storm_p99", median(p99s, PERF_ROUNDS));
+	return errors;
+}
+
+
+/**
+ * @brief Measure the command throughput with some concurrent sessions
+ *
+ * @param	sessions	Concurrent sessions
+ * @param	name		Metric name
+ * @return	Number of errors
+ */
+static int runCommands(int sessions, const char *name) {
+	perf_client_t clients[16];
+	double rates[PERF_ROUNDS];
+	uint64_t start, count;
+	int errors = 0;
+
+	for (int r=0; r<PERF_ROUNDS; r++) {
+		memset(clients, 0, sizeof(clients));
+		count = 0;
+		start = nowUs();
+		for (int i=0; i<sessions; i++) {
+			clients[i].deadline = start + PERF_RUN_MS * 1000;
+			pthread_create(&clients[i].tid, NULL, cmdClient, &clients[i]);
+		}
+		for (int i=0; i<sessions; i++) {
+			pthread_join(clients[i].tid, NULL);
+			count += clients[i].count;
+			errors += clients[i].errors;
+		}
+		rates[r] = count * 1e6 / (nowUs() - start);
+	}
+
+	setMetric(name, median(rates, PERF_ROUNDS));
+	return errors;
+}
+
+
+/**
+ * @brief Get the CPU time of a process, summed over its threads
+ *
+ * Threads that already exited are not counted, so only compare the times of
+ * threads that outlive the interval measured.
+ *
+ * @param	pid	Process
+ * @return	CPU time (ns), or 0 if unknown
+ */
+static uint64_t readCpuNs(pid_t pid) {
+	char path[64];
+	unsigned long long ns;
+	uint64_t total = 0;
+	struct dirent *ent;
+	FILE *f;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", pid);
+	if ((dir = opendir(path)) == NULL) {
+		return 0;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%d/task/%.16s/schedstat", pid,
+				ent->d_name);
+		if ((f = fopen(path, "r")) == NULL) {
+			continue;
+		}
+		if (fscanf(f, "%llu", &ns) == 1) {
+			total += ns;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+
+	return total;
+}
+
+
+/**
+ * @brief Measure the output bandwidth of a session, and the daemon's CPU time
+ * per MB
+ *
+ * The session stays open across the rounds, so the threads measured do too.
+ *
+ * @param	pid	Daemon
+ * @return	Number of errors
+ */
+static int runOutput(pid_t pid) {
+	char cmd[64];
+	double rates[PERF_ROUNDS];
+	double cpus[PERF_ROUNDS];
+	uint64_t bytes;
+	uint64_t start;
+	uint64_t cpu;
+	int sd;
+
+	if ((sd = openSession()) < 0) {
+		return 1;
+	}
+	snprintf(cmd, sizeof(cmd), "%shead -c %d /dev/zero\n", PERF_CMD,
+			PERF_OUTPUT_BYTES);
+	for (int r=0; r<PERF_ROUNDS; r++) {
+		bytes = 0;
+		cpu = readCpuNs(pid);
+		start = nowUs();
+		if (sendLine(sd, cmd) < 0 ||
+				waitFor(sd, NULL, PERF_TIMEOUT_MS, &bytes) < 0) {
+			close(sd);
+			return 1;
+		}
+		rates[r] = bytes / (double) (nowUs() - start);
+		cpus[r] = (readCpuNs(pid) - cpu) / 1000.0 / (bytes / 1000000.0);
+	}
+	setMetric("output_rate", median(rates, PERF_ROUNDS));
+	setMetric("output_cpu", median(cpus, PERF_ROUNDS));
+	close(sd);
+
+	return 0;
+}
+
+
+/**
+ * @brief Measure the latency of ctrl-c, to the EXIT line of the job
+ *
+ * The session asks for EXIT lines with a HELLO. Each job is given time to
+ * start before it is signaled, and both the CTL line and the job end with a
+ * prompt, so the session is drained before the next job.
+ *
+ * @return	Number of errors
+ */
+static int runSignals() {
+	uint64_t samples[PERF_SIGNALS];
+	char hello[64];
+	uint64_t start;
+	int count = 0;
+	int sd;
+
+	if ((sd = openSession()) < 0) {
+		return 1;
+	}
+	snprintf(hello, sizeof(hello), "%s%d %x %d\n", MSG_TYPE_HELLO,
+			PROTO_VERSION, PROTO_FEAT_EXIT, 65536);
+	if (sendLine(sd, hello) < 0 ||
+			waitFor(sd, MSG_TYPE_HELLO, PERF_TIMEOUT_MS, NULL) < 0) {
+		close(sd);
+		return 1;
+	}
+
+	for (int i=0; i<PERF_SIGNALS; i++) {
+		if (sendLine(sd, PERF_CMD "sleep 10\n") < 0) {
+			break;
+		}
+		usleep(50000);
+		start = nowUs();
+		if (sendLine(sd, PERF_CTL "c\n") < 0 ||
+				waitFor(sd, " signal 2 ", PERF_TIMEOUT_MS, NULL) < 0) {
+			break;
+		}
+		samples[count++] = nowUs() - start;
+		drainSession(sd);	// Prompts of the CTL line and of the job
+	}
+	close(sd);
+	qsort(samples, count, sizeof(uint64_t), cmpU64);
+
+	setMetric("signal_p50", percentile(samples, count, 50));
+	setMetric("signal_p99", percentile(samples, count, 99));
+	return PERF_SIGNALS - count;
+}
+
+
+/**
+ * @brief Get the resident memory of a process
+ *
+ * @param	pid	Process
+ * @return	Resident set size (KB), or 0 if unknown
+ */
+static long readRss(pid_t pid) {
+	char path[64];
+	char line[256];
+	long rss = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (sscanf(line, "VmRSS: %ld", &rss) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+
+	return rss;
+}
+
+
+/**
+ * @brief Measure the memory of idle sessions
+ *
+ * @param	pid	Daemon
+ * @return	Number of errors
+ */
+static int runMemory(pid_t pid) {
+	int sds[PERF_IDLE_SESSIONS];
+	int errors = 0;
+	long before, after;
+
+	usleep(200000);	// Let the sessions of the other tests end
+	before = readRss(pid);
+	for (int i=0; i<PERF_IDLE_SESSIONS; i++) {
+		if ((sds[i] = openSession()) < 0) {
+			errors++;
+		}
+	}
+	usleep(100000);
+	after = readRss(pid);
+	for (int i=0; i<PERF_IDLE_SESSIONS; i++) {
+		if (sds[i] >= 0) {
+			close(sds[i]);
+		}
+	}
+
+	if (before == 0 || after == 0) {
+		return errors + 1;
+	}
+	setMetric("session_rss", (double) (after - before) /
+			(PERF_IDLE_SESSIONS - errors));
+	return errors;
+}
+
+
+/**
+ * @brief Report the operations of a test that failed
+ *
+ * @param	test	Test name
+ * @param	errors	Number of errors
+ * @return	Number of errors
+ */
+static int checkErrors(const char *test, int errors) {
+	if (errors > 0) {
+		fprintf(stderr, "ERROR: %s: %d operations failed\n", test, errors);
+	}
+	return errors;
+}
+
+
+/**
+ * @brief Compare the results against a baseline, and print them
+ *
+ * @param	path	Baseline file, or NULL to only print the results
+ * @return	Number of regressions, or -1 if the baseline could not be read
+ */
+static int checkBaseline(const char *path) {
+	double base[PERF_METRICS];
+	int tol[PERF_METRICS];
+	char line[256];
+	char name[64];
+	double value, limit;
+	int tolerance;
+	int regressions = 0;
+	bool ok;
+	FILE *f = NULL;
+
+	for (int i=0; i<PERF_METRICS; i++) {
+		base[i] = -1;
+	}
+	if (path != NULL) {
+		if ((f = fopen(path, "r")) == NULL) {
+			perror(path);
+			return -1;
+		}
+		while (fgets(line, sizeof(line), f) != NULL) {
+			line[strcspn(line, "#")] = '\0';
+			if (sscanf(line, "%63s %lf %d", name, &value, &tolerance) != 3) {
+				continue;
+			}
+			for (int i=0; i<PERF_METRICS; i++) {
+				if (!strcmp(metrics[i].name, name)) {
+					base[i] = value;
+					tol[i] = tolerance;
+				}
+			}
+		}
+		fclose(f);
+	}
+
+	printf("%-12s %12s %-7s %12s %12s  %s\n", "metric", "value", "unit",
+			"baseline", "limit", "result");
+	for (int i=0; i<PERF_METRICS; i++) {
+		printf("%-12s %12.1f %-7s ", metrics[i].name, metrics[i].value,
+				metrics[i].unit);
+		if (base[i] < 0) {
+			printf("%12s %12s  %s\n", "-", "-", path ? "no baseline" : "-");
+			continue;
+		}
+		if (metrics[i].better == PERF_HIGHER) {
+			limit = base[i] * (100 - tol[i]) / 100;
+			ok = metrics[i].value >= limit;
+		} else {
+			limit = base[i] * (100 + tol[i]) / 100;
+			ok = metrics[i].value <= limit;
+		}
+		printf("%12.1f %12.1f  %s\n", base[i], limit, ok ? "ok" : "REGRESSED");
+		regressions += !ok;
+	}
+
+	return regressions;
+}
+
+
+/**
+ * @brief Write the results as a new baseline
+ *
+ * @param	path	Baseline file
+ * @return	0 on success, or -1 on error
+ */
+static int writeBaseline(const char *path) {
+	FILE *f;
+
+	if ((f = fopen(path, "w")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "# Baseline of yashd-perf (make perfcheck)\n"
+			"# metric value tolerance_pct\n");
+	for (int i=0; i<PERF_METRICS; i++) {
+		fprintf(f, "%s %.1f %d\t# %s, %s is better\n", metrics[i].name,
+				metrics[i].value, metrics[i].tolerance, metrics[i].unit,
+				metrics[i].better == PERF_HIGHER ? "higher" : "lower");
+	}
+	fclose(f);
+
+	return 0;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	const char *daemon = PERF_DAEMON;
+	const char *baseline = NULL;
+	const char *update = NULL;
+	const char *extra[3] = {"-T", NULL, NULL};
+	char log[64];
+	int errors = 0;
+	int regressions;
+	pid_t pid;
+
+	for (int i=1; i<argc; i++) {
+		if (i+1 < argc && !strcmp(argv[i], "-d")) {
+			daemon = argv[++i];
+		} else if (i+1 < argc && !strcmp(argv[i], "-p")) {
+			port = atoi(argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-T")) {
+			extra[1] = argv[++i];
+		} else if (i+1 < argc && !strcmp(argv[i], "-b")) {
+			baseline = argv[++i];
+		} else if (i+1 < argc && !strcmp(argv[i], "-u")) {
+			update = argv[++i];
+		} else {
+			fprintf(stderr, "Usage: %s [-d DAEMON] [-p PORT] [-T DIR] "
+					"[-b BASELINE] [-u BASELINE]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((pid = startDaemon(daemon, "yashd-perf", port,
+			extra[1] != NULL ? extra : NULL, log, sizeof(log))) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	errors += checkErrors("connection storm", runStorm());
+	errors += checkErrors("commands x1", runCommands(1, "cmd_rate_1"));
+	errors += checkErrors("commands x4", runCommands(4, "cmd_rate_4"));
+	errors += checkErrors("commands x16", runCommands(16, "cmd_rate_16"));
+	errors += checkErrors("output", runOutput(pid));
+	errors += checkErrors("signals", runSignals());
+	errors += checkErrors("memory", runMemory(pid));
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	regressions = checkBaseline(baseline);
+	if (errors > 0) {
+		fprintf(stderr, "ERROR: Results are not valid, see %s\n", log);
+	}
+	if (update != NULL && errors == 0 && writeBaseline(update) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	return (errors > 0 || regressions != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
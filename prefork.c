@@ -0,0 +1,455 @@
+/**
+ * @file  prefork.c
+ *
+ * @brief Prefork multi-process worker mode of the yash shell daemon
+ *
+ * The master process binds the server socket once, and forks worker processes
+ * that accept connections on it by themselves. Each worker runs a single shard
+ * (see shard.c) with its own event loop and tables, so a crashing worker only
+ * takes its own sessions down. Workers can be recycled after serving a number
+ * of sessions to bound memory fragmentation: a recycled worker tells the
+ * master when it stops accepting, and is replaced right away while it drains
+ * its sessions. The master respawns dead workers, and aggregates their
+ * counters, which workers keep in memory shared with the master.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+static shard_t *worker_shards = NULL;			//! Worker shards, two slots per worker (shared memory)
+static worker_info_t workers[MAX_WORKERS];		//! Worker table
+static int worker_count = 0;					//! Number of workers in table
+static pid_t slot_pids[2*MAX_WORKERS];			//! Process using each shard slot, or 0
+static int notify_fd[2] = {-1, -1};				//! Worker draining and SIGCHLD notices
+static uint64_t retired_sessions = 0;			//! Sessions of dead workers
+static uint64_t retired_rejected = 0;			//! Rejections of dead workers
+static uint64_t retired_cmds = 0;				//! Commands of dead workers
+static uint64_t retired_numa_local = 0;			//! NUMA local jobs of dead workers
+static uint64_t retired_numa_remote = 0;		//! NUMA remote jobs of dead workers
+static volatile sig_atomic_t stats_requested = 0;	//! SIGUSR1 received
+static volatile sig_atomic_t reload_requested = 0;	//! SIGHUP received
+
+
+/**
+ * @brief Handler for SIGUSR1 signal on the master process
+ *
+ * @param	sig	Signal
+ */
+void sigUsr1Master(int sig) {
+	stats_requested = 1;
+}
+
+
+/**
+ * @brief Handler for SIGHUP signal on the master process
+ *
+ * @param	sig	Signal
+ */
+void sigHupMaster(int sig) {
+	reload_requested = 1;
+}
+
+
+/**
+ * @brief Handler for SIGCHLD signal on the master process
+ *
+ * Wake the master up through its notice pipe, so a worker exiting while the
+ * master is about to poll is not missed. Only write() is used, so this is
+ * async-signal-safe.
+ *
+ * @param	sig	Signal
+ */
+static void sigChldMaster(int sig) {
+	pid_t notice = 0;
+	int saved = errno;
+
+	if (write(notify_fd[1], &notice, sizeof(notice)) < 0) {
+		// The pipe is full, the master has wake-ups pending anyway
+	}
+	errno = saved;
+}
+
+
+/**
+ * @brief Tell the master this worker stopped accepting connections
+ *
+ * Called by a worker's shard when it starts draining, so the master can spawn
+ * its replacement right away instead of when the last session ends.
+ *
+ * @param	fd	Write end of the master's notice pipe
+ */
+void notifyWorkerDraining(int fd) {
+	pid_t pid = getpid();
+
+	if (write(fd, &pid, sizeof(pid)) != sizeof(pid)) {
+		perror("ERROR: Notifying the master");
+	}
+}
+
+
+/**
+ * @brief Fork a worker process
+ *
+ * The worker runs a single shard accepting connections on the master's server
+ * socket, and exits once the shard stops (e.g. after being recycled). Each
+ * worker has two shard slots, so a recycled worker keeps its counters in one
+ * while its replacement runs in the other.
+ *
+ * @param	idx		Worker index in the worker table
+ * @param	slot	Shard slot for the worker
+ * @param	sds		Listener sockets
+ * @return	PID of the worker, or -1 on error
+ */
+pid_t spawnWorker(int idx, int slot, int *sds) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	pid_t pid;
+
+	if ((pid = fork()) < 0) {
+		perror("ERROR: Forking worker process");
+		return -1;
+	} else if (pid == 0) {	// Worker
+		// The job threads reap their own children
+		signal(SIGCHLD, SIG_DFL);
+		close(notify_fd[0]);
+
+		// Keep the shard table in the memory shared with the master
+		shards = &worker_shards[slot];
+		if (initShards(1, sds) < 0) {
+			exit(EXIT_ERR_THREAD);
+		}
+		for (int i=0; i<listener_count; i++) {
+			close(sds[i]);
+		}
+		shards[0].id = idx;
+		shards[0].max_sessions = args.recycle;
+		shards[0].drain_fd = notify_fd[1];
+		if (args.redirect > 0) {
+			startRegistry();
+		}
+		if (args.record[0] != '\0') {
+			startRecorder(args.record);
+		}
+		if (args.audit[0] != '\0' && startAudit(args.audit) < 0) {
+			exit(EXIT_ERR_DAEMON);	// Commands must not run unaudited
+		}
+		startJobRegistry(args.port);
+
+		runShard(&shards[0]);
+		exit(EXIT_OK);
+	}
+
+	// Master
+	workers[idx].pid = pid;
+	workers[idx].slot = slot;
+	workers[idx].started = time(NULL);
+	workers[idx].respawn_at = 0;
+	workers[idx].spawns++;
+	slot_pids[slot] = pid;
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Started worker %d, PID: %d\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), idx, pid);
+
+	return pid;
+}
+
+
+/**
+ * @brief Log the counters of every worker and their aggregate
+ *
+ * Workers still draining after being replaced are listed too. The workers are
+ * also asked to log their own session tables.
+ */
+void logWorkerStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	uint64_t sessions = retired_sessions;
+	uint64_t rejected = retired_rejected;
+	uint64_t cmds = retired_cmds;
+	uint64_t numa_local = retired_numa_local;
+	uint64_t numa_remote = retired_numa_remote;
+	uint64_t spawns = 0;
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Worker Table:\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+	for (int i=0; i<2*worker_count; i++) {
+		shard_t *shard = &worker_shards[i];
+		int idx = i % worker_count;
+		uint64_t w_sessions, w_rejected, w_cmds, w_local, w_remote;
+
+		if (slot_pids[i] == 0) {
+			continue;
+		}
+		w_sessions = __atomic_load_n(&shard->sessions, __ATOMIC_RELAXED);
+		w_rejected = __atomic_load_n(&shard->rejected, __ATOMIC_RELAXED);
+		w_cmds = __atomic_load_n(&shard->cmds, __ATOMIC_RELAXED);
+		w_local = __atomic_load_n(&shard->numa_local, __ATOMIC_RELAXED);
+		w_remote = __atomic_load_n(&shard->numa_remote, __ATOMIC_RELAXED);
+
+		fprintf(stderr, "\t[%d] PID: %d%s, Spawns: %lu, Sessions: %lu, "
+				"Rejected: %lu, Commands: %lu, NUMA local/remote: %lu/%lu\n",
+				idx, slot_pids[i],
+				(slot_pids[i] == workers[idx].pid) ? "" : " (draining)",
+				workers[idx].spawns, w_sessions, w_rejected, w_cmds, w_local,
+				w_remote);
+		sessions += w_sessions;
+		rejected += w_rejected;
+		cmds += w_cmds;
+		numa_local += w_local;
+		numa_remote += w_remote;
+
+		kill(slot_pids[i], SIGUSR1);
+	}
+	for (int i=0; i<worker_count; i++) {
+		spawns += workers[i].spawns;
+	}
+	fprintf(stderr, "%s yashd[daemon]: INFO: All workers: spawns: %lu, "
+			"sessions: %lu, rejected: %lu, commands: %lu, NUMA local jobs: %lu, "
+			"NUMA remote jobs: %lu\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), spawns, sessions, rejected,
+			cmds, numa_local, numa_remote);
+}
+
+
+/**
+ * @brief Schedule the replacement of a worker that stopped accepting
+ *
+ * A worker that stops right after being spawned is replaced after a delay, so
+ * a broken worker does not turn the master into a fork loop.
+ *
+ * @param	idx	Worker index in the worker table
+ */
+static void scheduleRespawn(int idx) {
+	time_t now = time(NULL);
+
+	workers[idx].pid = 0;
+	if (now - workers[idx].started < getConfig()->worker_respawn_delay) {
+		workers[idx].respawn_at = workers[idx].started +
+				getConfig()->worker_respawn_delay;
+	} else {
+		workers[idx].respawn_at = now;
+	}
+}
+
+
+/**
+ * @brief Find the shard slot used by a worker process
+ *
+ * @param	pid	Worker PID
+ * @return	Slot, or -1 if the process is not a worker
+ */
+static int searchSlot(pid_t pid) {
+	for (int i=0; i<2*worker_count; i++) {
+		if (slot_pids[i] == pid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * @brief Find a free shard slot for a worker's replacement
+ *
+ * The slot the worker did not use last is preferred, since a recycled worker
+ * is still draining in the other one.
+ *
+ * @param	idx	Worker index in the worker table
+ * @return	Slot, or -1 if both are in use
+ */
+static int freeSlot(int idx) {
+	int slot = (workers[idx].slot == idx) ? idx + worker_count : idx;
+
+	if (slot_pids[slot] == 0) {
+		return slot;
+	}
+	if (slot_pids[workers[idx].slot] == 0) {
+		return workers[idx].slot;
+	}
+	return -1;
+}
+
+
+/**
+ * @brief Reap the workers that exited
+ */
+static void reapWorkers() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	int status;
+	pid_t pid;
+	int slot, idx;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if ((slot = searchSlot(pid)) < 0) {
+			continue;
+		}
+		idx = slot % worker_count;
+
+		if (WIFSIGNALED(status)) {
+			fprintf(stderr, "%s yashd[daemon]: ERROR: Worker %d, PID: %d, "
+					"killed by signal %d\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), idx, pid,
+					WTERMSIG(status));
+		} else {
+			fprintf(stderr, "%s yashd[daemon]: INFO: Worker %d, PID: %d, "
+					"exited with status %d\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), idx, pid,
+					WEXITSTATUS(status));
+		}
+
+		// Keep the counters of the dead worker
+		retired_sessions += worker_shards[slot].sessions;
+		retired_rejected += worker_shards[slot].rejected;
+		retired_cmds += worker_shards[slot].cmds;
+		retired_numa_local += worker_shards[slot].numa_local;
+		retired_numa_remote += worker_shards[slot].numa_remote;
+		slot_pids[slot] = 0;
+
+		// A worker that was still accepting must be replaced. A drained one
+		// was replaced when it stopped accepting.
+		if (workers[idx].pid == pid) {
+			scheduleRespawn(idx);
+		}
+	}
+}
+
+
+/**
+ * @brief Run the prefork master process
+ *
+ * Bind the listeners, fork the workers, and replace them as they stop
+ * accepting: a recycled worker as soon as it starts draining, and a dead one
+ * once it is reaped. The master waits on its notice pipe, with a timeout to
+ * the next respawn due, so signals and reaps are handled meanwhile.
+ *
+ * @param	count	Number of worker processes
+ * @param	port	Server port
+ */
+void runMaster(int count, int port) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct sigaction sa;
+	struct pollfd pollfds[1];
+	pid_t notice;
+	int sds[MAX_LISTENERS];
+	int shared[MAX_LISTENERS];
+	int timeout, slot;
+	time_t now;
+
+	// Bind the listeners once, the workers accept on them
+	for (int i=0; i<MAX_LISTENERS; i++) {
+		shared[i] = -1;
+	}
+	if (openListeners(sds, shared, false) < 0) {
+		exit(EXIT_ERR_SOCKET);
+	}
+
+	worker_shards = mmap(NULL, 2 * count * sizeof(shard_t),
+			PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (worker_shards == MAP_FAILED) {
+		perror("ERROR: Allocating worker shards");
+		exit(EXIT_ERR_DAEMON);
+	}
+	worker_count = count;
+
+	// Workers post their PID when they start draining, and SIGCHLD posts 0
+	if (pipe2(notify_fd, O_CLOEXEC | O_NONBLOCK) == SYSCALL_RETURN_ERR) {
+		perror("ERROR: Creating worker notice pipe");
+		exit(EXIT_ERR_DAEMON);
+	}
+
+	// SIGCHLD, SIGUSR1 and SIGHUP must interrupt the master's poll()
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sigChldMaster;
+	sa.sa_flags = SA_NOCLDSTOP;
+	if (sigaction(SIGCHLD, &sa, NULL) < 0) {
+		perror("ERROR: Could not set signal handler for SIGCHLD");
+	}
+	sa.sa_flags = 0;
+	sa.sa_handler = sigUsr1Master;
+	if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+		perror("ERROR: Could not set signal handler for SIGUSR1");
+	}
+	sa.sa_handler = sigHupMaster;
+	if (sigaction(SIGHUP, &sa, NULL) < 0) {
+		perror("ERROR: Could not set signal handler for SIGHUP");
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Running %d prefork workers\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), count);
+
+	for (int i=0; i<count; i++) {
+		spawnWorker(i, i, sds);
+	}
+
+	pollfds[0].fd = notify_fd[0];
+	pollfds[0].events = POLLIN;
+	for (;;) {
+		// Wait for a notice, or the next respawn due
+		now = time(NULL);
+		timeout = -1;
+		for (int i=0; i<worker_count; i++) {
+			// Without a free slot, the respawn waits for a worker to exit
+			if (workers[i].respawn_at > 0 && freeSlot(i) >= 0) {
+				int ms = (workers[i].respawn_at > now) ?
+						(int) (workers[i].respawn_at - now) * 1000 : 0;
+				if (timeout < 0 || ms < timeout) {
+					timeout = ms;
+				}
+			}
+		}
+		if (poll(pollfds, 1, timeout) < 0 && errno != EINTR) {
+			perror("ERROR: Waiting for workers");
+			break;
+		}
+
+		if (stats_requested) {
+			stats_requested = 0;
+			logWorkerStats();
+		}
+		if (reload_requested) {
+			// The workers reload their own copy
+			reload_requested = 0;
+			reloadConfig();
+			for (int i=0; i<2*worker_count; i++) {
+				if (slot_pids[i] > 0) {
+					kill(slot_pids[i], SIGHUP);
+				}
+			}
+		}
+
+		// Workers that stopped accepting
+		while (read(notify_fd[0], &notice, sizeof(notice)) == sizeof(notice)) {
+			if (notice > 0 && (slot = searchSlot(notice)) >= 0 &&
+					workers[slot % worker_count].pid == notice) {
+				fprintf(stderr, "%s yashd[daemon]: INFO: Worker %d, PID: %d, "
+						"draining, replacing it\n",
+						timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+						slot % worker_count, notice);
+				scheduleRespawn(slot % worker_count);
+			}
+		}
+		reapWorkers();
+
+		// Respawns due
+		now = time(NULL);
+		for (int i=0; i<worker_count; i++) {
+			if (workers[i].respawn_at == 0 || workers[i].respawn_at > now ||
+					(slot = freeSlot(i)) < 0) {
+				continue;
+			}
+			if (spawnWorker(i, slot, sds) < 0) {
+				workers[i].respawn_at = now + WORKER_RESPAWN_DELAY;
+			}
+		}
+	}
+
+	for (int i=0; i<listener_count; i++) {
+		close(sds[i]);
+	}
+	close(notify_fd[0]);
+	close(notify_fd[1]);
+	munmap(worker_shards, 2 * count * sizeof(shard_t));
+}
@@ -0,0 +1,941 @@
+/**
+ * @file  proxy.c
+ *
+ * @brief Yash shell daemon front proxy
+ *
+ * The proxy accepts yash client connections, and routes each session to one of
+ * several yashd backends, so a host can run many daemon instances for isolation
+ * and rolling restarts. Backends are picked by consistent hashing of the client
+ * IP (a client keeps landing on the same backend, and only the clients of a
+ * removed backend move), or by least active sessions. The session's bytes are
+ * moved between the sockets with splice() through a pipe, so they never get
+ * copied to user space. A health check thread takes backends that stop sending
+ * their prompt out of rotation, and puts them back when they recover.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "proxy.h"
+
+
+// Globals
+static cmd_args_t args;
+static char log_path[PATHMAX+1];
+static char pid_path[PATHMAX+1];
+static backend_t backends[MAX_BACKENDS];	//! Backend table
+static int backend_count = 0;				//! Number of backends in table
+static ring_point_t ring[MAX_BACKENDS*HASH_VNODES];	//! Consistent hash ring
+static int ring_size = 0;					//! Number of points in the ring
+static uint32_t least_rr = 0;				//! Tie breaker for least-loaded picks
+static volatile sig_atomic_t stats_requested = 0;	//! SIGUSR1 received
+
+
+// Functions
+
+
+/**
+ * @brief Get a timestamp string
+ *
+ * @param	buff	Buffer to save the string to
+ * @param	size	Size of the buffer
+ * @return	Pointer to the buffer
+ */
+char *timeStr(char *buff, int size) {
+	struct tm sTm;
+
+	time_t now = time(NULL);
+	gmtime_r(&now, &sTm);
+
+	if (!strftime(buff, size, "%b %e %H:%M:%S", &sTm)) {
+		perror("Could not format timestamp");
+		strcpy(buff, "Jan  1 00:00:00\0");
+	}
+
+	return buff;
+}
+
+
+/**
+ * @brief Check if a string contains only number characters
+ *
+ * @param	number	String to check
+ * @return	True if the string contains only numbers, false otherwise
+ */
+bool isNumber(char number[]) {
+	int i = 0;
+
+	// Checking for negative numbers
+	if (number[0] == '-')
+		i = 1;
+	for (; number[i] != 0; i++) {
+		if (!isdigit(number[i]))
+			return false;
+	}
+	return true;
+}
+
+
+/**
+ * @brief Add a backend to the backend table
+ *
+ * @param	hostport	Backend address as HOST:PORT
+ * @return	0 on success, or -1 if the address is not valid
+ */
+int addBackend(char *hostport) {
+	backend_t *backend;
+	struct hostent *hp;
+	char *sep;
+
+	if (backend_count >= MAX_BACKENDS || (sep = strrchr(hostport, ':')) == NULL
+			|| sep == hostport || sep - hostport >= MAX_HOSTNAME_LEN
+			|| !isNumber(sep+1) || sep[1] == '-' || sep[1] == '\0') {
+		return -1;
+	}
+
+	backend = &backends[backend_count];
+	memset(backend, 0, sizeof(backend_t));
+	strncpy(backend->host, hostport, sep - hostport);
+	backend->port = atoi(sep+1);
+	if (backend->port < TCP_PORT_LOWER_LIM ||
+			backend->port > TCP_PORT_HIGHER_LIM) {
+		return -1;
+	}
+
+	if ((hp = gethostbyname(backend->host)) == NULL) {
+		return -1;
+	}
+	backend->addr.sin_family = AF_INET;
+	memcpy(&backend->addr.sin_addr, hp->h_addr, hp->h_length);
+	backend->addr.sin_port = htons((u_short) backend->port);
+
+	// Backends start in rotation until the first health check says otherwise
+	backend->healthy = true;
+	backend_count++;
+
+	return 0;
+}
+
+
+/**
+ * @brief Parse the command line arguments
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Struct with the parsed arguments
+ */
+cmd_args_t parseArgs(int argc, char** argv) {
+	const char USAGE[] = "\nUsage:\n"
+				"./yashd-proxy [options] -b HOST:PORT [-b HOST:PORT ...]\n"
+				"\n"
+				"Required arguments:\n"
+				"    -b HOST:PORT, --backend HOST:PORT\n"
+				"                            Backend yashd daemon, repeat for "
+				"each one\n"
+				"\n"
+				"Options:\n"
+				"    -h, --help              Print help and exit\n"
+				"    -i SEC, --interval SEC  Seconds between backend health "
+				"checks\n"
+				"    -m POL, --balance POL   Balancing policy [hash|least]\n"
+				"    -p PORT, --port PORT    Proxy port [1024-65535]\n"
+				"    -v, --verbose           Verbose logger output\n";
+		const char ARG_ERROR[MAX_ERROR_LEN] = "-yashd-proxy: unknown argument: "
+				"%s\n";
+		const char H_FLAG_SHORT[3] = "-h\0";
+		const char H_FLAG_LONG[10] = "--help\0";
+		const char P_FLAG_SHORT[3] = "-p\0";
+		const char P_FLAG_LONG[10] = "--port\0";
+		const char P_INFO[MAX_ERROR_LEN] = "-yashd-proxy: using port: %d\n";
+		const char P_ERROR1[MAX_ERROR_LEN] = "-yashd-proxy: missing port number\n";
+		const char P_ERROR2[MAX_ERROR_LEN] = "-yashd-proxy: port must be an "
+				"integer between %d and %d\n";
+		const char V_FLAG_SHORT[3] = "-v\0";
+		const char V_FLAG_LONG[10] = "--verbose\0";
+		const char V_INFO[MAX_ERROR_LEN] = "-yashd-proxy: verbose output enabled\n";
+		const char B_FLAG_SHORT[3] = "-b\0";
+		const char B_FLAG_LONG[10] = "--backend\0";
+		const char B_INFO[MAX_ERROR_LEN] = "-yashd-proxy: using backend: %s\n";
+		const char B_ERROR1[MAX_ERROR_LEN] = "-yashd-proxy: missing backend "
+				"address\n";
+		const char B_ERROR2[MAX_ERROR_LEN] = "-yashd-proxy: backend must be "
+				"HOST:PORT, with a known host, and at most %d backends\n";
+		const char B_ERROR3[MAX_ERROR_LEN] = "-yashd-proxy: at least one backend "
+				"is required\n";
+		const char M_FLAG_SHORT[3] = "-m\0";
+		const char M_FLAG_LONG[10] = "--balance\0";
+		const char M_INFO[MAX_ERROR_LEN] = "-yashd-proxy: using balancing policy: "
+				"%s\n";
+		const char M_ERROR1[MAX_ERROR_LEN] = "-yashd-proxy: missing balancing "
+				"policy\n";
+		const char M_ERROR2[MAX_ERROR_LEN] = "-yashd-proxy: balancing policy must "
+				"be hash or least\n";
+		const char M_HASH[5] = "hash\0";
+		const char M_LEAST[6] = "least\0";
+		const char I_FLAG_SHORT[3] = "-i\0";
+		const char I_FLAG_LONG[11] = "--interval\0";
+		const char I_INFO[MAX_ERROR_LEN] = "-yashd-proxy: health checks every %d "
+				"seconds\n";
+		const char I_ERROR1[MAX_ERROR_LEN] = "-yashd-proxy: missing health check "
+				"interval\n";
+		const char I_ERROR2[MAX_ERROR_LEN] = "-yashd-proxy: health check interval "
+				"must be a positive integer\n";
+		cmd_args_t args = {false, DEFAULT_TCP_PORT, BALANCE_HASH,
+				HEALTH_INTERVAL};
+
+	// Loop over the arguments, skipping the command token
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(H_FLAG_SHORT, argv[i])
+				|| !strcmp(H_FLAG_LONG, argv[i])) {
+			printf(USAGE);
+			exit(EXIT_OK);
+		} else if (!strcmp(V_FLAG_SHORT, argv[i])
+				|| !strcmp(V_FLAG_LONG, argv[i])) {
+			args.verbose = true;
+			printf(V_INFO);
+		} else if (!strcmp(P_FLAG_SHORT, argv[i])
+				|| !strcmp(P_FLAG_LONG, argv[i])) {
+			// Port argument detected, next argument should be the port number
+			if (i+1 >= argc) {
+				printf(P_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1])) {
+				printf(P_ERROR2, TCP_PORT_LOWER_LIM, TCP_PORT_HIGHER_LIM);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save port number
+			i++;
+			args.port = atoi(argv[i]);
+
+			// Check if port is in a valid range
+			if (args.port < TCP_PORT_LOWER_LIM ||
+					args.port > TCP_PORT_HIGHER_LIM) {
+				printf(P_ERROR2, TCP_PORT_LOWER_LIM, TCP_PORT_HIGHER_LIM);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(P_INFO, args.port);
+		} else if (!strcmp(B_FLAG_SHORT, argv[i])
+				|| !strcmp(B_FLAG_LONG, argv[i])) {
+			// Backend argument detected, next argument should be HOST:PORT
+			if (i+1 >= argc) {
+				printf(B_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			i++;
+			if (addBackend(argv[i]) < 0) {
+				printf(B_ERROR2, MAX_BACKENDS);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(B_INFO, argv[i]);
+		} else if (!strcmp(M_FLAG_SHORT, argv[i])
+				|| !strcmp(M_FLAG_LONG, argv[i])) {
+			// Balance argument detected, next argument should be the policy
+			if (i+1 >= argc) {
+				printf(M_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			i++;
+			if (!strcmp(M_HASH, argv[i])) {
+				args.balance = BALANCE_HASH;
+			} else if (!strcmp(M_LEAST, argv[i])) {
+				args.balance = BALANCE_LEAST;
+			} else {
+				printf(M_ERROR2);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(M_INFO, argv[i]);
+		} else if (!strcmp(I_FLAG_SHORT, argv[i])
+				|| !strcmp(I_FLAG_LONG, argv[i])) {
+			// Interval argument detected, next argument should be the seconds
+			if (i+1 >= argc) {
+				printf(I_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1]) || atoi(argv[i+1]) <= 0) {
+				printf(I_ERROR2);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			i++;
+			args.interval = atoi(argv[i]);
+
+			printf(I_INFO, args.interval);
+		} else {
+			printf(ARG_ERROR, argv[i]);
+			printf(USAGE);
+			exit(EXIT_ERR_ARG);
+		}
+	}
+
+	if (backend_count == 0) {
+		printf(B_ERROR3);
+		printf(USAGE);
+		exit(EXIT_ERR_ARG);
+	}
+
+	return args;
+}
+
+
+/**
+ * @brief Handler for SIGUSR1 signal
+ *
+ * The accept loop logs the backend table once it wakes up.
+ *
+ * @param	sig	Signal
+ */
+void sigUsr1(int sig) {
+	stats_requested = 1;
+}
+
+
+/**
+ * @brief Initializes the current program as a daemon
+ *
+ * Same steps as the yashd daemon: go to the background, detach from the
+ * terminal, send stderr to the log file, and lock the PID file so only one
+ * proxy runs.
+ *
+ * @param[in] path is where the daemon eventually operates
+ * @param[in] mask is the umask typically set to 0
+ */
+void daemonInit(const char *const path, uint mask) {
+	pid_t pid;
+	char buff[256];
+	FILE *log;
+	int fd;
+	int k;
+
+	fflush(stdout);
+
+	// Put proxy in background (with init/systemd as parent)
+	if ((pid = fork()) < 0) {
+		perror("daemon_init: Cannot fork process");
+		exit(EXIT_ERR_DAEMON);
+	} else if (pid > 0) {	// Parent
+		exit(EXIT_OK);
+	}
+
+	// Close all file descriptors that are open
+	for (k = getdtablesize() - 1; k > 0; k--)
+		close(k);
+
+	// Redirect stdin and stdout to /dev/null
+	if ((fd = open("/dev/null", O_RDWR)) < 0) {
+		perror("daemon_init: Error: Failed to open /dev/null");
+		exit(EXIT_ERR_DAEMON);
+	}
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	if (fd > STDERR_FILENO) {
+		close(fd);
+	}
+
+	// Redirect stderr to the log file
+	if ((log = fopen(log_path, "a")) == NULL) {
+		exit(EXIT_ERR_DAEMON);
+	}
+	fd = fileno(log);
+	dup2(fd, STDERR_FILENO);
+	if (fd > STDERR_FILENO) {
+		close(fd);
+	}
+
+	chdir(path);
+	umask(mask);
+	setsid();
+	pid = getpid();
+	setpgrp();
+
+	// Make sure only one proxy is running
+	if ((k = open(pid_path, O_RDWR | O_CREAT, 0666)) < 0) {
+		perror("daemon_init: Error: Could not open PID file");
+		exit(EXIT_ERR_DAEMON);
+	}
+	if (lockf(k, F_TLOCK, 0) != 0) {
+		perror("daemon_init: Warning: Could not lock PID file because other "
+				"proxy instance is running");
+		exit(EXIT_ERR_DAEMON);
+	}
+
+	// Save proxy's pid without closing file (so lock remains)
+	ftruncate(k, 0);
+	sprintf(buff, "%6d", pid);
+	write(k, buff, strlen(buff));
+}
+
+
+/**
+ * @brief Hash a byte string (32-bit FNV-1a)
+ *
+ * @param	data	Bytes to hash
+ * @param	len		Number of bytes
+ * @return	Hash
+ */
+uint32_t hashBytes(const void *data, size_t len) {
+	const uint8_t *bytes = data;
+	uint32_t hash = 2166136261u;
+
+	for (size_t i=0; i<len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	// Final avalanche, FNV alone clusters keys that differ in the last bytes
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+
+/**
+ * @brief Compare two ring points, for qsort()
+ */
+static int cmpRingPoints(const void *a, const void *b) {
+	uint32_t ha = ((const ring_point_t *) a)->hash;
+	uint32_t hb = ((const ring_point_t *) b)->hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+
+/**
+ * @brief Build the consistent hash ring
+ *
+ * Each backend gets HASH_VNODES points, hashed from its address, so the ring
+ * does not depend on the order of the backends on the command line.
+ */
+void buildRing() {
+	char key[MAX_HOSTNAME_LEN+32];
+	int len;
+
+	ring_size = 0;
+	for (int i=0; i<backend_count; i++) {
+		for (int v=0; v<HASH_VNODES; v++) {
+			len = snprintf(key, sizeof(key), "%s:%d#%d", backends[i].host,
+					backends[i].port, v);
+			ring[ring_size].hash = hashBytes(key, len);
+			ring[ring_size].backend = i;
+			ring_size++;
+		}
+	}
+	qsort(ring, ring_size, sizeof(ring_point_t), cmpRingPoints);
+}
+
+
+/**
+ * @brief Pick the backend for a new session
+ *
+ * With consistent hashing, the session goes to the owner of the first point
+ * at or after the client IP's hash, skipping the points of unhealthy backends.
+ * Otherwise, it goes to the healthy backend with the fewest active sessions.
+ *
+ * @param	from	Client address
+ * @return	Index of the backend, or -1 if no backend is healthy
+ */
+int pickBackend(struct sockaddr_in *from) {
+	int best = -1;
+
+	if (args.balance == BALANCE_HASH) {
+		uint32_t hash = hashBytes(&from->sin_addr, sizeof(from->sin_addr));
+		int lo = 0, hi = ring_size;
+
+		// Binary search the first point at or after the hash
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (ring[mid].hash < hash) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+
+		// Walk the ring to the first healthy owner
+		for (int i=0; i<ring_size; i++) {
+			int idx = ring[(lo + i) % ring_size].backend;
+			if (__atomic_load_n(&backends[idx].healthy, __ATOMIC_RELAXED)) {
+				return idx;
+			}
+		}
+		return -1;
+	}
+
+	// Least active sessions, rotating the start so ties spread out
+	uint64_t best_active = UINT64_MAX;
+	uint32_t start = __atomic_fetch_add(&least_rr, 1, __ATOMIC_RELAXED);
+	for (int i=0; i<backend_count; i++) {
+		int idx = (start + i) % backend_count;
+		uint64_t active = __atomic_load_n(&backends[idx].active,
+				__ATOMIC_RELAXED);
+		if (__atomic_load_n(&backends[idx].healthy, __ATOMIC_RELAXED) &&
+				active < best_active) {
+			best = idx;
+			best_active = active;
+		}
+	}
+
+	return best;
+}
+
+
+/**
+ * @brief Connect to a backend, giving up after a timeout
+ *
+ * @param	backend	Backend
+ * @param	timeout	Milliseconds to wait for the connection
+ * @return	Connected socket, or -1 on error
+ */
+int connectBackend(backend_t *backend, int timeout) {
+	struct pollfd pollfds[1];
+	socklen_t len = sizeof(int);
+	int err = 0;
+	int flags;
+	int s;
+
+	if ((s = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	// Connect without blocking, so a dead host does not stall the session
+	flags = fcntl(s, F_GETFL);
+	fcntl(s, F_SETFL, flags | O_NONBLOCK);
+	if (connect(s, (struct sockaddr *) &backend->addr, sizeof(backend->addr))
+			< 0 && errno != EINPROGRESS) {
+		close(s);
+		return -1;
+	}
+
+	pollfds[0].fd = s;
+	pollfds[0].events = POLLOUT;
+	if (poll(pollfds, 1, timeout) <= 0 ||
+			getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		close(s);
+		return -1;
+	}
+	fcntl(s, F_SETFL, flags);
+
+	return s;
+}
+
+
+/**
+ * @brief Check whether a backend is serving sessions
+ *
+ * Accepting the connection is not enough, since the kernel does that for a
+ * stuck daemon too: the backend must answer a HELLO in time. The probe sends
+ * no command and hangs up right after the answer, so the backend's session
+ * ends as soon as it started.
+ *
+ * @param	backend	Backend
+ * @return	True if the backend is healthy, false otherwise
+ */
+bool checkBackend(backend_t *backend) {
+	struct pollfd pollfds[1];
+	char hello[32];
+	char buf[512];
+	size_t mlen = strlen(MSG_TYPE_HELLO);
+	size_t len = 0;
+	bool healthy = false;
+	uint64_t deadline;
+	int64_t left;
+	ssize_t rc;
+	int n;
+	int s;
+
+	if ((s = connectBackend(backend, HEALTH_TIMEOUT)) < 0) {
+		return false;
+	}
+
+	// The answer comes after the prompt, and any line the session starts with
+	n = snprintf(hello, sizeof(hello), "%s%d 0 0\n", MSG_TYPE_HELLO,
+			PROTO_VERSION);
+	deadline = nowUs() + HEALTH_TIMEOUT * 1000;
+	pollfds[0].fd = s;
+	pollfds[0].events = POLLIN;
+	if (send(s, hello, n, MSG_NOSIGNAL) == n) {
+		while (!healthy &&
+				(left = (int64_t) (deadline - nowUs()) / 1000) > 0 &&
+				poll(pollfds, 1, left) > 0 &&
+				(rc = recv(s, &buf[len], sizeof(buf) - 1 - len, 0)) > 0) {
+			len += rc;
+			buf[len] = '\0';
+			healthy = (strstr(buf, MSG_TYPE_HELLO) != NULL);
+			// Keep the end, the answer may span reads
+			if (len >= mlen) {
+				memmove(buf, &buf[len - (mlen - 1)], mlen - 1);
+				len = mlen - 1;
+			}
+		}
+	}
+	close(s);
+
+	return healthy;
+}
+
+
+/**
+ * @brief Thread function to health check the backends
+ *
+ * Only health transitions are logged.
+ *
+ * @param	thread_args	Unused
+ */
+void *healthThread(void *thread_args) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+
+	for (;;) {
+		for (int i=0; i<backend_count; i++) {
+			backend_t *backend = &backends[i];
+			bool healthy = checkBackend(backend);
+
+			if (!healthy) {
+				__atomic_fetch_add(&backend->failures, 1, __ATOMIC_RELAXED);
+			}
+			if (healthy != __atomic_load_n(&backend->healthy, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&backend->healthy, healthy, __ATOMIC_RELAXED);
+				fprintf(stderr, "%s yashd-proxy[daemon]: %s: Backend %d (%s:%d) "
+						"is %s\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+						healthy ? "INFO" : "WARN", i, backend->host,
+						backend->port, healthy ? "up" : "down");
+			}
+		}
+		sleep(args.interval);
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Write what a direction's pipe holds to its destination socket
+ *
+ * @param	pipe_fd	Pipe used as the kernel buffer for this direction
+ * @param	dst		Socket to write to, non-blocking
+ * @param	pending	Bytes in the pipe, updated on return
+ * @return	0 on success, even if bytes are left in the pipe, or -1 on error
+ */
+int flushPipe(int pipe_fd[2], int dst, size_t *pending) {
+	ssize_t m;
+
+	while (*pending > 0) {
+		m = splice(pipe_fd[0], NULL, dst, NULL, *pending,
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (m < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return 0;	// The destination is full, wait for POLLOUT
+		} else if (m <= 0) {
+			return -1;
+		}
+		*pending -= m;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Move the bytes available on a socket to another socket
+ *
+ * The bytes go through a pipe with splice(), so they stay in the kernel. Both
+ * sockets are non-blocking: what the destination cannot take yet is left in
+ * the pipe, and the caller must not read the source again until it is flushed,
+ * so a slow reader only holds back its own direction.
+ *
+ * @param	src		Socket to read from, non-blocking
+ * @param	pipe_fd	Pipe used as the kernel buffer for this direction
+ * @param	dst		Socket to write to, non-blocking
+ * @param	pending	Bytes in the pipe, updated on return
+ * @return	Bytes read (1 if none were ready yet), 0 on EOF, or -1 on error
+ */
+ssize_t spliceOnce(int src, int pipe_fd[2], int dst, size_t *pending) {
+	ssize_t n;
+
+	n = splice(src, NULL, pipe_fd[1], NULL, SPLICE_CHUNK,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return 1;	// Spurious wakeup, nothing to move yet
+	} else if (n <= 0) {
+		return n;
+	}
+
+	*pending += n;
+	return (flushPipe(pipe_fd, dst, pending) < 0) ? -1 : n;
+}
+
+
+/**
+ * @brief Forward a session between the client and the backend
+ *
+ * Direction d reads socket d and writes the other one. A direction with bytes
+ * left in its pipe polls its destination for POLLOUT instead of its source for
+ * POLLIN. When one side stops sending, the other side's write half is shut
+ * down once the pipe is flushed, so EOF propagates; the session ends once both
+ * directions are done.
+ *
+ * @param	cs	Client socket
+ * @param	bs	Backend socket
+ */
+void forwardSession(int cs, int bs) {
+	struct pollfd pollfds[2];
+	int pipes[2][2];	// [0] client to backend, [1] backend to client
+	int fds[2] = {cs, bs};
+	size_t pending[2] = {0, 0};
+	bool reading[2] = {true, true};
+	bool done[2] = {false, false};
+	bool ok = true;
+	ssize_t n;
+
+	if (pipe2(pipes[0], O_CLOEXEC) < 0) {
+		return;
+	}
+	if (pipe2(pipes[1], O_CLOEXEC) < 0) {
+		close(pipes[0][0]);
+		close(pipes[0][1]);
+		return;
+	}
+	fcntl(cs, F_SETFL, fcntl(cs, F_GETFL) | O_NONBLOCK);
+	fcntl(bs, F_SETFL, fcntl(bs, F_GETFL) | O_NONBLOCK);
+
+	while (ok && !(done[0] && done[1])) {
+		for (int i=0; i<2; i++) {
+			pollfds[i].events =
+					((reading[i] && pending[i] == 0) ? POLLIN : 0) |
+					(pending[1-i] > 0 ? POLLOUT : 0);
+			pollfds[i].fd = pollfds[i].events ? fds[i] : -1;
+			pollfds[i].revents = 0;
+		}
+		if (poll(pollfds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for (int d=0; ok && d<2; d++) {
+			// Write first what the destination can take now
+			if (pending[d] > 0 && pollfds[1-d].revents &&
+					flushPipe(pipes[d], fds[1-d], &pending[d]) < 0) {
+				ok = false;
+			} else if (reading[d] && pending[d] == 0 && pollfds[d].revents) {
+				if ((n = spliceOnce(fds[d], pipes[d], fds[1-d],
+						&pending[d])) == 0) {
+					reading[d] = false;	// EOF: stop reading this direction
+				} else if (n < 0) {
+					ok = false;
+				}
+			}
+
+			// Pass EOF on once the pipe is flushed
+			if (ok && !reading[d] && pending[d] == 0 && !done[d]) {
+				shutdown(fds[1-d], SHUT_WR);
+				done[d] = true;
+			}
+		}
+	}
+
+	for (int d=0; d<2; d++) {
+		close(pipes[d][0]);
+		close(pipes[d][1]);
+	}
+}
+
+
+/**
+ * @brief Thread function to serve a client session
+ *
+ * A backend that refuses the connection is taken out of rotation, and the next
+ * pick is tried, until every backend has been tried once.
+ *
+ * @param	thread_args	Session arguments as a heap allocated session_args_t
+ * 						struct. The thread takes ownership of it.
+ */
+void *sessionThread(void *thread_args) {
+	session_args_t s_args = *(session_args_t *) thread_args;
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	backend_t *backend = NULL;
+	int bs = -1;
+	int idx;
+
+	free(thread_args);
+
+	for (int tries=0; tries<backend_count && bs < 0; tries++) {
+		if ((idx = pickBackend(&s_args.from)) < 0) {
+			break;
+		}
+		backend = &backends[idx];
+		if ((bs = connectBackend(backend, HEALTH_TIMEOUT)) < 0) {
+			__atomic_fetch_add(&backend->failures, 1, __ATOMIC_RELAXED);
+			__atomic_store_n(&backend->healthy, false, __ATOMIC_RELAXED);
+			fprintf(stderr, "%s yashd-proxy[daemon]: WARN: Backend %d (%s:%d) "
+					"is down\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP), idx,
+					backend->host, backend->port);
+		}
+	}
+
+	if (bs < 0) {
+		fprintf(stderr, "%s yashd-proxy[%s:%d]: ERROR: No backend available\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(s_args.from.sin_addr), ntohs(s_args.from.sin_port));
+		close(s_args.ps);
+		pthread_exit(NULL);
+	}
+
+	__atomic_fetch_add(&backend->active, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&backend->sessions, 1, __ATOMIC_RELAXED);
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd-proxy[%s:%d]: INFO: Routed to backend %d "
+				"(%s:%d)\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(s_args.from.sin_addr), ntohs(s_args.from.sin_port),
+				(int) (backend - backends), backend->host, backend->port);
+	}
+
+	forwardSession(s_args.ps, bs);
+
+	__atomic_fetch_sub(&backend->active, 1, __ATOMIC_RELAXED);
+	close(bs);
+	close(s_args.ps);
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Log the backend table
+ */
+void logStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+
+	fprintf(stderr, "%s yashd-proxy[daemon]: INFO: Backend Table:\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+	for (int i=0; i<backend_count; i++) {
+		backend_t *backend = &backends[i];
+
+		fprintf(stderr, "\t[%d] %s:%d, Status: %s, Active: %lu, Sessions: %lu, "
+				"Failures: %lu\n", i, backend->host, backend->port,
+				__atomic_load_n(&backend->healthy, __ATOMIC_RELAXED) ?
+						"Up" : "Down",
+				__atomic_load_n(&backend->active, __ATOMIC_RELAXED),
+				__atomic_load_n(&backend->sessions, __ATOMIC_RELAXED),
+				__atomic_load_n(&backend->failures, __ATOMIC_RELAXED));
+	}
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Error code
+ */
+int main(int argc, char **argv) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct sockaddr_in server = {0};
+	struct sockaddr_in from;
+	socklen_t fromlen;
+	struct pollfd pollfds[1];
+	struct sigaction sa;
+	session_args_t *s_args;
+	pthread_attr_t attr;
+	pthread_t th;
+	int one = 1;
+	int sd, ps;
+
+	// Process command line arguments
+	args = parseArgs(argc, argv);
+	buildRing();
+
+	// Initialize the daemon
+	strcpy(log_path, PROXY_LOG_PATH);
+	strcpy(pid_path, PROXY_PID_PATH);
+	daemonInit(PROXY_DIR, PROXY_UMASK);
+
+	// A client or backend hanging up must not kill the proxy
+	signal(SIGPIPE, SIG_IGN);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sigUsr1;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+		perror("ERROR: Could not set signal handler for SIGUSR1");
+	}
+
+	// Set up the listening socket
+	if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("ERROR: Opening stream socket");
+		exit(EXIT_ERR_SOCKET);
+	}
+	setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, (char*) &one, sizeof(one));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = htonl(INADDR_ANY);
+	server.sin_port = htons((u_short) args.port);
+	if (bind(sd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+		perror("ERROR: Binding stream socket");
+		exit(EXIT_ERR_SOCKET);
+	}
+	listen(sd, MAX_CONNECT_QUEUE);
+
+	fprintf(stderr, "%s yashd-proxy[daemon]: INFO: Proxy running on port %d, "
+			"%d backends, %s balancing\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), args.port, backend_count,
+			args.balance == BALANCE_HASH ? "hash" : "least");
+
+	// Session threads are never joined
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	if (pthread_create(&th, &attr, healthThread, NULL) != 0) {
+		perror("ERROR: Creating health check thread");
+		exit(EXIT_ERR_THREAD);
+	}
+
+	pollfds[0].fd = sd;
+	pollfds[0].events = POLLIN;
+	for (;;) {
+		if (stats_requested) {
+			stats_requested = 0;
+			logStats();
+		}
+
+		if (poll(pollfds, 1, -1) <= 0) {
+			continue;	// Interrupted by SIGUSR1
+		}
+
+		fromlen = sizeof(from);
+		if ((ps = accept(sd, (struct sockaddr *) &from, &fromlen)) < 0) {
+			continue;
+		}
+
+		if ((s_args = malloc(sizeof(session_args_t))) == NULL) {
+			close(ps);
+			continue;
+		}
+		s_args->ps = ps;
+		s_args->from = from;
+		if (pthread_create(&th, &attr, sessionThread, s_args) != 0) {
+			fprintf(stderr, "%s yashd-proxy[daemon]: ERROR: Creating session "
+					"thread\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+			free(s_args);
+			close(ps);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(sd);
+	exit(EXIT_OK);
+}
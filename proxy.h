@@ -0,0 +1,126 @@
+/**
+ * @file  proxy.h
+ *
+ * @brief Yash shell daemon front proxy
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef PROXY_H_
+#define PROXY_H_
+
+#define _GNU_SOURCE	// splice()
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include "yashd_defs.h"
+#include "yash_time.h"
+
+#define PATHMAX 255			//! Max length of a path
+#define BUFF_SIZE_TIMESTAMP 24	//! Timestamp string buffer size
+#define MAX_CONNECT_QUEUE 5	//! Max queue of pending connections
+#define MAX_BACKENDS 64		//! Max number of backend daemons
+#define HASH_VNODES 64		//! Points per backend on the consistent hash ring
+#define HEALTH_INTERVAL 2	//! Default seconds between backend health checks
+#define HEALTH_TIMEOUT 1000	//! Milliseconds a backend has to answer a HELLO
+#define SPLICE_CHUNK 65536	//! Max bytes moved per splice() call
+
+#define PROXY_DIR "/tmp/"						//! Proxy safe directory
+#define PROXY_LOG_PATH "/tmp/yashd-proxy.log"	//! Proxy log path
+#define PROXY_PID_PATH "/tmp/yashd-proxy.pid"	//! Proxy PID file path
+#define PROXY_UMASK 0							//! Proxy umask
+
+#define BALANCE_HASH 0		//! Balancing policy: consistent hashing of client IP
+#define BALANCE_LEAST 1		//! Balancing policy: least active sessions
+
+
+/**
+ * \brief Struct to organize all the command line arguments.
+ *
+ * Arguments:
+ *   - verbose: enable debugging log output
+ *   - port: port the proxy listens on
+ *   - balance: balancing policy (BALANCE_*)
+ *   - interval: seconds between backend health checks
+ */
+typedef struct _cmd_args_t {
+	bool verbose;	// Logger verbose output
+	int port;		// Proxy port
+	int balance;	// Balancing policy
+	int interval;	// Health check interval
+} cmd_args_t;
+
+
+/**
+ * @brief Struct to keep a backend daemon's address, health and counters
+ */
+typedef struct _backend_t {
+	char host[MAX_HOSTNAME_LEN];	// Backend host, as given
+	int port;						// Backend port
+	struct sockaddr_in addr;		// Backend address
+	bool healthy;					// Whether the last health check passed
+	uint64_t active;				// Sessions currently routed to the backend
+	uint64_t sessions;				// Sessions routed to the backend
+	uint64_t failures;				// Failed connections and health checks
+} backend_t;
+
+
+/**
+ * @brief Struct for a point in the consistent hash ring
+ */
+typedef struct _ring_point_t {
+	uint32_t hash;	// Point on the ring
+	int backend;	// Index of the backend owning the point
+} ring_point_t;
+
+
+/**
+ * @brief Struct to pass arguments to the session threads
+ */
+typedef struct _session_args_t {
+	int ps;						// Client socket
+	struct sockaddr_in from;	// Client address
+} session_args_t;
+
+
+// Functions
+char *timeStr(char *buff, int size);
+bool isNumber(char number[]);
+int addBackend(char *hostport);
+cmd_args_t parseArgs(int argc, char** argv);
+void sigUsr1(int sig);
+void daemonInit(const char *const path, uint mask);
+uint32_t hashBytes(const void *data, size_t len);
+void buildRing();
+int pickBackend(struct sockaddr_in *from);
+int connectBackend(backend_t *backend, int timeout);
+bool checkBackend(backend_t *backend);
+void *healthThread(void *thread_args);
+int flushPipe(int pipe_fd[2], int dst, size_t *pending);
+ssize_t spliceOnce(int src, int pipe_fd[2], int dst, size_t *pending);
+void forwardSession(int cs, int bs);
+void *sessionThread(void *thread_args);
+void logStats();
+int main(int argc, char **argv);
+
+
+#endif /* PROXY_H_ */
@@ -0,0 +1,159 @@
+/**
+ * @file  record.c
+ *
+ * @brief Session transcript store of the yash shell daemon
+ *
+ * Shared by the daemon and the replay tools.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <sys/types.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "record.h"
+#include "lz.h"
+
+
+/**
+ * @brief Bit positions of a session in a bloom filter
+ *
+ * Two probes from one 64-bit mix of the ID. With a few dozen sessions per
+ * block, false positives stay in the low percents.
+ *
+ * @param	session	Session ID
+ * @param	bits	Bit positions
+ */
+static void bloomBits(uint64_t session, uint32_t bits[2]) {
+	uint64_t h = session;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	bits[0] = (uint32_t) h % (RECORD_BLOOM_BYTES * 8);
+	bits[1] = (uint32_t) (h >> 32) % (RECORD_BLOOM_BYTES * 8);
+}
+
+
+/**
+ * @brief Add a session to a block's bloom filter
+ *
+ * @param	bloom	Bloom filter
+ * @param	session	Session ID
+ */
+void recordBloomAdd(uint8_t *bloom, uint64_t session) {
+	uint32_t bits[2];
+
+	bloomBits(session, bits);
+	for (int i=0; i<2; i++) {
+		bloom[bits[i] / 8] |= (uint8_t) (1 << (bits[i] % 8));
+	}
+}
+
+
+/**
+ * @brief Check whether a block may hold events of a session
+ *
+ * @param	bloom	Bloom filter
+ * @param	session	Session ID
+ * @return	False if the block has no events of the session, true if it may
+ */
+bool recordBloomTest(const uint8_t *bloom, uint64_t session) {
+	uint32_t bits[2];
+
+	bloomBits(session, bits);
+	for (int i=0; i<2; i++) {
+		if (!(bloom[bits[i] / 8] & (1 << (bits[i] % 8)))) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+ * @brief Compare segment names, for qsort()
+ */
+static int cmpNames(const void *a, const void *b) {
+	return strcmp(a, b);
+}
+
+
+/**
+ * @brief List the segments in a directory, oldest day first
+ *
+ * @param	dir		Recordings directory
+ * @param	names	Segment names (without suffix), sorted
+ * @param	max		Max number of segments listed
+ * @return	Number of segments, or -1 on error
+ */
+int recordListSegments(const char *dir, char names[][RECORD_NAME_LEN],
+		int max) {
+	size_t sfx = strlen(RECORD_IDX_SUFFIX);
+	struct dirent *ent;
+	DIR *d;
+	int count = 0;
+
+	if ((d = opendir(dir)) == NULL) {
+		return -1;
+	}
+	while ((ent = readdir(d)) != NULL && count < max) {
+		size_t len = strlen(ent->d_name);
+
+		if (len > sfx && len - sfx < RECORD_NAME_LEN &&
+				!strcmp(&ent->d_name[len - sfx], RECORD_IDX_SUFFIX)) {
+			memcpy(names[count], ent->d_name, len - sfx);
+			names[count][len - sfx] = '\0';
+			count++;
+		}
+	}
+	closedir(d);
+
+	// Names are YYYYMMDD-PID, so this sorts them by day
+	qsort(names, count, RECORD_NAME_LEN, cmpNames);
+
+	return count;
+}
+
+
+/**
+ * @brief Read and decompress a block
+ *
+ * @param	fd		Segment file
+ * @param	offset	Offset of the block
+ * @param	raw		Output, RECORD_BLOCK_SIZE bytes
+ * @param	comp	Scratch buffer, RECORD_BLOCK_SIZE bytes
+ * @return	Decompressed length, or -1 if the block is missing or corrupt
+ */
+int recordReadBlock(int fd, uint64_t offset, uint8_t *raw, uint8_t *comp) {
+	record_block_hdr_t hdr;
+
+	if (pread(fd, &hdr, sizeof(hdr), offset) != sizeof(hdr) ||
+			hdr.magic != RECORD_MAGIC || hdr.raw_len > RECORD_BLOCK_SIZE ||
+			hdr.comp_len > RECORD_BLOCK_SIZE) {
+		return -1;
+	}
+
+	if (hdr.flags & RECORD_BLOCK_RAW) {
+		if (hdr.comp_len != hdr.raw_len || pread(fd, raw, hdr.raw_len,
+				offset + sizeof(hdr)) != hdr.raw_len) {
+			return -1;
+		}
+		return hdr.raw_len;
+	}
+
+	if (pread(fd, comp, hdr.comp_len, offset + sizeof(hdr)) != hdr.comp_len ||
+			lzDecompress(comp, hdr.comp_len, raw, RECORD_BLOCK_SIZE) !=
+					(int) hdr.raw_len) {
+		return -1;
+	}
+
+	return hdr.raw_len;
+}
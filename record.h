@@ -0,0 +1,102 @@
+/**
+ * @file  record.h
+ *
+ * @brief Session transcript store of the yash shell daemon
+ *
+ * With `--record DIR`, the daemon appends every session's events (open, input
+ * from the client, output to the client, close) to an append-only store in
+ * DIR. Each daemon process writes its own pair of files per day:
+ *
+ * 	- `YYYYMMDD-PID.seg`: the events, packed into blocks of up to
+ * 	  RECORD_BLOCK_SIZE bytes, each LZ compressed (see lz.h) behind a block
+ * 	  header.
+ * 	- `YYYYMMDD-PID.idx`: a sparse index, one fixed size entry per block with
+ * 	  its offset, time range, and a bloom filter of the sessions in it.
+ *
+ * A reader finds a session by scanning the small index files, and only reads
+ * and decompresses the blocks whose bloom filter and time range match. The
+ * index entry of a block is written after the block, so a crash can at most
+ * leave a block the index does not point to.
+ *
+ * Block layout:
+ *
+ * 	| record_block_hdr_t | payload (comp_len) |
+ *
+ * Event layout, packed back to back in the decompressed payload:
+ *
+ * 	| record_event_hdr_t | data (len) |
+ *
+ * Integers are stored in host byte order: the files are read back on the host
+ * that wrote them.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef RECORD_H_
+#define RECORD_H_
+
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+#define RECORD_MAGIC 0x43455259		//! Block header magic ("YREC")
+#define RECORD_BLOCK_SIZE 65536		//! Max decompressed block size
+#define RECORD_BLOOM_BYTES 32		//! Size of a block's session bloom filter
+#define RECORD_SEG_SUFFIX ".seg"	//! Segment file suffix
+#define RECORD_IDX_SUFFIX ".idx"	//! Index file suffix
+#define RECORD_NAME_LEN 32			//! Max length of a segment/index file name
+
+#define RECORD_BLOCK_RAW 0x1		//! Block flag: payload is not compressed
+
+#define RECORD_OPEN 1		//! Event: session opened, data is the client address
+#define RECORD_INPUT 2		//! Event: message received from the client
+#define RECORD_OUTPUT 3		//! Event: output sent to the client
+#define RECORD_CLOSE 4		//! Event: session closed
+
+
+/**
+ * @brief Struct for the header of a block in a segment file
+ */
+typedef struct _record_block_hdr {
+	uint32_t magic;		// RECORD_MAGIC
+	uint32_t flags;		// RECORD_BLOCK_*
+	uint32_t raw_len;	// Decompressed payload length
+	uint32_t comp_len;	// Stored payload length
+} record_block_hdr_t;
+
+
+/**
+ * @brief Struct for the header of an event in a block
+ */
+typedef struct __attribute__((packed)) _record_event_hdr {
+	uint64_t session;	// Session ID
+	uint64_t ts;		// Time (microseconds since the epoch)
+	uint32_t len;		// Data length
+	uint8_t type;		// RECORD_OPEN, RECORD_INPUT...
+} record_event_hdr_t;
+
+
+/**
+ * @brief Struct for an entry of an index file, describing one block
+ */
+typedef struct _record_idx {
+	uint64_t offset;					// Offset of the block in the segment
+	uint64_t first_ts;					// Time of the block's first event
+	uint64_t last_ts;					// Time of the block's last event
+	uint32_t events;					// Number of events in the block
+	uint32_t opens;						// Number of RECORD_OPEN events
+	uint8_t bloom[RECORD_BLOOM_BYTES];	// Bloom filter of the session IDs
+} record_idx_t;
+
+
+// Functions
+void recordBloomAdd(uint8_t *bloom, uint64_t session);
+bool recordBloomTest(const uint8_t *bloom, uint64_t session);
+int recordListSegments(const char *dir, char names[][RECORD_NAME_LEN],
+		int max);
+int recordReadBlock(int fd, uint64_t offset, uint8_t *raw, uint8_t *comp);
+
+
+#endif /* RECORD_H_ */
@@ -0,0 +1,455 @@
+/**
+ * @file  recorder.c
+ *
+ * @brief Session transcript recorder of the yash shell daemon
+ *
+ * With `--record DIR`, every session's client socket is fronted by a socket
+ * pair: the session and its jobs write to one end as they would to the
+ * client, and the servant thread relays what comes out of the other end to
+ * the client, recording it on the way. The client's messages are recorded as
+ * the servant thread reads them.
+ *
+ * With `--capture DIR`, only the client's messages are recorded (with the
+ * session's open and close): the output goes straight to the client, with no
+ * socket pair nor relay, so capturing costs one copy of each message read.
+ * yash-replay replays the captures against a daemon.
+ *
+ * Recording an event only copies it into the block being filled, under one
+ * short lock. A recorder thread compresses the sealed blocks and appends them
+ * to the day's segment file, together with their index entries, so sessions
+ * never wait on the disk unless the recorder falls RECORD_BUFFERS blocks
+ * behind. A partial block is sealed after `record_flush` seconds, which bounds
+ * how much a crash can lose. See record.h for the file format.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include "lz.h"
+
+
+// Globals
+static recorder_t *recorder = NULL;	//! Recorder, NULL if not recording
+
+
+/**
+ * @brief Write a whole buffer to a file, retrying partial writes
+ *
+ * @param	fd	File
+ * @param	buf	Buffer
+ * @param	len	Buffer length
+ * @return	0 on success, or -1 on error
+ */
+static int writeAll(int fd, const void *buf, size_t len) {
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Seal the block being filled, and start filling the next one
+ *
+ * Waits for the recorder thread to free a buffer if they are all sealed. Must
+ * be called with the recorder lock held.
+ */
+static void sealBlock() {
+	while (recorder->sealed >= RECORD_BUFFERS - 1) {
+		recorder->waits++;
+		pthread_cond_wait(&recorder->free_cond, &recorder->lock);
+	}
+
+	recorder->sealed++;
+	recorder->fill = (recorder->fill + 1) % RECORD_BUFFERS;
+	recorder->bufs[recorder->fill].len = 0;
+	memset(&recorder->bufs[recorder->fill].idx, 0, sizeof(record_idx_t));
+	pthread_cond_signal(&recorder->sealed_cond);
+}
+
+
+/**
+ * @brief Open the segment and index files of a day, closing the previous ones
+ *
+ * @param	day	Day, as YYYYMMDD
+ * @return	0 on success, or -1 on error
+ */
+static int openSegment(const char *day) {
+	char path[PATHMAX + RECORD_NAME_LEN];
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	off_t off;
+
+	if (recorder->seg_fd >= 0) {
+		close(recorder->seg_fd);
+		close(recorder->idx_fd);
+		recorder->seg_fd = -1;
+		recorder->idx_fd = -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s-%d%s", recorder->dir, day, getpid(),
+			RECORD_SEG_SUFFIX);
+	if ((recorder->seg_fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			0644)) < 0) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Opening segment %s: %s\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), path, strerror(errno));
+		return -1;
+	}
+	snprintf(path, sizeof(path), "%s/%s-%d%s", recorder->dir, day, getpid(),
+			RECORD_IDX_SUFFIX);
+	if ((recorder->idx_fd = open(path, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,
+			0644)) < 0) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Opening index %s: %s\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), path, strerror(errno));
+		close(recorder->seg_fd);
+		recorder->seg_fd = -1;
+		return -1;
+	}
+
+	// Append after what an earlier run of this PID left, if any
+	if ((off = lseek(recorder->seg_fd, 0, SEEK_END)) < 0) {
+		off = 0;
+	}
+	recorder->seg_off = (uint64_t) off;
+	strcpy(recorder->day, day);
+
+	return 0;
+}
+
+
+/**
+ * @brief Compress a sealed block and append it, and its index entry
+ *
+ * @param	buf	Sealed block
+ */
+static void writeBlock(record_buf_t *buf) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char day[sizeof(recorder->day)];
+	record_block_hdr_t hdr;
+	time_t secs = (time_t) (buf->idx.first_ts / 1000000);
+	struct tm tm;
+	int n;
+
+	// Blocks go to the file of the day they started on
+	localtime_r(&secs, &tm);
+	strftime(day, sizeof(day), "%Y%m%d", &tm);
+	if ((recorder->seg_fd < 0 || strcmp(day, recorder->day)) &&
+			openSegment(day) < 0) {
+		__atomic_fetch_add(&recorder->lost, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	hdr.magic = RECORD_MAGIC;
+	hdr.raw_len = buf->len;
+	n = lzCompress(buf->data, (int) buf->len, recorder->comp, buf->len);
+	if (n < 0) {	// Does not compress, store it as is
+		hdr.flags = RECORD_BLOCK_RAW;
+		hdr.comp_len = buf->len;
+	} else {
+		hdr.flags = 0;
+		hdr.comp_len = (uint32_t) n;
+	}
+
+	buf->idx.offset = recorder->seg_off;
+	if (writeAll(recorder->seg_fd, &hdr, sizeof(hdr)) < 0 ||
+			writeAll(recorder->seg_fd, n < 0 ? buf->data : recorder->comp,
+					hdr.comp_len) < 0 ||
+			writeAll(recorder->idx_fd, &buf->idx, sizeof(record_idx_t)) < 0) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Writing recording: %s\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), strerror(errno));
+		__atomic_fetch_add(&recorder->lost, 1, __ATOMIC_RELAXED);
+		// Resync the offset with what actually made it to the file
+		recorder->seg_off = (uint64_t) lseek(recorder->seg_fd, 0, SEEK_END);
+		return;
+	}
+
+	recorder->seg_off += sizeof(hdr) + hdr.comp_len;
+	__atomic_fetch_add(&recorder->blocks, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&recorder->raw_bytes, buf->len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&recorder->stored_bytes, sizeof(hdr) + hdr.comp_len,
+			__ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Start the recorder thread, recording sessions in a directory
+ *
+ * @param	dir	Directory for the segment and index files
+ * @return	0 on success, or -1 on error
+ */
+int startRecorder(const char *dir) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	pthread_attr_t attr;
+	pthread_t th;
+
+	if ((recorder = calloc(1, sizeof(recorder_t))) == NULL) {
+		perror("ERROR: Allocating recorder");
+		return -1;
+	}
+	strncpy(recorder->dir, dir, PATHMAX);
+	recorder->seg_fd = -1;
+	recorder->idx_fd = -1;
+	pthread_mutex_init(&recorder->lock, NULL);
+	pthread_cond_init(&recorder->sealed_cond, NULL);
+	pthread_cond_init(&recorder->free_cond, NULL);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&th, &attr, recorderThread, NULL) != 0) {
+		perror("ERROR: Creating recorder thread");
+		pthread_attr_destroy(&attr);
+		free(recorder);
+		recorder = NULL;
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: %s sessions in %s\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			args.capture ? "Capturing" : "Recording", dir);
+
+	return 0;
+}
+
+
+/**
+ * @brief Thread function to write sealed blocks to disk
+ *
+ * @param	thread_args	Unused
+ */
+void *recorderThread(void *thread_args) {
+	struct timespec deadline;
+	record_buf_t *buf;
+
+	pthread_mutex_lock(&recorder->lock);
+	for (;;) {
+		// Wait for a sealed block, sealing the partial one once it is old
+		while (recorder->sealed == 0) {
+			record_buf_t *fill = &recorder->bufs[recorder->fill];
+
+			if (fill->len > 0 && wallUs() - fill->idx.first_ts >=
+					getConfig()->record_flush * 1000000ULL) {
+				sealBlock();
+				break;
+			}
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_sec += getConfig()->record_flush;
+			pthread_cond_timedwait(&recorder->sealed_cond, &recorder->lock,
+					&deadline);
+		}
+
+		// The oldest sealed block stays sealed (not reused) while it is written
+		buf = &recorder->bufs[(recorder->fill - recorder->sealed +
+				RECORD_BUFFERS) % RECORD_BUFFERS];
+		pthread_mutex_unlock(&recorder->lock);
+
+		writeBlock(buf);
+
+		pthread_mutex_lock(&recorder->lock);
+		recorder->sealed--;
+		pthread_cond_broadcast(&recorder->free_cond);
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Record an event
+ *
+ * @param	session	Session ID
+ * @param	type	RECORD_OPEN, RECORD_INPUT...
+ * @param	data	Event data
+ * @param	len		Event data length
+ */
+void recordEvent(uint64_t session, uint8_t type, const void *data,
+		uint32_t len) {
+	record_event_hdr_t hdr;
+	record_buf_t *buf;
+
+	if (recorder == NULL) {
+		return;
+	}
+	if (len > RECORD_BLOCK_SIZE - sizeof(hdr)) {
+		len = RECORD_BLOCK_SIZE - sizeof(hdr);
+	}
+
+	hdr.session = session;
+	hdr.len = len;
+	hdr.type = type;
+
+	pthread_mutex_lock(&recorder->lock);
+	buf = &recorder->bufs[recorder->fill];
+	if (buf->len + sizeof(hdr) + len > RECORD_BLOCK_SIZE) {
+		sealBlock();
+		buf = &recorder->bufs[recorder->fill];
+	}
+
+	// Stamp under the lock, so the events of a block are in time order
+	hdr.ts = wallUs();
+	memcpy(&buf->data[buf->len], &hdr, sizeof(hdr));
+	if (len > 0) {
+		memcpy(&buf->data[buf->len + sizeof(hdr)], data, len);
+	}
+	buf->len += sizeof(hdr) + len;
+
+	if (buf->idx.events++ == 0) {
+		buf->idx.first_ts = hdr.ts;
+	}
+	buf->idx.last_ts = hdr.ts;
+	if (type == RECORD_OPEN) {
+		buf->idx.opens++;
+	}
+	recordBloomAdd(buf->idx.bloom, session);
+	recorder->events++;
+	pthread_mutex_unlock(&recorder->lock);
+}
+
+
+/**
+ * @brief Log the recorder counters
+ */
+void logRecorderStats() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	uint64_t raw, stored;
+
+	if (recorder == NULL) {
+		return;
+	}
+
+	raw = __atomic_load_n(&recorder->raw_bytes, __ATOMIC_RELAXED);
+	stored = __atomic_load_n(&recorder->stored_bytes, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&recorder->lock);
+	fprintf(stderr, "%s yashd[daemon]: INFO: Recorder: events: %lu, blocks: "
+			"%lu, recorded bytes: %lu, stored bytes: %lu (%lu%%), waits: %lu, "
+			"lost blocks: %lu\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), recorder->events,
+			__atomic_load_n(&recorder->blocks, __ATOMIC_RELAXED), raw, stored,
+			raw ? stored * 100 / raw : 0, recorder->waits,
+			__atomic_load_n(&recorder->lost, __ATOMIC_RELAXED));
+	pthread_mutex_unlock(&recorder->lock);
+}
+
+
+/**
+ * @brief Start recording a session
+ *
+ * From here on, the session writes its output to a socket pair that the
+ * servant thread relays to the client with relaySessionOutput(). Capturing
+ * leaves the output alone.
+ *
+ * @param	shell_info	Shell info of the session
+ * @return	0 on success (or if not recording), or -1 on error
+ */
+int startSessionRecording(shell_info_t *shell_info) {
+	char addr[INET_ADDRSTRLEN + 8];
+	int sp[2];
+	int n;
+
+	shell_info->rec_fd = -1;
+	shell_info->session_id = 0;
+	if (recorder == NULL) {
+		return 0;
+	}
+
+	if (!args.capture) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sp) < 0) {
+			return -1;
+		}
+		shell_info->rec_fd = sp[0];
+		shell_info->rec_sock = shell_info->th_args.ps;
+		shell_info->th_args.ps = sp[1];
+		shell_info->host.fd = sp[1];
+	}
+	shell_info->session_id = ((uint64_t) getpid() << 32) |
+			__atomic_add_fetch(&recorder->sessions, 1, __ATOMIC_RELAXED);
+
+	inet_ntop(AF_INET, &shell_info->th_args.from.sin_addr, addr, sizeof(addr));
+	n = strlen(addr);
+	n += snprintf(&addr[n], sizeof(addr) - n, ":%d",
+			ntohs(shell_info->th_args.from.sin_port));
+	recordEvent(shell_info->session_id, RECORD_OPEN, addr, n);
+
+	return 0;
+}
+
+
+/**
+ * @brief Relay the output waiting on a recorded session's socket pair to the
+ * client, recording it
+ *
+ * @param	shell_info	Shell info of the session
+ * @return	Bytes relayed, 0 if there was nothing to relay, or -1 if the
+ * 			client is gone
+ */
+int relaySessionOutput(shell_info_t *shell_info) {
+	char buf[RECORD_RELAY_LEN];
+	ssize_t n;
+
+	if ((n = recv(shell_info->rec_fd, buf, getConfig()->relay_len,
+			MSG_DONTWAIT)) <= 0) {
+		return (n < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+	}
+	recordEvent(shell_info->session_id, RECORD_OUTPUT, buf, n);
+	if (sendAll(shell_info->rec_sock, buf, n) < 0) {
+		return -1;
+	}
+
+	return n;
+}
+
+
+/**
+ * @brief Record a message received from a session's client
+ *
+ * @param	shell_info	Shell info of the session
+ * @param	msg			Message
+ * @param	len			Message length
+ */
+void recordSessionInput(shell_info_t *shell_info, const char *msg, int len) {
+	if (shell_info->session_id != 0) {
+		recordEvent(shell_info->session_id, RECORD_INPUT, msg, len);
+	}
+}
+
+
+/**
+ * @brief Stop recording a session
+ *
+ * The output still waiting on the socket pair is relayed, and the session
+ * writes to the client socket directly again. Call it once the session's jobs
+ * are gone, or when nothing else writes to the session (e.g. before switching
+ * the connection to frames).
+ *
+ * @param	shell_info	Shell info of the session
+ */
+void stopSessionRecording(shell_info_t *shell_info) {
+	if (shell_info->session_id == 0) {
+		return;
+	}
+
+	if (shell_info->rec_fd >= 0) {
+		close(shell_info->th_args.ps);
+		shell_info->th_args.ps = shell_info->rec_sock;
+		shell_info->host.fd = shell_info->rec_sock;
+		while (relaySessionOutput(shell_info) > 0);
+	}
+
+	recordEvent(shell_info->session_id, RECORD_CLOSE, NULL, 0);
+	shell_info->session_id = 0;
+	if (shell_info->rec_fd >= 0) {
+		close(shell_info->rec_fd);
+		shell_info->rec_fd = -1;
+	}
+}
@@ -0,0 +1,244 @@
+/**
+ * @file  registry.c
+ *
+ * @brief Peer registry and load-aware redirection of the yash shell daemon
+ *
+ * The daemons on a host publish their load in a registry kept in shared
+ * memory. Each daemon process claims a slot, and a registry thread refreshes
+ * its session count and load every `registry_heartbeat` seconds. Slots that stop
+ * being refreshed (e.g. the daemon was killed) are ignored, and reclaimed by
+ * the next daemon that needs a slot. The registry is private to the user the
+ * daemons run as: a registry of another user is refused.
+ *
+ * When a shard is loaded past the redirect threshold, new clients get a
+ * `REDIRECT host:port` line naming the least loaded peer instead of the prompt,
+ * and the client reconnects there. The host is the address the client reached
+ * this daemon on, since the peers in the registry run on the same host.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+// Globals
+static registry_slot_t *registry = NULL;	//! Registry (shared memory)
+static registry_slot_t *registry_slot = NULL;	//! This process' slot
+
+
+/**
+ * @brief Open the registry, claim a slot, and start the registry thread
+ *
+ * @return	0 on success, or -1 on error
+ */
+int startRegistry() {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	pthread_attr_t attr;
+	pthread_t th;
+	char name[64];
+	struct stat st;
+	pid_t pid = getpid();
+	time_t now = time(NULL);
+	int fd;
+
+	snprintf(name, sizeof(name), REGISTRY_NAME, (unsigned int) geteuid());
+	if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0) {
+		perror("ERROR: Opening peer registry");
+		return -1;
+	}
+	// Peers trust each other's slots, so only share them with our own user
+	if (fstat(fd, &st) < 0 || st.st_uid != geteuid() ||
+			(st.st_mode & 0777) != 0600) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Peer registry %s is not "
+				"owned by this user with mode 0600\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), name);
+		close(fd);
+		return -1;
+	}
+	if (ftruncate(fd, REGISTRY_SLOTS * sizeof(registry_slot_t)) < 0) {
+		perror("ERROR: Sizing peer registry");
+		close(fd);
+		return -1;
+	}
+	registry = mmap(NULL, REGISTRY_SLOTS * sizeof(registry_slot_t),
+			PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (registry == MAP_FAILED) {
+		perror("ERROR: Mapping peer registry");
+		registry = NULL;
+		return -1;
+	}
+
+	// Claim a free slot, or the slot of a daemon that is gone
+	for (int i=0; i<REGISTRY_SLOTS && registry_slot == NULL; i++) {
+		pid_t owner = __atomic_load_n(&registry[i].pid, __ATOMIC_ACQUIRE);
+
+		if (owner != 0 && (now - registry[i].heartbeat <= getConfig()->registry_stale ||
+				kill(owner, 0) == 0 || errno != ESRCH)) {
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&registry[i].pid, &owner, pid, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			registry_slot = &registry[i];
+		}
+	}
+	if (registry_slot == NULL) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Peer registry is full\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+		return -1;
+	}
+	registry_slot->port = args.port;
+	updateRegistry();
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&th, &attr, registryThread, NULL) != 0) {
+		perror("ERROR: Creating registry thread");
+		pthread_attr_destroy(&attr);
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Joined peer registry, slot %d\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			(int) (registry_slot - registry));
+
+	return 0;
+}
+
+
+/**
+ * @brief Publish this process' session count and load
+ */
+void updateRegistry() {
+	uint32_t sessions = 0;
+	uint32_t capacity = 0;
+
+	for (int i=0; i<shard_count; i++) {
+		sessions += countServantThreads(&shards[i]);
+	}
+	capacity = shardMaxClients() * shard_count;
+
+	__atomic_store_n(&registry_slot->sessions, sessions, __ATOMIC_RELAXED);
+	__atomic_store_n(&registry_slot->load,
+			capacity ? sessions * 100 / capacity : 100, __ATOMIC_RELAXED);
+	__atomic_store_n(&registry_slot->heartbeat, time(NULL), __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief Thread function to keep this process' registry slot up to date
+ *
+ * @param	thread_args	Unused
+ */
+void *registryThread(void *thread_args) {
+	for (;;) {
+		sleep(getConfig()->registry_heartbeat);
+		updateRegistry();
+	}
+
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Pick the least loaded peer, if it is less loaded than this shard
+ *
+ * Peers on this daemon's own port (e.g. other prefork workers) are skipped,
+ * since redirecting there would land on the same listener.
+ *
+ * @param	load	Load of the redirecting shard (percent)
+ * @return	Port of the peer, or -1 if there is no better peer
+ */
+int pickPeer(uint32_t load) {
+	time_t now = time(NULL);
+	uint32_t best_load = load;
+	int best = -1;
+
+	for (int i=0; i<REGISTRY_SLOTS; i++) {
+		registry_slot_t *slot = &registry[i];
+		pid_t owner = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+		time_t heartbeat = __atomic_load_n(&slot->heartbeat, __ATOMIC_ACQUIRE);
+		uint32_t peer_load = __atomic_load_n(&slot->load, __ATOMIC_RELAXED);
+
+		if (owner == 0 || slot == registry_slot || slot->port == args.port ||
+				now - heartbeat > getConfig()->registry_stale) {
+			continue;
+		}
+		if (peer_load < best_load && peer_load < (uint32_t) args.redirect) {
+			best_load = peer_load;
+			best = slot->port;
+		}
+	}
+
+	return best;
+}
+
+
+/**
+ * @brief Pick the peer to redirect a new session to, if this shard is loaded
+ * past the redirect threshold
+ *
+ * Called with the shard's thread table lock held, so the session count is
+ * consistent with the slot the session would take. Nothing is sent here.
+ *
+ * @param	ps		Client socket
+ * @param	active	Active sessions on the shard
+ * @return	Port of the peer, or -1 if the session must be served here
+ */
+int pickRedirect(int ps, int active) {
+	struct sockaddr_in local;
+	socklen_t len = sizeof(local);
+	uint32_t load;
+
+	if (args.redirect <= 0 || registry == NULL) {
+		return -1;
+	}
+
+	load = (uint32_t) active * 100 / shardMaxClients();
+
+	// Streams of a multiplexed connection are not redirected
+	if (getsockname(ps, (struct sockaddr *) &local, &len) < 0 ||
+			local.sin_family != AF_INET) {
+		return -1;
+	}
+	if (load < (uint32_t) args.redirect) {
+		return -1;
+	}
+
+	return pickPeer(load);
+}
+
+
+/**
+ * @brief Redirect a new session to a peer, and close its socket
+ *
+ * The line is sent without blocking, like a busy line: a client that does not
+ * read it just sees the connection close.
+ *
+ * @param	shard	Shard that accepted the session
+ * @param	ps		Client socket
+ * @param	port	Port of the peer, from pickRedirect()
+ */
+void redirectSession(shard_t *shard, int ps, int port) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char msg[MAX_HOSTNAME_LEN];
+	struct sockaddr_in local;
+	socklen_t len = sizeof(local);
+	int n;
+
+	if (getsockname(ps, (struct sockaddr *) &local, &len) == 0) {
+		n = snprintf(msg, sizeof(msg), "%s%s:%d\n", MSG_TYPE_REDIRECT,
+				inet_ntoa(local.sin_addr), port);
+		send(ps, msg, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	close(ps);
+	__atomic_fetch_add(&shard->redirected, 1, __ATOMIC_RELAXED);
+
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Shard %d past its redirect "
+				"threshold, redirected client to port %d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), shard->id, port);
+	}
+}
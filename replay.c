@@ -0,0 +1,339 @@
+/**
+ * @file  replay.c
+ *
+ * @brief Replay tool for yashd session transcripts
+ *
+ * Reads the segments a daemon wrote with `--record DIR` (see record.h). Only
+ * the index files are scanned: a block is read and decompressed only if its
+ * time range and session bloom filter match, so finding one session among
+ * days of recordings reads a handful of blocks.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "replay.h"
+
+
+// Globals
+static cmd_args_t args;
+static replay_stats_t stats;
+static char segments[MAX_SEGMENTS][RECORD_NAME_LEN];	//! Segment names, sorted
+
+
+// Functions
+
+
+/**
+ * @brief Check if a string contains only number characters
+ *
+ * @param	number	String to check
+ * @return	True if the string contains only numbers, false otherwise
+ */
+bool isNumber(char number[]) {
+	int i = 0;
+
+	// Checking for negative numbers
+	if (number[0] == '-')
+		i = 1;
+	for (; number[i] != 0; i++) {
+		if (!isdigit(number[i]))
+			return false;
+	}
+	return true;
+}
+
+
+/**
+ * @brief Parse the command line arguments
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Struct with the parsed arguments
+ */
+cmd_args_t parseArgs(int argc, char** argv) {
+	const char USAGE[] = "\nUsage:\n"
+				"./yashd-replay [options] DIR\n"
+				"\n"
+				"Options:\n"
+				"    -f SEC, --from SEC      Skip events before SEC (seconds "
+				"since the epoch)\n"
+				"    -h, --help              Print help and exit\n"
+				"    -l, --list              List the recorded sessions\n"
+				"    -s ID, --session ID     Print the transcript of session ID\n"
+				"    -t SEC, --to SEC        Skip events after SEC (seconds since "
+				"the epoch)\n"
+				"    -v, --verbose           Log session boundaries and blocks "
+				"read\n";
+		const char ARG_ERROR[MAX_ERROR_LEN] = "-yashd-replay: unknown argument: "
+				"%s\n";
+		const char DIR_ERROR[MAX_ERROR_LEN] = "-yashd-replay: missing recordings "
+				"directory\n";
+		const char MODE_ERROR[MAX_ERROR_LEN] = "-yashd-replay: use either "
+				"--list or --session\n";
+		const char H_FLAG_SHORT[3] = "-h\0";
+		const char H_FLAG_LONG[10] = "--help\0";
+		const char V_FLAG_SHORT[3] = "-v\0";
+		const char V_FLAG_LONG[10] = "--verbose\0";
+		const char L_FLAG_SHORT[3] = "-l\0";
+		const char L_FLAG_LONG[10] = "--list\0";
+		const char S_FLAG_SHORT[3] = "-s\0";
+		const char S_FLAG_LONG[11] = "--session\0";
+		const char S_ERROR[MAX_ERROR_LEN] = "-yashd-replay: session must be a "
+				"hexadecimal ID, as listed by --list\n";
+		const char F_FLAG_SHORT[3] = "-f\0";
+		const char F_FLAG_LONG[10] = "--from\0";
+		const char T_FLAG_SHORT[3] = "-t\0";
+		const char T_FLAG_LONG[10] = "--to\0";
+		const char FT_ERROR[MAX_ERROR_LEN] = "-yashd-replay: time must be a "
+				"positive integer\n";
+		cmd_args_t args = {false, false, 0, 0, UINT64_MAX, EMPTY_STR};
+		bool session = false;
+		char *end;
+
+	// Loop over the arguments, skipping the command token
+	for (int i=1; i<argc; i++) {
+		if (!strcmp(H_FLAG_SHORT, argv[i])
+				|| !strcmp(H_FLAG_LONG, argv[i])) {
+			printf(USAGE);
+			exit(EXIT_OK);
+		} else if (!strcmp(V_FLAG_SHORT, argv[i])
+				|| !strcmp(V_FLAG_LONG, argv[i])) {
+			args.verbose = true;
+		} else if (!strcmp(L_FLAG_SHORT, argv[i])
+				|| !strcmp(L_FLAG_LONG, argv[i])) {
+			args.list = true;
+		} else if (!strcmp(S_FLAG_SHORT, argv[i])
+				|| !strcmp(S_FLAG_LONG, argv[i])) {
+			// Session argument detected, next argument should be the ID
+			if (i+1 >= argc || argv[i+1][0] == '\0') {
+				printf(S_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			i++;
+			args.session = strtoull(argv[i], &end, 16);
+			if (*end != '\0') {
+				printf(S_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			session = true;
+		} else if (!strcmp(F_FLAG_SHORT, argv[i])
+				|| !strcmp(F_FLAG_LONG, argv[i])
+				|| !strcmp(T_FLAG_SHORT, argv[i])
+				|| !strcmp(T_FLAG_LONG, argv[i])) {
+			// Time argument detected, next argument should be the seconds
+			if (i+1 >= argc || !isNumber(argv[i+1]) || argv[i+1][0] == '-') {
+				printf(FT_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			if (!strcmp(F_FLAG_SHORT, argv[i])
+					|| !strcmp(F_FLAG_LONG, argv[i])) {
+				args.from = strtoull(argv[i+1], NULL, 10) * 1000000;
+			} else {
+				args.to = strtoull(argv[i+1], NULL, 10) * 1000000 + 999999;
+			}
+			i++;
+		} else if (argv[i][0] != '-' && args.dir[0] == '\0' &&
+				strlen(argv[i]) <= PATHMAX) {
+			strcpy(args.dir, argv[i]);
+		} else {
+			printf(ARG_ERROR, argv[i]);
+			printf(USAGE);
+			exit(EXIT_ERR_ARG);
+		}
+	}
+
+	if (args.dir[0] == '\0') {
+		printf(DIR_ERROR);
+		printf(USAGE);
+		exit(EXIT_ERR_ARG);
+	}
+	if (args.list == session) {
+		printf(MODE_ERROR);
+		printf(USAGE);
+		exit(EXIT_ERR_ARG);
+	}
+
+	return args;
+}
+
+
+/**
+ * @brief Check whether a block may hold events the replay wants
+ *
+ * @param	idx	Index entry of the block
+ * @return	True if the block must be read
+ */
+bool wantBlock(const record_idx_t *idx) {
+	if (idx->last_ts < args.from || idx->first_ts > args.to) {
+		return false;
+	}
+	if (args.list) {
+		return idx->opens > 0;
+	}
+	return recordBloomTest(idx->bloom, args.session);
+}
+
+
+/**
+ * @brief Print an event of the session being replayed
+ *
+ * The transcript reads like the client's terminal: output as sent, commands
+ * after the prompt, and control messages as the keys that sent them.
+ *
+ * @param	hdr		Event header
+ * @param	data	Event data
+ */
+void printEvent(const record_event_hdr_t *hdr, const char *data) {
+	time_t secs = (time_t) (hdr->ts / 1000000);
+	char buf_time[32];
+	struct tm tm;
+
+	localtime_r(&secs, &tm);
+	strftime(buf_time, sizeof(buf_time), "%Y-%m-%d %H:%M:%S", &tm);
+
+	switch (hdr->type) {
+	case RECORD_OPEN:
+		if (args.list) {
+			printf("%016lx  %s  %.*s\n", hdr->session, buf_time,
+					(int) hdr->len, data);
+		} else if (args.verbose) {
+			fprintf(stderr, "-yashd-replay: session %016lx opened at %s by "
+					"%.*s\n", hdr->session, buf_time, (int) hdr->len, data);
+		}
+		break;
+	case RECORD_CLOSE:
+		if (args.verbose && !args.list) {
+			fprintf(stderr, "-yashd-replay: session %016lx closed at %s\n",
+					hdr->session, buf_time);
+		}
+		break;
+	case RECORD_INPUT:
+		if (args.list) {
+			break;
+		}
+		if (hdr->len > 4 && !strncmp(data, "CMD ", 4)) {
+			fwrite(&data[4], 1, hdr->len - 4, stdout);
+		} else if (hdr->len >= 5 && !strncmp(data, "CTL ", 4)) {
+			printf("^%c\n", toupper(data[4]));
+		} else {
+			fwrite(data, 1, hdr->len, stdout);
+		}
+		break;
+	case RECORD_OUTPUT:
+		if (!args.list) {
+			fwrite(data, 1, hdr->len, stdout);
+		}
+		break;
+	}
+
+	stats.events++;
+}
+
+
+/**
+ * @brief Print the wanted events of a decompressed block
+ *
+ * @param	raw	Block
+ * @param	len	Block length
+ */
+void replayBlock(const uint8_t *raw, int len) {
+	record_event_hdr_t hdr;
+	int pos = 0;
+
+	while (len - pos >= (int) sizeof(hdr)) {
+		memcpy(&hdr, &raw[pos], sizeof(hdr));
+		pos += sizeof(hdr);
+		if (hdr.len > (uint32_t) (len - pos)) {
+			stats.corrupt++;
+			return;
+		}
+
+		if ((args.list || hdr.session == args.session) &&
+				hdr.ts >= args.from && hdr.ts <= args.to) {
+			printEvent(&hdr, (const char *) &raw[pos]);
+		}
+		pos += hdr.len;
+	}
+}
+
+
+/**
+ * @brief Replay the wanted blocks of a segment
+ *
+ * @param	name	Segment name, without suffix
+ */
+void replaySegment(const char *name) {
+	static uint8_t raw[RECORD_BLOCK_SIZE];
+	static uint8_t comp[RECORD_BLOCK_SIZE];
+	char path[PATHMAX + RECORD_NAME_LEN + 2];
+	record_idx_t idx;
+	FILE *idx_file;
+	int seg_fd;
+	int len;
+
+	snprintf(path, sizeof(path), "%s/%s%s", args.dir, name, RECORD_IDX_SUFFIX);
+	if ((idx_file = fopen(path, "r")) == NULL) {
+		perror(path);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/%s%s", args.dir, name, RECORD_SEG_SUFFIX);
+	if ((seg_fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		fclose(idx_file);
+		return;
+	}
+
+	while (fread(&idx, sizeof(idx), 1, idx_file) == 1) {
+		stats.blocks++;
+		if (!wantBlock(&idx)) {
+			continue;
+		}
+
+		stats.read++;
+		if ((len = recordReadBlock(seg_fd, idx.offset, raw, comp)) < 0) {
+			stats.corrupt++;
+			continue;
+		}
+		replayBlock(raw, len);
+	}
+
+	close(seg_fd);
+	fclose(idx_file);
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Error code
+ */
+int main(int argc, char **argv) {
+	int count;
+
+	args = parseArgs(argc, argv);
+
+	if ((count = recordListSegments(args.dir, segments,
+			MAX_SEGMENTS)) < 0) {
+		perror(args.dir);
+		exit(EXIT_ERR);
+	}
+
+	for (int i=0; i<count; i++) {
+		replaySegment(segments[i]);
+	}
+	fflush(stdout);
+
+	if (args.verbose) {
+		fprintf(stderr, "-yashd-replay: segments: %d, blocks: %lu, read: %lu, "
+				"events: %lu, corrupt: %lu\n", count, stats.blocks, stats.read,
+				stats.events, stats.corrupt);
+	}
+
+	exit(stats.corrupt ? EXIT_ERR : EXIT_OK);
+}
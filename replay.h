@@ -0,0 +1,76 @@
+/**
+ * @file  replay.h
+ *
+ * @brief Replay tool for yashd session transcripts
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef REPLAY_H_
+#define REPLAY_H_
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include "yashd_defs.h"
+#include "record.h"
+#include "lz.h"
+
+#define PATHMAX 255			//! Max length of a path
+#define MAX_SEGMENTS 4096	//! Max number of segments read
+
+
+/**
+ * \brief Struct to organize all the command line arguments.
+ *
+ * Arguments:
+ *   - verbose: log session boundaries and blocks read to stderr
+ *   - list: list the sessions instead of printing a transcript
+ *   - session: session to print the transcript of
+ *   - from: skip events before this time (seconds since the epoch)
+ *   - to: skip events after this time (seconds since the epoch)
+ *   - dir: directory of the recordings
+ */
+typedef struct _cmd_args_t {
+	bool verbose;			// Log session boundaries and blocks read
+	bool list;				// List sessions
+	uint64_t session;		// Session to print
+	uint64_t from;			// Start of the time filter (us)
+	uint64_t to;			// End of the time filter (us)
+	char dir[PATHMAX+1];	// Recordings directory
+} cmd_args_t;
+
+
+/**
+ * \brief Struct for the counters of a replay
+ */
+typedef struct _replay_stats_t {
+	uint64_t blocks;	// Blocks in the index files
+	uint64_t read;		// Blocks read and decompressed
+	uint64_t events;	// Events printed
+	uint64_t corrupt;	// Blocks that could not be read
+} replay_stats_t;
+
+
+// Functions
+bool isNumber(char number[]);
+cmd_args_t parseArgs(int argc, char** argv);
+bool wantBlock(const record_idx_t *idx);
+void printEvent(const record_event_hdr_t *hdr, const char *data);
+void replayBlock(const uint8_t *raw, int len);
+void replaySegment(const char *name);
+int main(int argc, char **argv);
+
+
+#endif /* REPLAY_H_ */
@@ -0,0 +1,696 @@
+/**
+ * @file  shard.c
+ *
+ * @brief Shared-nothing shards of the yash shell daemon
+ *
+ * The daemon can run one shard per CPU. Each shard owns its listener socket,
+ * acceptor loop, servant thread table and counters, and it is pinned to its
+ * CPU so the servant threads, job threads and children it spawns stay there
+ * too. Shards never touch each other's state. Cross-shard operations are
+ * posted as messages to the shard's message queue (a pipe), which the shard
+ * polls together with its listener.
+ *
+ * Each shard also keeps the idle timers of its sessions on a timer wheel (see
+ * wheel.c), and its acceptor loop sleeps until the next timer is due. Client
+ * messages and session output only stamp the session's last activity, without
+ * touching the wheel. When a timer expires, a session that was active since
+ * gets its timer re-armed from its last activity, and one silent for
+ * `idle_timeout` seconds, with no jobs, has its socket shut down: its servant
+ * thread sees the hang up and cleans up as if the client had left. Dead peers
+ * that never send a FIN are found by TCP keepalive (`keepalive`).
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include <stddef.h>
+#include <dirent.h>
+
+
+// Globals
+shard_t *shards = NULL;	//! Shards table
+int shard_count = 0;	//! Number of shards in the table
+
+
+/**
+ * @brief Handler for SIGUSR1 signal
+ *
+ * Ask every shard to log its thread table and counters. Only write() is used
+ * to post the messages, so this is async-signal-safe.
+ *
+ * @param	sig	Signal
+ */
+void sigUsr1(int sig) {
+	broadcastShardMsg(SHARD_MSG_STATS, 0);
+}
+
+
+/**
+ * @brief Handler for SIGHUP signal
+ *
+ * Ask the first shard to reload the config, so reloads never run
+ * concurrently.
+ *
+ * @param	sig	Signal
+ */
+void sigHup(int sig) {
+	postShardMsg(&shards[0], SHARD_MSG_RELOAD, 0);
+}
+
+
+/**
+ * @brief Post a message to a shard's message queue
+ *
+ * Messages are smaller than PIPE_BUF, so the write is atomic and several
+ * threads can post to the same shard concurrently. The write never blocks,
+ * since posters may hold the shard's thread table lock, or run in a signal
+ * handler. A WAKE that finds the queue full is dropped, since the shard has
+ * messages to wake up for anyway.
+ *
+ * @param	shard	Target shard
+ * @param	type	Message type (SHARD_MSG_*)
+ * @param	arg		Message argument
+ */
+void postShardMsg(shard_t *shard, uint32_t type, uint32_t arg) {
+	shard_msg_t msg = {type, arg};
+
+	if (write(shard->mq_fd[1], &msg, sizeof(msg)) != sizeof(msg) &&
+			!(errno == EAGAIN && type == SHARD_MSG_WAKE)) {
+		perror("ERROR: Posting shard message");
+	}
+}
+
+
+/**
+ * @brief Post a message to the message queue of every shard
+ *
+ * @param	type	Message type (SHARD_MSG_*)
+ * @param	arg		Message argument
+ */
+void broadcastShardMsg(uint32_t type, uint32_t arg) {
+	for (int i=0; i<shard_count; i++) {
+		postShardMsg(&shards[i], type, arg);
+	}
+}
+
+
+/**
+ * @brief Handle a message received on the shard's message queue
+ *
+ * @param	shard	Shard receiving the message
+ * @param	msg		Message
+ * @return	False if the shard should stop, true otherwise
+ */
+bool handleShardMsg(shard_t *shard, shard_msg_t *msg) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char name[64];
+	hist_t latency;
+
+	switch (msg->type) {
+	case SHARD_MSG_STATS:
+		fprintf(stderr, "%s yashd[daemon]: INFO: Shard %d (CPU %d): sessions: "
+				"%lu, rejected: %lu, redirected: %lu, reaped idle: %lu, "
+				"compressed output: %lu -> %lu bytes, commands: %lu, NUMA "
+				"local jobs: %lu, NUMA remote jobs: %lu\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), shard->id, shard->cpu,
+				__atomic_load_n(&shard->sessions, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->rejected, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->redirected, __ATOMIC_RELAXED),
+				shard->reaped,
+				__atomic_load_n(&shard->lz_raw, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->lz_sent, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->cmds, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->numa_local, __ATOMIC_RELAXED),
+				__atomic_load_n(&shard->numa_remote, __ATOMIC_RELAXED));
+		pthread_mutex_lock(&shard->servant_th_table_lock);
+		latency = shard->ctl_latency;
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+		if (latency.count > 0) {
+			snprintf(name, sizeof(name), "Shard %d signal latency (us)",
+					shard->id);
+			histLog(name, &latency);
+		}
+		printServantThTable(shard);
+		if (shard == &shards[0]) {	// Once per process
+			logRecorderStats();
+			logAuditStats();
+			logJobRegStats();
+			logListenerStats();
+			logAdmitStats();
+		}
+		return true;
+	case SHARD_MSG_RELOAD:
+		if (reloadConfig() == 0) {
+			// Each shard applies the new backlogs to its own sockets
+			broadcastShardMsg(SHARD_MSG_RELISTEN, 0);
+		}
+		return true;
+	case SHARD_MSG_RELISTEN:
+		// The backlog of a listening socket can be changed in place. A
+		// draining shard has closed its sockets.
+		for (int j=0; j<listener_count; j++) {
+			if (shard->sd[j] >= 0) {
+				listen(shard->sd[j], getConfig()->listeners[j].backlog);
+			}
+		}
+		return true;
+	case SHARD_MSG_WAKE:
+		return true;	// The acceptor loop recomputes its timeout
+	case SHARD_MSG_STOP:
+		return false;
+	default:
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Shard %d received unknown "
+				"message: %u\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				shard->id, msg->type);
+		return true;
+	}
+}
+
+
+/**
+ * @brief Pick the CPU to pin a new session to, as per the affinity policy
+ *
+ * Policies:
+ * 	- AFFINITY_NONE: do not pin the session
+ * 	- AFFINITY_RR: next CPU, round-robin, among the CPUs the acceptor may run on
+ * 	- AFFINITY_ACCEPTOR: the CPU the acceptor is running on right now
+ *
+ * The session's job threads and child processes inherit the CPU set of the
+ * servant thread.
+ *
+ * @param	shard	Shard accepting the session
+ * @return	CPU number, or -1 to leave the session unpinned
+ */
+int pickSessionCpu(shard_t *shard) {
+	int count = CPU_COUNT(&shard->cpus);
+
+	switch (args.affinity) {
+	case AFFINITY_RR:
+		if (count <= 0) {
+			return -1;
+		}
+		for (int i=1; i<=CPU_SETSIZE; i++) {
+			int cpu = (shard->rr_cpu + i) % CPU_SETSIZE;
+			if (CPU_ISSET(cpu, &shard->cpus)) {
+				shard->rr_cpu = cpu;
+				return cpu;
+			}
+		}
+		return -1;
+	case AFFINITY_ACCEPTOR:
+		return sched_getcpu();
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * @brief Get the NUMA node of a CPU
+ *
+ * Looks for the `nodeN` link sysfs puts in the CPU's directory.
+ *
+ * @param	cpu	CPU number
+ * @return	Node number, or -1 if the CPU is -1 or its node is unknown
+ */
+int cpuNode(int cpu) {
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	int node = -1;
+
+	if (cpu < 0) {
+		return -1;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	if ((dir = opendir(path)) == NULL) {
+		return -1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		if (!strncmp(ent->d_name, "node", 4) && isdigit(ent->d_name[4])) {
+			node = atoi(&ent->d_name[4]);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+
+/**
+ * @brief Get the max number of sessions of a shard
+ *
+ * The process' limit is split evenly between its shards, rounding up.
+ *
+ * @return	Max sessions per shard
+ */
+int shardMaxClients() {
+	return (getConfig()->max_clients + shard_count - 1) / shard_count;
+}
+
+
+/**
+ * @brief Count the servant threads serving a client in the shard
+ *
+ * @param	shard	Shard owning the table
+ * @return	Number of running servant threads
+ */
+int countServantThreads(shard_t *shard) {
+	int active = 0;
+
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	for (int i=0; i<shard->servant_th_table_idx; i++) {
+		if (shard->servant_th_table[i].run) {
+			active++;
+		}
+	}
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
+
+	return active;
+}
+
+
+/**
+ * @brief Arm the idle timer of a new session
+ *
+ * Called with the shard's thread table locked.
+ *
+ * @param	shard	Shard owning the session
+ * @param	idx		Thread table index of the session
+ */
+void armIdleTimer(shard_t *shard, int idx) {
+	servant_th_info_t *entry = &shard->servant_th_table[idx];
+	uint64_t now = wheelNow();
+	int idle = getConfig()->idle_timeout;
+
+	entry->last_active = now;
+	entry->shell = NULL;
+	wheelAdd(&shard->wheel, &entry->idle_timer,
+			now + (idle > 0 ? idle : IDLE_TIMEOUT));
+
+	// The acceptor may be sleeping without a timeout
+	if (shard->wheel.count == 1) {
+		postShardMsg(shard, SHARD_MSG_WAKE, 0);
+	}
+}
+
+
+/**
+ * @brief Stamp a session's last activity
+ *
+ * Only the timestamp is written, the timer is re-armed lazily when it expires.
+ *
+ * @param	shard	Shard owning the session
+ * @param	idx		Thread table index of the session
+ */
+void touchSession(shard_t *shard, int idx) {
+	__atomic_store_n(&shard->servant_th_table[idx].last_active, wheelNow(),
+			__ATOMIC_RELAXED);
+}
+
+
+/**
+ * @brief Handle an expired idle timer: re-arm it, or close the session
+ *
+ * Called with the shard's thread table locked.
+ *
+ * @param	timer	Idle timer of a servant thread table entry
+ * @param	arg		Shard owning the table
+ */
+static void expireIdleTimer(wheel_timer_t *timer, void *arg) {
+	shard_t *shard = (shard_t *) arg;
+	servant_th_info_t *entry = (servant_th_info_t *) ((char *) timer -
+			offsetof(servant_th_info_t, idle_timer));
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	uint64_t now = wheelNow();
+	uint64_t last = __atomic_load_n(&entry->last_active, __ATOMIC_RELAXED);
+	int idle = getConfig()->idle_timeout;
+
+	if (!entry->run) {
+		return;
+	}
+
+	// Check again later, the timeout may be enabled by a reload
+	if (idle <= 0) {
+		wheelAdd(&shard->wheel, timer, now + IDLE_TIMEOUT);
+		return;
+	}
+	if (last + idle > now) {
+		wheelAdd(&shard->wheel, timer, last + idle);
+		return;
+	}
+	// A session waiting on its jobs is not idle
+	if (entry->shell != NULL &&
+			__atomic_load_n(&entry->shell->job_table_idx, __ATOMIC_RELAXED) > 0) {
+		__atomic_store_n(&entry->last_active, now, __ATOMIC_RELAXED);
+		wheelAdd(&shard->wheel, timer, now + idle);
+		return;
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Shard %d closing session %d, idle "
+			"for %lu seconds\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			shard->id, (int) (entry - shard->servant_th_table), now - last);
+	shutdown(entry->socket, SHUT_RDWR);
+	shard->reaped++;
+}
+
+
+/**
+ * @brief Close the sessions that have been idle for too long
+ *
+ * @param	shard	Shard owning the sessions
+ * @return	Milliseconds until the next idle timer is due, or -1 if there are
+ * 			no timers, for poll()
+ */
+int reapIdleSessions(shard_t *shard) {
+	uint64_t now = wheelNow();
+	int timeout;
+
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	wheelAdvance(&shard->wheel, now, expireIdleTimer, shard);
+	timeout = wheelTimeout(&shard->wheel, now);
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
+
+	return timeout;
+}
+
+
+/**
+ * @brief Stop accepting connections, and wait for the running sessions to end
+ *
+ * A stop message received while draining stops the remaining sessions.
+ *
+ * @param	shard	Shard to drain
+ */
+void drainServantThreads(shard_t *shard) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct pollfd pollfds[1];
+	shard_msg_t msg;
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Draining shard %d after %lu "
+			"sessions\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP), shard->id,
+			__atomic_load_n(&shard->sessions, __ATOMIC_RELAXED));
+
+	for (int i=0; i<listener_count; i++) {
+		close(shard->sd[i]);
+		shard->sd[i] = -1;
+	}
+	if (shard->drain_fd >= 0) {
+		notifyWorkerDraining(shard->drain_fd);
+	}
+
+	pollfds[0].fd = shard->mq_fd[0];
+	pollfds[0].events = POLLIN;
+	while (countServantThreads(shard) > 0) {
+		reapIdleSessions(shard);
+		if (poll(pollfds, 1, 1000) > 0 && (pollfds[0].revents & POLLIN)
+				&& read(shard->mq_fd[0], &msg, sizeof(msg)) == sizeof(msg)
+				&& !handleShardMsg(shard, &msg)) {
+			stopAllServantThreads(shard);
+		}
+	}
+}
+
+
+/**
+ * @brief Accept a connection from a listener, and serve it on a new servant
+ * thread
+ *
+ * Clients of Unix listeners are shown as 127.0.0.1, port 0.
+ *
+ * @param	shard	Shard accepting the connection
+ * @param	idx		Listener index
+ * @return	False if there was no connection to accept, true otherwise
+ */
+bool acceptSession(shard_t *shard, int idx) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	struct sockaddr_storage addr;
+	struct sockaddr_in from;
+	socklen_t addrlen = sizeof(addr);
+	int ps;
+
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Accepting connections on "
+				"shard %d, listener %d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP), shard->id, idx);
+	}
+
+	ps = accept4(shard->sd[idx], (struct sockaddr *) &addr, &addrlen,
+			SOCK_CLOEXEC);
+	if (ps < 0) {
+		// Another shard or process may have taken the connection
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			perror("ERROR: Accepting connection");
+		}
+		return false;
+	}
+
+	// Turn floods away before anything is allocated for them
+	if (!admitConnection(ps, &addr)) {
+		return true;
+	}
+	if (addr.ss_family == AF_INET) {
+		setKeepalive(ps);
+		setNoDelay(ps);
+	}
+
+	if (addr.ss_family == AF_INET) {
+		memcpy(&from, &addr, sizeof(from));
+	} else {
+		memset(&from, 0, sizeof(from));
+		from.sin_family = AF_INET;
+		from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+
+	// Serve the new client on a new thread
+	startServantThread(shard, ps, from, idx, false);
+
+	// Print thread table
+	if (args.verbose) {
+		printServantThTable(shard);
+	}
+
+	return true;
+}
+
+
+/**
+ * @brief Accept connections and serve them on new servant threads
+ *
+ * This is the shard's event loop. It waits on both the shard's listeners and
+ * its message queue, until the next idle timer is due, so it only wakes up
+ * when there is work to do. High
+ * priority listeners are served first, up to LISTENER_BURST connections each,
+ * then the others one connection each. If the shard has a session budget
+ * (`max_sessions`), it drains once the budget is spent instead of stopping the
+ * running sessions.
+ *
+ * @param	shard	Shard to run
+ */
+void runShard(shard_t *shard) {
+	struct pollfd pollfds[MAX_LISTENERS+1];
+	shard_msg_t msg;
+	bool run = true;
+	bool drain = false;
+
+	// Sessions are placed among the CPUs the acceptor may run on
+	CPU_ZERO(&shard->cpus);
+	pthread_getaffinity_np(pthread_self(), sizeof(shard->cpus), &shard->cpus);
+	shard->rr_cpu = -1;
+
+	pollfds[0].fd = shard->mq_fd[0];
+	pollfds[0].events = POLLIN;
+	for (int i=0; i<listener_count; i++) {
+		pollfds[i+1].fd = shard->sd[i];
+		pollfds[i+1].events = POLLIN;
+	}
+
+	while (run) {
+		if (poll(pollfds, listener_count + 1, reapIdleSessions(shard)) < 0) {
+			if (errno != EINTR) {
+				perror("ERROR: Polling shard listeners");
+			}
+			continue;
+		}
+
+		// Handle messages from other shards first, they are cheap
+		if (pollfds[0].revents & POLLIN) {
+			if (read(shard->mq_fd[0], &msg, sizeof(msg)) == sizeof(msg)) {
+				run = handleShardMsg(shard, &msg);
+			}
+		}
+
+		// Accept connections, high priority listeners first
+		for (int prio=LISTENER_HIGH; run && prio>=LISTENER_NORMAL; prio--) {
+			for (int i=0; run && i<listener_count; i++) {
+				if (getConfig()->listeners[i].priority != prio ||
+						!(pollfds[i+1].revents & POLLIN)) {
+					continue;
+				}
+				for (int n=0; n<(prio == LISTENER_HIGH ? LISTENER_BURST : 1) &&
+						acceptSession(shard, i); n++) {
+					// Check if the session budget is spent
+					if (shard->max_sessions > 0
+							&& __atomic_load_n(&shard->sessions, __ATOMIC_RELAXED)
+							>= shard->max_sessions) {
+						run = false;
+						drain = true;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	// Ensure all threads are dead on exit
+	if (drain) {
+		drainServantThreads(shard);
+	} else {
+		stopAllServantThreads(shard);
+	}
+
+	// Release resources
+	for (int i=0; i<listener_count; i++) {
+		if (shard->sd[i] >= 0) {
+			close(shard->sd[i]);
+		}
+	}
+	close(shard->mq_fd[0]);
+	close(shard->mq_fd[1]);
+	pthread_mutex_destroy(&shard->servant_th_table_lock);
+}
+
+
+/**
+ * @brief Shard thread function
+ *
+ * Pin the thread to the shard's CPU before running the shard, so every thread
+ * and child process created by the shard inherits the CPU set.
+ *
+ * @param	shard_arg	Shard to run
+ */
+void *shardThread(void *shard_arg) {
+	shard_t *shard = (shard_t *) shard_arg;
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	cpu_set_t cpus;
+
+	if (shard->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(shard->cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) {
+			fprintf(stderr, "%s yashd[daemon]: WARN: Could not pin shard %d to "
+					"CPU %d\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+					shard->id, shard->cpu);
+		}
+	}
+
+	runShard(shard);
+	pthread_exit(NULL);
+}
+
+
+/**
+ * @brief Create the shards, and start the shard threads if there is more than
+ * one
+ *
+ * Shards are pinned round-robin to the CPUs the daemon may run on (its
+ * affinity mask, e.g. from taskset or a cgroup cpuset), not to the first CPUs
+ * of the machine. A single shard is not pinned and it is meant to be run on the
+ * calling thread with runShard(). If `shards` already points to storage for the
+ * table (e.g. memory shared with a prefork master), it is used instead of
+ * allocating it.
+ *
+ * @param	count	Number of shards, or 0 for one per CPU the daemon may run on
+ * @param	sds		Listener sockets shared by all shards, or NULL to bind the
+ * 					TCP listeners once per shard
+ * @return	0 on success, -1 on error
+ */
+int initShards(int count, int *sds) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	int cpu_list[CPU_SETSIZE];
+	cpu_set_t allowed;
+	bool pin = true;
+	int cpus = 0;
+	int shared[MAX_LISTENERS];
+	int rc;
+
+	for (int i=0; i<MAX_LISTENERS; i++) {
+		shared[i] = -1;
+	}
+
+	// The CPUs the daemon may run on
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+		for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed)) {
+				cpu_list[cpus++] = cpu;
+			}
+		}
+	}
+	if (cpus < 1) {
+		// Unknown mask: one shard per online CPU, none of them pinned
+		cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = cpus < 1 ? 1 : cpus;
+		pin = false;
+	}
+	if (count <= 0) {
+		count = cpus < MAX_SHARDS ? cpus : MAX_SHARDS;
+	}
+
+	if (shards != NULL) {
+		memset(shards, 0, count * sizeof(shard_t));
+	} else if ((shards = calloc(count, sizeof(shard_t))) == NULL) {
+		perror("ERROR: Allocating shards");
+		return -1;
+	}
+
+	// Set before the listeners are created, see reusePort()
+	shard_count = count;
+	for (int i=0; i<count; i++) {
+		shards[i].id = i;
+		shards[i].cpu = (count > 1 && pin) ? cpu_list[i % cpus] : -1;
+		shards[i].wheel.now = wheelNow();
+		shards[i].drain_fd = -1;
+		if (openListeners(shards[i].sd, sds != NULL ? sds : shared,
+				sds != NULL) < 0) {
+			return -1;
+		}
+		if (pipe2(shards[i].mq_fd, O_CLOEXEC) == SYSCALL_RETURN_ERR ||
+				fcntl(shards[i].mq_fd[1], F_SETFL, O_NONBLOCK)
+				== SYSCALL_RETURN_ERR) {
+			perror("ERROR: Creating shard message queue");
+			return -1;
+		}
+		if (pthread_mutex_init(&shards[i].servant_th_table_lock, NULL) != 0) {
+			fprintf(stderr, "%s yashd[daemon]: ERROR: Mutex init has failed\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+			return -1;
+		}
+	}
+
+	if (signal(SIGUSR1, sigUsr1) == SIG_ERR) {
+		perror("ERROR: Could not set signal handler for SIGUSR1");
+	}
+	if (signal(SIGHUP, sigHup) == SIG_ERR) {
+		perror("ERROR: Could not set signal handler for SIGHUP");
+	}
+
+	if (count == 1) {
+		return 0;
+	}
+
+	for (int i=0; i<count; i++) {
+		if ((rc = pthread_create(&shards[i].tid, NULL, shardThread, &shards[i]))) {
+			fprintf(stderr, "%s yashd[daemon]: ERROR: shardThread "
+					"pthread_create failed, rc: %d\n",
+					timeStr(buf_time, BUFF_SIZE_TIMESTAMP), rc);
+			return -1;
+		}
+	}
+
+	fprintf(stderr, "%s yashd[daemon]: INFO: Running %d shards\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), count);
+
+	return 0;
+}
@@ -3,6 +3,12 @@
  *
  * @brief Main functionality of the yash shell
  *
+ * The shell engine parses commands, runs them as jobs, and reaps them. It is
+ * built into libyashshell.a, and does not depend on the daemon: its output
+ * goes to the sink of shell_info->host, and the daemon's services (audit log,
+ * job registry, config) are reached through the host's hooks. shellharness.c
+ * drives it without a socket.
+ *
  * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
  * @author: Utkarsh Vardan <uvardan@utexas.edu>
  */
@@ -14,6 +20,59 @@
 extern int errno;
 
 
+/**
+ * @brief Generate a string with the current timestamp in syslog format
+ *
+ * @param	buff	Buffer to hold the timestamp
+ * @param	size	Buffer size
+ * @return	String with current timestamp in syslog format
+ */
+char *timeStr(char *buff, int size) {
+	struct tm sTm;
+
+	time_t now = time(NULL);
+	gmtime_r(&now, &sTm);
+
+	if (!strftime(buff, size, "%b %e %H:%M:%S", &sTm)) {
+		perror("Could not format timestamp");
+		strcpy(buff, "Jan  1 00:00:00\0");
+	}
+
+	return buff;
+}
+
+
+/**
+ * @brief Send shell output to the host's sink
+ *
+ * \param	shell_info	Shell info struct pointer
+ * \param	buf			Output
+ * \param	len			Output length
+ * \return	Bytes written, or -1 on error
+ */
+ssize_t shellOut(shell_info_t *shell_info, const void *buf, size_t len) {
+	ssize_t n;
+	size_t off = 0;
+
+	if (shell_info->host.write != NULL) {
+		return shell_info->host.write(shell_info, buf, len);
+	}
+
+	while (off < len) {
+		if ((n = write(shell_info->host.fd, (const char *) buf + off,
+				len - off)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return SYSCALL_RETURN_ERR;
+		}
+		off += n;
+	}
+
+	return off;
+}
+
+
 /**
  * \brief Check for input that should be ignored.
  *
@@ -53,6 +112,9 @@ bool ignoreInput(char* input_str) {
  */
 void removeJob(int job_idx, shell_info_t *shell_info) {
 	// Clear job entries
+	if (shell_info->host.job_ended != NULL) {
+		shell_info->host.job_ended(&shell_info->job_table[job_idx]);
+	}
 	shell_info->job_table[job_idx].jobno = 0;
 	shell_info->job_table[job_idx].gpid = 0;
 	strcpy(shell_info->job_table[job_idx].status, "\0");
@@ -60,7 +122,7 @@ void removeJob(int job_idx, shell_info_t *shell_info) {
 	// Iterate over the table backwards to lower table index
 	for (int i=(shell_info->job_table_idx)-1; i>=0; i--) {
 		// Reduce the index if thread at the end of the table is done
-		if (shell_info->job_table[shell_info->job_table_idx].jobno < 1) {
+		if (shell_info->job_table[i].jobno < 1) {
 			(shell_info->job_table_idx)--;
 		} else {	// Exit when we find the last running thread
 			break;
@@ -83,30 +145,30 @@ void printJob(int job_idx, shell_info_t *shell_info) {
 	// Print the job number
 	//fprintf(stderr, "[%d]", jobs_table[job_idx].jobno);
 	sprintf(buf, "[%d]", shell_info->job_table[job_idx].jobno);
-	send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+	shellOut(shell_info, buf, strlen(buf));
 
 	// Print current job indicator
 	if ((shell_info->job_table_idx)-1 == job_idx) {
 		//fprintf(stderr, "+");
 		sprintf(buf, "+");
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+		shellOut(shell_info, buf, strlen(buf));
 	} else {
 		//fprintf(stderr, "-");
 		sprintf(buf, "-");
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+		shellOut(shell_info, buf, strlen(buf));
 	}
 
 	// Print job status
 	//fprintf(stderr, " %s", shell_info->jobs_table[job_idx].status);
 	sprintf(buf, " %s\t", shell_info->job_table[job_idx].status);
-	send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+	shellOut(shell_info, buf, strlen(buf));
 
 	// Print job command string
 	//fprintf(stderr, "\t");
 	for (int j=0; j<shell_info->job_table[job_idx].cmd_tok_len; j++) {
 		//fprintf(stderr, "%s ", shell_info->jobs_table[job_idx].cmd_tok[j]);
 		sprintf(buf, "%s ", shell_info->job_table[job_idx].cmd_tok[j]);
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+		shellOut(shell_info, buf, strlen(buf));
 	}
 	//fprintf(stderr, "\n");
 }
@@ -116,10 +178,12 @@ void printJob(int job_idx, shell_info_t *shell_info) {
  * @brief Send command to the background.
  *
  * TODO: Implement bg
+ *
+ * \param	shell_info	Shell info struct pointer
  */
-void bgExec() {
-	pthread_mutex_lock(&shell_info_lock);
-	pthread_mutex_unlock(&shell_info_lock);
+void bgExec(shell_info_t *shell_info) {
+	pthread_mutex_lock(&shell_info->lock);
+	pthread_mutex_unlock(&shell_info->lock);
 }
 
 
@@ -127,10 +191,12 @@ void bgExec() {
  * @brief Send command to the foreground.
  *
  * TODO: Implement fg
+ *
+ * \param	shell_info	Shell info struct pointer
  */
-void fgExec() {
-	pthread_mutex_lock(&shell_info_lock);
-	pthread_mutex_unlock(&shell_info_lock);
+void fgExec(shell_info_t *shell_info) {
+	pthread_mutex_lock(&shell_info->lock);
+	pthread_mutex_unlock(&shell_info->lock);
 }
 
 
@@ -143,15 +209,15 @@ void jobsExec(shell_info_t *shell_info) {
 	const char JOBS_MSG1[MAX_ERROR_LEN] = "No jobs in job table\n";
 
 	// Update the jobs table
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	maintainJobsTable(shell_info);
 
 	// Check we at least have one job in the list
 	if (shell_info->job_table_idx <= 0) {
 		// TODO: Send this output to the client
 		//fprintf(stderr, "No jobs in job table\n");
-		send(shell_info->th_args.ps, JOBS_MSG1, (size_t) strlen(JOBS_MSG1), 0);
-		pthread_mutex_unlock(&shell_info_lock);
+		shellOut(shell_info, JOBS_MSG1, strlen(JOBS_MSG1));
+		pthread_mutex_unlock(&shell_info->lock);
 		return;
 	}
 
@@ -164,7 +230,7 @@ void jobsExec(shell_info_t *shell_info) {
 			printJob(i, shell_info);
 		}
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 }
 
 
@@ -177,10 +243,10 @@ void jobsExec(shell_info_t *shell_info) {
  */
 bool runShellCmd(char* input, shell_info_t *shell_info) {
 	if (!strcmp(input, CMD_BG)) {
-		bgExec();
+		bgExec(shell_info);
 		return true;
 	} else if (!strcmp(input, CMD_FG)) {
-		fgExec();
+		fgExec(shell_info);
 		return true;
 	} else if (!strcmp(input, CMD_JOBS)) {
 		jobsExec(shell_info);
@@ -193,40 +259,65 @@ bool runShellCmd(char* input, shell_info_t *shell_info) {
 /**
  * \brief Split a command string into string tokens.
  *
- * This function assumes the `cmd.cmd_str` is not an empty string.
- *
- * This function uses strtok() to split a command string into string tokens.
+ * This function uses strtok_r() to split a command string into string tokens.
  * Tokens are considered to be contiguous characters separated by whitespace.
+ * A command with more than MAX_TOKEN_NUM-1 tokens (the last entry ends the
+ * array) sets `cmd.err_msg`, and keeps the tokens that fit.
  *
  * \param	cmd	Command struct
  *
- * \sa strtok(), Cmd
+ * \sa strtok_r(), Cmd
  */
 void tokenizeString(job_info_t* cmd) {
-	const char CMD_TOKEN_DELIM = ' ';	// From requirements
+	const char CMD_TOKEN_DELIM[2] = " \0";	// From requirements
+	const char TOKEN_ERR[MAX_ERROR_LEN] = "syntax error: too many tokens\0";
 	size_t len = 0;
+	uint32_t count = 0;
+	char *save;
 
 	// Remove final newline char and replace with NULL char
 	len = strlen(cmd->cmd_str);
-	if (cmd->cmd_str[len-1] == '\n') {
+	if (len > 0 && cmd->cmd_str[len-1] == '\n') {
 		cmd->cmd_str[len-1] = '\0';
 	}
 
-	// Break down the command into tokens using strtok
-	cmd->cmd_tok[0] = strtok(cmd->cmd_str, &CMD_TOKEN_DELIM);
-	uint32_t count = 1;	// Start at one because we already run strtok once
-
-	while ((cmd->cmd_tok[count] = strtok(NULL, &CMD_TOKEN_DELIM))) {
+	// Break down the command into tokens, strtok_r() since sessions tokenize
+	// concurrently
+	cmd->cmd_tok[0] = strtok_r(cmd->cmd_str, CMD_TOKEN_DELIM, &save);
+	while (cmd->cmd_tok[count] != NULL) {
+		if (count == MAX_TOKEN_NUM-1) {
+			cmd->cmd_tok[count] = NULL;
+			strcpy(cmd->err_msg, TOKEN_ERR);
+			break;
+		}
 		count++;
+		cmd->cmd_tok[count] = strtok_r(NULL, CMD_TOKEN_DELIM, &save);
 	}
 	cmd->cmd_tok_len = count;
 }
 
 
 /**
- * \brief Parse a command.
+ * \brief Copy a redirection file name into a job.
  *
- * This function assumes the `cmd.cmd_str` is not an empty string.
+ * \param	path	Job's redirection field, MAX_TOKEN_LEN+1 bytes
+ * \param	tok		File name token
+ * \param	cmd		Job, whose error message is set if the name is too long
+ * \return	True if the name was copied, false otherwise
+ */
+static bool setRedirection(char *path, const char *tok, job_info_t *cmd) {
+	if (strlen(tok) > MAX_TOKEN_LEN) {
+		snprintf(cmd->err_msg, MAX_ERROR_LEN, "syntax error: file name too "
+				"long: %.*s...", MAX_TOKEN_LEN, tok);
+		return false;
+	}
+	strcpy(path, tok);
+	return true;
+}
+
+
+/**
+ * \brief Parse a command.
  *
  * This function takes a raw command string, and parses it to load it into a
  * `Job` struct as per the requirements.
@@ -252,10 +343,21 @@ void parseJob(char* cmd_str, shell_info_t *shell_info) {
 	const char SYNTAX_ERR_4[MAX_ERROR_LEN] = "syntax error: & should be the last"
 			" token of the command\0";
 
+	const char LENGTH_ERR[MAX_ERROR_LEN] = "syntax error: command too long\0";
+
 	// Save and tokenize command string
+	if (strlen(cmd_str) > MAX_CMD_LEN) {
+		strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg,
+				LENGTH_ERR);
+		return;
+	}
 	strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].cmd_str,
 			cmd_str);
 	tokenizeString(&(shell_info->job_table[(shell_info->job_table_idx)-1]));
+	if (strcmp(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg,
+			EMPTY_STR)) {
+		return;
+	}
 
 	/*
 	 * Iterate over all tokens to look for arguments, redirection directives,
@@ -284,9 +386,13 @@ void parseJob(char* cmd_str, shell_info_t *shell_info) {
 			} else {	// Correct syntax
 				i++;	// Move ahead one iter to get the redir argument
 				if (!shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].in1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].in1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				} else {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].in2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].in2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				}
 			}
 		} else if (!strcmp(O_REDIR_OPT,shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i])) {	// Output redir
@@ -310,9 +416,13 @@ void parseJob(char* cmd_str, shell_info_t *shell_info) {
 			} else {	// Correct syntax
 				i++;	// Move ahead one iter to get the redir argument
 				if (!shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].out1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].out1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				} else {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].out2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].out2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				}
 			}
 		} else if (!strcmp(E_REDIR_OPT, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i])) {	// Error redir
@@ -336,9 +446,13 @@ void parseJob(char* cmd_str, shell_info_t *shell_info) {
 			} else {	// Correct syntax
 				i++;	// Move ahead one iter to get the redir argument
 				if (!shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].err1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].err1, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				} else {
-					strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].err2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i]);
+					if (!setRedirection(shell_info->job_table[(shell_info->job_table_idx)-1].err2, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i], &(shell_info->job_table[(shell_info->job_table_idx)-1]))) {
+						return;
+					}
 				}
 			}
 		} else if (!strcmp(PIPE_OPT, shell_info->job_table[(shell_info->job_table_idx)-1].cmd_tok[i])) {	// Pipe command
@@ -527,12 +641,50 @@ void redirectPipe(job_info_t* cmd) {
 
 
 /**
- * \brief Set up signal handling to relay signals to children processes.
+ * \brief Reap a process of a job, if it changed state
  *
- * This function is based on the UT Austin EE 382V Systems Programming class
- * examples posted by Dr. Ramesh Yerraballi.
+ * Job processes are only reaped here, by the thread owning the job, so their
+ * status is never lost. A process that ended is cleared from the job's `live`
+ * mask, and its CPU time is added to the job's. The status of the job is the
+ * one of its last process.
  *
- * TODO: Add support for job control.
+ * \param	job		Job
+ * \param	proc	Process: 0 for the first one, 1 for the second one of a pipe
+ * \param	options	wait4() options, besides WUNTRACED
+ * \param	status	Wait status of the process, if it changed state
+ * \return	PID if the process changed state, 0 if it did not (WNOHANG), or -1
+ * 			on error (ECHILD, and cleared from the mask, if it is gone)
+ */
+pid_t reapJobProcess(job_info_t *job, int proc, int options, int *status) {
+	pid_t pid = (proc == 0) ? job->gpid : job->last_pid;
+	bool last = (proc == 1) || !job->pipe;
+	struct rusage ru;
+	pid_t rc;
+
+	if ((rc = wait4(pid, status, options | WUNTRACED, &ru)) <= 0) {
+		if (rc < 0 && errno == ECHILD) {
+			job->live &= ~(1 << proc);
+		}
+		return rc;
+	}
+
+	if (WIFEXITED(*status) || WIFSIGNALED(*status)) {
+		job->live &= ~(1 << proc);
+		job->user_us += ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec;
+		job->sys_us += ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+		if (last) {
+			job->wait_status = *status;
+		}
+	}
+
+	return rc;
+}
+
+
+/**
+ * \brief Wait for the processes of a foreground job to end.
+ *
+ * A stopped job keeps its thread waiting.
  *
  * \param	cmd			Parsed command
  * \param	shell_info	Shell info struct pointer
@@ -544,7 +696,6 @@ void waitForChildren(job_info_t* cmd, shell_info_t *shell_info) {
 	char errno_str[sizeof(int)*8+1];
 
 	int status;
-	uint8_t count = 0;
 	int child_num;
 
 	// Determine the number of child processes
@@ -554,56 +705,57 @@ void waitForChildren(job_info_t* cmd, shell_info_t *shell_info) {
 		child_num = CHILD_COUNT_SIMPLE;
 	}
 
-	// Wait for child to exit
-	while (count < child_num) {
-		/**
-		 * TODO: Fix EINTR (4) error
-		 *
-		 * This snippet always throws the EINTR (4) error code. The
-		 * documentation for waitpid (3) says EINTR means: "WNOHANG was not set
-		 * and an unblocked signal or a SIGCHLD was caught; see signal(7)."
-		 *
-		 * TODO: Fix WCONTINUED compilation error
-		 *
-		 * See this for error description: https://stackoverflow.com/questions/
-		 * 60101242/compiler-error-using-wcontinued-option-for-waitpid
-		 */
-		//if (waitpid(-1, &status, WUNTRACED|WCONTINUED) == SYSCALL_RETURN_ERR) {
-		if (waitpid(shell_info->job_table[(shell_info->job_table_idx)-1].gpid, &status, WUNTRACED) == SYSCALL_RETURN_ERR) {
-			sprintf(errno_str, "%d", errno);
-			strcpy(cmd->err_msg, SIG_ERR_1);
-			strcat(cmd->err_msg, errno_str);
-			strcat(cmd->err_msg, SIG_ERR_2);
-			return;
+	// Wait for each child to exit
+	for (int i=0; i<child_num; i++) {
+		while (cmd->live & (1 << i)) {
+			if (reapJobProcess(cmd, i, 0, &status) == SYSCALL_RETURN_ERR &&
+					errno != EINTR && errno != ECHILD) {
+				sprintf(errno_str, "%d", errno);
+				strcpy(cmd->err_msg, SIG_ERR_1);
+				strcat(cmd->err_msg, errno_str);
+				strcat(cmd->err_msg, SIG_ERR_2);
+				return;
+			}
 		}
+	}
+}
 
-		if (WIFEXITED(status)) {
-			/*
-			if (args->cmd_args.verbose) {
-				printf("-yash: child process terminated normally\n");
-			}
-			*/
-			count++;
-		} else if (WIFSIGNALED(status)) {
-			/*
-			printf("\n");	// Ensure there is an space after "^C"
-			if (args->cmd_args.verbose) {
-				printf("-yash: child process terminated by a signal\n");
-			}
-			*/
-			count++;
-		} else if (WIFSTOPPED(status)) {
-			/*
-			printf("\n");	// Ensure there is an space after "^Z"
-			if (args->cmd_args.verbose) {
-				printf("-yash: child process stopped by a signal\n");
-			}
-			*/
-			//
-		} /*else if (WIFCONTINUED(status)) {
-			//
-		}*/
+
+/**
+ * \brief Send the status of a job that ended, if the client asked for it
+ *
+ * Clients that have the PROTO_FEAT_EXIT feature get a line after each job:
+ *
+ * 	EXIT jobno exit|signal|unknown code wall_us user_us sys_us
+ *
+ * With the exit code or the signal that ended the last process of the job,
+ * the time since it started, and the CPU time of all its processes.
+ *
+ * \param	job			Job, with all its processes reaped
+ * \param	shell_info	Shell info struct pointer
+ */
+void sendJobExit(job_info_t *job, shell_info_t *shell_info) {
+	char msg[EXIT_LINE_LEN];
+	const char *how = "unknown";
+	int code = 0;
+	int n;
+
+	if (!(shell_info->features & PROTO_FEAT_EXIT)) {
+		return;
 	}
+
+	if (job->wait_status >= 0 && WIFEXITED(job->wait_status)) {
+		how = "exit";
+		code = WEXITSTATUS(job->wait_status);
+	} else if (job->wait_status >= 0 && WIFSIGNALED(job->wait_status)) {
+		how = "signal";
+		code = WTERMSIG(job->wait_status);
+	}
+
+	n = snprintf(msg, sizeof(msg), "%s%d %s %d %lu %lu %lu\n", MSG_TYPE_EXIT,
+			job->jobno, how, code, nowUs() - job->start_us, job->user_us,
+			job->sys_us);
+	shellOut(shell_info, msg, n);
 }
 
 
@@ -632,20 +784,32 @@ void runJob(shell_info_t *shell_info) {
 	int pfd[2];
 	//int stdout_fd;	// Not needed since stdin/out will be the socket
 
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	if (shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
 		//stdout_fd = dup(STDOUT_FILENO);	// Save stdout
 
-		if (pipe(pfd) == SYSCALL_RETURN_ERR) {
+		// Close-on-exec, or the jobs other sessions fork meanwhile would keep
+		// the pipe open, and the reader would not get EOF until they end
+		if (pipe2(pfd, O_CLOEXEC) == SYSCALL_RETURN_ERR) {
 			sprintf(errno_str, "%d", errno);
 			strcpy(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg, PIPE_ERR_1);
 			strcat(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg, errno_str);
 			strcat(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg, PIPE_ERR_2);
-			pthread_mutex_unlock(&shell_info_lock);
+			pthread_mutex_unlock(&shell_info->lock);
 			return;
 		}
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+	// The session's jobs may have been killed already
+	if (shell_info->closing) {
+		if (shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
+			close(pfd[0]);
+			close(pfd[1]);
+		}
+		pthread_mutex_unlock(&shell_info->lock);
+		return;
+	}
+	shell_info->job_table[(shell_info->job_table_idx)-1].start_us = nowUs();
+	pthread_mutex_unlock(&shell_info->lock);
 
 	c1_pid = fork();
 
@@ -654,14 +818,14 @@ void runJob(shell_info_t *shell_info) {
 		setpgid(0, 0);
 
 		// Set up signal handling sent to the children process group
-		if (args.verbose) {
+		if (shell_info->th_args.cmd_args.verbose) {
 			/*
 			printf("-yash: children process group: ignoring signal SIGTTOU, "
 					"but getting all the others\n");
 			*/
 			sprintf(buf, "-yash: children process group: ignoring signal "
 					"SIGTTOU, but getting all the others\n");
-			send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+			shellOut(shell_info, buf, strlen(buf));
 		}
 		signal(SIGTTOU, SIG_IGN);
 		signal(SIGINT, SIG_DFL);
@@ -678,12 +842,13 @@ void runJob(shell_info_t *shell_info) {
 		if (shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
 			close(pfd[0]);	// Close unused read end
 			dup2(pfd[1], STDOUT_FILENO);	// Make output go to pipe
-			dup2(shell_info->th_args.ps, STDERR_FILENO);	// Send the stderr to socket
-			close(shell_info->th_args.ps);
+			dup2(shell_info->host.fd, STDERR_FILENO);	// Send the stderr to the sink
 		} else {
-			dup2(shell_info->th_args.ps, STDOUT_FILENO);	// Send the output to socket
-			dup2(shell_info->th_args.ps, STDERR_FILENO);	// Send the stderr to socket
-			close(shell_info->th_args.ps);
+			dup2(shell_info->host.fd, STDOUT_FILENO);	// Send the output to the sink
+			dup2(shell_info->host.fd, STDERR_FILENO);	// Send the stderr to the sink
+		}
+		if (shell_info->host.fd > STDERR_FILENO) {
+			close(shell_info->host.fd);
 		}
 
 		// Do additional redirection if necessary
@@ -697,23 +862,29 @@ void runJob(shell_info_t *shell_info) {
 			printf("-yash: %s\n", shell_info->job_table[(shell_info->job_table_idx)-1].err_msg);
 			//sprintf(buf, "-yash: %s\n",
 			//		shell_info->jobs_table[(shell_info->jobs_table_idx)-1].err_msg);
-			send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
 			exit(EXIT_ERR_CMD);
 		}
 
 		// Execute command
 		if (execvp(shell_info->job_table[(shell_info->job_table_idx)-1].cmd1[0], shell_info->job_table[(shell_info->job_table_idx)-1].cmd1) == SYSCALL_RETURN_ERR
-				&& args.verbose) {
+				&& shell_info->th_args.cmd_args.verbose) {
 			printf("-yash: execvp() errno: %d\n", errno);
 			//sprintf(buf, "-yash: execvp() errno: %d\n", errno);
-			//send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+			//shellOut(shell_info, buf, strlen(buf));
 		}
 		// Make sure we terminate child on execvp() error
 		exit(EXIT_ERR_CMD);
 	} else {	// Parent process
-		pthread_mutex_lock(&shell_info_lock);
+		// Set the group here too, or a kill() of the group sent before the
+		// child ran setpgid() would miss it
+		if (c1_pid > 0) {
+			setpgid(c1_pid, c1_pid);
+		}
+
+		pthread_mutex_lock(&shell_info->lock);
 		close(shell_info->stdin_pipe_fd[0]);	// Close unused read end (only needed in child 1)
-		pthread_mutex_unlock(&shell_info_lock);
+		shell_info->stdin_pipe_fd[0] = -1;	// So it is not closed twice, the number may be reused by then
+		pthread_mutex_unlock(&shell_info->lock);
 
 		if (shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
 			c2_pid = fork();
@@ -737,9 +908,11 @@ void runJob(shell_info_t *shell_info) {
 				close(shell_info->stdin_pipe_fd[1]);	// Close unused write end (only needed in parent, read end already closed before fork)
 				close(pfd[1]);	// Close unused write end
 				dup2(pfd[0], STDIN_FILENO);	// Get input from pipe
-				dup2(shell_info->th_args.ps, STDOUT_FILENO);	// Send the output to socket
-				dup2(shell_info->th_args.ps, STDERR_FILENO);	// Send the stderr to socket
-				close(shell_info->th_args.ps);
+				dup2(shell_info->host.fd, STDOUT_FILENO);	// Send the output to the sink
+				dup2(shell_info->host.fd, STDERR_FILENO);	// Send the stderr to the sink
+				if (shell_info->host.fd > STDERR_FILENO) {
+					close(shell_info->host.fd);
+				}
 
 				// Do additional redirection if necessary
 				redirectPipe(&(shell_info->job_table[(shell_info->job_table_idx)-1]));
@@ -751,13 +924,16 @@ void runJob(shell_info_t *shell_info) {
 
 				// Execute command
 				if (execvp(shell_info->job_table[(shell_info->job_table_idx)-1].cmd2[0], shell_info->job_table[(shell_info->job_table_idx)-1].cmd2) == SYSCALL_RETURN_ERR
-						&& args.verbose) {
+						&& shell_info->th_args.cmd_args.verbose) {
 					printf("-yash: execvp() errno: %d\n", errno);
 				}
 				// Make sure we terminate child on execvp() error
 				exit(EXIT_ERR_CMD);
 			}
 			// Parent process. Close pipes so EOF can work
+			if (c2_pid > 0) {
+				setpgid(c2_pid, c1_pid);
+			}
 			close(pfd[0]);
 			close(pfd[1]);
 			//close(stdout_fd);
@@ -765,9 +941,30 @@ void runJob(shell_info_t *shell_info) {
 
 		// Parent process
 		// Save job gpid
-		pthread_mutex_lock(&shell_info_lock);
+		pthread_mutex_lock(&shell_info->lock);
 		shell_info->job_table[(shell_info->job_table_idx)-1].gpid = c1_pid;
-		pthread_mutex_unlock(&shell_info_lock);
+		if (shell_info->job_table[(shell_info->job_table_idx)-1].pipe) {
+			shell_info->job_table[(shell_info->job_table_idx)-1].last_pid = c2_pid;
+			shell_info->job_table[(shell_info->job_table_idx)-1].live = 0x3;
+		} else {
+			shell_info->job_table[(shell_info->job_table_idx)-1].last_pid = c1_pid;
+			shell_info->job_table[(shell_info->job_table_idx)-1].live = 0x1;
+		}
+		// The session ended while the job was forked, after its jobs were
+		// killed: kill it too, and reap it as a foreground job
+		if (shell_info->closing) {
+			kill(-c1_pid, SIGKILL);
+			shell_info->job_table[(shell_info->job_table_idx)-1].bg = false;
+		}
+		pthread_mutex_unlock(&shell_info->lock);
+		if (!shell_info->job_table[(shell_info->job_table_idx)-1].bg) {
+			__atomic_store_n(&shell_info->fg_pgid, c1_pid, __ATOMIC_RELEASE);
+		}
+		if (shell_info->host.job_started != NULL) {
+			shell_info->host.job_started(shell_info,
+					&(shell_info->job_table[(shell_info->job_table_idx)-1]),
+					shell_info->job_table[(shell_info->job_table_idx)-1].last_pid);
+		}
 		if (!shell_info->job_table[(shell_info->job_table_idx)-1].bg) {
 			// Give terminal control to child
 			/*
@@ -780,9 +977,11 @@ void runJob(shell_info_t *shell_info) {
 
 			// Block while waiting for children
 			waitForChildren(&(shell_info->job_table[(shell_info->job_table_idx)-1]), shell_info);
+			__atomic_store_n(&shell_info->fg_pgid, 0, __ATOMIC_RELEASE);
 			if (strcmp(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg, EMPTY_STR)) {
 				return;
 			}
+			sendJobExit(&(shell_info->job_table[(shell_info->job_table_idx)-1]), shell_info);
 
 			// Get back terminal control to parent
 			/*
@@ -792,9 +991,9 @@ void runJob(shell_info_t *shell_info) {
 			*/
 			//tcsetpgrp(0, getpid());
 
-			pthread_mutex_lock(&shell_info_lock);
+			pthread_mutex_lock(&shell_info->lock);
 			removeJob((shell_info->job_table_idx)-1, shell_info);	// Remove job from jobs table
-			pthread_mutex_unlock(&shell_info_lock);
+			pthread_mutex_unlock(&shell_info->lock);
 		}
 	}
 }
@@ -811,6 +1010,7 @@ void runJob(shell_info_t *shell_info) {
  */
 void handleNewJob(char* input, shell_info_t *shell_info) {
 	char buf[MAX_ERROR_LEN+10];
+	int max_jobs;
 	// Initialize a new Job struct
 	job_info_t job = {
 		EMPTY_STR,		// cmd_str
@@ -829,12 +1029,29 @@ void handleNewJob(char* input, shell_info_t *shell_info) {
 		EMPTY_ARRAY,	// gpid
 		EMPTY_ARRAY,	// jobno
 		EMPTY_STR,		// status
-		EMPTY_STR		// err_msg
+		EMPTY_STR,		// err_msg
+		EMPTY_ARRAY,	// reg_slot
+		0,				// last_pid
+		0,				// live
+		EMPTY_ARRAY,	// wait_status
+		0,				// start_us
+		0,				// user_us
+		0				// sys_us
 	};
 
+	// Log the command durably before running it
+	if (shell_info->host.audit != NULL &&
+			shell_info->host.audit(shell_info, input) < 0) {
+		sprintf(buf, "-yash: audit log unavailable, command not run\n");
+		shellOut(shell_info, buf, strlen(buf));
+		return;
+	}
+
 	// Add command to the jobs array
-	pthread_mutex_lock(&shell_info_lock);
-	if ((shell_info->job_table_idx)-1 < MAX_CONCURRENT_JOBS) {
+	max_jobs = (shell_info->host.max_jobs != NULL) ?
+			shell_info->host.max_jobs() : MAX_CONCURRENT_JOBS;
+	pthread_mutex_lock(&shell_info->lock);
+	if (shell_info->job_table_idx < max_jobs) {
 		shell_info->job_table[shell_info->job_table_idx] = job;
 		shell_info->job_table[shell_info->job_table_idx].jobno =
 				(shell_info->job_table_idx)+1;
@@ -847,45 +1064,47 @@ void handleNewJob(char* input, shell_info_t *shell_info) {
 		printf("-yash: max number of concurrent jobs reached: %d",
 				shell_info->jobs_table_idx);
 		*/
-		sprintf(buf, "-yash: max number of concurrent jobs reached: %d",
-				MAX_CONCURRENT_JOBS);
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
-		pthread_mutex_unlock(&shell_info_lock);
+		sprintf(buf, "-yash: max number of concurrent jobs reached: %d\n",
+				max_jobs);
+		shellOut(shell_info, buf, strlen(buf));
+		pthread_mutex_unlock(&shell_info->lock);
 		return;
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 
 	// Parse job
-	if (args.verbose) {
+	if (shell_info->th_args.cmd_args.verbose) {
 		//printf("-yash: parsing input...\n");
 		sprintf(buf, "-yash: parsing input...\n");
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+		shellOut(shell_info, buf, strlen(buf));
 	}
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	parseJob(input, shell_info);
-	pthread_mutex_unlock(&shell_info_lock);
 	if (strcmp(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg,
 			EMPTY_STR)) {
 		//printf("-yash: %s\n", jobs_table[last_job].err_msg);
 		sprintf(buf, "-yash: %s\n",
-				shell_info->job_table[shell_info->job_table_idx].err_msg);
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+				shell_info->job_table[(shell_info->job_table_idx)-1].err_msg);
+		removeJob((shell_info->job_table_idx)-1, shell_info);	// Nothing ran
+		pthread_mutex_unlock(&shell_info->lock);
+		shellOut(shell_info, buf, strlen(buf));
 		return;
 	}
+	pthread_mutex_unlock(&shell_info->lock);
 
 	// Run job
-	if (args.verbose) {
+	if (shell_info->th_args.cmd_args.verbose) {
 		//printf("-yash: executing command...\n");
 		sprintf(buf, "-yash: executing command...\n");
-		send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+		shellOut(shell_info, buf, strlen(buf));
 	}
 	runJob(shell_info);
-	if (shell_info->job_table_idx != EMPTY_ARRAY) {
+	if (shell_info->job_table_idx > 0) {	// A foreground job is already removed
 		if (strcmp(shell_info->job_table[(shell_info->job_table_idx)-1].err_msg, EMPTY_STR)) {
 			//printf("-yash: %s\n", shell_info->jobs_table[shell_info->jobs_table_idx].err_msg);
 			sprintf(buf, "-yash: %s\n",
-					shell_info->job_table[shell_info->job_table_idx].err_msg);
-			send(shell_info->th_args.ps, buf, (size_t) strlen(buf), 0);
+					shell_info->job_table[(shell_info->job_table_idx)-1].err_msg);
+			shellOut(shell_info, buf, strlen(buf));
 			return;
 		}
 	}
@@ -900,36 +1119,47 @@ void handleNewJob(char* input, shell_info_t *shell_info) {
  * \param	shell_info	Shell info struct pointer
  */
 void maintainJobsTable(shell_info_t *shell_info) {
+	job_info_t *job;
+	int status;
+	pid_t rc;
+
 	// Check every job in the jobs_table
 	for (int i=0; i<shell_info->job_table_idx; i++) {
-		// Skip jobs that already finished
-		if (!strcmp(shell_info->job_table[i].status, JOB_STATUS_RUNNING) ||
-				!strcmp(shell_info->job_table[i].status, JOB_STATUS_STOPPED)) {
-			int status;
-			if (waitpid(shell_info->job_table[i].gpid, &status, WNOHANG|WUNTRACED|WCONTINUED) == SYSCALL_RETURN_ERR) {
+		job = &shell_info->job_table[i];
+		// Skip jobs that already finished, and the foreground job, which its
+		// thread reaps
+		if (!job->bg || (strcmp(job->status, JOB_STATUS_RUNNING) &&
+				strcmp(job->status, JOB_STATUS_STOPPED))) {
+			continue;
+		}
+		for (int p=0; p<(job->pipe ? CHILD_COUNT_PIPE : CHILD_COUNT_SIMPLE); p++) {
+			if (!(job->live & (1 << p))) {
+				continue;
+			}
+			rc = reapJobProcess(job, p, WNOHANG|WCONTINUED, &status);
+			if (rc == SYSCALL_RETURN_ERR && errno != ECHILD) {
 				perror("Error checking child status");
-				// TODO: handle error
 			}
-			if (WIFEXITED(status)) {
-				// Change status to done and, remove child from array
-				strcpy(shell_info->job_table[i].status, JOB_STATUS_DONE);
-				// TODO: Send output to client
-				printJob(i, shell_info);
-				removeJob(i, shell_info);
-			} else if (WIFSIGNALED(status)) {
-				// Change status to done, and remove child from array
-				strcpy(shell_info->job_table[i].status, JOB_STATUS_DONE);
-				// TODO: Send output to client
-				printJob(i, shell_info);
-				removeJob(i, shell_info);
-			} else if (WIFSTOPPED(status)) {
+			if (rc <= 0) {
+				// Still running, or gone
+				continue;
+			}
+			if (WIFSTOPPED(status)) {
 				// Change status to stopped
-				strcpy(shell_info->job_table[i].status, JOB_STATUS_STOPPED);
+				strcpy(job->status, JOB_STATUS_STOPPED);
 			} else if (WIFCONTINUED(status)) {
 				// Change status to running
-				strcpy(shell_info->job_table[i].status, JOB_STATUS_RUNNING);
+				strcpy(job->status, JOB_STATUS_RUNNING);
 			}
 		}
+		if (job->live == 0) {
+			// Change status to done and, remove child from array
+			strcpy(job->status, JOB_STATUS_DONE);
+			sendJobExit(job, shell_info);
+			// TODO: Send output to client
+			printJob(i, shell_info);
+			removeJob(i, shell_info);
+		}
 	}
 }
 
@@ -942,9 +1172,23 @@ void maintainJobsTable(shell_info_t *shell_info) {
 void killAllJobs(shell_info_t *shell_info) {
 	for (int i=0; i<shell_info->job_table_idx; i++) {
 			// Skip jobs that already finished
-			if (!strcmp(shell_info->job_table[i].status, JOB_STATUS_RUNNING) ||
-					!strcmp(shell_info->job_table[i].status, JOB_STATUS_STOPPED)) {
-				kill(shell_info->job_table[i].gpid, SIGKILL);
+			if ((!strcmp(shell_info->job_table[i].status, JOB_STATUS_RUNNING) ||
+					!strcmp(shell_info->job_table[i].status, JOB_STATUS_STOPPED)) &&
+					shell_info->job_table[i].gpid > 0) {
+				kill(-shell_info->job_table[i].gpid, SIGKILL);
+
+				// Job threads reap the foreground job, background jobs are
+				// reaped here
+				for (int p=0; shell_info->job_table[i].bg && p<CHILD_COUNT_PIPE; p++) {
+					int status;
+
+					while ((shell_info->job_table[i].live & (1 << p)) &&
+							(reapJobProcess(&shell_info->job_table[i], p, 0,
+									&status) >= 0 || errno == EINTR));
+				}
+			}
+			if (shell_info->host.job_ended != NULL) {
+				shell_info->host.job_ended(&shell_info->job_table[i]);
 			}
 	}
 }
@@ -961,7 +1205,7 @@ int startJob(char *job_str, shell_info_t *shell_info) {
 	char buf_time[BUFF_SIZE_TIMESTAMP];
 
 	// Check input to ignore and show the prompt again
-	if (args.verbose) {
+	if (shell_info->th_args.cmd_args.verbose) {
 		fprintf(stderr, "%s yashd[%s:%d]: INFO: Checking if input should be "
 				"ignored...\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(shell_info->th_args.from.sin_addr),
@@ -970,21 +1214,21 @@ int startJob(char *job_str, shell_info_t *shell_info) {
 
 	// Check if input should be ignored
 	if (ignoreInput(job_str)) {
-		if (args.verbose) {
+		if (shell_info->th_args.cmd_args.verbose) {
 			fprintf(stderr, "%s yashd[%s:%d]: INFO: Input ignored\n",
 					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 					inet_ntoa(shell_info->th_args.from.sin_addr),
 					ntohs(shell_info->th_args.from.sin_port));
 		}
 	} else if (runShellCmd(job_str, shell_info)) {	// Check if input is a shell command
-		if (args.verbose) {
+		if (shell_info->th_args.cmd_args.verbose) {
 			fprintf(stderr, "%s yashd[%s:%d]: INFO: Ran shell command\n",
 					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 					inet_ntoa(shell_info->th_args.from.sin_addr),
 					ntohs(shell_info->th_args.from.sin_port));
 		}
 	} else {	// Handle new job
-		if (args.verbose) {
+		if (shell_info->th_args.cmd_args.verbose) {
 			fprintf(stderr, "%s yashd[%s:%d]: INFO: New job\n",
 					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 					inet_ntoa(shell_info->th_args.from.sin_addr),
@@ -994,8 +1238,8 @@ int startJob(char *job_str, shell_info_t *shell_info) {
 	}
 
 	// Check for finished jobs
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	maintainJobsTable(shell_info);
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 	return (EXIT_OK);
 }
@@ -0,0 +1,371 @@
+/**
+ * @file  shellharness.c
+ *
+ * @brief In-process harness of the shell engine
+ *
+ * Drives the engine of libyashshell.a (parse, spawn, reap) the way a job
+ * thread of the daemon does, with no socket nor daemon around it. The jobs'
+ * output goes to a temporary file, and the shell's messages (syntax errors,
+ * EXIT lines) are captured through the host's write hook, so each command's
+ * result can be checked.
+ *
+ * Without commands, it runs a built-in corpus and checks each result against
+ * the expected output and exit status. Commands given on the command line are
+ * only timed. Each command runs ITERATIONS times, and its latency (startJob()
+ * call to return, the reaping of its processes included) is reported.
+ * The corpus run also checks the EXIT line of a job whose fields are all at
+ * their widest.
+ *
+ * 	make bench
+ * 	./yashd-shell [-n ITERATIONS] [-v] [CMD...]
+ *
+ * Exits with an error if a result does not match, or jobs are left behind.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+#include <limits.h>
+
+
+#define HARNESS_MSG_LEN 4096	//! Bytes of shell messages captured per command
+#define HARNESS_OUT_LEN 4096	//! Bytes of job output checked per command
+#define HARNESS_DRAIN_MS 2000	//! Max milliseconds to wait for background jobs
+#define HARNESS_NO_EXIT -1		//! Expected exit code of a command that does not run
+#define HARNESS_ANY_EXIT -2		//! Expected exit code when it is not checked
+
+
+/**
+ * \brief Struct for a command of the corpus, and its expected result
+ */
+typedef struct _harness_case {
+	const char *cmd;	// Command line
+	const char *out;	// Job output, or NULL to not check it
+	const char *msg;	// Shell messages, EXIT lines aside, or NULL to not check them
+	int code;			// Exit code, HARNESS_NO_EXIT or HARNESS_ANY_EXIT
+} harness_case_t;
+
+
+/**
+ * \brief Struct for the messages captured from the engine
+ */
+typedef struct _harness_sink {
+	char buf[HARNESS_MSG_LEN];	// Messages of the current command
+	size_t len;					// Bytes in buf
+} harness_sink_t;
+
+
+// Globals
+static const harness_case_t corpus[] = {
+	{"echo hello", "hello\n", "", 0},
+	{"true", "", "", 0},
+	{"false", "", "", 1},
+	{"echo a b c | wc -w", "3\n", "", 0},
+	{"ls / > /dev/null", "", "", 0},
+	{"ls /nonexistent-yash-harness", NULL, "", 2},
+	{"cat < /nonexistent-yash-harness", NULL, "", EXIT_ERR_CMD},
+	{"nonexistent-yash-harness", "", "", EXIT_ERR_CMD},
+	{"| wc", "", "-yash: syntax error: command should not start with |\n",
+			HARNESS_NO_EXIT},
+	{"echo a >", "", "-yash: syntax error: command should not end with >\n",
+			HARNESS_NO_EXIT},
+	{"echo a & b", "",
+			"-yash: syntax error: & should be the last token of the command\n",
+			HARNESS_NO_EXIT},
+	{"jobs", "", "No jobs in job table\n", HARNESS_NO_EXIT},
+	{"true &", NULL, NULL, HARNESS_ANY_EXIT},
+};
+
+
+/**
+ * @brief Capture the shell's messages, the write hook of the host
+ *
+ * \param	shell_info	Shell info struct pointer
+ * \param	buf			Message
+ * \param	len			Message length
+ * \return	Bytes taken
+ */
+static ssize_t captureMessage(shell_info_t *shell_info, const void *buf,
+		size_t len) {
+	harness_sink_t *sink = shell_info->host.ctx;
+	size_t n = len;
+
+	if (n > sizeof(sink->buf) - 1 - sink->len) {
+		n = sizeof(sink->buf) - 1 - sink->len;
+	}
+	memcpy(&sink->buf[sink->len], buf, n);
+	sink->len += n;
+	sink->buf[sink->len] = '\0';
+
+	return len;
+}
+
+
+/**
+ * @brief Run a command through the engine, as a job thread would
+ *
+ * Each command gets a fresh stdin pipe, closed once it ran, so a job reading
+ * its stdin sees EOF.
+ *
+ * \param	cmd			Command line
+ * \param	shell_info	Shell info struct pointer
+ * \return	Microseconds startJob() took, or 0 on error
+ */
+static uint64_t runCommand(const char *cmd, shell_info_t *shell_info) {
+	char job_str[MAX_CMD_LEN+1];
+	uint64_t start;
+
+	if (pipe(shell_info->stdin_pipe_fd) == SYSCALL_RETURN_ERR) {
+		perror("ERROR: Creating stdin pipe");
+		return 0;
+	}
+
+	snprintf(job_str, sizeof(job_str), "%s", cmd);
+	fflush(stdout);	// Children that fail to exec flush their copy on exit()
+	start = nowUs();
+	startJob(job_str, shell_info);
+	start = nowUs() - start;
+
+	if (shell_info->stdin_pipe_fd[0] >= 0) {
+		close(shell_info->stdin_pipe_fd[0]);
+	}
+	close(shell_info->stdin_pipe_fd[1]);
+
+	return start ? start : 1;
+}
+
+
+/**
+ * @brief Take the output the jobs wrote to the sink so far
+ *
+ * \param	fd		Sink
+ * \param	buf		Buffer, HARNESS_OUT_LEN bytes
+ */
+static void takeOutput(int fd, char *buf) {
+	ssize_t n;
+
+	n = pread(fd, buf, HARNESS_OUT_LEN - 1, 0);
+	buf[n > 0 ? n : 0] = '\0';
+	if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+		perror("ERROR: Clearing output");
+	}
+}
+
+
+/**
+ * @brief Check the result of a command against the corpus
+ *
+ * \param	test	Corpus entry
+ * \param	out		Job output
+ * \param	sink	Shell messages
+ * \return	Empty string if it matches, or what did not match
+ */
+static const char *checkResult(const harness_case_t *test, const char *out,
+		harness_sink_t *sink) {
+	char *exit_line;
+	char *end;
+	int code = HARNESS_NO_EXIT;
+
+	// Split the EXIT line from the other messages
+	if ((exit_line = strstr(sink->buf, MSG_TYPE_EXIT)) != NULL) {
+		if (sscanf(exit_line, MSG_TYPE_EXIT "%*d exit %d", &code) != 1) {
+			code = INT_MIN;
+		}
+		if ((end = strchr(exit_line, '\n')) != NULL) {
+			memmove(exit_line, end + 1, strlen(end + 1) + 1);
+		} else {
+			*exit_line = '\0';
+		}
+	}
+
+	if (test->code != HARNESS_ANY_EXIT && code != test->code) {
+		return "exit status";
+	}
+	if (test->out != NULL && strcmp(out, test->out)) {
+		return "output";
+	}
+	if (test->msg != NULL && strcmp(sink->buf, test->msg)) {
+		return "shell messages";
+	}
+
+	return EMPTY_STR;
+}
+
+
+/**
+ * @brief Check the EXIT line of a job whose fields are all at their widest
+ *
+ * \param	shell_info	Shell info struct pointer
+ * \param	sink		Shell messages
+ * \return	Empty string if the line is sent whole, or what did not match
+ */
+static const char *checkExitLine(shell_info_t *shell_info,
+		harness_sink_t *sink) {
+	static job_info_t job;
+	unsigned long wall, user, sys;
+	char how[8];
+	int jobno, code;
+
+	memset(&job, 0, sizeof(job));
+	job.jobno = UINT8_MAX;
+	job.wait_status = -1;				// "unknown"
+	job.start_us = nowUs() + 1000000;	// Wall time wraps to 20 digits
+	job.user_us = UINT64_MAX;
+	job.sys_us = UINT64_MAX;
+
+	sink->len = 0;
+	sink->buf[0] = '\0';
+	sendJobExit(&job, shell_info);
+
+	if (sink->len == 0 || sink->len != strlen(sink->buf) ||
+			sink->buf[sink->len - 1] != '\n' ||
+			sscanf(sink->buf, MSG_TYPE_EXIT "%d %7s %d %lu %lu %lu", &jobno,
+					how, &code, &wall, &user, &sys) != 6 ||
+			jobno != UINT8_MAX || strcmp(how, "unknown") || wall < UINT32_MAX ||
+			user != UINT64_MAX || sys != UINT64_MAX) {
+		return "EXIT line";
+	}
+
+	return EMPTY_STR;
+}
+
+
+/**
+ * @brief Wait for the background jobs to end, reaping them
+ *
+ * \param	shell_info	Shell info struct pointer
+ * \return	Number of jobs left in the table
+ */
+static int drainJobs(shell_info_t *shell_info) {
+	uint64_t deadline = nowUs() + HARNESS_DRAIN_MS * 1000;
+
+	pthread_mutex_lock(&shell_info->lock);
+	maintainJobsTable(shell_info);
+	while (shell_info->job_table_idx > 0 && nowUs() < deadline) {
+		pthread_mutex_unlock(&shell_info->lock);
+		usleep(1000);
+		pthread_mutex_lock(&shell_info->lock);
+		maintainJobsTable(shell_info);
+	}
+	pthread_mutex_unlock(&shell_info->lock);
+
+	return shell_info->job_table_idx;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	static shell_info_t shell_info;	// Too big for the stack
+	static harness_sink_t sink;
+	char out[HARNESS_OUT_LEN];
+	FILE *out_file;
+	harness_case_t user_case = {NULL, NULL, NULL, 0};
+	const harness_case_t *test;
+	const char *fail;
+	int iterations = 100;
+	int cases;
+	int failures = 0;
+	int left;
+	int first = 1;
+	uint64_t us;
+	hist_t hist;
+
+	for (; first<argc && argv[first][0] == '-'; first++) {
+		if (!strcmp(argv[first], "-n") && first+1 < argc) {
+			iterations = atoi(argv[++first]);
+		} else if (!strcmp(argv[first], "-v")) {
+			shell_info.th_args.cmd_args.verbose = true;
+		} else {
+			break;
+		}
+	}
+	if (iterations < 1 || (first < argc && argv[first][0] == '-')) {
+		fprintf(stderr, "Usage: %s [-n ITERATIONS] [-v] [CMD...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// A session of the engine, with no socket behind it
+	pthread_mutex_init(&shell_info.lock, NULL);
+	shell_info.features = PROTO_FEATURES;
+	shell_info.max_frame = FRAME_MAX_PAYLOAD;
+	shell_info.host = (shell_host_t) {
+		-1,					// fd
+		&sink,				// ctx
+		captureMessage,		// write
+		NULL,				// audit
+		NULL,				// job_started
+		NULL,				// job_ended
+		NULL				// max_jobs
+	};
+	if ((out_file = tmpfile()) != NULL) {
+		shell_info.host.fd = fileno(out_file);
+	}
+	if (shell_info.host.fd < 0) {
+		perror("ERROR: Creating output sink");
+		return EXIT_FAILURE;
+	}
+	signal(SIGPIPE, SIG_IGN);
+
+	cases = (first < argc) ? argc - first : sizeof(corpus)/sizeof(corpus[0]);
+	printf("%-36s %6s %8s %8s %8s %8s  %s\n", "command", "runs", "mean us",
+			"p50 us", "p99 us", "max us", "result");
+	for (int c=0; c<cases; c++) {
+		if (first < argc) {
+			user_case.cmd = argv[first + c];
+			test = &user_case;
+		} else {
+			test = &corpus[c];
+		}
+		memset(&hist, 0, sizeof(hist));
+		fail = EMPTY_STR;
+
+		for (int i=0; i<iterations; i++) {
+			sink.len = 0;
+			sink.buf[0] = '\0';
+			if ((us = runCommand(test->cmd, &shell_info)) == 0) {
+				return EXIT_FAILURE;
+			}
+			histAdd(&hist, us);
+			takeOutput(shell_info.host.fd, out);
+			if (test != &user_case && !fail[0]) {
+				fail = checkResult(test, out, &sink);
+			}
+		}
+
+		// Background jobs are reaped between commands, and must all end
+		if ((left = drainJobs(&shell_info)) > 0 && !fail[0]) {
+			fail = "jobs left";
+		}
+		takeOutput(shell_info.host.fd, out);
+
+		printf("%-36.36s %6lu %8lu %8lu %8lu %8lu  %s%s\n", test->cmd,
+				hist.count, hist.sum / hist.count, histPercentile(&hist, 50),
+				histPercentile(&hist, 99), hist.max,
+				fail[0] ? "FAIL: " : (test == &user_case ? "-" : "ok"), fail);
+		if (fail[0]) {
+			failures++;
+			if (left > 0) {
+				killAllJobs(&shell_info);
+				shell_info.job_table_idx = 0;
+			}
+		}
+	}
+
+	// The EXIT line of the widest job fits its buffer
+	if (first >= argc) {
+		fail = checkExitLine(&shell_info, &sink);
+		printf("%-36s %6d %8s %8s %8s %8s  %s%s\n", "(EXIT line, widest fields)",
+				1, "-", "-", "-", "-", fail[0] ? "FAIL: " : "ok", fail);
+		failures += fail[0] != '\0';
+	}
+
+	fclose(out_file);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
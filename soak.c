@@ -0,0 +1,610 @@
+/**
+ * @file  soak.c
+ *
+ * @brief Soak test of the yash shell daemon, tracking its resources over time
+ *
+ * Starts a daemon in the foreground on a local port, and runs mixed traffic
+ * against it for hours: sessions running commands, pipes and redirections,
+ * failing commands and syntax errors, background and stopped jobs, ctrl-c and
+ * ctrl-z, job output, sessions hanging up in the middle of a job, and
+ * sessions ending with `CTL d`.
+ *
+ * The traffic runs in rounds. At the end of each round the clients stop, the
+ * daemon is given time to tear their sessions down, and it is sampled:
+ *
+ * 	- Open file descriptors (/proc/PID/fd).
+ * 	- Threads, and resident memory (/proc/PID/status).
+ * 	- Children, and zombie children among them (/proc/PID/stat of every
+ * 	  process).
+ * 	- Servant thread table entries, and running jobs of the job registry
+ * 	  (the SIGUSR1 stats of its log).
+ *
+ * Once idle, the daemon should be back to where it was, whatever the traffic
+ * it took. A metric grows without bound if the highest sample of the second
+ * half of the run is above the highest sample of the first half by more than
+ * its tolerance, and the exit code is an error if any does.
+ *
+ * 	make soak
+ * 	./yashd-soak [-d DAEMON] [-p PORT] [-t SECONDS] [-r SECONDS] [-n CLIENTS]
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include "benchharness.h"
+#include "yash_client.h"
+#include "yash_time.h"
+
+
+#define SOAK_PORT 4827			//! Default port of the daemon under test
+#define SOAK_DAEMON "./yashd"	//! Default daemon binary
+#define SOAK_SECONDS 3600		//! Default length of the run
+#define SOAK_ROUND 30			//! Default length of a round (seconds)
+#define SOAK_CLIENTS 8			//! Default number of clients
+#define SOAK_MAX_CLIENTS 32		//! Max number of clients
+#define SOAK_MAX_ROUNDS 4096	//! Max number of rounds sampled
+#define SOAK_TIMEOUT_MS 15000	//! Max milliseconds to wait for a reply
+#define SOAK_SETTLE_MS 10000	//! Max milliseconds for the sessions to end
+#define SOAK_SIGNALS 5			//! Tries to signal a job
+#define SOAK_STATS_MS 300		//! Milliseconds for the SIGUSR1 stats to be logged
+#define SOAK_METRICS 7			//! Metrics sampled
+#define SOAK_CMD "CMD "			//! Command line prefix
+#define SOAK_CTL "CTL "			//! Control line prefix
+
+
+/**
+ * \brief Struct for a metric, and its samples
+ */
+typedef struct _soak_metric {
+	const char *name;	// Name
+	const char *unit;	// Unit
+	long tolerance;		// Growth allowed, in its unit
+	int percent;		// Growth allowed, percent of the first half
+	long samples[SOAK_MAX_ROUNDS];	// Samples, one per round
+} soak_metric_t;
+
+
+/**
+ * \brief Struct for a client thread
+ */
+typedef struct _soak_client {
+	pthread_t tid;
+	unsigned int seed;		// Scenario picker state
+	uint64_t deadline;		// Time to stop (nowUs())
+	uint64_t ops;			// Scenarios run
+	int errors;				// Scenarios that failed
+} soak_client_t;
+
+
+/**
+ * \brief Enum of the metrics, indexes of the metrics table
+ */
+enum {
+	SOAK_FDS,
+	SOAK_THREADS,
+	SOAK_RSS,
+	SOAK_CHILDREN,
+	SOAK_ZOMBIES,
+	SOAK_SESSIONS,
+	SOAK_JOBS,
+};
+
+
+// Globals
+static int port = SOAK_PORT;	//! Port of the daemon under test
+static char log_path[64];		//! Log of the daemon under test
+static long log_off = 0;		//! Log bytes already parsed
+
+static soak_metric_t metrics[SOAK_METRICS] = {
+	{"fds", "", 2, 0, {0}},
+	{"threads", "", 1, 0, {0}},
+	{"rss", "KB", 1024, 10, {0}},
+	{"children", "", 0, 0, {0}},
+	{"zombies", "", 0, 0, {0}},
+	{"table", "", 0, 0, {0}},
+	{"jobs", "", 0, 0, {0}},
+};
+
+// Commands run by the sessions, a few of them fail or are not valid
+static const char *commands[] = {
+	"echo hello",
+	"true",
+	"false",
+	"echo a b c | wc -w",
+	"ls / > /dev/null",
+	"ls /nonexistent-yash-soak",
+	"cat < /nonexistent-yash-soak",
+	"nonexistent-yash-soak",
+	"echo soak > /dev/null",
+	"| wc",
+	"echo a >",
+	"echo a & b",
+	"jobs",
+	"true &",
+	"sleep 0.05",
+};
+
+
+/**
+ * @brief Run a command in a session, and wait for its prompt
+ *
+ * @param	sd		Socket
+ * @param	cmd		Command line, without its newline
+ * @return	0 on success, or -1 on error
+ */
+static int runCommand(int sd, const char *cmd) {
+	char line[256];
+
+	snprintf(line, sizeof(line), SOAK_CMD "%s\n", cmd);
+	if (sendLine(sd, line) < 0) {
+		return -1;
+	}
+	return waitFor(sd, NULL, SOAK_TIMEOUT_MS, NULL);
+}
+
+
+/**
+ * @brief Run one scenario of the mixed traffic, in a session of its own
+ *
+ * @param	client	Client running it
+ * @return	0 on success, or -1 on error
+ */
+static int runScenario(soak_client_t *client) {
+	struct linger hangup = {1, 0};
+	char hello[64];
+	int rc = 0;
+	int sd;
+
+	if ((sd = connectDaemon(port)) < 0 ||
+			waitFor(sd, NULL, SOAK_TIMEOUT_MS, NULL) < 0) {
+		if (sd >= 0) {
+			close(sd);
+		}
+		return -1;
+	}
+
+	switch (rand_r(&client->seed) % 8) {
+	case 0:		// Commands, back to back
+	case 1:
+		for (int i=rand_r(&client->seed) % 8; i>=0 && rc == 0; i--) {
+			rc = runCommand(sd, commands[rand_r(&client->seed) %
+					(sizeof(commands)/sizeof(commands[0]))]);
+		}
+		break;
+	case 2:		// Ctrl-c of a job, reported by its EXIT line
+		snprintf(hello, sizeof(hello), "%s%d %x %d\n", MSG_TYPE_HELLO,
+				PROTO_VERSION, PROTO_FEAT_EXIT, 65536);
+		if (sendLine(sd, hello) < 0 ||
+				waitFor(sd, MSG_TYPE_HELLO, SOAK_TIMEOUT_MS, NULL) < 0 ||
+				sendLine(sd, SOAK_CMD "sleep 10\n") < 0) {
+			rc = -1;
+			break;
+		}
+		// A signal sent before the job started is lost, so send it again
+		rc = -1;
+		for (int i=1; i<=SOAK_SIGNALS && rc < 0; i++) {
+			usleep(50000 * i);
+			if (sendLine(sd, SOAK_CTL "c\n") < 0) {
+				break;
+			}
+			rc = waitFor(sd, " signal 2 ", 1000, NULL);
+		}
+		drainSession(sd);	// Prompts of the CTL lines and of the job
+		break;
+	case 3:		// Ctrl-z of a job, left stopped when the session ends
+		if (sendLine(sd, SOAK_CMD "sleep 10\n") < 0) {
+			rc = -1;
+			break;
+		}
+		usleep(50000);
+		if (sendLine(sd, SOAK_CTL "z\n") < 0 ||
+				waitFor(sd, NULL, SOAK_TIMEOUT_MS, NULL) < 0) {
+			rc = -1;
+			break;
+		}
+		drainSession(sd);
+		rc = runCommand(sd, "jobs");
+		break;
+	case 4:		// Background jobs, one still running when the session ends
+		if (runCommand(sd, "sleep 0.1 &") < 0 || runCommand(sd, "jobs") < 0) {
+			rc = -1;
+			break;
+		}
+		usleep(150000);
+		if (runCommand(sd, "true") < 0 || runCommand(sd, "sleep 10 &") < 0) {
+			rc = -1;
+		}
+		break;
+	case 5:		// Hang up in the middle of a job, at times with a reset
+		if (sendLine(sd, SOAK_CMD "sleep 10\n") < 0) {
+			rc = -1;
+			break;
+		}
+		usleep(rand_r(&client->seed) % 50000);
+		if (rand_r(&client->seed) % 2) {
+			setsockopt(sd, SOL_SOCKET, SO_LINGER, &hangup, sizeof(hangup));
+		}
+		break;
+	case 6:		// Job output
+		rc = runCommand(sd, "head -c 262144 /dev/zero");
+		break;
+	case 7:		// End of the session from the client
+		if (sendLine(sd, SOAK_CTL "d\n") < 0) {
+			rc = -1;
+			break;
+		}
+		// Read until the daemon closes it
+		while (waitFor(sd, NULL, SOAK_TIMEOUT_MS, NULL) == 0);
+		break;
+	}
+
+	close(sd);
+	return rc;
+}
+
+
+/**
+ * @brief Client thread, running scenarios until its deadline
+ *
+ * @param	arg	Client
+ * @return	NULL
+ */
+static void *soakClient(void *arg) {
+	soak_client_t *client = arg;
+
+	while (nowUs() < client->deadline) {
+		if (runScenario(client) < 0) {
+			client->errors++;
+		}
+		client->ops++;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @brief Count the entries of a directory
+ *
+ * @param	path	Directory
+ * @return	Number of entries, . and .. aside, or -1 on error
+ */
+static long countEntries(const char *path) {
+	struct dirent *entry;
+	long count = 0;
+	DIR *dir;
+
+	if ((dir = opendir(path)) == NULL) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		count += (entry->d_name[0] != '.');
+	}
+	closedir(dir);
+
+	return count;
+}
+
+
+/**
+ * @brief Read a field of the status of a process
+ *
+ * @param	pid		Process
+ * @param	field	Field, with its colon
+ * @return	Value of the field, or -1 if unknown
+ */
+static long readStatus(pid_t pid, const char *field) {
+	char path[64];
+	char line[256];
+	size_t len = strlen(field);
+	long value = -1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", pid);
+	if ((f = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (!strncmp(line, field, len)) {
+			value = atol(&line[len]);
+			break;
+		}
+	}
+	fclose(f);
+
+	return value;
+}
+
+
+/**
+ * @brief Count the children of a process, and the zombies among them
+ *
+ * @param	pid		Process
+ * @param	zombies	Zombie children
+ * @return	Children, or -1 on error
+ */
+static long countChildren(pid_t pid, long *zombies) {
+	char path[64];
+	struct dirent *entry;
+	long children = 0;
+	char state;
+	pid_t ppid;
+	DIR *dir;
+	FILE *f;
+
+	*zombies = 0;
+	if ((dir = opendir("/proc")) == NULL) {
+		return -1;
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] < '1' || entry->d_name[0] > '9') {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/proc/%d/stat", atoi(entry->d_name));
+		if ((f = fopen(path, "r")) == NULL) {
+			continue;	// The process exited
+		}
+		if (fscanf(f, "%*d (%*[^)]) %c %d", &state, &ppid) == 2 && ppid == pid) {
+			children++;
+			*zombies += (state == 'Z');
+		}
+		fclose(f);
+	}
+	closedir(dir);
+
+	return children;
+}
+
+
+/**
+ * @brief Read the table occupancy of the daemon from its SIGUSR1 stats
+ *
+ * Every shard logs its servant thread table, one line per entry, and the
+ * job registry logs its running jobs.
+ *
+ * @param	pid		Daemon
+ * @param	entries	Servant thread table entries
+ * @param	jobs	Running jobs in the job registry
+ * @return	0 on success, or -1 on error
+ */
+static int readTables(pid_t pid, long *entries, long *jobs) {
+	char line[512];
+	FILE *f;
+
+	*entries = 0;
+	*jobs = -1;
+	if (kill(pid, SIGUSR1) < 0) {
+		return -1;
+	}
+	usleep(SOAK_STATS_MS * 1000);
+
+	if ((f = fopen(log_path, "r")) == NULL) {
+		return -1;
+	}
+	fseek(f, log_off, SEEK_SET);
+	while (fgets(line, sizeof(line), f) != NULL) {
+		if (line[0] == '\t' && strstr(line, "Socket FD:") != NULL) {
+			(*entries)++;
+		} else if (strstr(line, "Job registry: running jobs: ") != NULL) {
+			*jobs = atol(strstr(line, "running jobs: ") + 14);
+		}
+	}
+	log_off = ftell(f);
+	fclose(f);
+
+	return (*jobs < 0) ? -1 : 0;
+}
+
+
+/**
+ * @brief Sample the resources of the daemon, once its sessions ended
+ *
+ * @param	pid		Daemon
+ * @param	round	Round sampled
+ * @return	0 on success, or -1 on error
+ */
+static int sample(pid_t pid, int round) {
+	char path[64];
+	uint64_t deadline = nowUs() + SOAK_SETTLE_MS * 1000;
+	long *s[SOAK_METRICS];
+
+	for (int i=0; i<SOAK_METRICS; i++) {
+		s[i] = &metrics[i].samples[round];
+	}
+
+	// The sessions end, and their jobs are killed, after the clients hang up
+	do {
+		usleep(200000);
+		if (readTables(pid, s[SOAK_SESSIONS], s[SOAK_JOBS]) < 0) {
+			return -1;
+		}
+		*s[SOAK_CHILDREN] = countChildren(pid, s[SOAK_ZOMBIES]);
+	} while ((*s[SOAK_SESSIONS] > 0 || *s[SOAK_CHILDREN] > 0) &&
+			nowUs() < deadline);
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+	*s[SOAK_FDS] = countEntries(path);
+	*s[SOAK_THREADS] = readStatus(pid, "Threads:");
+	*s[SOAK_RSS] = readStatus(pid, "VmRSS:");
+
+	for (int i=0; i<SOAK_METRICS; i++) {
+		if (*s[i] < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+/**
+ * @brief Run a round of traffic
+ *
+ * @param	clients	Number of clients
+ * @param	seconds	Length of the round
+ * @param	ops		Scenarios run
+ * @return	Number of scenarios that failed
+ */
+static int runRound(int clients, int seconds, uint64_t *ops) {
+	static soak_client_t client[SOAK_MAX_CLIENTS];
+	static unsigned int seed = 1;
+	uint64_t deadline = nowUs() + (uint64_t) seconds * 1000000;
+	int errors = 0;
+
+	*ops = 0;
+	for (int i=0; i<clients; i++) {
+		client[i] = (soak_client_t) {0, seed++, deadline, 0, 0};
+		if (pthread_create(&client[i].tid, NULL, soakClient, &client[i])) {
+			perror("ERROR: Starting client");
+			client[i].tid = 0;
+			errors++;
+		}
+	}
+	for (int i=0; i<clients; i++) {
+		if (client[i].tid) {
+			pthread_join(client[i].tid, NULL);
+		}
+		*ops += client[i].ops;
+		errors += client[i].errors;
+	}
+
+	return errors;
+}
+
+
+/**
+ * @brief Check the metrics for growth between both halves of the run
+ *
+ * The first round is a warm up, and is not taken into account.
+ *
+ * @param	rounds	Rounds sampled
+ * @return	Number of metrics that grew, or -1 if there are too few rounds
+ */
+static int checkGrowth(int rounds) {
+	long first, second, allowed;
+	int half = 1 + (rounds - 1) / 2;
+	int grew = 0;
+
+	if (rounds < 3) {
+		fprintf(stderr, "ERROR: %d rounds are too few to check for growth\n",
+				rounds);
+		return -1;
+	}
+
+	printf("\n%-10s %10s %10s %10s  %s\n", "metric", "1st half", "2nd half",
+			"allowed", "result");
+	for (int i=0; i<SOAK_METRICS; i++) {
+		first = second = 0;
+		for (int r=1; r<rounds; r++) {
+			long *max = (r < half) ? &first : &second;
+			if (metrics[i].samples[r] > *max) {
+				*max = metrics[i].samples[r];
+			}
+		}
+		allowed = first + metrics[i].tolerance + first * metrics[i].percent / 100;
+		printf("%-10s %10ld %10ld %10ld  %s\n", metrics[i].name, first, second,
+				allowed, (second > allowed) ? "GREW" : "ok");
+		grew += (second > allowed);
+	}
+
+	return grew;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	const char *daemon = SOAK_DAEMON;
+	int seconds = SOAK_SECONDS;
+	int round_secs = SOAK_ROUND;
+	int clients = SOAK_CLIENTS;
+	uint64_t start;
+	uint64_t ops;
+	int errors = 0;
+	int failed;
+	int rounds;
+	int grew;
+	pid_t pid;
+
+	for (int i=1; i<argc; i++) {
+		if (i+1 < argc && !strcmp(argv[i], "-d")) {
+			daemon = argv[++i];
+		} else if (i+1 < argc && !strcmp(argv[i], "-p")) {
+			port = atoi(argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-t")) {
+			seconds = atoi(argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-r")) {
+			round_secs = atoi(argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-n")) {
+			clients = atoi(argv[++i]);
+		} else {
+			clients = 0;
+			break;
+		}
+	}
+	rounds = (round_secs > 0) ? seconds / round_secs : 0;
+	if (clients < 1 || clients > SOAK_MAX_CLIENTS || rounds < 1 ||
+			rounds > SOAK_MAX_ROUNDS) {
+		fprintf(stderr, "Usage: %s [-d DAEMON] [-p PORT] [-t SECONDS] "
+				"[-r SECONDS] [-n CLIENTS]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((pid = startDaemon(daemon, "yashd-soak", port, NULL, log_path,
+			sizeof(log_path))) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	printf("%5s %7s %8s %6s %6s %8s %8s %7s %8s %5s %5s\n", "round", "secs",
+			"ops", "errors", "fds", "threads", "rss KB", "childs", "zombies",
+			"table", "jobs");
+	start = nowUs();
+	for (int r=0; r<rounds; r++) {
+		failed = runRound(clients, round_secs, &ops);
+		errors += failed;
+		if (sample(pid, r) < 0) {
+			fprintf(stderr, "ERROR: Could not sample the daemon, see %s\n",
+					log_path);
+			rounds = r;
+			errors++;
+			break;
+		}
+		printf("%5d %7lu %8lu %6d %6ld %8ld %8ld %7ld %8ld %5ld %5ld\n", r,
+				(nowUs() - start) / 1000000, ops, failed,
+				metrics[SOAK_FDS].samples[r], metrics[SOAK_THREADS].samples[r],
+				metrics[SOAK_RSS].samples[r], metrics[SOAK_CHILDREN].samples[r],
+				metrics[SOAK_ZOMBIES].samples[r],
+				metrics[SOAK_SESSIONS].samples[r], metrics[SOAK_JOBS].samples[r]);
+		fflush(stdout);
+	}
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	grew = checkGrowth(rounds);
+	if (errors > 0) {
+		fprintf(stderr, "ERROR: %d scenarios failed, see %s\n", errors,
+				log_path);
+	}
+
+	return (errors > 0 || grew != 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file  wheel.c
+ *
+ * @brief Hierarchical timer wheel of the yash shell daemon
+ *
+ * A wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots, and ticks once a
+ * second. A timer due in less than WHEEL_SLOTS ticks goes to the slot of its
+ * tick on level 0. Later timers go to a coarser level, whose slots span
+ * WHEEL_SLOTS times as many ticks, and are moved down a level (cascaded) when
+ * the level below wraps around. Adding and deleting a timer is O(1), and a
+ * timer is cascaded at most WHEEL_LEVELS-1 times.
+ *
+ * The slots are intrusive lists, so timers live in the structs they time and
+ * a zeroed wheel is empty. A bitmap of the slots in use per level tells when
+ * the next timer is due, so the owner only wakes up when something expires.
+ * Wheels are not locked: the caller serializes the calls.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include "yashd.h"
+
+
+/**
+ * @brief Get the current tick of the wheels
+ *
+ * @return	Seconds since an arbitrary point
+ */
+uint64_t wheelNow() {
+	return nowUs() / 1000000;
+}
+
+
+/**
+ * @brief Link a timer into the slot of its expiry time
+ *
+ * @param	wheel	Wheel
+ * @param	timer	Timer, with its expiry time set
+ */
+static void linkTimer(wheel_t *wheel, wheel_timer_t *timer) {
+	uint64_t delta = timer->expires - wheel->now;
+	wheel_timer_t **slot;
+	int level = 0;
+	int idx;
+
+	while (level < WHEEL_LEVELS-1 &&
+			delta >= (uint64_t) 1 << (WHEEL_BITS * (level+1))) {
+		level++;
+	}
+	idx = (timer->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1);
+
+	slot = &wheel->slots[level][idx];
+	timer->next = *slot;
+	if (*slot != NULL) {
+		(*slot)->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot = timer;
+	wheel->occupied[level] |= (uint64_t) 1 << idx;
+}
+
+
+/**
+ * @brief Unlink a timer from its slot
+ *
+ * @param	timer	Timer, linked
+ */
+static void unlinkTimer(wheel_timer_t *timer) {
+	*timer->pprev = timer->next;
+	if (timer->next != NULL) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+
+/**
+ * @brief Add a timer
+ *
+ * A timer already due expires on the next tick. Timers beyond the range of
+ * the wheel expire at the end of its range, and are expected to re-arm.
+ *
+ * @param	wheel	Wheel
+ * @param	timer	Timer, not linked
+ * @param	expires	Expiry time (wheelNow() seconds)
+ */
+void wheelAdd(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires) {
+	uint64_t range = ((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	if (expires <= wheel->now) {
+		expires = wheel->now + 1;
+	} else if (expires - wheel->now > range) {
+		expires = wheel->now + range;
+	}
+	timer->expires = expires;
+	linkTimer(wheel, timer);
+	wheel->count++;
+}
+
+
+/**
+ * @brief Delete a timer, if it is linked
+ *
+ * The slot's bit in the bitmap is left set, and cleared when the slot is
+ * next visited.
+ *
+ * @param	wheel	Wheel
+ * @param	timer	Timer
+ */
+void wheelDel(wheel_t *wheel, wheel_timer_t *timer) {
+	if (timer->pprev == NULL) {
+		return;
+	}
+	unlinkTimer(timer);
+	wheel->count--;
+}
+
+
+/**
+ * @brief Advance the wheel to the current time, expiring the timers due
+ *
+ * The callback may add timers, including the one expiring.
+ *
+ * @param	wheel	Wheel
+ * @param	now		Current time (wheelNow() seconds)
+ * @param	expire	Function called with each timer expiring, unlinked
+ * @param	arg		Argument passed to the callback
+ * @return	Number of timers expired
+ */
+int wheelAdvance(wheel_t *wheel, uint64_t now,
+		void (*expire)(wheel_timer_t *timer, void *arg), void *arg) {
+	wheel_timer_t *timer;
+	wheel_timer_t *list;
+	int expired = 0;
+	int level;
+	int idx;
+
+	while (wheel->now < now) {
+		wheel->now++;
+
+		// Cascade the levels whose period starts on this tick
+		for (level=1; level<WHEEL_LEVELS; level++) {
+			if (wheel->now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) {
+				break;
+			}
+			idx = (wheel->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS-1);
+			list = wheel->slots[level][idx];
+			wheel->slots[level][idx] = NULL;
+			wheel->occupied[level] &= ~((uint64_t) 1 << idx);
+			while ((timer = list) != NULL) {
+				list = timer->next;
+				linkTimer(wheel, timer);
+			}
+		}
+
+		idx = wheel->now & (WHEEL_SLOTS-1);
+		while ((timer = wheel->slots[0][idx]) != NULL) {
+			unlinkTimer(timer);
+			wheel->count--;
+			expired++;
+			expire(timer, arg);
+		}
+		wheel->occupied[0] &= ~((uint64_t) 1 << idx);
+	}
+
+	return expired;
+}
+
+
+/**
+ * @brief Get the time until the wheel has work to do
+ *
+ * That is the next tick with a timer due on level 0, or the next cascade of a
+ * slot in use on a higher level, whichever comes first.
+ *
+ * @param	wheel	Wheel
+ * @param	now		Current time (wheelNow() seconds)
+ * @return	Milliseconds to wait, for poll(), or -1 if the wheel is empty
+ */
+int wheelTimeout(wheel_t *wheel, uint64_t now) {
+	uint64_t next = UINT64_MAX;
+	uint64_t rot, at;
+	int from, dist;
+
+	if (wheel->count == 0) {
+		return -1;
+	}
+
+	for (int level=0; level<WHEEL_LEVELS; level++) {
+		if (wheel->occupied[level] == 0) {
+			continue;
+		}
+		// Distance from the slot after the current one, up to a full turn
+		from = ((wheel->now >> (WHEEL_BITS * level)) + 1) & (WHEEL_SLOTS-1);
+		rot = (wheel->occupied[level] >> from) |
+				(from ? wheel->occupied[level] << (WHEEL_SLOTS - from) : 0);
+		dist = __builtin_ctzll(rot) + 1;
+		at = ((wheel->now >> (WHEEL_BITS * level)) + dist) << (WHEEL_BITS * level);
+		if (at < next) {
+			next = at;
+		}
+	}
+
+	if (next <= now) {
+		return 0;
+	}
+	if (next - now > WHEEL_MAX_WAIT) {
+		return WHEEL_MAX_WAIT * 1000;
+	}
+	return (next - now) * 1000;
+}
@@ -54,15 +54,22 @@ bool isNumber(char number[]) {
  * @return	Struct with the parsed arguments
  */
 cmd_args_t parseArgs(int argc, char** argv) {
-	const char USAGE[MAX_ERROR_LEN] = "\nUsage:\n"
+	const char USAGE[] = "\nUsage:\n"
 			"./yash [options] <host>\n"
+			"./yash [options] -H FILE -c CMD\n"
 			"\n"
 			"Required arguments:\n"
 			"    host                    Yashd server host address\n"
 			"\n"
 			"Options:\n"
+			"    -c CMD, --command CMD   Command to run on every fan-out host\n"
 			"    -h, --help              Print help and exit\n"
-			"    -p PORT, --port PORT    Server port [1024-65535]\n";
+			"    -H FILE, --hosts FILE   Run the command on every HOST[:PORT] "
+			"listed in FILE\n"
+			"    -n N, --concurrency N   Max concurrent fan-out connections\n"
+			"    -p PORT, --port PORT    Server port [1024-65535]\n"
+			"    -t SEC, --timeout SEC   Seconds each fan-out host has to "
+			"finish\n";
 	const char ARG_ERROR[MAX_ERROR_LEN] = "-yash: wrong number of arguments\n";
 	const char H_FLAG_SHORT[3] = "-h\0";
 	const char H_FLAG_LONG[10] = "--help\0";
@@ -72,14 +79,23 @@ cmd_args_t parseArgs(int argc, char** argv) {
 	const char P_ERROR1[MAX_ERROR_LEN] = "-yash: missing port number\n";
 	const char P_ERROR2[MAX_ERROR_LEN] = "-yash: port must be an integer "
 			"between %d and %d\n";
-	cmd_args_t args = {EMPTY_STR, DEFAULT_TCP_PORT};
-
-	// Check we got the correct number of arguments
-	if (argc < 2 || argc > 4) {
-		printf(ARG_ERROR);
-		printf(USAGE);
-		exit(EXIT_ERR_ARG);
-	}
+	const char HOSTS_FLAG_SHORT[3] = "-H\0";
+	const char HOSTS_FLAG_LONG[10] = "--hosts\0";
+	const char HOSTS_ERROR[MAX_ERROR_LEN] = "-yash: missing host list path\n";
+	const char C_FLAG_SHORT[3] = "-c\0";
+	const char C_FLAG_LONG[10] = "--command\0";
+	const char C_ERROR1[MAX_ERROR_LEN] = "-yash: missing command\n";
+	const char C_ERROR2[MAX_ERROR_LEN] = "-yash: a host list needs a command\n";
+	const char N_FLAG_SHORT[3] = "-n\0";
+	const char N_FLAG_LONG[15] = "--concurrency\0";
+	const char N_ERROR[MAX_ERROR_LEN] = "-yash: concurrency must be a positive "
+			"integer\n";
+	const char T_FLAG_SHORT[3] = "-t\0";
+	const char T_FLAG_LONG[10] = "--timeout\0";
+	const char T_ERROR[MAX_ERROR_LEN] = "-yash: timeout must be a positive "
+			"integer\n";
+	cmd_args_t args = {EMPTY_STR, DEFAULT_TCP_PORT, EMPTY_STR, EMPTY_STR,
+			FANOUT_CONCURRENCY, FANOUT_TIMEOUT};
 
 	// Loop over the arguments, skipping the command token
 	for (int i=1; i<argc; i++) {
@@ -113,11 +129,60 @@ cmd_args_t parseArgs(int argc, char** argv) {
 			}
 
 			printf(P_INFO, args.port);
+		} else if (!strcmp(HOSTS_FLAG_SHORT, argv[i])
+				|| !strcmp(HOSTS_FLAG_LONG, argv[i])) {
+			if (i+1 >= argc || strlen(argv[i+1]) > PATHMAX) {
+				printf(HOSTS_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			i++;
+			strcpy(args.hosts, argv[i]);
+		} else if (!strcmp(C_FLAG_SHORT, argv[i])
+				|| !strcmp(C_FLAG_LONG, argv[i])) {
+			if (i+1 >= argc || strlen(argv[i+1]) >= MAX_CMD_LEN) {
+				printf(C_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			i++;
+			strcpy(args.command, argv[i]);
+		} else if (!strcmp(N_FLAG_SHORT, argv[i])
+				|| !strcmp(N_FLAG_LONG, argv[i])) {
+			if (i+1 >= argc || !isNumber(argv[i+1]) || atoi(argv[i+1]) <= 0) {
+				printf(N_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			i++;
+			args.concurrency = atoi(argv[i]);
+		} else if (!strcmp(T_FLAG_SHORT, argv[i])
+				|| !strcmp(T_FLAG_LONG, argv[i])) {
+			if (i+1 >= argc || !isNumber(argv[i+1]) || atoi(argv[i+1]) <= 0) {
+				printf(T_ERROR);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			i++;
+			args.timeout = atoi(argv[i]);
 		} else { // Assume this is the host address
-			strcpy(args.host, argv[i]);
+			strncpy(args.host, argv[i], MAX_HOSTNAME_LEN-1);
 		}
 	}
 
+	// Check we got a host, or a host list and a command
+	if (args.hosts[0] != '\0') {
+		if (args.command[0] == '\0') {
+			printf(C_ERROR2);
+			printf(USAGE);
+			exit(EXIT_ERR_ARG);
+		}
+	} else if (args.host[0] == '\0') {
+		printf(ARG_ERROR);
+		printf(USAGE);
+		exit(EXIT_ERR_ARG);
+	}
+
 	return args;
 }
 
@@ -142,21 +207,13 @@ void cleanBuffer(char *buffer) {
  */
 static void clientSignalHandler(int sigNum) {
 	if (sigNum == SIGINT) {
-		cleanBuffer(buff);
-		strcpy(buff, "CTL c\n");
-		rc = strlen(buff);
-		if (send(sd, buff, rc, 0) < 0)
+		if (yashSendCtl(sd, 'c') < 0)
 			perror("Send Msg");
-		cleanBuffer(buff);
 	}
 
 	if (sigNum == SIGTSTP) {
-		cleanBuffer(buff);
-		strcpy(buff, "CTL z\n");
-		rc = strlen(buff);
-		if (send(sd, buff, rc, 0) < 0)
+		if (yashSendCtl(sd, 'z') < 0)
 			perror("Send Msg");
-		cleanBuffer(buff);
 	}
 }
 
@@ -170,20 +227,16 @@ void receiveUserInput() {
 		printf("SIGSTP error");
 	if (signal(SIGINT, clientSignalHandler) == SIG_ERR)
 		printf("SIGINT error");
-	char *yashProtoBuf = malloc(sizeof(char) * MAX_INPT_LEN);
-	char inputCmd[] = "CMD ";
 	for (;;) {
 		cleanBuffer(buff);
-		cleanBuffer(yashProtoBuf);
-		if ((rc = read(0, buff, sizeof(buff)))) {
+		if ((rc = read(0, buff, sizeof(buff)-1))) {
 			if (strstr(buff, "exit")) {
 				break;
 			}
 			if (rc > 0) {
-				strcat(yashProtoBuf, inputCmd);
-				strcat(yashProtoBuf, buff);
-				rc = strlen(yashProtoBuf);
-				if (send(sd, yashProtoBuf, (size_t) rc, 0) < 0)
+				if (buff[rc-1] == '\n')
+					buff[rc-1] = '\0';
+				if (yashSendCmd(sd, buff) < 0)
 					perror("Sending Message");
 			}
 		}
@@ -206,12 +259,9 @@ void receiveUserInput() {
  */
 int main(int argc, char **argv) {
 	int child_pid;
-	struct sockaddr_in server;
-	struct hostent *h_name,* gethostbyname();
+	struct hostent *h_name;
 	struct sockaddr_in _from;
-	struct sockaddr_in _addr;
 	socklen_t _fromlen;
-	char thHost[MAX_HOSTNAME_LEN];
 
 	//uint16_t server_port = 3826;
 	//struct sockaddr_in client;
@@ -222,40 +272,23 @@ int main(int argc, char **argv) {
 	// Process command line arguments
 	args = parseArgs(argc, argv);
 
-	gethostname(thHost, MAX_HOSTNAME_LEN);
-
-	if ((h_name = gethostbyname(thHost)) == NULL) {
-		fprintf(stderr, "Invalid Host %s\n", args.host);
-		exit(EXIT_ERR_SOCKET);
+	// Run the command on every host in the list, instead of a session
+	if (args.hosts[0] != '\0') {
+		exit(runFanout(&args));
 	}
-	bcopy(h_name->h_addr, &(server.sin_addr), h_name->h_length);
 
-	if ((h_name = gethostbyname(args.host)) == NULL) {
-		_addr.sin_addr.s_addr = inet_addr(args.host);
-		if ((h_name = gethostbyaddr((char*) &_addr.sin_addr.s_addr,
-				sizeof(_addr.sin_addr.s_addr), AF_INET)) == NULL) {
+	// Connect, following the redirects of a loaded server
+	if ((sd = yashConnect(args.host, args.port)) < 0) {
+		if (sd == -YASH_ERR_RESOLVE) {
 			fprintf(stderr, "Can't find host %s\n", args.host);
-			exit(EXIT_ERR_SOCKET);
+		} else if (sd == -YASH_ERR_BUSY) {
+			fprintf(stderr, "Server %s is busy, try again later\n", args.host);
+		} else {
+			perror("connecting ...");
 		}
-	}
-	bcopy(h_name->h_addr, &(server.sin_addr), h_name->h_length);
-
-	server.sin_family = AF_INET;
-
-	server.sin_port = htons(args.port);
-
-	sd = socket(AF_INET, SOCK_STREAM, 0);
-
-	if (sd < 0) {
-		perror("Initializing the Socket Stream");
 		exit(EXIT_ERR_SOCKET);
 	}
 
-	if (connect(sd, (struct sockaddr*) &server, sizeof(server)) < 0) {
-		close(sd);
-		perror("connecting ...");
-		exit(EXIT_ERR_SOCKET);
-	}
 	_fromlen = sizeof(_from);
 	if (getpeername(sd, (struct sockaddr*) &_from, &_fromlen) < 0) {
 		perror("no  peer name\n");
@@ -23,35 +23,72 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include "yashd_defs.h"
+#include "yash_client.h"
 
 
 #define BUFFER_SIZE 50000
 #define MAX_INPT_LEN 200
+#define PATHMAX 255				//! Max length of a path
+#define FANOUT_CONCURRENCY 64	//! Default max concurrent fan-out connections
+#define FANOUT_TIMEOUT 10		//! Default seconds a fan-out host has to finish
+#define FANOUT_LINE_LEN 4096	//! Longest output line kept before flushing it
 
 
 /**
  * @brief Struct to organize all the command line arguments.
  *
  * Arguments:
- *   - verbose: enable debugging log output
+ *   - host: address of the yashd server
  *   - port: port of the TCP server
+ *   - hosts: path of the fan-out host list (empty for an interactive session)
+ *   - command: command to run on every fan-out host
+ *   - concurrency: max concurrent fan-out connections
+ *   - timeout: seconds each fan-out host has to finish
  */
 typedef struct _cmd_args_t {
 	char host[MAX_HOSTNAME_LEN];	// Host address
 	int port;						// Server port
+	char hosts[PATHMAX+1];			// Fan-out host list path
+	char command[MAX_CMD_LEN];		// Fan-out command
+	int concurrency;				// Fan-out concurrency cap
+	int timeout;					// Fan-out per-host timeout
 } cmd_args_t;
 
 
+/**
+ * @brief Struct to keep the state of a fan-out host
+ */
+typedef struct _fanout_host_t {
+	char host[MAX_HOSTNAME_LEN];	// Host address
+	int port;						// Server port
+	int result;						// YASH_OK, YASH_ERR_CMD...
+	int exit_code;					// Exit code of the command, 0 if unknown
+	char line[FANOUT_LINE_LEN+1];	// Output line being received
+	size_t line_len;				// Length of the output line
+} fanout_host_t;
+
+
 // Functions
 bool isNumber(char number[]);
 cmd_args_t parseArgs(int argc, char** argv);
 void cleanBuffer(char *buffer);
-static void clientSignalHandler(int sigNum);
 void receiveUserInput();
 int main(int argc, char **argv);
 
+// Fan-out functions
+fanout_host_t *loadHosts(char *path, int port, int *count);
+void flushHostLine(fanout_host_t *fh);
+void onHostOutput(yash_cmd_t *cmd, const char *data, size_t len, void *ctx);
+void onHostDone(yash_cmd_t *cmd, int status, const yash_exit_t *ex, void *ctx);
+int runFanout(cmd_args_t *args);
+
 
 #endif /* YASH_H_ */
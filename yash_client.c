@@ -0,0 +1,979 @@
+/**
+ * @file yash_client.c
+ *
+ * @brief Client API to run commands on yashd servers
+ *
+ * The protocol handling of the yash client: connecting (following the
+ * redirects of loaded servers), sending commands and control messages, and
+ * telling a command's output from the prompt that ends it. The event driven
+ * client runs it for many commands at once from a single poll() loop.
+ *
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "frame.h"
+#include "yash_time.h"
+#include "yash_client.h"
+
+
+//! Status names, indexed by YASH_OK, YASH_ERR_CMD...
+static const char *STATUS_NAMES[] = {"ok", "command failed", "unknown host",
+		"could not connect", "timed out", "disconnected", "server busy"};
+
+
+/**
+ * @brief Resolve a server address
+ *
+ * @param	host	Server host
+ * @param	port	Server port
+ * @param	server	Resolved address
+ * @return	0 on success, or -1 if the host is unknown
+ */
+static int resolveServer(const char *host, int port, struct sockaddr_in *server) {
+	struct hostent *h_name;
+
+	if ((h_name = gethostbyname(host)) == NULL) {
+		return -1;
+	}
+	memset(server, 0, sizeof(*server));
+	memcpy(&server->sin_addr, h_name->h_addr, h_name->h_length);
+	server->sin_family = AF_INET;
+	server->sin_port = htons(port);
+
+	return 0;
+}
+
+
+/**
+ * @brief Split a redirect line into the peer's host and port
+ *
+ * @param	line	`REDIRECT host:port` line, without the newline. It is split
+ * 					in place.
+ * @param	port	Peer port
+ * @return	Peer host, or NULL if the line is malformed
+ */
+static char *parseRedirect(char *line, int *port) {
+	char *target = line + strlen(MSG_TYPE_REDIRECT);
+	char *sep;
+
+	if ((sep = strrchr(target, ':')) == NULL ||
+			sep - target >= MAX_HOSTNAME_LEN) {
+		return NULL;
+	}
+	*sep = '\0';
+	*port = atoi(sep+1);
+
+	return target;
+}
+
+
+/**
+ * @brief Connect to a yashd server, following its redirects
+ *
+ * A saturated daemon names a less loaded peer with a `REDIRECT host:port`
+ * line instead of sending the prompt. The connection is moved to the peer, up
+ * to MAX_REDIRECTS times. The prompt is left unread.
+ *
+ * @param	host	Server host
+ * @param	port	Server port
+ * @return	Connected socket, or -YASH_ERR_RESOLVE, -YASH_ERR_CONNECT or
+ * 			-YASH_ERR_BUSY on error
+ */
+int yashConnect(const char *host, int port) {
+	struct sockaddr_in server;
+	char msg[MAX_HOSTNAME_LEN+16];
+	char target[MAX_HOSTNAME_LEN];
+	char *end;
+	ssize_t n;
+	int sd;
+
+	for (int hops=0; hops<=MAX_REDIRECTS; hops++) {
+		if (resolveServer(host, port, &server) < 0) {
+			return -YASH_ERR_RESOLVE;
+		}
+		if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			return -YASH_ERR_CONNECT;
+		}
+		if (connect(sd, (struct sockaddr*) &server, sizeof(server)) < 0) {
+			close(sd);
+			return -YASH_ERR_CONNECT;
+		}
+
+		// Peek, so the prompt is left for the caller
+		if ((n = recv(sd, msg, sizeof(msg)-1, MSG_PEEK)) <= 0) {
+			return sd;
+		}
+		msg[n] = '\0';
+		if (!strncmp(msg, MSG_TYPE_BUSY, strlen(MSG_TYPE_BUSY))) {
+			close(sd);
+			return -YASH_ERR_BUSY;
+		}
+		if (strncmp(msg, MSG_TYPE_REDIRECT, strlen(MSG_TYPE_REDIRECT)) ||
+				(end = strchr(msg, '\n')) == NULL) {
+			return sd;
+		}
+		close(sd);
+		*end = '\0';
+
+		if ((host = parseRedirect(msg, &port)) == NULL) {
+			return -YASH_ERR_CONNECT;
+		}
+		strcpy(target, host);
+		host = target;
+	}
+
+	return -YASH_ERR_CONNECT;
+}
+
+
+/**
+ * @brief Send a command
+ *
+ * @param	sd	Connected socket
+ * @param	cmd	Command line, without the trailing newline
+ * @return	0 on success, or -1 on error
+ */
+int yashSendCmd(int sd, const char *cmd) {
+	char msg[MAX_CMD_LEN+6];
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "CMD %s\n", cmd);
+	if (len >= (int) sizeof(msg)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return sendAll(sd, msg, len);
+}
+
+
+/**
+ * @brief Send a control message
+ *
+ * Only calls send(), so it is safe in a signal handler.
+ *
+ * @param	sd	Connected socket
+ * @param	ctl	Control character: 'c' (SIGINT), 'z' (SIGTSTP) or 'd' (EOF)
+ * @return	0 on success, or -1 on error
+ */
+int yashSendCtl(int sd, char ctl) {
+	char msg[] = "CTL x\n";
+
+	msg[4] = ctl;
+	return sendAll(sd, msg, sizeof(msg)-1);
+}
+
+
+/**
+ * @brief Negotiate the protocol of a new connection
+ *
+ * Sends HELLO, and reads up to the prompt that follows the server's HELLO
+ * line, skipping the first prompt and any notices before it. Servers that
+ * predate HELLO ignore it: if no reply comes within YASH_HELLO_TIMEOUT ms of
+ * the first prompt, the connection is left as is, with the features the
+ * protocol had before HELLO (version 0, PROTO_FEAT_LEGACY, LZ still to be
+ * confirmed by the MUX frame). The next prompt is left unread either way.
+ *
+ * @param	sd		Socket returned by yashConnect()
+ * @param	hello	Struct to store the protocol settled in
+ * @return	1 if the server answered, 0 if it predates HELLO, or -1 on error
+ */
+int yashHello(int sd, yash_hello_t *hello) {
+	char line[MAX_HOSTNAME_LEN];
+	char tail[sizeof(YASH_PROMPT)] = { 0 };
+	size_t plen = strlen(YASH_PROMPT);
+	size_t len = 0;
+	struct pollfd pfd = {sd, POLLIN, 0};
+	int64_t deadline = -1;
+	bool answered = false;
+	char *p;
+	char c;
+	int n;
+
+	*hello = (yash_hello_t) {0, PROTO_FEAT_LEGACY, FRAME_MAX_PAYLOAD, 0};
+	n = snprintf(line, sizeof(line), "%s%d %x %u\n", MSG_TYPE_HELLO,
+			PROTO_VERSION, PROTO_FEATURES, FRAME_MAX_PAYLOAD);
+	if (sendAll(sd, line, n) < 0) {
+		return -1;
+	}
+
+	while (true) {
+		// Byte by byte, so nothing after the prompt is consumed
+		if (deadline >= 0) {
+			n = deadline - (int64_t) (nowUs() / 1000);
+			if (n <= 0 || poll(&pfd, 1, n) == 0) {
+				return 0;
+			}
+		}
+		if (recvAll(sd, &c, 1) <= 0) {
+			return -1;
+		}
+
+		memmove(tail, &tail[1], plen - 1);
+		tail[plen - 1] = c;
+		if (!memcmp(tail, YASH_PROMPT, plen)) {
+			if (answered) {
+				return 1;
+			}
+			deadline = (int64_t) (nowUs() / 1000) + YASH_HELLO_TIMEOUT;
+		}
+
+		if (c != '\n') {
+			if (len < sizeof(line) - 1) {
+				line[len++] = c;
+			}
+			continue;
+		}
+		line[len] = '\0';
+		len = 0;
+		p = line;
+		if (!strncmp(p, "# ", 2)) {	// The HELLO line follows the first prompt
+			p += 2;
+		}
+		if (!strncmp(p, MSG_TYPE_HELLO, strlen(MSG_TYPE_HELLO)) &&
+				sscanf(&p[strlen(MSG_TYPE_HELLO)], "%d %x %u %lx",
+						&hello->version, &hello->features, &hello->max_frame,
+						&hello->token) == 4) {
+			answered = true;
+		}
+	}
+}
+
+
+/**
+ * @brief Parse the EXIT line the server sends after each job
+ *
+ * Servers only send it to sessions that asked for PROTO_FEAT_EXIT with
+ * yashHello().
+ *
+ * @param	line	Line of output, with or without its newline
+ * @param	ex		Struct to store the job's status in
+ * @return	True if the line is an EXIT line, false otherwise
+ */
+bool yashParseExit(const char *line, yash_exit_t *ex) {
+	char how[8];
+
+	if (!strncmp(line, "# ", 2)) {	// Right after a prompt
+		line += 2;
+	}
+	if (strncmp(line, MSG_TYPE_EXIT, strlen(MSG_TYPE_EXIT)) ||
+			sscanf(&line[strlen(MSG_TYPE_EXIT)], "%d %7s %d %lu %lu %lu",
+					&ex->jobno, how, &ex->code, &ex->wall_us, &ex->user_us,
+					&ex->sys_us) != 6) {
+		return false;
+	}
+	ex->signaled = !strcmp(how, "signal");
+
+	return true;
+}
+
+
+/**
+ * @brief Get the name of a command status
+ *
+ * @param	status	YASH_OK, YASH_ERR_CMD...
+ * @return	Status name
+ */
+const char *yashStatusStr(int status) {
+	if (status < YASH_OK || status > YASH_ERR_BUSY) {
+		return "unknown";
+	}
+	return STATUS_NAMES[status];
+}
+
+
+/**
+ * @brief Start connecting without blocking
+ *
+ * The protocol is negotiated with helloConn() once the connection is up.
+ *
+ * @param	conn	Connection
+ * @param	host	Server host
+ * @param	port	Server port
+ * @return	0 on success, or the command status if it failed right away
+ */
+static int startConn(yash_conn_t *conn, const char *host, int port) {
+	struct sockaddr_in server;
+
+	conn->state = YASH_CONN_CONNECTING;
+	conn->line_len = 0;
+	conn->features = 0;
+	conn->hello = false;
+
+	if (resolveServer(host, port, &server) < 0) {
+		return YASH_ERR_RESOLVE;
+	}
+	if ((conn->sd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return YASH_ERR_CONNECT;
+	}
+	fcntl(conn->sd, F_SETFL, O_NONBLOCK);
+	if (connect(conn->sd, (struct sockaddr*) &server, sizeof(server)) < 0 &&
+			errno != EINPROGRESS) {
+		return YASH_ERR_CONNECT;
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Ask a connected session for the EXIT line after each job
+ *
+ * The reply is read by readConn(), on the way to the prompt the command is
+ * sent after.
+ *
+ * @param	conn	Connection, just connected
+ * @return	0 on success, or -1 on error
+ */
+static int helloConn(yash_conn_t *conn) {
+	char line[64];
+	int n;
+
+	n = snprintf(line, sizeof(line), "%s%d %x %u\n", MSG_TYPE_HELLO,
+			PROTO_VERSION, PROTO_FEAT_EXIT, FRAME_MAX_PAYLOAD);
+	conn->state = YASH_CONN_PROMPT;
+
+	return sendAll(conn->sd, line, n);
+}
+
+
+/**
+ * @brief Close a connection, and drop it from the client
+ *
+ * Sessions left idle are ended politely, so the server does not log an error.
+ *
+ * @param	client	Client
+ * @param	idx		Index of the connection
+ */
+static void closeConn(yash_client_t *client, int idx) {
+	yash_conn_t *conn = client->conns[idx];
+
+	if (conn->sd >= 0) {
+		if (conn->state == YASH_CONN_IDLE) {
+			yashSendCtl(conn->sd, 'd');
+		}
+		close(conn->sd);
+	}
+	free(conn);
+
+	client->n_conns--;
+	client->conns[idx] = client->conns[client->n_conns];
+	client->pollfds[idx] = client->pollfds[client->n_conns];
+}
+
+
+/**
+ * @brief Report a command's status, and free it
+ *
+ * @param	client	Client
+ * @param	cmd		Command, already out of the queue
+ * @param	status	YASH_OK, YASH_ERR_CMD...
+ */
+static void finishCmd(yash_client_t *client, yash_cmd_t *cmd, int status) {
+	if (cmd->conn != NULL) {
+		cmd->conn->cmd = NULL;
+		cmd->conn = NULL;
+		client->n_running--;
+	}
+	if (cmd->on_done != NULL) {
+		cmd->on_done(cmd, status, cmd->exited ? &cmd->exit : NULL, cmd->ctx);
+	}
+	free(cmd);
+}
+
+
+/**
+ * @brief Pass output to a command's callback, watching for error messages
+ *
+ * @param	cmd		Command
+ * @param	data	Output
+ * @param	len		Output length
+ */
+static void feedOutput(yash_cmd_t *cmd, const char *data, size_t len) {
+	static const char prefix[] = YASH_ERR_PREFIX;
+
+	for (size_t i=0; i<len && cmd->status == YASH_OK; i++) {
+		if (data[i] == '\n') {
+			cmd->err_match = 0;
+		} else if (cmd->err_match >= 0 && data[i] == prefix[cmd->err_match]) {
+			if (++cmd->err_match == sizeof(prefix)-1) {
+				cmd->status = YASH_ERR_CMD;
+			}
+		} else {
+			cmd->err_match = -1;
+		}
+	}
+
+	if (len > 0 && cmd->on_output != NULL) {
+		cmd->on_output(cmd, data, len, cmd->ctx);
+	}
+}
+
+
+/**
+ * @brief Send a command on a connection that got the prompt
+ *
+ * @param	conn	Connection, with its command set
+ * @return	0 on success, or -1 on error
+ */
+static int sendConn(yash_conn_t *conn) {
+	if (yashSendCmd(conn->sd, conn->cmd->command) < 0) {
+		return -1;
+	}
+	conn->state = YASH_CONN_RUNNING;
+	conn->held_len = 0;
+
+	return 0;
+}
+
+
+/**
+ * @brief Create a client
+ *
+ * @param	max_conns	Max connections open at a time
+ * @param	timeout		Seconds each command has to finish, from the moment it
+ * 						leaves the queue, or 0 for no limit
+ * @return	Client, or NULL on error
+ */
+yash_client_t *yashClientNew(int max_conns, int timeout) {
+	yash_client_t *client;
+
+	if ((client = calloc(1, sizeof(yash_client_t))) == NULL) {
+		return NULL;
+	}
+	client->max_conns = max_conns;
+	client->timeout = timeout;
+	client->conns = calloc(max_conns, sizeof(yash_conn_t *));
+	client->pollfds = calloc(max_conns, sizeof(struct pollfd));
+	if (client->conns == NULL || client->pollfds == NULL) {
+		yashClientFree(client);
+		return NULL;
+	}
+
+	return client;
+}
+
+
+/**
+ * @brief Free a client, closing its connections
+ *
+ * Commands still queued or running are dropped without calling back.
+ *
+ * @param	client	Client
+ */
+void yashClientFree(yash_client_t *client) {
+	yash_cmd_t *cmd;
+
+	while (client->n_conns > 0) {
+		free(client->conns[client->n_conns-1]->cmd);
+		closeConn(client, client->n_conns-1);
+	}
+	while ((cmd = client->queue) != NULL) {
+		client->queue = cmd->next;
+		free(cmd);
+	}
+	free(client->pollfds);
+	free(client->conns);
+	free(client);
+}
+
+
+/**
+ * @brief Queue a command
+ *
+ * The command starts on the next call to yashPoll(), on a pooled session of
+ * the server if there is one.
+ *
+ * @param	client		Client
+ * @param	host		Server host
+ * @param	port		Server port
+ * @param	command		Command line, without the trailing newline
+ * @param	on_output	Output callback, may be NULL
+ * @param	on_done		Done callback, may be NULL
+ * @param	ctx			Context passed to the callbacks
+ * @return	Command, valid until its done callback returns, or NULL on error
+ */
+yash_cmd_t *yashRun(yash_client_t *client, const char *host, int port,
+		const char *command, yash_output_cb_t on_output, yash_done_cb_t on_done,
+		void *ctx) {
+	yash_cmd_t *cmd;
+
+	if (strlen(host) >= MAX_HOSTNAME_LEN || strlen(command) >= MAX_CMD_LEN) {
+		errno = EMSGSIZE;
+		return NULL;
+	}
+	if ((cmd = calloc(1, sizeof(yash_cmd_t))) == NULL) {
+		return NULL;
+	}
+	strcpy(cmd->host, host);
+	cmd->port = port;
+	strcpy(cmd->command, command);
+	cmd->on_output = on_output;
+	cmd->on_done = on_done;
+	cmd->ctx = ctx;
+
+	if (client->queue_tail != NULL) {
+		client->queue_tail->next = cmd;
+	} else {
+		client->queue = cmd;
+	}
+	client->queue_tail = cmd;
+	client->n_queued++;
+
+	return cmd;
+}
+
+
+/**
+ * @brief Send a control message to a running command
+ *
+ * @param	cmd	Command
+ * @param	ctl	Control character: 'c' (SIGINT) or 'z' (SIGTSTP)
+ * @return	0 on success, or -1 if the command is not running
+ */
+int yashSignal(yash_cmd_t *cmd, char ctl) {
+	if (cmd->conn == NULL || cmd->conn->state != YASH_CONN_RUNNING) {
+		errno = ENOTCONN;
+		return -1;
+	}
+	return yashSendCtl(cmd->conn->sd, ctl);
+}
+
+
+/**
+ * @brief Take a command out of the queue
+ *
+ * @param	client	Client
+ * @param	prev	Command before it in the queue, NULL if it is the first
+ * @param	cmd		Command
+ */
+static void dequeue(yash_client_t *client, yash_cmd_t *prev, yash_cmd_t *cmd) {
+	if (prev != NULL) {
+		prev->next = cmd->next;
+	} else {
+		client->queue = cmd->next;
+	}
+	if (client->queue_tail == cmd) {
+		client->queue_tail = prev;
+	}
+	cmd->next = NULL;
+	client->n_queued--;
+}
+
+
+/**
+ * @brief Start the queued commands that can get a connection
+ *
+ * A command takes a pooled session of its server if there is one. Otherwise
+ * it opens a new connection, closing the oldest idle session of another
+ * server if the client is at its connection cap.
+ *
+ * @param	client	Client
+ * @param	now		Current time (ms)
+ */
+static void dispatch(yash_client_t *client, int64_t now) {
+	int64_t deadline = (client->timeout > 0) ?
+			now + (int64_t) client->timeout * 1000 : INT64_MAX;
+	yash_cmd_t *prev, *cmd, *next;
+	yash_conn_t *conn;
+	int idle, oldest, status;
+
+	// Hand out the pooled sessions first, so none is closed while a queued
+	// command could still run on it
+	for (int pass=0; pass<2; pass++) {
+		prev = NULL;
+		for (cmd = client->queue; cmd != NULL; cmd = next) {
+			next = cmd->next;
+
+			// Look for a pooled session of the server, and the oldest idle one
+			idle = oldest = -1;
+			for (int i=0; i<client->n_conns && idle < 0; i++) {
+				conn = client->conns[i];
+				if (conn->state != YASH_CONN_IDLE) {
+					continue;
+				}
+				if (conn->port == cmd->port && !strcmp(conn->host, cmd->host)) {
+					idle = i;
+				} else if (oldest < 0 ||
+						conn->idle_since < client->conns[oldest]->idle_since) {
+					oldest = i;
+				}
+			}
+
+			if (idle >= 0) {
+				conn = client->conns[idle];
+				conn->cmd = cmd;
+				if (sendConn(conn) < 0) {
+					// The session is gone, try the command again without it
+					conn->cmd = NULL;
+					conn->state = YASH_CONN_RUNNING;	// No goodbye
+					closeConn(client, idle);
+					next = cmd;
+					continue;
+				}
+				dequeue(client, prev, cmd);
+				cmd->deadline = deadline;
+				cmd->conn = conn;
+				client->n_running++;
+				continue;
+			}
+
+			if (pass == 0) {
+				prev = cmd;
+				continue;
+			}
+			if (client->n_conns >= client->max_conns) {
+				if (oldest < 0) {
+					prev = cmd;
+					continue;	// Every connection is busy
+				}
+				closeConn(client, oldest);
+			}
+
+			// Open a new session for the command
+			dequeue(client, prev, cmd);
+			cmd->deadline = deadline;
+			if ((conn = calloc(1, sizeof(yash_conn_t))) == NULL) {
+				finishCmd(client, cmd, YASH_ERR_CONNECT);
+				continue;
+			}
+			strcpy(conn->host, cmd->host);
+			conn->port = cmd->port;
+			conn->sd = -1;
+			conn->cmd = cmd;
+			cmd->conn = conn;
+			client->conns[client->n_conns++] = conn;
+			client->n_running++;
+
+			if ((status = startConn(conn, cmd->host, cmd->port)) != 0) {
+				finishCmd(client, cmd, status);
+				closeConn(client, client->n_conns-1);
+			}
+		}
+	}
+}
+
+
+/**
+ * @brief Check if some output may be the start of the EXIT line and the
+ * prompt that end a command
+ *
+ * @param	data	Output
+ * @param	len		Output length
+ * @return	True if it may be, false otherwise
+ */
+static bool exitTail(const char *data, size_t len) {
+	const size_t exit_len = strlen(MSG_TYPE_EXIT);
+	size_t i;
+
+	if (memcmp(data, MSG_TYPE_EXIT, len < exit_len ? len : exit_len)) {
+		return false;
+	}
+	for (i=exit_len; i<len && data[i] != '\n'; i++) {
+		if (!isalnum((unsigned char) data[i]) && data[i] != ' ' &&
+				data[i] != '-') {
+			return false;
+		}
+	}
+	if (i >= EXIT_LINE_LEN - 1) {
+		return false;
+	}
+	if (i == len) {
+		return true;
+	}
+
+	// What follows the newline may be the start of the prompt
+	i++;
+	return len - i <= strlen(YASH_PROMPT) &&
+			!memcmp(&data[i], YASH_PROMPT, len - i);
+}
+
+
+/**
+ * @brief Handle a running command's output, up to the prompt that ends it
+ *
+ * The last bytes of the output are held back while they may be the start of
+ * the prompt, or of the EXIT line that comes right before it. The EXIT line is
+ * not passed on as output, its status is kept for the done callback.
+ *
+ * @param	conn	Connection
+ * @param	data	Output received, with room for the held back bytes before it
+ * @param	len		Output length
+ * @return	True if the prompt was received, false otherwise
+ */
+static bool outputConn(yash_conn_t *conn, char *data, size_t len) {
+	const size_t prompt_len = strlen(YASH_PROMPT);
+	bool exits = (conn->features & PROTO_FEAT_EXIT) != 0;
+	char line[EXIT_LINE_LEN];
+	size_t keep, start;
+
+	// Put the held back bytes in front of what was received
+	data -= conn->held_len;
+	memcpy(data, conn->held, conn->held_len);
+	len += conn->held_len;
+	conn->held_len = 0;
+
+	if (len >= prompt_len && !memcmp(data + len - prompt_len, YASH_PROMPT,
+			prompt_len)) {
+		len -= prompt_len;
+
+		// Take the job's EXIT line off the end of the output
+		start = (len > EXIT_LINE_LEN - 1) ? len - (EXIT_LINE_LEN - 1) : 0;
+		for (size_t i=len; exits && i-- > start; ) {
+			if (data[len-1] == '\n' && exitTail(&data[i], len - i)) {
+				memcpy(line, &data[i], len - i);
+				line[len - i] = '\0';
+				if (yashParseExit(line, &conn->cmd->exit)) {
+					conn->cmd->exited = true;
+					len = i;
+					break;
+				}
+			}
+		}
+
+		feedOutput(conn->cmd, data, len);
+		return true;
+	}
+
+	// Hold back the longest tail that starts the prompt, or the EXIT line
+	for (keep = prompt_len-1; keep > 0; keep--) {
+		if (len >= keep && !memcmp(data + len - keep, YASH_PROMPT, keep)) {
+			break;
+		}
+	}
+	start = (len > sizeof(conn->held) - 1) ? len - (sizeof(conn->held) - 1) : 0;
+	for (size_t i=start; exits && len - i > keep; i++) {
+		if (exitTail(&data[i], len - i)) {
+			keep = len - i;
+			break;
+		}
+	}
+	feedOutput(conn->cmd, data, len - keep);
+	memcpy(conn->held, data + len - keep, keep);
+	conn->held_len = keep;
+
+	return false;
+}
+
+
+/**
+ * @brief Read what a server sent, and move its connection along its states
+ *
+ * @param	client	Client
+ * @param	idx		Index of the connection
+ * @param	now		Current time (ms)
+ * @return	True if the connection was closed, false otherwise
+ */
+static bool readConn(yash_client_t *client, int idx, int64_t now) {
+	yash_conn_t *conn = client->conns[idx];
+	char buf[sizeof(conn->held) + BUFSIZ];
+	char *data = buf + sizeof(conn->held);
+	char *host, *p;
+	int port, status;
+	ssize_t n;
+
+	if ((n = recv(conn->sd, data, BUFSIZ, 0)) < 0 &&
+			(errno == EAGAIN || errno == EINTR)) {
+		return false;
+	}
+	if (n <= 0) {	// Hung up
+		if (conn->cmd != NULL) {
+			feedOutput(conn->cmd, conn->held, conn->held_len);
+			finishCmd(client, conn->cmd, YASH_ERR_DISCONNECT);
+		}
+		closeConn(client, idx);
+		return true;
+	}
+
+	switch (conn->state) {
+	case YASH_CONN_PROMPT:
+	case YASH_CONN_HELLO:
+		for (ssize_t i=0; i<n; i++) {
+			if (data[i] != '\n') {
+				if (conn->line_len < sizeof(conn->line)-1) {
+					conn->line[conn->line_len++] = data[i];
+				}
+				continue;
+			}
+			conn->line[conn->line_len] = '\0';
+			conn->line_len = 0;
+			p = conn->line;
+			if (!strncmp(p, "# ", 2)) {	// The HELLO line follows a prompt
+				p += 2;
+			}
+			if (!strncmp(p, MSG_TYPE_HELLO, strlen(MSG_TYPE_HELLO)) &&
+					sscanf(&p[strlen(MSG_TYPE_HELLO)], "%*d %x",
+							&conn->features) == 1) {
+				conn->hello = true;
+				continue;
+			}
+			if (!strncmp(conn->line, MSG_TYPE_BUSY, strlen(MSG_TYPE_BUSY))) {
+				if (conn->cmd != NULL) {
+					finishCmd(client, conn->cmd, YASH_ERR_BUSY);
+				}
+				closeConn(client, idx);
+				return true;
+			}
+			if (strncmp(conn->line, MSG_TYPE_REDIRECT, strlen(MSG_TYPE_REDIRECT))) {
+				continue;
+			}
+
+			// Move to the peer the server named
+			close(conn->sd);
+			conn->sd = -1;
+			if (++conn->redirects > MAX_REDIRECTS ||
+					(host = parseRedirect(conn->line, &port)) == NULL) {
+				status = YASH_ERR_CONNECT;
+			} else {
+				status = startConn(conn, host, port);
+			}
+			if (status != 0) {
+				finishCmd(client, conn->cmd, status);
+				closeConn(client, idx);
+				return true;
+			}
+			return false;
+		}
+
+		// The prompt comes alone after its newline
+		if (conn->line_len != strlen(YASH_PROMPT)-1 ||
+				strncmp(conn->line, YASH_PROMPT + 1, conn->line_len)) {
+			return false;
+		}
+		conn->line_len = 0;
+
+		// The HELLO reply follows the first prompt. A server that predates
+		// HELLO does not reply, see yashPoll().
+		if (!conn->hello && conn->state == YASH_CONN_PROMPT) {
+			conn->state = YASH_CONN_HELLO;
+			conn->hello_deadline = now + YASH_HELLO_TIMEOUT;
+			return false;
+		}
+		if (sendConn(conn) < 0) {
+			finishCmd(client, conn->cmd, YASH_ERR_DISCONNECT);
+			closeConn(client, idx);
+			return true;
+		}
+		return false;
+	case YASH_CONN_RUNNING:
+		if (outputConn(conn, data, n)) {
+			conn->state = YASH_CONN_IDLE;
+			conn->idle_since = now;
+			finishCmd(client, conn->cmd, conn->cmd->status);
+		}
+		return false;
+	default:	// Output of background jobs while idle is dropped
+		return false;
+	}
+}
+
+
+/**
+ * @brief Run the client's event loop once
+ *
+ * Starts the queued commands that can get a connection, waits for the servers
+ * to answer (up to the given timeout, or the nearest command deadline), and
+ * invokes the callbacks.
+ *
+ * @param	client	Client
+ * @param	timeout	Milliseconds to wait, or -1 to wait until something happens
+ * @return	Number of commands queued or running, or -1 on error
+ */
+int yashPoll(yash_client_t *client, int timeout) {
+	int64_t now = (int64_t) (nowUs() / 1000);
+	int64_t wait_ms = (timeout < 0) ? INT64_MAX : timeout;
+	yash_conn_t *conn;
+	socklen_t len;
+	int err;
+
+	dispatch(client, now);
+
+	// Close the sessions idle for too long
+	for (int i=client->n_conns-1; i>=0; i--) {
+		conn = client->conns[i];
+		if (conn->state == YASH_CONN_IDLE &&
+				now - conn->idle_since >= YASH_IDLE_TIMEOUT * 1000) {
+			closeConn(client, i);
+		}
+	}
+
+	if (client->n_running == 0) {
+		return client->n_queued;
+	}
+
+	// Wait until the nearest deadline at most
+	for (int i=0; i<client->n_conns; i++) {
+		conn = client->conns[i];
+		client->pollfds[i].fd = conn->sd;
+		client->pollfds[i].events = (conn->state == YASH_CONN_CONNECTING) ?
+				POLLOUT : POLLIN;
+		client->pollfds[i].revents = 0;
+		if (conn->cmd != NULL && conn->cmd->deadline - now < wait_ms) {
+			wait_ms = conn->cmd->deadline - now;
+		}
+		if (conn->state == YASH_CONN_HELLO &&
+				conn->hello_deadline - now < wait_ms) {
+			wait_ms = conn->hello_deadline - now;
+		}
+	}
+	if (wait_ms == INT64_MAX) {
+		wait_ms = -1;
+	} else if (wait_ms < 0) {
+		wait_ms = 0;
+	} else if (wait_ms > INT32_MAX) {
+		wait_ms = INT32_MAX;
+	}
+	if (poll(client->pollfds, client->n_conns, (int) wait_ms) < 0 &&
+			errno != EINTR) {
+		return -1;
+	}
+
+	// Walk backwards, since closing a connection moves the last one in its slot
+	now = (int64_t) (nowUs() / 1000);
+	for (int i=client->n_conns-1; i>=0; i--) {
+		conn = client->conns[i];
+
+		if (conn->state == YASH_CONN_CONNECTING && client->pollfds[i].revents) {
+			len = sizeof(err);
+			if (getsockopt(conn->sd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+					err != 0 || helloConn(conn) < 0) {
+				finishCmd(client, conn->cmd, YASH_ERR_CONNECT);
+				closeConn(client, i);
+				continue;
+			}
+		} else if (client->pollfds[i].revents && readConn(client, i, now)) {
+			continue;
+		}
+
+		// No HELLO reply after the first prompt: the server predates HELLO,
+		// and its prompt was the one to send the command after
+		if (conn->state == YASH_CONN_HELLO && now >= conn->hello_deadline &&
+				sendConn(conn) < 0) {
+			finishCmd(client, conn->cmd, YASH_ERR_DISCONNECT);
+			closeConn(client, i);
+			continue;
+		}
+
+		if (conn->cmd != NULL && now >= conn->cmd->deadline) {
+			finishCmd(client, conn->cmd, YASH_ERR_TIMEOUT);
+			closeConn(client, i);
+		}
+	}
+
+	// Hand the sessions just freed to the queued commands
+	dispatch(client, now);
+
+	return client->n_queued + client->n_running;
+}
@@ -0,0 +1,194 @@
+/**
+ * @file yash_client.h
+ *
+ * @brief Client API to run commands on yashd servers
+ *
+ * An event driven client: commands are queued with yashRun(), and one thread
+ * drives them all by calling yashPoll(), which invokes the output and done
+ * callbacks as the servers answer. Nothing blocks, so one process can keep
+ * thousands of remote commands in flight without spawning a process for each.
+ *
+ * Connections are pooled: when a command finishes, its session goes back to
+ * the pool and the next command for the same server runs on it right away,
+ * skipping the connection and prompt round trips. Each new session asks for
+ * PROTO_FEAT_EXIT with a HELLO, so the done callback gets the exit status of
+ * the command's job from the EXIT line that precedes its prompt. Example:
+ *
+ * @code
+ * void onOutput(yash_cmd_t *cmd, const char *data, size_t len, void *ctx) {
+ * 	fwrite(data, 1, len, stdout);
+ * }
+ * void onDone(yash_cmd_t *cmd, int status, const yash_exit_t *ex, void *ctx) {
+ * 	printf("%s: %s, exit %d\n", cmd->command, yashStatusStr(status),
+ * 			ex != NULL ? ex->code : -1);
+ * }
+ *
+ * yash_client_t *client = yashClientNew(64, 10);
+ * yashRun(client, "host1", 3826, "uname -a", onOutput, onDone, NULL);
+ * yashRun(client, "host2", 3826, "uname -a", onOutput, onDone, NULL);
+ * while (yashPoll(client, -1) > 0);
+ * yashClientFree(client);
+ * @endcode
+ *
+ * The client is not thread safe: use it from one thread, or one client per
+ * thread.
+ *
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ */
+
+#ifndef YASH_CLIENT_H_
+#define YASH_CLIENT_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <poll.h>
+#include "yashd_defs.h"
+
+
+#define YASH_PROMPT "\n# "			//! Prompt the server sends when it is ready
+#define YASH_ERR_PREFIX "-yash: "	//! Prefix of the server's error messages
+#define YASH_IDLE_TIMEOUT 60		//! Seconds a pooled session is kept idle
+#define YASH_HELLO_TIMEOUT 1000		//! Milliseconds to wait for a HELLO reply
+
+#define YASH_OK 0					//! Command status: ran
+#define YASH_ERR_CMD 1				//! Command status: server reported an error
+#define YASH_ERR_RESOLVE 2			//! Command status: unknown host
+#define YASH_ERR_CONNECT 3			//! Command status: could not connect
+#define YASH_ERR_TIMEOUT 4			//! Command status: timed out
+#define YASH_ERR_DISCONNECT 5		//! Command status: server hung up
+#define YASH_ERR_BUSY 6				//! Command status: server turned the connection away
+
+#define YASH_CONN_CONNECTING 0		//! Connection state: connecting
+#define YASH_CONN_PROMPT 1			//! Connection state: waiting for the prompt
+#define YASH_CONN_IDLE 2			//! Connection state: pooled, prompt received
+#define YASH_CONN_RUNNING 3			//! Connection state: command sent
+#define YASH_CONN_HELLO 4			//! Connection state: waiting for the HELLO reply
+
+
+/**
+ * @brief Struct for the protocol settled by yashHello()
+ */
+typedef struct _yash_hello {
+	int version;					// Protocol version, 0 for servers without HELLO
+	uint32_t features;				// PROTO_FEAT_* the session may use
+	uint32_t max_frame;				// Max frame payload the server sends
+	uint64_t token;					// Session token, 0 if unknown
+} yash_hello_t;
+
+
+/**
+ * @brief Struct for the status of a job, from an EXIT line
+ */
+typedef struct _yash_exit {
+	int jobno;						// Job number
+	bool signaled;					// Ended by a signal, not an exit
+	int code;						// Exit code, or signal number
+	uint64_t wall_us;				// Time since the job started
+	uint64_t user_us;				// User CPU time of its processes
+	uint64_t sys_us;				// System CPU time of its processes
+} yash_exit_t;
+
+
+typedef struct _yash_cmd yash_cmd_t;
+typedef struct _yash_conn yash_conn_t;
+
+/**
+ * @brief Callback receiving a command's output, as it arrives
+ */
+typedef void (*yash_output_cb_t)(yash_cmd_t *cmd, const char *data, size_t len,
+		void *ctx);
+
+/**
+ * @brief Callback receiving a command's status (YASH_OK, YASH_ERR_CMD...),
+ * and the exit status of its job
+ *
+ * The exit status is NULL if the server sent no EXIT line: the command did not
+ * run, it was a background job, or the server predates PROTO_FEAT_EXIT. The
+ * command is freed when the callback returns.
+ */
+typedef void (*yash_done_cb_t)(yash_cmd_t *cmd, int status,
+		const yash_exit_t *ex, void *ctx);
+
+
+/**
+ * @brief Struct for a command queued or running on a server
+ */
+struct _yash_cmd {
+	char host[MAX_HOSTNAME_LEN];	// Server host
+	int port;						// Server port
+	char command[MAX_CMD_LEN];		// Command line
+	yash_output_cb_t on_output;		// Output callback, may be NULL
+	yash_done_cb_t on_done;			// Done callback, may be NULL
+	void *ctx;						// Caller's context for the callbacks
+	int status;						// YASH_OK, YASH_ERR_CMD...
+	int64_t deadline;				// Time to give up on the command (ms)
+	yash_conn_t *conn;				// Connection running it, NULL if queued
+	int err_match;					// Chars of YASH_ERR_PREFIX matched on the
+									// current line, -1 if it does not match
+	bool exited;					// Exit status received
+	yash_exit_t exit;				// Exit status of its job, from the EXIT line
+	yash_cmd_t *next;				// Next queued command
+};
+
+
+/**
+ * @brief Struct for a connection (session) to a server
+ */
+struct _yash_conn {
+	char host[MAX_HOSTNAME_LEN];	// Server host, as asked for
+	int port;						// Server port, as asked for
+	int sd;							// Socket
+	int state;						// YASH_CONN_CONNECTING, YASH_CONN_PROMPT...
+	int redirects;					// Redirects followed
+	int64_t idle_since;				// Time it went back to the pool (ms)
+	int64_t hello_deadline;			// Time to stop waiting for the HELLO reply
+									// (ms)
+	uint32_t features;				// PROTO_FEAT_* settled by HELLO
+	bool hello;						// HELLO reply received
+	char line[MAX_HOSTNAME_LEN+16];	// Text received before the command's prompt
+	size_t line_len;				// Length of the text
+	char held[EXIT_LINE_LEN+sizeof(YASH_PROMPT)];	// Output held back, may
+									// start the EXIT line or the prompt
+	size_t held_len;				// Length of the output held back
+	yash_cmd_t *cmd;				// Command running on it, NULL if idle
+};
+
+
+/**
+ * @brief Struct for a client
+ */
+typedef struct _yash_client {
+	int max_conns;					// Max connections open at a time
+	int timeout;					// Seconds each command has to finish
+	yash_conn_t **conns;			// Open connections
+	struct pollfd *pollfds;			// Poll table, in step with conns
+	int n_conns;					// Number of open connections
+	yash_cmd_t *queue;				// Commands waiting for a connection
+	yash_cmd_t *queue_tail;			// Last command waiting for a connection
+	int n_queued;					// Number of commands waiting
+	int n_running;					// Number of commands running
+} yash_client_t;
+
+
+// Blocking helpers
+int yashConnect(const char *host, int port);
+int yashSendCmd(int sd, const char *cmd);
+int yashSendCtl(int sd, char ctl);
+int yashHello(int sd, yash_hello_t *hello);
+bool yashParseExit(const char *line, yash_exit_t *ex);
+const char *yashStatusStr(int status);
+
+// Event driven client
+yash_client_t *yashClientNew(int max_conns, int timeout);
+void yashClientFree(yash_client_t *client);
+yash_cmd_t *yashRun(yash_client_t *client, const char *host, int port,
+		const char *command, yash_output_cb_t on_output, yash_done_cb_t on_done,
+		void *ctx);
+int yashSignal(yash_cmd_t *cmd, char ctl);
+int yashPoll(yash_client_t *client, int timeout);
+
+
+#endif /* YASH_CLIENT_H_ */
@@ -0,0 +1,245 @@
+/**
+ * @file yash_mux.c
+ *
+ * @brief Client API for multiplexed yashd sessions
+ *
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "yashd_defs.h"
+#include "yash_client.h"
+#include "yash_mux.h"
+#include "lz.h"
+
+
+/**
+ * @brief Search an open stream
+ *
+ * @param	mux		Multiplexed connection
+ * @param	stream	Stream ID
+ * @return	Index of the stream in the open stream table, or -1
+ */
+static int searchStream(yash_mux_t *mux, uint16_t stream) {
+	for (int i=0; i<mux->count; i++) {
+		if (mux->streams[i] == stream) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * @brief Forget a stream
+ *
+ * @param	mux		Multiplexed connection
+ * @param	stream	Stream ID
+ */
+static void forgetStream(yash_mux_t *mux, uint16_t stream) {
+	int idx = searchStream(mux, stream);
+
+	if (idx >= 0) {
+		mux->streams[idx] = mux->streams[--mux->count];
+	}
+}
+
+
+/**
+ * @brief Connect to a yashd server, and switch the connection to frames
+ *
+ * The protocol is settled with HELLO first, see yashHello(). Output
+ * compression is enabled if the server offers it.
+ *
+ * @param	host	Server host
+ * @param	port	Server port
+ * @return	Multiplexed connection, or NULL on error
+ */
+yash_mux_t *yashMuxConnect(const char *host, int port) {
+	yash_hello_t hello;
+	frame_hdr_t hdr;
+	yash_mux_t *mux;
+	int one = 1;
+	int sd;
+
+	if ((sd = yashConnect(host, port)) < 0) {
+		return NULL;
+	}
+	// Frames are small and latency bound
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// Settle the protocol, then switch to frames and wait for the server to
+	// switch
+	if (yashHello(sd, &hello) < 0 || !(hello.features & PROTO_FEAT_MUX) ||
+			sendAll(sd, MSG_TYPE_MUX, strlen(MSG_TYPE_MUX)) < 0 ||
+			recvFrame(sd, &hdr, NULL, 0) <= 0 || hdr.type != FRAME_MUX) {
+		close(sd);
+		return NULL;
+	}
+
+	if ((mux = calloc(1, sizeof(yash_mux_t))) == NULL) {
+		close(sd);
+		return NULL;
+	}
+	mux->sd = sd;
+	mux->next_stream = 1;
+	mux->hello = hello;
+
+	if (hdr.flags & FRAME_FLAG_LZ) {
+		if (sendFrame(sd, FRAME_MUX, FRAME_FLAG_LZ, 0, NULL, 0) < 0) {
+			yashMuxDisconnect(mux);
+			return NULL;
+		}
+		mux->lz = true;
+	}
+
+	return mux;
+}
+
+
+/**
+ * @brief Open a stream, which starts a new session on the server
+ *
+ * The server answers with a FRAME_OPEN event once the session starts, or a
+ * FRAME_CLOSE event if it could not be started. Commands can be sent right
+ * away.
+ *
+ * @param	mux	Multiplexed connection
+ * @return	Stream ID, or -1 on error
+ */
+int yashMuxOpen(yash_mux_t *mux) {
+	uint16_t stream;
+
+	if (mux->count >= MUX_MAX_STREAMS) {
+		errno = EMFILE;
+		return -1;
+	}
+
+	// Skip 0 (the connection itself) and IDs still in use after wrapping
+	do {
+		stream = mux->next_stream++;
+	} while (stream == 0 || searchStream(mux, stream) >= 0);
+
+	if (sendFrame(mux->sd, FRAME_OPEN, 0, stream, NULL, 0) < 0) {
+		return -1;
+	}
+	mux->streams[mux->count++] = stream;
+
+	return stream;
+}
+
+
+/**
+ * @brief Run a command on a stream
+ *
+ * @param	mux		Multiplexed connection
+ * @param	stream	Stream ID
+ * @param	cmd		Command line, without the trailing newline
+ * @return	0 on success, or -1 on error
+ */
+int yashMuxCmd(yash_mux_t *mux, int stream, const char *cmd) {
+	char msg[MAX_CMD_LEN+6];
+	int len;
+
+	len = snprintf(msg, sizeof(msg), "CMD %s\n", cmd);
+	if (len >= (int) sizeof(msg)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return sendFrame(mux->sd, FRAME_DATA, 0, stream, msg, len);
+}
+
+
+/**
+ * @brief Send a control message to a stream
+ *
+ * @param	mux		Multiplexed connection
+ * @param	stream	Stream ID
+ * @param	ctl		Control character: 'c' (SIGINT), 'z' (SIGTSTP) or 'd' (EOF)
+ * @return	0 on success, or -1 on error
+ */
+int yashMuxCtl(yash_mux_t *mux, int stream, char ctl) {
+	char msg[] = "CTL x\n";
+
+	msg[4] = ctl;
+	return sendFrame(mux->sd, FRAME_DATA, 0, stream, msg, strlen(msg));
+}
+
+
+/**
+ * @brief Close a stream, which ends its session on the server
+ *
+ * @param	mux		Multiplexed connection
+ * @param	stream	Stream ID
+ * @return	0 on success, or -1 on error
+ */
+int yashMuxClose(yash_mux_t *mux, int stream) {
+	forgetStream(mux, stream);
+	return sendFrame(mux->sd, FRAME_CLOSE, 0, stream, NULL, 0);
+}
+
+
+/**
+ * @brief Receive the next event on any stream
+ *
+ * @param	mux		Multiplexed connection
+ * @param	ev		Event received
+ * @param	timeout	Milliseconds to wait for an event, or -1 to wait forever
+ * @return	1 if an event was received, 0 on timeout, or -1 if the connection
+ * 			was closed or failed
+ */
+int yashMuxRecv(yash_mux_t *mux, yash_mux_event_t *ev, int timeout) {
+	struct pollfd pollfds[1];
+	frame_hdr_t hdr;
+	int rc;
+
+	pollfds[0].fd = mux->sd;
+	pollfds[0].events = POLLIN;
+	if ((rc = poll(pollfds, 1, timeout)) <= 0) {
+		return (rc < 0 && errno != EINTR) ? -1 : 0;
+	}
+
+	if (recvFrame(mux->sd, &hdr, mux->comp, FRAME_MAX_PAYLOAD) <= 0) {
+		return -1;
+	}
+	ev->type = hdr.type;
+	ev->stream = hdr.stream;
+	if (hdr.flags & FRAME_FLAG_LZ) {
+		if (!mux->lz || (rc = lzDecompress((const uint8_t *) mux->comp,
+				hdr.len, (uint8_t *) ev->data, FRAME_MAX_PAYLOAD)) < 0) {
+			return -1;	// Out of sync
+		}
+		ev->len = rc;
+	} else {
+		memcpy(ev->data, mux->comp, hdr.len);
+		ev->len = hdr.len;
+	}
+	ev->data[ev->len] = '\0';
+
+	if (hdr.type == FRAME_CLOSE) {
+		forgetStream(mux, hdr.stream);
+	}
+
+	return 1;
+}
+
+
+/**
+ * @brief Close the connection, ending all its sessions
+ *
+ * @param	mux	Multiplexed connection
+ */
+void yashMuxDisconnect(yash_mux_t *mux) {
+	close(mux->sd);
+	free(mux);
+}
@@ -0,0 +1,75 @@
+/**
+ * @file yash_mux.h
+ *
+ * @brief Client API for multiplexed yashd sessions
+ *
+ * Open many independent shell sessions (streams) over one connection to a
+ * yashd server. Example:
+ *
+ * @code
+ * yash_mux_t *mux = yashMuxConnect("localhost", 3826);
+ * int s1 = yashMuxOpen(mux);
+ * int s2 = yashMuxOpen(mux);
+ * yashMuxCmd(mux, s1, "ls -l");
+ * yashMuxCmd(mux, s2, "uname -a");
+ * while (yashMuxRecv(mux, &ev, 1000) > 0) {
+ * 	// ev.type is FRAME_OPEN, FRAME_DATA or FRAME_CLOSE for stream ev.stream
+ * }
+ * yashMuxClose(mux, s1);
+ * yashMuxDisconnect(mux);
+ * @endcode
+ *
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ */
+
+#ifndef YASH_MUX_H_
+#define YASH_MUX_H_
+
+
+#include <stdbool.h>
+#include "frame.h"
+#include "yash_client.h"
+
+
+/**
+ * @brief Struct for a multiplexed connection
+ */
+typedef struct _yash_mux {
+	int sd;								// Connection socket
+	uint16_t next_stream;				// Next stream ID to hand out
+	uint16_t streams[MUX_MAX_STREAMS];	// IDs of the open streams
+	int count;							// Number of open streams
+	yash_hello_t hello;					// Protocol settled with the server
+	bool lz;							// Output may come compressed
+	char comp[FRAME_MAX_PAYLOAD];		// Compressed payload being received
+} yash_mux_t;
+
+
+/**
+ * @brief Struct for an event received on a multiplexed connection
+ *
+ * Events:
+ *   - FRAME_OPEN: the server started the stream's session
+ *   - FRAME_DATA: output of the stream's session (prompts included)
+ *   - FRAME_CLOSE: the stream's session ended, or could not be opened
+ */
+typedef struct _yash_mux_event {
+	uint8_t type;						// FRAME_OPEN, FRAME_DATA or FRAME_CLOSE
+	uint16_t stream;					// Stream the event belongs to
+	uint32_t len;						// Data length
+	char data[FRAME_MAX_PAYLOAD+1];		// Data, NULL terminated
+} yash_mux_event_t;
+
+
+// Functions
+yash_mux_t *yashMuxConnect(const char *host, int port);
+int yashMuxOpen(yash_mux_t *mux);
+int yashMuxCmd(yash_mux_t *mux, int stream, const char *cmd);
+int yashMuxCtl(yash_mux_t *mux, int stream, char ctl);
+int yashMuxClose(yash_mux_t *mux, int stream);
+int yashMuxRecv(yash_mux_t *mux, yash_mux_event_t *ev, int timeout);
+void yashMuxDisconnect(yash_mux_t *mux);
+
+
+#endif /* YASH_MUX_H_ */
@@ -0,0 +1,839 @@
+/**
+ * @file  yash_replay.c
+ *
+ * @brief Replays captured yashd sessions against a daemon, as load
+ *
+ * Reads the store a daemon wrote with `--capture DIR` (or `--record DIR`, the
+ * output is skipped; see record.h), and plays every session's input back to a
+ * daemon, each session on its own connection and thread:
+ *
+ * 	- Sessions open in their recorded order, and with their recorded overlap.
+ * 	  At a speed of N, the gaps between sessions and between the lines of a
+ * 	  session are divided by N. At max speed (0) there are no gaps, but a
+ * 	  session only opens once the sessions that had closed before it was
+ * 	  recorded are done, so the concurrency stays the recorded one.
+ * 	- Like a client, a session sends a command only once the prompt of the
+ * 	  previous one came back. Control lines (ctrl-c, ctrl-z) keep their
+ * 	  recorded gap after the line before them at any speed, or they would
+ * 	  find no job to signal.
+ *
+ * It reports the latency distributions of connecting (to the first prompt),
+ * commands (line to prompt), control lines, and how late lines went out
+ * against the schedule (the daemon falling behind the recorded load). With
+ * `-j FILE` they are also written as JSON, to compare builds.
+ *
+ * 	./yash-replay [-H HOST] [-p PORT] [-x SPEED] [-j FILE] DIR
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "yash_client.h"
+#include "frame.h"
+#include "yash_time.h"
+#include "record.h"
+
+
+#define REPLAY_MAX_SEGMENTS 4096	//! Max number of segments read
+#define REPLAY_PATH_LEN 512			//! Max length of a segment path
+#define REPLAY_TIMEOUT_MS 30000		//! Max milliseconds to wait for a prompt
+#define REPLAY_STACK (256 << 10)	//! Stack size of a session thread
+#define REPLAY_MAX_PENDING 64		//! Max lines of a session awaiting a prompt
+#define REPLAY_CMD "CMD "			//! Command line prefix
+#define REPLAY_CTL "CTL "			//! Control line prefix
+
+#define REPLAY_CONNECT 0	//! Latency: connect to first prompt
+#define REPLAY_CMD_LAT 1	//! Latency: command to prompt
+#define REPLAY_CTL_LAT 2	//! Latency: control line to prompt
+#define REPLAY_LAG 3		//! Lines sent behind the schedule
+#define REPLAY_HELLO 4		//! Line awaiting a prompt, not timed
+#define REPLAY_METRICS 4	//! Latency distributions reported
+
+
+/**
+ * \brief Struct for a captured event, while the store is read
+ */
+typedef struct _replay_event {
+	uint64_t session;	// Session ID
+	uint64_t seq;		// Order read, the recorded order within a session
+	uint64_t ts;		// Time (us since the epoch)
+	uint8_t type;		// RECORD_OPEN, RECORD_INPUT...
+	uint32_t len;		// Data length
+	char *data;			// Data
+} replay_event_t;
+
+
+/**
+ * \brief Struct for a line of input of a session
+ */
+typedef struct _replay_line {
+	uint64_t ts;		// Time the line was complete (us since the epoch)
+	uint32_t len;		// Line length, newline included
+	char *data;			// Line
+} replay_line_t;
+
+
+/**
+ * \brief Struct for a list of latency samples
+ */
+typedef struct _replay_samples {
+	uint64_t *v;		// Samples (us)
+	size_t count;		// Number of samples
+	size_t cap;			// Samples allocated
+} replay_samples_t;
+
+
+/**
+ * \brief Struct for a session to replay
+ */
+typedef struct _replay_session {
+	uint64_t id;							// Session ID
+	uint64_t open_ts;						// Time opened
+	uint64_t close_ts;						// Time closed, or 0 if not captured
+	replay_line_t *lines;					// Input lines
+	int count;								// Number of lines
+	int cap;								// Lines allocated
+	char partial[MAX_CMD_LEN + 8];			// Input not ended by a newline yet
+	size_t partial_len;						// Bytes in partial
+	bool muxed;								// Switched to frames, not captured
+	replay_samples_t samples[REPLAY_METRICS];	// Results
+	int errors;								// Connections lost, or prompts late
+	pthread_t tid;							// Thread replaying it
+} replay_session_t;
+
+
+/**
+ * \brief Struct for a line of a session awaiting its prompt
+ */
+typedef struct _replay_pending {
+	int kind;			// REPLAY_CONNECT, REPLAY_CMD_LAT...
+	uint64_t sent;		// Time sent (nowUs())
+} replay_pending_t;
+
+
+/**
+ * \brief Struct for the connection state of a session being replayed
+ */
+typedef struct _replay_conn {
+	int sd;											// Socket
+	replay_pending_t pending[REPLAY_MAX_PENDING];	// Lines awaiting a prompt
+	int npending;									// Lines in pending
+	char tail[2];									// Last bytes read
+	size_t tail_len;								// Bytes in tail
+} replay_conn_t;
+
+
+// Globals
+static struct sockaddr_storage addr;	//! Daemon address
+static socklen_t addr_len;				//! Daemon address length
+static double speed = 1;				//! Replay speed, 0 for max
+static replay_session_t *sessions;		//! Sessions, by time opened
+static int session_count;				//! Number of sessions
+static int finished;					//! Sessions replayed
+static pthread_mutex_t finished_lock = PTHREAD_MUTEX_INITIALIZER;	//! Guards finished
+static pthread_cond_t finished_cond = PTHREAD_COND_INITIALIZER;	//! Signaled when a session ends
+static const char *metric_names[REPLAY_METRICS] = {"connect", "command",
+		"control", "lag"};
+
+
+/**
+ * @brief Add a latency sample to a list
+ *
+ * @param	samples	List
+ * @param	value	Sample (us)
+ */
+static void addSample(replay_samples_t *samples, uint64_t value) {
+	uint64_t *v;
+
+	if (samples->count == samples->cap) {
+		samples->cap = samples->cap ? samples->cap * 2 : 64;
+		if ((v = realloc(samples->v, samples->cap * sizeof(uint64_t))) ==
+				NULL) {
+			samples->cap = samples->count;
+			return;
+		}
+		samples->v = v;
+	}
+	samples->v[samples->count++] = value;
+}
+
+
+/**
+ * @brief Compare events by session, then by order read, for qsort()
+ */
+static int cmpEvents(const void *a, const void *b) {
+	const replay_event_t *x = a;
+	const replay_event_t *y = b;
+
+	if (x->session != y->session) {
+		return (x->session > y->session) - (x->session < y->session);
+	}
+	return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+
+/**
+ * @brief Compare sessions by time opened, for qsort()
+ */
+static int cmpSessions(const void *a, const void *b) {
+	const replay_session_t *x = a;
+	const replay_session_t *y = b;
+
+	return (x->open_ts > y->open_ts) - (x->open_ts < y->open_ts);
+}
+
+
+/**
+ * @brief Compare latencies, for qsort()
+ */
+static int cmpU64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * @brief Read the events of every segment in a directory
+ *
+ * @param	dir		Captures directory
+ * @param	count	Number of events read
+ * @return	Events, or NULL on error
+ */
+static replay_event_t *readEvents(const char *dir, size_t *count) {
+	static char names[REPLAY_MAX_SEGMENTS][RECORD_NAME_LEN];
+	static uint8_t raw[RECORD_BLOCK_SIZE];
+	static uint8_t comp[RECORD_BLOCK_SIZE];
+	char path[REPLAY_PATH_LEN];
+	replay_event_t *events = NULL;
+	replay_event_t *grown;
+	record_event_hdr_t hdr;
+	record_idx_t idx;
+	size_t cap = 0;
+	FILE *idx_file;
+	int segments;
+	int seg_fd;
+	int len, pos;
+
+	*count = 0;
+	if ((segments = recordListSegments(dir, names, REPLAY_MAX_SEGMENTS)) < 0) {
+		perror(dir);
+		return NULL;
+	}
+
+	for (int s=0; s<segments; s++) {
+		snprintf(path, sizeof(path), "%s/%s%s", dir, names[s],
+				RECORD_IDX_SUFFIX);
+		if ((idx_file = fopen(path, "r")) == NULL) {
+			perror(path);
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s%s", dir, names[s],
+				RECORD_SEG_SUFFIX);
+		if ((seg_fd = open(path, O_RDONLY)) < 0) {
+			perror(path);
+			fclose(idx_file);
+			continue;
+		}
+
+		while (fread(&idx, sizeof(idx), 1, idx_file) == 1) {
+			if ((len = recordReadBlock(seg_fd, idx.offset, raw, comp)) < 0) {
+				fprintf(stderr, "-yash-replay: %s: corrupt block at %lu\n",
+						names[s], idx.offset);
+				continue;
+			}
+			for (pos = 0; len - pos >= (int) sizeof(hdr); pos += hdr.len) {
+				memcpy(&hdr, &raw[pos], sizeof(hdr));
+				pos += sizeof(hdr);
+				if (hdr.len > (uint32_t) (len - pos)) {
+					break;
+				}
+				if (hdr.type == RECORD_OUTPUT) {
+					continue;
+				}
+
+				if (*count == cap) {
+					cap = cap ? cap * 2 : 1024;
+					if ((grown = realloc(events, cap * sizeof(*events))) ==
+							NULL) {
+						perror("ERROR: Reading events");
+						exit(EXIT_FAILURE);
+					}
+					events = grown;
+				}
+				events[*count] = (replay_event_t) {hdr.session, *count, hdr.ts,
+						hdr.type, hdr.len, malloc(hdr.len + 1)};
+				if (events[*count].data == NULL) {
+					perror("ERROR: Reading events");
+					exit(EXIT_FAILURE);
+				}
+				memcpy(events[*count].data, &raw[pos], hdr.len);
+				(*count)++;
+			}
+		}
+
+		close(seg_fd);
+		fclose(idx_file);
+	}
+
+	return events;
+}
+
+
+/**
+ * @brief Add the input a session received to its lines
+ *
+ * The input was recorded as read from the socket, so lines may span events.
+ * Lines after a switch to frames are not captured, and are left out.
+ *
+ * @param	session	Session
+ * @param	ev		Input event
+ */
+static void addInput(replay_session_t *session, const replay_event_t *ev) {
+	replay_line_t *grown;
+	size_t n;
+
+	for (uint32_t i=0; i<ev->len && !session->muxed; i++) {
+		if (session->partial_len < sizeof(session->partial)) {
+			session->partial[session->partial_len++] = ev->data[i];
+		}
+		if (ev->data[i] != '\n') {
+			continue;
+		}
+
+		n = session->partial_len;
+		session->partial_len = 0;
+		if (n == strlen(MSG_TYPE_MUX) &&
+				!memcmp(session->partial, MSG_TYPE_MUX, n)) {
+			session->muxed = true;
+			break;
+		}
+
+		if (session->count == session->cap) {
+			session->cap = session->cap ? session->cap * 2 : 16;
+			if ((grown = realloc(session->lines, session->cap *
+					sizeof(replay_line_t))) == NULL) {
+				perror("ERROR: Reading lines");
+				exit(EXIT_FAILURE);
+			}
+			session->lines = grown;
+		}
+		session->lines[session->count].ts = ev->ts;
+		session->lines[session->count].len = n;
+		if ((session->lines[session->count].data = malloc(n)) == NULL) {
+			perror("ERROR: Reading lines");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(session->lines[session->count].data, session->partial, n);
+		session->count++;
+	}
+}
+
+
+/**
+ * @brief Build the sessions to replay from the captured events
+ *
+ * @param	events	Events, sorted by session and order
+ * @param	count	Number of events
+ */
+static void buildSessions(replay_event_t *events, size_t count) {
+	replay_session_t *session = NULL;
+	size_t distinct = 0;
+
+	for (size_t i=0; i<count; i++) {
+		distinct += (i == 0 || events[i].session != events[i-1].session);
+	}
+	if ((sessions = calloc(distinct ? distinct : 1,
+			sizeof(replay_session_t))) == NULL) {
+		perror("ERROR: Allocating sessions");
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i=0; i<count; i++) {
+		if (session == NULL || session->id != events[i].session) {
+			session = &sessions[session_count++];
+			session->id = events[i].session;
+			session->open_ts = events[i].ts;	// Opened before the capture
+		}
+
+		switch (events[i].type) {
+		case RECORD_OPEN:
+			session->open_ts = events[i].ts;
+			break;
+		case RECORD_INPUT:
+			addInput(session, &events[i]);
+			break;
+		case RECORD_CLOSE:
+			session->close_ts = events[i].ts;
+			break;
+		}
+		free(events[i].data);
+	}
+
+	qsort(sessions, session_count, sizeof(replay_session_t), cmpSessions);
+}
+
+
+/**
+ * @brief Connect to the daemon
+ *
+ * @return	Socket, or -1 on error
+ */
+static int connectDaemon() {
+	int one = 1;
+	int sd;
+
+	if ((sd = socket(addr.ss_family, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+	setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(sd, (struct sockaddr *) &addr, addr_len) < 0) {
+		close(sd);
+		return -1;
+	}
+
+	return sd;
+}
+
+
+/**
+ * @brief Take a prompt, timing the line it answers
+ *
+ * A control line gets its prompt right away, ahead of the job it signaled,
+ * so the oldest control line takes the prompt if there is one.
+ *
+ * @param	session	Session
+ * @param	conn	Connection
+ */
+static void takePrompt(replay_session_t *session, replay_conn_t *conn) {
+	int pick = 0;
+
+	if (conn->npending == 0) {
+		return;
+	}
+	for (int i=0; i<conn->npending; i++) {
+		if (conn->pending[i].kind == REPLAY_CTL_LAT) {
+			pick = i;
+			break;
+		}
+	}
+
+	if (conn->pending[pick].kind != REPLAY_HELLO) {
+		addSample(&session->samples[conn->pending[pick].kind],
+				nowUs() - conn->pending[pick].sent);
+	}
+	memmove(&conn->pending[pick], &conn->pending[pick + 1],
+			(conn->npending - pick - 1) * sizeof(replay_pending_t));
+	conn->npending--;
+}
+
+
+/**
+ * @brief Read what the daemon sent, taking the prompts in it
+ *
+ * A prompt is told from job output that looks like one by what follows it:
+ * nothing (the end of what was read), another prompt, or an EXIT line.
+ *
+ * @param	session	Session
+ * @param	conn	Connection
+ * @param	until	Time to stop waiting (nowUs())
+ * @param	drain	Stop as soon as no line awaits a prompt
+ * @return	0 on success, or -1 if the daemon hung up
+ */
+static int pump(replay_session_t *session, replay_conn_t *conn,
+		uint64_t until, bool drain) {
+	char buf[8192 + 2];
+	struct pollfd pfd = {conn->sd, POLLIN, 0};
+	size_t plen = strlen(YASH_PROMPT);
+	size_t elen = strlen(MSG_TYPE_EXIT);
+	uint64_t now;
+	ssize_t n;
+	size_t len;
+
+	while ((now = nowUs()) < until && !(drain && conn->npending == 0)) {
+		if (poll(&pfd, 1, (until - now + 999) / 1000) <= 0) {
+			continue;
+		}
+		if ((n = read(conn->sd, &buf[conn->tail_len], sizeof(buf) - 2)) <= 0) {
+			return -1;
+		}
+
+		// The last bytes read before may start a prompt
+		memcpy(buf, conn->tail, conn->tail_len);
+		len = conn->tail_len + n;
+		for (size_t i=0; i+plen<=len; i++) {
+			if (memcmp(&buf[i], YASH_PROMPT, plen)) {
+				continue;
+			}
+			if (i + plen == len ||
+					!memcmp(&buf[i + plen], YASH_PROMPT,
+							(len - i - plen < plen) ? len - i - plen : plen) ||
+					!memcmp(&buf[i + plen], MSG_TYPE_EXIT,
+							(len - i - plen < elen) ? len - i - plen : elen)) {
+				takePrompt(session, conn);
+			}
+		}
+
+		// Keep what may be the start of a prompt
+		conn->tail_len = 0;
+		for (size_t k=(len < plen - 1) ? len : plen - 1; k>0; k--) {
+			if (!memcmp(&buf[len - k], YASH_PROMPT, k)) {
+				memcpy(conn->tail, &buf[len - k], k);
+				conn->tail_len = k;
+				break;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * @brief Replay a session
+ *
+ * @param	session	Session
+ */
+static void replaySession(replay_session_t *session) {
+	replay_conn_t conn;
+	replay_line_t *line;
+	uint64_t start, due, now;
+	uint64_t prev_ts = session->open_ts;
+	bool ctl;
+
+	memset(&conn, 0, sizeof(conn));
+	start = nowUs();
+	conn.pending[conn.npending++] = (replay_pending_t) {REPLAY_CONNECT, start};
+	if ((conn.sd = connectDaemon()) < 0 ||
+			pump(session, &conn, start + REPLAY_TIMEOUT_MS * 1000, true) < 0 ||
+			conn.npending > 0) {
+		session->errors++;
+		if (conn.sd >= 0) {
+			close(conn.sd);
+		}
+		return;
+	}
+
+	for (int i=0; i<session->count; i++) {
+		line = &session->lines[i];
+		ctl = !strncmp(line->data, REPLAY_CTL, strlen(REPLAY_CTL));
+
+		// A client sends a command once the prompt of the last one is back
+		if (!ctl) {
+			now = nowUs();
+			if (pump(session, &conn, now + REPLAY_TIMEOUT_MS * 1000, true) < 0) {
+				session->errors++;
+				break;
+			}
+			if (conn.npending > 0) {
+				session->errors++;	// Timed out, forget the lines
+				conn.npending = 0;
+			}
+		}
+
+		// Wait for the line's time
+		if (ctl) {
+			due = nowUs() + (line->ts - prev_ts);
+		} else if (speed > 0) {
+			due = start + (uint64_t) ((line->ts - session->open_ts) / speed);
+		} else {
+			due = 0;
+		}
+		if (pump(session, &conn, due, false) < 0) {
+			session->errors++;
+			break;
+		}
+		now = nowUs();
+		if (due > 0 && !ctl) {
+			addSample(&session->samples[REPLAY_LAG], now > due ? now - due : 0);
+		}
+		prev_ts = line->ts;
+
+		if (send(conn.sd, line->data, line->len, MSG_NOSIGNAL) !=
+				(ssize_t) line->len) {
+			session->errors++;
+			break;
+		}
+
+		// Lines answered with a prompt: commands, signals and HELLO
+		if (conn.npending < REPLAY_MAX_PENDING) {
+			if (!strncmp(line->data, REPLAY_CMD, strlen(REPLAY_CMD))) {
+				conn.pending[conn.npending++] = (replay_pending_t)
+						{REPLAY_CMD_LAT, now};
+			} else if (ctl && line->len == strlen(REPLAY_CTL) + 2 &&
+					(line->data[4] == 'c' || line->data[4] == 'z')) {
+				conn.pending[conn.npending++] = (replay_pending_t)
+						{REPLAY_CTL_LAT, now};
+			} else if (!strncmp(line->data, MSG_TYPE_HELLO,
+					strlen(MSG_TYPE_HELLO))) {
+				conn.pending[conn.npending++] = (replay_pending_t)
+						{REPLAY_HELLO, now};
+			}
+		}
+		if (ctl && line->data[4] == 'd') {
+			break;	// The daemon hangs up
+		}
+	}
+
+	// Wait for the last prompts, and keep the session open until it closed
+	now = nowUs();
+	if (pump(session, &conn, now + REPLAY_TIMEOUT_MS * 1000, true) < 0 ||
+			conn.npending > 0) {
+		if (!(session->count > 0 && !strncmp(
+				session->lines[session->count - 1].data, REPLAY_CTL "d", 5))) {
+			session->errors++;
+		}
+	}
+	if (speed > 0 && session->close_ts > session->open_ts) {
+		pump(session, &conn, start + (uint64_t) ((session->close_ts -
+				session->open_ts) / speed), false);
+	}
+	close(conn.sd);
+}
+
+
+/**
+ * @brief Thread function to replay a session
+ *
+ * @param	arg	Session
+ */
+static void *sessionThread(void *arg) {
+	replaySession(arg);
+
+	pthread_mutex_lock(&finished_lock);
+	finished++;
+	pthread_cond_broadcast(&finished_cond);
+	pthread_mutex_unlock(&finished_lock);
+
+	return NULL;
+}
+
+
+/**
+ * @brief Replay every session, in its recorded order and overlap
+ */
+static void replaySessions() {
+	uint64_t *closes;
+	uint64_t start, due, now;
+	pthread_attr_t attr;
+	int closed = 0;
+
+	// Times sessions closed, in order, to keep the overlap at max speed
+	if ((closes = malloc((session_count + 1) * sizeof(uint64_t))) == NULL) {
+		perror("ERROR: Allocating sessions");
+		exit(EXIT_FAILURE);
+	}
+	for (int i=0; i<session_count; i++) {
+		closes[i] = sessions[i].close_ts ? sessions[i].close_ts : UINT64_MAX;
+	}
+	qsort(closes, session_count, sizeof(uint64_t), cmpU64);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, REPLAY_STACK);
+	start = nowUs();
+	for (int i=0; i<session_count; i++) {
+		if (speed > 0) {
+			due = start + (uint64_t) ((sessions[i].open_ts -
+					sessions[0].open_ts) / speed);
+			if ((now = nowUs()) < due) {
+				usleep(due - now);
+			}
+		} else {
+			// Wait for the sessions that were done before this one opened
+			while (closed < session_count &&
+					closes[closed] <= sessions[i].open_ts) {
+				closed++;
+			}
+			pthread_mutex_lock(&finished_lock);
+			while (finished < closed) {
+				pthread_cond_wait(&finished_cond, &finished_lock);
+			}
+			pthread_mutex_unlock(&finished_lock);
+		}
+
+		if (pthread_create(&sessions[i].tid, &attr, sessionThread,
+				&sessions[i]) != 0) {
+			perror("ERROR: Creating session thread");
+			sessions[i].errors++;
+			sessions[i].tid = 0;
+			pthread_mutex_lock(&finished_lock);
+			finished++;
+			pthread_mutex_unlock(&finished_lock);
+		}
+	}
+	for (int i=0; i<session_count; i++) {
+		if (sessions[i].tid != 0) {
+			pthread_join(sessions[i].tid, NULL);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	free(closes);
+}
+
+
+/**
+ * @brief Print the results, and write them as JSON
+ *
+ * @param	json	JSON file, or NULL
+ * @param	elapsed	Microseconds the replay took
+ * @return	Number of errors
+ */
+static int report(const char *json, uint64_t elapsed) {
+	replay_samples_t all[REPLAY_METRICS];
+	uint64_t pct[4];
+	char pace[32];
+	int errors = 0;
+	int lines = 0;
+	FILE *f = NULL;
+
+	memset(all, 0, sizeof(all));
+	for (int i=0; i<session_count; i++) {
+		errors += sessions[i].errors;
+		lines += sessions[i].count;
+		for (int m=0; m<REPLAY_METRICS; m++) {
+			for (size_t k=0; k<sessions[i].samples[m].count; k++) {
+				addSample(&all[m], sessions[i].samples[m].v[k]);
+			}
+		}
+	}
+
+	if (json != NULL && (f = fopen(json, "w")) == NULL) {
+		perror(json);
+	}
+	if (f != NULL) {
+		fprintf(f, "{\n  \"speed\": %g,\n  \"sessions\": %d,\n  \"lines\": %d,"
+				"\n  \"errors\": %d,\n  \"elapsed_us\": %lu,\n  \"latency_us\": "
+				"{\n", speed, session_count, lines, errors, elapsed);
+	}
+
+	if (speed > 0) {
+		snprintf(pace, sizeof(pace), "%gx", speed);
+	} else {
+		snprintf(pace, sizeof(pace), "max");
+	}
+	printf("sessions: %d, lines: %d, errors: %d, speed: %s, elapsed: %.1f s\n",
+			session_count, lines, errors, pace, elapsed / 1e6);
+	printf("%-8s %8s %10s %10s %10s %10s %10s\n", "latency", "count", "mean us",
+			"p50 us", "p90 us", "p99 us", "max us");
+	for (int m=0; m<REPLAY_METRICS; m++) {
+		uint64_t sum = 0;
+
+		qsort(all[m].v, all[m].count, sizeof(uint64_t), cmpU64);
+		for (size_t k=0; k<all[m].count; k++) {
+			sum += all[m].v[k];
+		}
+		for (int p=0; p<4; p++) {
+			static const int pcts[4] = {50, 90, 99, 100};
+
+			pct[p] = all[m].count ?
+					all[m].v[(all[m].count - 1) * pcts[p] / 100] : 0;
+		}
+		printf("%-8s %8zu %10lu %10lu %10lu %10lu %10lu\n", metric_names[m],
+				all[m].count, all[m].count ? sum / all[m].count : 0, pct[0],
+				pct[1], pct[2], pct[3]);
+		if (f != NULL) {
+			fprintf(f, "    \"%s\": {\"count\": %zu, \"mean\": %lu, \"p50\": "
+					"%lu, \"p90\": %lu, \"p99\": %lu, \"max\": %lu}%s\n",
+					metric_names[m], all[m].count,
+					all[m].count ? sum / all[m].count : 0, pct[0], pct[1],
+					pct[2], pct[3], (m < REPLAY_METRICS - 1) ? "," : "");
+		}
+		free(all[m].v);
+	}
+
+	if (f != NULL) {
+		fprintf(f, "  }\n}\n");
+		fclose(f);
+	}
+
+	return errors;
+}
+
+
+/**
+ * @brief Point of entry
+ *
+ * @param	argc	Number of command line arguments
+ * @param	argv	Array of command line arguments
+ * @return	Exit code
+ */
+int main(int argc, char **argv) {
+	const char *host = "127.0.0.1";
+	const char *json = NULL;
+	const char *dir = NULL;
+	char port[8];
+	struct addrinfo hints;
+	struct addrinfo *res;
+	replay_event_t *events;
+	size_t count;
+	uint64_t start;
+	int rc;
+
+	snprintf(port, sizeof(port), "%d", DEFAULT_TCP_PORT);
+	for (int i=1; i<argc; i++) {
+		if (i+1 < argc && !strcmp(argv[i], "-H")) {
+			host = argv[++i];
+		} else if (i+1 < argc && !strcmp(argv[i], "-p")) {
+			snprintf(port, sizeof(port), "%s", argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-x")) {
+			speed = atof(argv[++i]);
+		} else if (i+1 < argc && !strcmp(argv[i], "-j")) {
+			json = argv[++i];
+		} else if (argv[i][0] != '-' && dir == NULL) {
+			dir = argv[i];
+		} else {
+			dir = NULL;
+			break;
+		}
+	}
+	if (dir == NULL || speed < 0) {
+		fprintf(stderr, "Usage: %s [-H HOST] [-p PORT] [-x SPEED] [-j FILE] "
+				"DIR\nSPEED is a multiple of the recorded pace, or 0 for max "
+				"(default 1)\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rc = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "-yash-replay: %s: %s\n", host, gai_strerror(rc));
+		return EXIT_FAILURE;
+	}
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	if ((events = readEvents(dir, &count)) == NULL && count == 0) {
+		fprintf(stderr, "-yash-replay: no captures in %s\n", dir);
+		return EXIT_FAILURE;
+	}
+	qsort(events, count, sizeof(replay_event_t), cmpEvents);
+	buildSessions(events, count);
+	free(events);
+
+	signal(SIGPIPE, SIG_IGN);
+	start = nowUs();
+	replaySessions();
+
+	return report(json, nowUs() - start) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
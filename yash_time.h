@@ -0,0 +1,62 @@
+/**
+ * @file  yash_time.h
+ *
+ * @brief Clocks shared by the daemon, the client library and the tools
+ *
+ * Durations, deadlines and latencies are measured with nowUs() (or nowNs()),
+ * on the monotonic clock, so they do not jump when the system time is set.
+ * wallUs() is only for timestamps that are stored or shown as dates, like the
+ * events of a session transcript.
+ *
+ * The functions are inline, so every binary and library gets its own copy
+ * without linking anything, and libyash does not export them.
+ *
+ * @author:	Jose Carlos Martinez Garcia-Vaso <carlosgvaso@utexas.edu>
+ * @author: Utkarsh Vardan <uvardan@utexas.edu>
+ */
+
+#ifndef YASH_TIME_H_
+#define YASH_TIME_H_
+
+
+#include <stdint.h>
+#include <time.h>
+
+
+/**
+ * @brief Get a monotonic timestamp
+ *
+ * @return	Nanoseconds since an arbitrary point
+ */
+static inline uint64_t nowNs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/**
+ * @brief Get a monotonic timestamp
+ *
+ * @return	Microseconds since an arbitrary point
+ */
+static inline uint64_t nowUs() {
+	return nowNs() / 1000;
+}
+
+
+/**
+ * @brief Get the wall clock time
+ *
+ * @return	Microseconds since the epoch
+ */
+static inline uint64_t wallUs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+#endif /* YASH_TIME_H_ */
@@ -16,44 +16,7 @@ extern int errno;
 static char log_path[PATHMAX+1];
 static char pid_path[PATHMAX+1];
 
-servant_th_info_t servant_th_table[MAX_CONCURRENT_CLIENTS];	//! Thread table
-int servant_th_table_idx = 0;						//! New thread index in table
-pthread_mutex_t servant_th_table_lock;				//! Thread table lock
-
-
-/**
- * \brief Clean an array buffer by setting all entries to '\0'
- *
- * \param	buffer	Buffer
- * \param	size	Number of entries in buffer array
- */
-void cleanBuffer(char *buffer, int size) {
-	for (int i=0; i<size; i++) {
-		buffer[i] = '\0';
-	}
-}
-
-
-/**
- * @brief Generate a string with the current timestamp in syslog format
- *
- * @param	buff	Buffer to hold the timestamp
- * @param	size	Buffer size
- * @return	String with current timestamp in syslog format
- */
-char *timeStr(char *buff, int size) {
-	struct tm sTm;
-
-	time_t now = time(NULL);
-	gmtime_r(&now, &sTm);
-
-	if (!strftime(buff, size, "%b %e %H:%M:%S", &sTm)) {
-		perror("Could not format timestamp");
-		strcpy(buff, "Jan  1 00:00:00\0");
-	}
-
-	return buff;
-}
+cmd_args_t args;	//! Command line arguments
 
 
 /**
@@ -85,13 +48,34 @@ bool isNumber(char number[]) {
  * @return	Struct with the parsed arguments
  */
 cmd_args_t parseArgs(int argc, char** argv) {
-	const char USAGE[MAX_ERROR_LEN] = "\nUsage:\n"
+	const char USAGE[] = "\nUsage:\n"
 				"./yashd [options]\n"
 				"\n"
 				"Options:\n"
+				"    -a POL, --affinity POL  Session CPU affinity policy "
+				"[none|rr|acceptor]\n"
+				"    -A FILE, --audit FILE   Log every command durably to FILE "
+				"before it runs\n"
+				"    -c FILE, --config FILE  Read limits and timeouts from FILE, "
+				"reloaded on SIGHUP\n"
+				"    -C DIR, --capture DIR   Capture the sessions' input in DIR, "
+				"for yash-replay\n"
+				"    -f, --foreground        Stay in the foreground, and log to "
+				"stderr\n"
 				"    -h, --help              Print help and exit\n"
+				"    -j DIR, --jobs DIR      Keep the job registry in DIR, "
+				"private to the daemon's user\n"
 				"    -p PORT, --port PORT    Server port [1024-65535]\n"
-				"    -v, --verbose           Verbose logger output\n";
+				"    -r N, --recycle N       Recycle workers after N sessions, "
+				"0 never\n"
+				"    -R PCT, --redirect PCT  Redirect new sessions to less loaded "
+				"peers from PCT%% load, 0 never [0-100]\n"
+				"    -s N, --shards N        Run N shards, 0 for one per CPU "
+				"[0-256]\n"
+				"    -T DIR, --record DIR    Record session transcripts in DIR\n"
+				"    -v, --verbose           Verbose logger output\n"
+				"    -w N, --workers N       Run N prefork worker processes "
+				"[0-256]\n";
 		const char ARG_ERROR[MAX_ERROR_LEN] = "-yashd: unknown argument: %s\n";
 		const char H_FLAG_SHORT[3] = "-h\0";
 		const char H_FLAG_LONG[10] = "--help\0";
@@ -104,7 +88,78 @@ cmd_args_t parseArgs(int argc, char** argv) {
 		const char V_FLAG_SHORT[3] = "-v\0";
 		const char V_FLAG_LONG[10] = "--verbose\0";
 		const char V_INFO[MAX_ERROR_LEN] = "-yashd: verbose output enabled\n";
-		cmd_args_t args = {false, DEFAULT_TCP_PORT};
+		const char F_FLAG_SHORT[3] = "-f\0";
+		const char F_FLAG_LONG[13] = "--foreground\0";
+		const char F_INFO[MAX_ERROR_LEN] = "-yashd: running in the foreground\n";
+		const char S_FLAG_SHORT[3] = "-s\0";
+		const char S_FLAG_LONG[10] = "--shards\0";
+		const char S_INFO[MAX_ERROR_LEN] = "-yashd: using shards: %d\n";
+		const char S_ERROR1[MAX_ERROR_LEN] = "-yashd: missing number of shards\n";
+		const char S_ERROR2[MAX_ERROR_LEN] = "-yashd: shards must be an integer "
+				"between 0 and %d\n";
+		const char W_FLAG_SHORT[3] = "-w\0";
+		const char W_FLAG_LONG[10] = "--workers\0";
+		const char W_INFO[MAX_ERROR_LEN] = "-yashd: using workers: %d\n";
+		const char W_ERROR1[MAX_ERROR_LEN] = "-yashd: missing number of workers\n";
+		const char W_ERROR2[MAX_ERROR_LEN] = "-yashd: workers must be an integer "
+				"between 0 and %d\n";
+		const char R_FLAG_SHORT[3] = "-r\0";
+		const char R_FLAG_LONG[10] = "--recycle\0";
+		const char R_INFO[MAX_ERROR_LEN] = "-yashd: recycling workers after %d "
+				"sessions\n";
+		const char R_ERROR1[MAX_ERROR_LEN] = "-yashd: missing number of sessions\n";
+		const char R_ERROR2[MAX_ERROR_LEN] = "-yashd: sessions must be a positive "
+				"integer\n";
+		const char A_FLAG_SHORT[3] = "-a\0";
+		const char A_FLAG_LONG[11] = "--affinity\0";
+		const char A_INFO[MAX_ERROR_LEN] = "-yashd: using affinity policy: %s\n";
+		const char A_ERROR1[MAX_ERROR_LEN] = "-yashd: missing affinity policy\n";
+		const char A_ERROR2[MAX_ERROR_LEN] = "-yashd: affinity policy must be "
+				"none, rr or acceptor\n";
+		const char RD_FLAG_SHORT[3] = "-R\0";
+		const char RD_FLAG_LONG[11] = "--redirect\0";
+		const char RD_INFO[MAX_ERROR_LEN] = "-yashd: redirecting sessions from %d%% "
+				"load\n";
+		const char RD_ERROR1[MAX_ERROR_LEN] = "-yashd: missing redirect load\n";
+		const char RD_ERROR2[MAX_ERROR_LEN] = "-yashd: redirect load must be an "
+				"integer between 0 and 100\n";
+		const char T_FLAG_SHORT[3] = "-T\0";
+		const char T_FLAG_LONG[10] = "--record\0";
+		const char T_INFO[MAX_ERROR_LEN] = "-yashd: recording sessions in: %s\n";
+		const char T_ERROR1[MAX_ERROR_LEN] = "-yashd: missing record directory\n";
+		const char T_ERROR2[MAX_ERROR_LEN] = "-yashd: cannot use record directory: "
+				"%s\n";
+		const char CP_FLAG_SHORT[3] = "-C\0";
+		const char CP_FLAG_LONG[10] = "--capture\0";
+		const char CP_INFO[MAX_ERROR_LEN] = "-yashd: capturing session input in: "
+				"%s\n";
+		const char AU_FLAG_SHORT[3] = "-A\0";
+		const char AU_FLAG_LONG[10] = "--audit\0";
+		const char AU_INFO[MAX_ERROR_LEN] = "-yashd: auditing commands to: %s\n";
+		const char AU_ERROR1[MAX_ERROR_LEN] = "-yashd: missing audit log path\n";
+		const char AU_ERROR2[MAX_ERROR_LEN] = "-yashd: audit log path is too "
+				"long: %s\n";
+		const char C_FLAG_SHORT[3] = "-c\0";
+		const char C_FLAG_LONG[10] = "--config\0";
+		const char C_INFO[MAX_ERROR_LEN] = "-yashd: using config file: %s\n";
+		const char C_ERROR1[MAX_ERROR_LEN] = "-yashd: missing config file path\n";
+		const char C_ERROR2[MAX_ERROR_LEN] = "-yashd: config file path is too "
+				"long: %s\n";
+		const char J_FLAG_SHORT[3] = "-j\0";
+		const char J_FLAG_LONG[10] = "--jobs\0";
+		const char J_INFO[MAX_ERROR_LEN] = "-yashd: keeping the job registry in: "
+				"%s\n";
+		const char J_ERROR1[MAX_ERROR_LEN] = "-yashd: missing job registry "
+				"directory\n";
+		const char J_ERROR2[MAX_ERROR_LEN] = "-yashd: cannot use job registry "
+				"directory: %s\n";
+		const char A_NONE[5] = "none\0";
+		const char A_RR[3] = "rr\0";
+		const char A_ACCEPTOR[9] = "acceptor\0";
+		cmd_args_t args = {false, DEFAULT_TCP_PORT, 1, 0, 0, AFFINITY_NONE, 0,
+				EMPTY_STR, EMPTY_STR, EMPTY_STR, EMPTY_STR, false, false};
+		char cwd[PATHMAX+1];
+		char *path;
 
 	// Loop over the arguments, skipping the command token
 	for (int i=1; i<argc; i++) {
@@ -116,6 +171,10 @@ cmd_args_t parseArgs(int argc, char** argv) {
 				|| !strcmp(V_FLAG_LONG, argv[i])) {
 			args.verbose = true;
 			printf(V_INFO);
+		} else if (!strcmp(F_FLAG_SHORT, argv[i])
+				|| !strcmp(F_FLAG_LONG, argv[i])) {
+			args.foreground = true;
+			printf(F_INFO);
 		} else if (!strcmp(P_FLAG_SHORT, argv[i])
 				|| !strcmp(P_FLAG_LONG, argv[i])) {
 			// Port argument detected, next argument should be the port number
@@ -142,6 +201,218 @@ cmd_args_t parseArgs(int argc, char** argv) {
 			}
 
 			printf(P_INFO, args.port);
+		} else if (!strcmp(S_FLAG_SHORT, argv[i])
+				|| !strcmp(S_FLAG_LONG, argv[i])) {
+			// Shards argument detected, next argument should be the count
+			if (i+1 >= argc) {
+				printf(S_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1])) {
+				printf(S_ERROR2, MAX_SHARDS);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save number of shards
+			i++;
+			args.shards = atoi(argv[i]);
+
+			// Check if the number of shards is in a valid range
+			if (args.shards < 0 || args.shards > MAX_SHARDS) {
+				printf(S_ERROR2, MAX_SHARDS);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(S_INFO, args.shards);
+		} else if (!strcmp(W_FLAG_SHORT, argv[i])
+				|| !strcmp(W_FLAG_LONG, argv[i])) {
+			// Workers argument detected, next argument should be the count
+			if (i+1 >= argc) {
+				printf(W_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1])) {
+				printf(W_ERROR2, MAX_WORKERS);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save number of workers
+			i++;
+			args.workers = atoi(argv[i]);
+
+			// Check if the number of workers is in a valid range
+			if (args.workers < 0 || args.workers > MAX_WORKERS) {
+				printf(W_ERROR2, MAX_WORKERS);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(W_INFO, args.workers);
+		} else if (!strcmp(R_FLAG_SHORT, argv[i])
+				|| !strcmp(R_FLAG_LONG, argv[i])) {
+			// Recycle argument detected, next argument should be the sessions
+			if (i+1 >= argc) {
+				printf(R_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1]) || atoi(argv[i+1]) < 0) {
+				printf(R_ERROR2);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save number of sessions
+			i++;
+			args.recycle = atoi(argv[i]);
+
+			printf(R_INFO, args.recycle);
+		} else if (!strcmp(A_FLAG_SHORT, argv[i])
+				|| !strcmp(A_FLAG_LONG, argv[i])) {
+			// Affinity argument detected, next argument should be the policy
+			if (i+1 >= argc) {
+				printf(A_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save affinity policy
+			i++;
+			if (!strcmp(A_NONE, argv[i])) {
+				args.affinity = AFFINITY_NONE;
+			} else if (!strcmp(A_RR, argv[i])) {
+				args.affinity = AFFINITY_RR;
+			} else if (!strcmp(A_ACCEPTOR, argv[i])) {
+				args.affinity = AFFINITY_ACCEPTOR;
+			} else {
+				printf(A_ERROR2);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(A_INFO, argv[i]);
+		} else if (!strcmp(RD_FLAG_SHORT, argv[i])
+				|| !strcmp(RD_FLAG_LONG, argv[i])) {
+			// Redirect argument detected, next argument should be the load
+			if (i+1 >= argc) {
+				printf(RD_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			} else if (!isNumber(argv[i+1]) || atoi(argv[i+1]) < 0 ||
+					atoi(argv[i+1]) > 100) {
+				printf(RD_ERROR2);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save redirect load
+			i++;
+			args.redirect = atoi(argv[i]);
+
+			printf(RD_INFO, args.redirect);
+		} else if (!strcmp(T_FLAG_SHORT, argv[i])
+				|| !strcmp(T_FLAG_LONG, argv[i])
+				|| !strcmp(CP_FLAG_SHORT, argv[i])
+				|| !strcmp(CP_FLAG_LONG, argv[i])) {
+			// Record argument detected, next argument should be the directory.
+			// Capturing records the same store, with the input only.
+			args.capture = !strcmp(CP_FLAG_SHORT, argv[i])
+					|| !strcmp(CP_FLAG_LONG, argv[i]);
+			if (i+1 >= argc) {
+				printf(T_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save the absolute path, since the daemon changes its directory
+			i++;
+			mkdir(argv[i], 0755);
+			if ((path = realpath(argv[i], NULL)) == NULL ||
+					strlen(path) > PATHMAX) {
+				printf(T_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			strcpy(args.record, path);
+			free(path);
+
+			printf(args.capture ? CP_INFO : T_INFO, args.record);
+		} else if (!strcmp(AU_FLAG_SHORT, argv[i])
+				|| !strcmp(AU_FLAG_LONG, argv[i])) {
+			// Audit argument detected, next argument should be the path
+			if (i+1 >= argc) {
+				printf(AU_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save the absolute path, since the daemon changes its directory
+			i++;
+			if (argv[i][0] == '/') {
+				cwd[0] = '\0';
+			} else if (getcwd(cwd, sizeof(cwd)) == NULL) {
+				printf(AU_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			if (snprintf(args.audit, sizeof(args.audit), "%s%s%s", cwd,
+					cwd[0] ? "/" : "", argv[i]) >= (int) sizeof(args.audit)) {
+				printf(AU_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(AU_INFO, args.audit);
+		} else if (!strcmp(C_FLAG_SHORT, argv[i])
+				|| !strcmp(C_FLAG_LONG, argv[i])) {
+			// Config argument detected, next argument should be the path
+			if (i+1 >= argc) {
+				printf(C_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save the absolute path, since the daemon changes its directory
+			i++;
+			if (argv[i][0] == '/') {
+				cwd[0] = '\0';
+			} else if (getcwd(cwd, sizeof(cwd)) == NULL) {
+				printf(C_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			if (snprintf(args.config, sizeof(args.config), "%s%s%s", cwd,
+					cwd[0] ? "/" : "", argv[i]) >= (int) sizeof(args.config)) {
+				printf(C_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			printf(C_INFO, args.config);
+		} else if (!strcmp(J_FLAG_SHORT, argv[i])
+				|| !strcmp(J_FLAG_LONG, argv[i])) {
+			// Jobs argument detected, next argument should be the directory
+			if (i+1 >= argc) {
+				printf(J_ERROR1);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+
+			// Save the absolute path, since the daemon changes its directory
+			i++;
+			mkdir(argv[i], 0700);
+			if ((path = realpath(argv[i], NULL)) == NULL ||
+					strlen(path) > PATHMAX) {
+				printf(J_ERROR2, argv[i]);
+				printf(USAGE);
+				exit(EXIT_ERR_ARG);
+			}
+			strcpy(args.jobs, path);
+			free(path);
+
+			printf(J_INFO, args.jobs);
 		} else {
 			printf(ARG_ERROR, argv[i]);
 			printf(USAGE);
@@ -188,26 +459,14 @@ void sigPipe(int sig) {
 }
 
 
-/**
- * @brief Handler for SIGCHLD signal
- *
- * Based on an example provided in Unix Systems Programming by Ramesh
- * Yerraballi.
- *
- * @param	sig	Signal
- */
-void sigChld(int sig) {
-	int status;
-	fprintf(stderr, "Child terminated\n");
-	wait(&status); // So no zombies
-}
-
-
 /**
  * @brief Initializes the current program as a daemon, by changing working
  *  directory, umask, and eliminating control terminal, setting signal handlers,
  *  saving pid, making sure that only one daemon is running.
  *
+ * In the foreground (`-f`), the process keeps its terminal, stdio and process
+ * group, and logs to stderr, so a supervisor or a test harness can run it.
+ *
  * Modified from Ramesh Yerraballi.
  *
  * @param[in] path is where the daemon eventually operates
@@ -220,43 +479,49 @@ void daemonInit(const char *const path, uint mask) {
 	int fd;
 	int k;
 
-	// Put server in background (with init/systemd as parent)
-	if ((pid = fork()) < 0) {
-		perror("daemon_init: Cannot fork process");
-		safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
-	} else if (pid > 0) {	// Parent
-		// No need for safe exit because parent is done
-		exit(EXIT_OK);
-	}
+	// Don't let the child flush what the parent printed into a reused fd
+	fflush(stdout);
 
-	// Child
+	if (!args.foreground) {
+		// Put server in background (with init/systemd as parent)
+		if ((pid = fork()) < 0) {
+			perror("daemon_init: Cannot fork process");
+			safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
+		} else if (pid > 0) {	// Parent
+			// No need for safe exit because parent is done
+			exit(EXIT_OK);
+		}
 
-	// Close all file descriptors that are open
-	for (k = getdtablesize() - 1; k > 0; k--)
-		close(k);
+		// Child
 
-	// Redirect stdin and stdout to /dev/null
-	if ((fd = open("/dev/null", O_RDWR)) < 0) {
-		perror("daemon_init: Error: Failed to open /dev/null");
-		safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
-	}
-	dup2(fd, STDIN_FILENO); /* detach stdin */
-	dup2(fd, STDOUT_FILENO); /* detach stdout */
-	close(fd);
-	// From this point on printf and scanf have no effect
-
-	// Redirect stderr to u_log_path
-	log = fopen(log_path, "aw");	// attach stderr to log file
-	fd = fileno(log);	// Obtain file descriptor of the log
-	dup2(fd, STDERR_FILENO);
-	close(fd);
-	// From this point on printing to stderr will go to log file
-
-	// Set signal handlers
-	if (signal(SIGCHLD, sigChld) < 0) {
-		perror("daemon_init: Error: Could not set signal handler for SIGCHLD");
-		safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
+		// Close all file descriptors that are open
+		for (k = getdtablesize() - 1; k > 0; k--)
+			close(k);
+
+		// Redirect stdin and stdout to /dev/null
+		if ((fd = open("/dev/null", O_RDWR)) < 0) {
+			perror("daemon_init: Error: Failed to open /dev/null");
+			safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
+		}
+		dup2(fd, STDIN_FILENO); /* detach stdin */
+		dup2(fd, STDOUT_FILENO); /* detach stdout */
+		if (fd > STDERR_FILENO) {
+			close(fd);
+		}
+		// From this point on printf and scanf have no effect
+
+		// Redirect stderr to u_log_path
+		log = fopen(log_path, "aw");	// attach stderr to log file
+		fd = fileno(log);	// Obtain file descriptor of the log
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO) {
+			close(fd);
+		}
+		// From this point on printing to stderr will go to log file
 	}
+
+	// Set signal handlers. SIGCHLD keeps its default: the job threads reap
+	// their own processes, see reapJobProcess().
 	if (signal(SIGPIPE, sigPipe) < 0) {
 		perror("daemon_init: Error: Could not set signal handler for SIGPIPE");
 		safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
@@ -276,14 +541,16 @@ void daemonInit(const char *const path, uint mask) {
 	umask(mask);
 
 	// Detach controlling terminal by becoming session leader
-	setsid();
-
-	// Put self in a new process group
 	pid = getpid();
-	setpgrp();	// GPI: modified for linux
+	if (!args.foreground) {
+		setsid();
+
+		// Put self in a new process group
+		setpgrp();	// GPI: modified for linux
+	}
 
 	/* Make sure only one server is running */
-	if ((k = open(pid_path, O_RDWR | O_CREAT, 0666)) < 0) {
+	if ((k = open(pid_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666)) < 0) {
 		perror("daemon_init: Error: Could not open PID file");
 		safeExit(EXIT_ERR_DAEMON);	// TODO: Evaluate if we need this safe exit
 	}
@@ -294,6 +561,7 @@ void daemonInit(const char *const path, uint mask) {
 	}
 
 	/* Save server's pid without closing file (so lock remains)*/
+	ftruncate(k, 0);
 	sprintf(buff, "%6d", pid);
 	write(k, buff, strlen(buff));
 
@@ -304,6 +572,13 @@ void daemonInit(const char *const path, uint mask) {
 /**
  * @brief Reuse TCP port
  *
+ * SO_REUSEADDR lets the server restart while old connections are in
+ * TIME_WAIT. With more than one shard, or in prefork mode, SO_REUSEPORT also
+ * lets every shard bind its own listener to the same port, and the kernel
+ * balances incoming connections between them. A single shard keeps the port
+ * to itself, so a second daemon on the same port fails to bind instead of
+ * silently taking half of the connections.
+ *
  * @param	s	Socket
  */
 void reusePort(int s) {
@@ -312,6 +587,13 @@ void reusePort(int s) {
 
 	if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (char*) &one, sizeof(one))
 			== -1) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: error in setsockopt, "
+				"SO_REUSEADDR \n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+		exit(EXIT_ERR_SOCKET);
+	}
+	if ((shard_count > 1 || args.workers > 0) &&
+			setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (char*) &one, sizeof(one))
+			== -1) {
 		fprintf(stderr, "%s yashd[daemon]: ERROR: error in setsockopt, "
 				"SO_REUSEPORT \n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
 		exit(EXIT_ERR_SOCKET);
@@ -319,6 +601,54 @@ void reusePort(int s) {
 }
 
 
+/**
+ * @brief Enable TCP keepalive on a client connection
+ *
+ * A peer that disappears without closing (a crashed host, a broken link) is
+ * probed after `keepalive` seconds of silence, and the connection fails once
+ * it misses KEEPALIVE_CNT probes, or leaves data unacknowledged as long.
+ *
+ * @param	s	Client socket
+ */
+void setKeepalive(int s) {
+	int idle = getConfig()->keepalive;
+	int intvl = KEEPALIVE_INTVL;
+	int cnt = KEEPALIVE_CNT;
+	unsigned int timeout = (idle + intvl * cnt) * 1000;
+	int one = 1;
+
+	if (idle <= 0) {
+		return;
+	}
+	if (setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) < 0 ||
+			setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle)) < 0 ||
+			setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl)) < 0 ||
+			setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt)) < 0 ||
+			setsockopt(s, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout,
+					sizeof(timeout)) < 0) {
+		perror("ERROR: Enabling keepalive");
+	}
+}
+
+
+/**
+ * @brief Send a client connection's writes right away (no Nagle)
+ *
+ * A session writes small lines back to back, e.g. the prompt then the EXIT
+ * line of a job. Nagle's algorithm would hold the second one until the first
+ * is acknowledged, which the client delays.
+ *
+ * @param	s	Client socket
+ */
+void setNoDelay(int s) {
+	int one = 1;
+
+	if (setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+		perror("ERROR: Disabling Nagle's algorithm");
+	}
+}
+
+
 /**
  * @brief Create and open server socket
  *
@@ -360,7 +690,7 @@ int createSocket(int port) {
 	server.sin_port = pn;
 
 	// Create socket on which to send  and receive
-	sd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
 	// sd = socket (hp->h_addrtype,SOCK_STREAM,0);
 
 	if (sd < 0) {
@@ -388,206 +718,49 @@ int createSocket(int port) {
 			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), ntohs(server.sin_port));
 
 	// Accept TCP connections from clients
-	listen(sd, MAX_CONNECT_QUEUE);
+	listen(sd, getConfig()->connect_queue);
 
 	return sd;
 }
 
 
-/**
- * \name Message Communication Protocol
- *
- * The messages sent between the server and client are expected to be
- * ASCII strings encapsulated between a start-message delimiter and a
- * end-message. The start-message delimiter is 2 bytes of value `0x02` (STX or
- * start of text ASCII control code), and the end-message delimiter is 2 bytes
- * of value `0x03` (ETX or end of text ASCII control code). We don't expect to
- * see any ASCII control codes in the messages except horizontal tabs (`0x09`)
- * and new lines (`0x0A`). See below for examples of messages:
- *
- * ```console
- * (STX)(STX)CMD ls -l(ETX)(ETX)
- * (STX)(STX)CTL c(ETX)(ETX)
- * (STX)(STX)This is text output from a command.\n\tIt can have tabs and new lines(ETX)(ETX)
- * ```
- *
- * The recvMsg() and sendMsg() functions will try to receive and send a full
- * message respectively from a non-blocking socket.
- */
-///@{
-/**
- * @brief Receive encapsulated message over non-blocking socket
- *
- * \param	socket	Socket file descriptor
- * \param	buffer	Buffer to store the message
- * \return	Size in bytes of the received message
- */
-int recvMsg(int socket, msg_t *buffer) {
-	bool receiving = false;
-	size_t rc = 0;
-	char buf;
-
-	buffer->msg_size = 0;
-	cleanBuffer(buffer->msg, MAX_CMD_LEN+5);	// Start with a fresh buffer
-
-	// Read socket byte-by-byte until we get the start-message delimiter
-	while (!receiving) {
-		rc = recv(socket, &buf, 1, 0);
-
-		// Check if we received anything
-		if (rc < 0) {
-			// Nothing to receive or error
-			// TODO: handle errors
-			perror("ERROR: Receiving stream message");
-			return -1;
-		} else if (rc == 0) {
-			// Socket closed
-			// TODO: disconnect client
-			perror("ERROR: Receiving stream message");
-			return -1;
-		} else if (buf == MSG_START_DELIMITER) {
-			// First start-message delimiter detected
-			// Check for second delimiter
-			rc = recv(socket, &buf, 1, 0);
-
-			// Check if we received anything
-			if (rc < 0) {
-				// Nothing to receive or error
-				// TODO: handle errors
-				perror("ERROR: Receiving stream message");
-				return -1;
-			} else if (rc == 0) {
-				// Socket closed
-				// TODO: disconnect client
-				perror("ERROR: Receiving stream message");
-				return -1;
-			} else if (buf == MSG_START_DELIMITER) {
-				// Second start-message delimiter found
-				receiving = true;
-			}
-		} else {
-			// Ignore it garbage
-		}
-	}
-
-	// Read socket byte-by-byte until we get the end-message delimiter
-	while (receiving) {
-		rc = recv(socket, &buf, 1, 0);
-
-		// Check if we received anything
-		if (rc < 0) {
-			// Nothing to receive or error
-			// TODO: handle errors
-			return -1;
-		} else if (rc == 0) {
-			// Socket closed
-			// TODO: disconnect client
-			return -1;
-		} else if (buf == MSG_END_DELIMITER) {
-			// First end-message delimiter detected
-			// Check for second delimiter
-			rc = recv(socket, &buf, 1, 0);
-
-			// Check if we received anything
-			if (rc < 0) {
-				// Nothing to receive or error
-				// TODO: handle errors
-				perror("ERROR: Receiving stream message");
-				return -1;
-			} else if (rc == 0) {
-				// Socket closed
-				// TODO: disconnect client
-				perror("ERROR: Receiving stream message");
-				return -1;
-			} else if (buf == MSG_END_DELIMITER) {
-				// Second end-message delimiter found
-				receiving = false;
-			}
-		} else {
-			// Save message chunk to buffer
-			buffer->msg[buffer->msg_size] = buf;
-			buffer->msg_size++;
-		}
-	}
-
-	// Add '\0' to end of buffer
-	//buffer->msg[buffer->msg_size] = '\0';
-
-	return buffer->msg_size;
-}
-
-
-/**
- * \brief Send encapsulated message over non-blocking socket
- *
- * \param	socket	Socket file descriptor
- * \param	buffer	Buffer with the message
- * \param	size	Size in bytes of the message
- * \return	Size in bytes of the sent message
- */
-int sendMsg(int socket, msg_t *buffer) {
-	int idx;
-	// Create a buffer larger than the original to fit the delimiters
-	char *buf;
-	buf = (char *) malloc(buffer->msg_size+4);
-
-	// Add start-message delimiters
-	buf[0] = MSG_START_DELIMITER;
-	buf[1] = MSG_START_DELIMITER;
-
-	// Add message to buffer
-	for (idx=2; idx<buffer->msg_size+2; idx++) {
-		buf[idx] = buffer->msg[idx-2];
-	}
-
-	// Add end-message delimiters and increase index
-	buf[idx] = MSG_END_DELIMITER;
-	idx++;
-	buf[idx] = MSG_END_DELIMITER;
-	idx++;
-
-	idx = send(socket, buf, idx, 0);
-
-	free(buf);
-
-	return idx;
-}
-///@}
-
-
 /**
  * @brief Print the servant thread table to stderr
+ *
+ * @param	shard	Shard owning the table
  */
-void printServantThTable() {
+void printServantThTable(shard_t *shard) {
 	char buf_time[BUFF_SIZE_TIMESTAMP];
 
-	fprintf(stderr, "%s yashd[daemon]: INFO: Servant Thread Table:\n",
-			timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+	fprintf(stderr, "%s yashd[daemon]: INFO: Servant Thread Table (shard %d):\n",
+			timeStr(buf_time, BUFF_SIZE_TIMESTAMP), shard->id);
 
-	pthread_mutex_lock(&servant_th_table_lock);
-	for (int i=0; i<servant_th_table_idx; i++) {
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	for (int i=0; i<shard->servant_th_table_idx; i++) {
 		fprintf(stderr, "\t[%d] TID: %lu, Status: %s, Socket FD: %d\n",
-				i, servant_th_table[i].tid, servant_th_table[i].run ? "Running" : "Done",
-				servant_th_table[i].socket);
+				i, shard->servant_th_table[i].tid,
+				shard->servant_th_table[i].run ? "Running" : "Done",
+				shard->servant_th_table[i].socket);
 	}
-	pthread_mutex_unlock(&servant_th_table_lock);
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
 }
 
 
 /**
  * @brief Search the servant thread table for the index of the given Thread ID
- * @param	tid	Thread ID
+ * @param	tid		Thread ID
+ * @param	shard	Shard owning the table
  * @return	The index of the thread, or -1 if not found
  */
-int searchServantThByTid(pthread_t tid) {
-	pthread_mutex_lock(&servant_th_table_lock);
-	for (int i=0; i<servant_th_table_idx; i++) {
-		if (servant_th_table[i].tid == tid) {
-			pthread_mutex_unlock(&servant_th_table_lock);
+int searchServantThByTid(pthread_t tid, shard_t *shard) {
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	for (int i=0; i<shard->servant_th_table_idx; i++) {
+		if (shard->servant_th_table[i].tid == tid) {
+			pthread_mutex_unlock(&shard->servant_th_table_lock);
 			return i;
 		}
 	}
-	pthread_mutex_unlock(&servant_th_table_lock);
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
 
 	perror("ERROR: Could not find servant thread in table");
 	return -1;
@@ -597,78 +770,95 @@ int searchServantThByTid(pthread_t tid) {
 /**
  * @brief Remove thread from servant thread table by index
  *
- * @param	idx	Index of the thread to remove in the thread table
+ * @param	idx		Index of the thread to remove in the thread table
+ * @param	shard	Shard owning the table
  */
-void removeServantThFromTableByIdx(int idx) {
+void removeServantThFromTableByIdx(int idx, shard_t *shard) {
 	// Get semaphore to remove thread from thread table
-	pthread_mutex_lock(&servant_th_table_lock);
+	pthread_mutex_lock(&shard->servant_th_table_lock);
 
 	// Check the index is within bounds
-	if (idx < 0 || idx >= servant_th_table_idx) {
+	if (idx < 0 || idx >= shard->servant_th_table_idx) {
 		perror("Thread index provided not in servant thread table");
-		pthread_mutex_unlock(&servant_th_table_lock);
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
 		return;
 	}
 
+	// A thread removing itself was not claimed by stopAllServantThreads(), so
+	// no one will join it: detach it to have its stack freed once it exits
+	if (shard->servant_th_table[idx].run &&
+			pthread_equal(shard->servant_th_table[idx].tid, pthread_self())) {
+		pthread_detach(pthread_self());
+	}
+
 	// Remove thread info from table
-	servant_th_table[idx].tid = 0;
-	servant_th_table[idx].run = false;
-	servant_th_table[idx].socket = 0;
+	wheelDel(&shard->wheel, &shard->servant_th_table[idx].idle_timer);
+	if (shard->servant_th_table[idx].listener >= 0) {
+		releaseSession(shard->servant_th_table[idx].listener);
+		shard->servant_th_table[idx].listener = -1;
+	}
+	shard->servant_th_table[idx].tid = 0;
+	shard->servant_th_table[idx].run = false;
+	shard->servant_th_table[idx].socket = 0;
 	//th_table[idx].pid = 0;
 
 	// Iterate over the table backwards to lower the table index
-	for (int i=(servant_th_table_idx-1); i>=0; i--) {
+	for (int i=(shard->servant_th_table_idx-1); i>=0; i--) {
 		// Reduce the index if thread at the end of the table is done
-		if (!servant_th_table[i].run) {
-			servant_th_table_idx--;
+		if (!shard->servant_th_table[i].run) {
+			shard->servant_th_table_idx--;
 		} else {	// Exit when we find the last running thread
 			break;
 		}
 	}
 
-	pthread_mutex_unlock(&servant_th_table_lock);
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
 }
 
 
 /**
  * @brief Remove thread from servant thread table by Thread ID
- * @param	tid	Thread ID
+ * @param	tid		Thread ID
+ * @param	shard	Shard owning the table
  */
-void removeServantThFromTableByTid(pthread_t tid) {
+void removeServantThFromTableByTid(pthread_t tid, shard_t *shard) {
 	int th_idx = -1;
 
-	// Get semaphore to remove thread from thread table
-	pthread_mutex_lock(&servant_th_table_lock);
-
 	// Search thread table and get thread index on table
-	th_idx = searchServantThByTid(tid);
+	th_idx = searchServantThByTid(tid, shard);
 
 	// Check we found the thread
-	if (th_idx < 0 || th_idx >= servant_th_table_idx) {
+	if (th_idx < 0) {
 		perror("ERROR: Could not remove servant thread from table");
-		pthread_mutex_unlock(&servant_th_table_lock);
 		return;
 	}
 
-	pthread_mutex_unlock(&servant_th_table_lock);
-
-	removeServantThFromTableByIdx(th_idx);
+	removeServantThFromTableByIdx(th_idx, shard);
 }
 
 
 /**
  * @brief Send signal to stop all servant threads and join them
+ *
+ * @param	shard	Shard owning the table
  */
-void stopAllServantThreads() {
+void stopAllServantThreads(shard_t *shard) {
 	pthread_t tid;
+	bool run;
 	// Send signal to stop all threads, and join them afterwards
-	for (int i=(servant_th_table_idx-1); i>=0; i--) {
-		// Check the entry is populated
-		if (servant_th_table[i].run) {
-			tid = servant_th_table[i].tid;
-			pthread_mutex_lock(&servant_th_table_lock);
-			servant_th_table[i].run = false;	// Send stop signal
-			pthread_mutex_unlock(&servant_th_table_lock);
+	for (int i=(shard->servant_th_table_idx-1); i>=0; i--) {
+		// Claim the entry under the lock, or the thread may detach itself
+		pthread_mutex_lock(&shard->servant_th_table_lock);
+		run = shard->servant_th_table[i].run;
+		tid = shard->servant_th_table[i].tid;
+		if (run) {
+			shard->servant_th_table[i].run = false;	// Send stop signal
+			if (shard->servant_th_table[i].socket > 0) {	// Wake it up
+				shutdown(shard->servant_th_table[i].socket, SHUT_RDWR);
+			}
+		}
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+		if (run) {
 			pthread_join(tid, NULL);	// Wait for the thread to stop
 		}
 	}
@@ -677,27 +867,31 @@ void stopAllServantThreads() {
 
 /**
  * @brief Release necessary resources to exit the servant thread safely
+ *
+ * @param	shard	Shard owning the thread
  */
-void exitServantThreadSafely() {
+void exitServantThreadSafely(shard_t *shard) {
 	int th_idx = -1;
 
 	// Search thread table and get thread index on table
-	th_idx = searchServantThByTid(pthread_self());
+	th_idx = searchServantThByTid(pthread_self(), shard);
 
 	// Check we found the thread
-	if (th_idx < 0 || th_idx >= servant_th_table_idx) {
+	if (th_idx < 0 || th_idx >= shard->servant_th_table_idx) {
 		perror("ERROR: Could not exit the servant thread safely");
 		pthread_exit(NULL);
 	}
 
-	// Release thread resources
-	pthread_mutex_lock(&servant_th_table_lock);
-	close(servant_th_table[th_idx].socket);
-	pthread_mutex_unlock(&servant_th_table_lock);
+	// Release thread resources, the socket is not shut down once closed
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	wheelDel(&shard->wheel, &shard->servant_th_table[th_idx].idle_timer);
+	close(shard->servant_th_table[th_idx].socket);
+	shard->servant_th_table[th_idx].socket = -1;
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
 
 
 	// Remove thread from table
-	removeServantThFromTableByIdx(th_idx);
+	removeServantThFromTableByIdx(th_idx, shard);
 
 	// Exit thread
 	pthread_exit(NULL);
@@ -715,14 +909,14 @@ void printJobThTable(shell_info_t *shell_info) {
 	fprintf(stderr, "%s yashd[daemon]: INFO: Job Thread Table:\n",
 			timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
 
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	for (int i=0; i<shell_info->job_th_table_idx; i++) {
 		fprintf(stderr, "\t[%d] TID: %lu, Status: %s, Job no: %d\n",
 				i, shell_info->job_th_table[i].tid,
 				shell_info->job_th_table[i].run ? "Running" : "Done",
 				shell_info->job_th_table[i].jobno);
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 }
 
 
@@ -734,14 +928,14 @@ void printJobThTable(shell_info_t *shell_info) {
  * \return	The index of the thread, or -1 if not found
  */
 int searchJobThByTid(pthread_t tid, shell_info_t *shell_info) {
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 	for (int i=0; i<shell_info->job_th_table_idx; i++) {
 		if (shell_info->job_th_table[i].tid == tid) {
-			pthread_mutex_unlock(&shell_info_lock);
+			pthread_mutex_unlock(&shell_info->lock);
 			return i;
 		}
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 
 	perror("ERROR: Could not find job thread in table");
 	return -1;
@@ -756,15 +950,22 @@ int searchJobThByTid(pthread_t tid, shell_info_t *shell_info) {
  */
 void removeJobThFromTableByIdx(int idx, shell_info_t *shell_info) {
 	// Get semaphore to remove thread from thread table
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 
 	// Check the index is within bounds
 	if (idx < 0 || idx >= shell_info->job_th_table_idx) {
 		perror("Thread index provided not in job thread table");
-		pthread_mutex_unlock(&shell_info_lock);
+		pthread_mutex_unlock(&shell_info->lock);
 		return;
 	}
 
+	// A thread removing itself was not claimed by stopAllJobThreads(), so no
+	// one will join it: detach it to have its stack freed once it exits
+	if (shell_info->job_th_table[idx].run &&
+			pthread_equal(shell_info->job_th_table[idx].tid, pthread_self())) {
+		pthread_detach(pthread_self());
+	}
+
 	// Remove thread info from table
 	shell_info->job_th_table[idx].tid = 0;
 	shell_info->job_th_table[idx].run = false;
@@ -782,7 +983,7 @@ void removeJobThFromTableByIdx(int idx, shell_info_t *shell_info) {
 		}
 	}
 
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 }
 
 
@@ -796,7 +997,7 @@ void removeJobThFromTableByTid(pthread_t tid, shell_info_t *shell_info) {
 	int th_idx = -1;
 
 	// Get semaphore to remove thread from thread table
-	pthread_mutex_lock(&shell_info_lock);
+	pthread_mutex_lock(&shell_info->lock);
 
 	// Search thread table and get thread index on table
 	th_idx = searchJobThByTid(tid, shell_info);
@@ -804,11 +1005,11 @@ void removeJobThFromTableByTid(pthread_t tid, shell_info_t *shell_info) {
 	// Check we found the thread
 	if (th_idx < 0 || th_idx >= shell_info->job_th_table_idx) {
 		perror("ERROR: Could not remove thread from job thread table");
-		pthread_mutex_unlock(&shell_info_lock);
+		pthread_mutex_unlock(&shell_info->lock);
 		return;
 	}
 
-	pthread_mutex_unlock(&shell_info_lock);
+	pthread_mutex_unlock(&shell_info->lock);
 
 	removeJobThFromTableByIdx(th_idx, shell_info);
 }
@@ -821,14 +1022,16 @@ void removeJobThFromTableByTid(pthread_t tid, shell_info_t *shell_info) {
  */
 void stopAllJobThreads(shell_info_t *shell_info) {
 	pthread_t tid;
+	bool run;
 	// Send signal to stop all threads, and join them afterwards
 	for (int i=(shell_info->job_th_table_idx-1); i>=0; i--) {
-		// Check the entry is populated
-		if (shell_info->job_th_table[i].run) {
-			tid = shell_info->job_th_table[i].tid;
-			pthread_mutex_lock(&shell_info_lock);
-			shell_info->job_th_table[i].run = false;	// Send stop signal
-			pthread_mutex_unlock(&shell_info_lock);
+		// Claim the entry under the lock, or the thread may detach itself
+		pthread_mutex_lock(&shell_info->lock);
+		run = shell_info->job_th_table[i].run;
+		tid = shell_info->job_th_table[i].tid;
+		shell_info->job_th_table[i].run = false;	// Send stop signal
+		pthread_mutex_unlock(&shell_info->lock);
+		if (run) {
 			pthread_join(tid, NULL);	// Wait for the thread to stop
 		}
 	}
@@ -867,55 +1070,63 @@ void exitJobThreadSafely(shell_info_t *shell_info) {
 
 
 /**
- * @brief Separate the message type and arguments
+ * \brief Handle HELLO messages
+ *
+ * The client sends `HELLO version features max_frame`, and the session
+ * settles on the lowest version, the features both ends have, and the
+ * smallest max frame. The reply carries the settled values and the session
+ * token, and is followed by the prompt:
+ *
+ * 	HELLO version features max_frame token
  *
- * If the message is malformed, this function returns an empty msg_args_t
- * struct.
+ * Features are in hex, the token is 16 hex digits. A malformed HELLO gets the
+ * values of a client without HELLO.
  *
- * @param	msg	Raw message string
- * @return	Struct with the parsed message
+ * \param	arguments		HELLO message arguments
+ * \param	shell_info		Shell info struct pointer
  */
-msg_args_t parseMessage(char *msg) {
-	char buf[MAX_CMD_LEN+5];
-	size_t len_orig, len_first;
-	msg_args_t msg_parsed;
-
-	// Remove final newline char and replace with NULL char
-	len_orig = strlen(msg);
-
-	if (msg[len_orig-1] == '\n') {
-		msg[len_orig-1] = '\0';
+void handleHelloMessages(char *arguments, shell_info_t *shell_info) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	char msg[HELLO_REPLY_LEN];
+	unsigned int features, max_frame;
+	int version;
+	int n;
+
+	if (sscanf(arguments, "%d %x %u", &version, &features, &max_frame) == 3 &&
+			version > 0) {
+		shell_info->proto_version =
+				(version < PROTO_VERSION) ? version : PROTO_VERSION;
+		shell_info->features = features & PROTO_FEATURES;
+		// A stream cannot be multiplexed again
+		if (shell_info->th_args.stream) {
+			shell_info->features &= ~PROTO_FEAT_MUX;
+		}
+		if (max_frame > 0) {
+			shell_info->max_frame =
+					(max_frame < FRAME_MAX_PAYLOAD) ? max_frame : FRAME_MAX_PAYLOAD;
+		}
+	} else {
+		fprintf(stderr, "%s yashd[%s:%d]: WARN: Malformed HELLO: %s\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(shell_info->th_args.from.sin_addr),
+				ntohs(shell_info->th_args.from.sin_port), arguments);
 	}
 
-	// Check the message is not empty (larger than "CMD \0")
-	if (len_orig <= 5) {
-		strcpy(msg_parsed.type, EMPTY_STR);
-		strcpy(msg_parsed.args, EMPTY_STR);
-		return msg_parsed;
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[%s:%d]: INFO: HELLO: version: %d, features: "
+				"%x, max frame: %u\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(shell_info->th_args.from.sin_addr),
+				ntohs(shell_info->th_args.from.sin_port),
+				shell_info->proto_version, shell_info->features,
+				shell_info->max_frame);
 	}
 
-	// Copy string so strtok() doesn't modify the original string
-	strcpy(buf, msg);
-
-	// Find and save the msg type
-	// Use white space as delimiter to get the first word in the string
-	char *type = strtok(buf, MSG_TYPE_DELIM);
-	strcpy(msg_parsed.type, type);
-
-	// Check there are msg args
-	len_first = strlen(buf);
-	if (len_first >= len_orig) {
-		strcpy(msg_parsed.type, EMPTY_STR);
-		strcpy(msg_parsed.args, EMPTY_STR);
-		return msg_parsed;
+	n = snprintf(msg, sizeof(msg), "%s%d %x %u %016lx\n", MSG_TYPE_HELLO,
+			shell_info->proto_version, shell_info->features,
+			shell_info->max_frame, shell_info->token);
+	if (send(shell_info->th_args.ps, msg, n, MSG_NOSIGNAL) < 0) {
+		perror("ERROR: Sending HELLO");
 	}
-
-	// Find and save the msg arguments
-	// Use the null char as delimiter to get the second part of the string
-	char *args = strtok(NULL, MSG_ARGS_DELIM);
-	strcpy(msg_parsed.args, args);
-
-	return msg_parsed;
 }
 
 
@@ -927,73 +1138,45 @@ msg_args_t parseMessage(char *msg) {
  * 	- z: SIGTSTP
  * 	- d: EOF (disconnect client)
  *
+ * Signals go to the process group of the foreground job, read from
+ * `fg_pgid` without taking the session lock, which a job thread may be
+ * holding while it forks or reaps.
+ *
  * \param	arg				CTL message argument
  * \param	shell_info		Shell info struct pointer
+ * \return	True if a signal was sent, false otherwise
  */
-void handleCTLMessages(char arg, shell_info_t *shell_info) {
+bool handleCTLMessages(char arg, shell_info_t *shell_info) {
 	char buf_time[BUFF_SIZE_TIMESTAMP];
-	pid_t pid_job = 0;
-
-	pthread_mutex_lock(&shell_info_lock);
-
-	// Search the job table to see if we have a fg job
-	for (int i=((shell_info->job_table_idx)-1); i>=0; i--) {
-		if (strcmp(shell_info->job_table[i].status, JOB_STATUS_DONE) &&
-				!shell_info->job_table[i].bg) {
-			pid_job = shell_info->job_table[i].gpid;
-			break;
-		}
-	}
+	shard_t *shard;
+	pid_t pgid;
+	int sig;
 
-	if (pid_job == 0) {
-		if (arg == MSG_CTL_EOF) {
-			if (args.verbose) {
-				fprintf(stderr, "%s yashd[%s:%d]: INFO: EOF received\n",
-						timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-						inet_ntoa(shell_info->th_args.from.sin_addr),
-						ntohs(shell_info->th_args.from.sin_port));
-				fprintf(stderr, "%s yashd[%s:%d]: INFO: Disconnecting client...\n",
-						timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-						inet_ntoa(shell_info->th_args.from.sin_addr),
-						ntohs(shell_info->th_args.from.sin_port));
-			}
-			pthread_mutex_unlock(&shell_info_lock);
-			exitServantThreadSafely();
-			return;
-		} else {
+	switch(arg) {
+	case MSG_CTL_SIGINT:
+	case MSG_CTL_SIGTSTP:
+		sig = (arg == MSG_CTL_SIGINT) ? SIGINT : SIGTSTP;
+		pgid = __atomic_load_n(&shell_info->fg_pgid, __ATOMIC_ACQUIRE);
+		if (pgid <= 0) {
 			fprintf(stderr, "%s yashd[%s:%d]: INFO: No foreground "
 					"process to receive the signal\n",
 					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 					inet_ntoa(shell_info->th_args.from.sin_addr),
 					ntohs(shell_info->th_args.from.sin_port));
-			pthread_mutex_unlock(&shell_info_lock);
-			return;
+			return false;
 		}
-	}
-
-	switch(arg) {
-	case MSG_CTL_SIGINT:
-		// Send SIGINT to child process
-		if (args.verbose) {
-			fprintf(stderr, "%s yashd[%s:%d]: INFO: Sending SIGINT to "
-					"child process\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-					inet_ntoa(shell_info->th_args.from.sin_addr),
-					ntohs(shell_info->th_args.from.sin_port));
+		// Send the signal to the whole job, both ends of a pipe included
+		if (kill(-pgid, sig) < 0) {
+			return false;
 		}
-		kill(pid_job, SIGINT);
-		break;
-	case MSG_CTL_SIGTSTP:
-		// Send SIGTSTP to child process
 		if (args.verbose) {
-			fprintf(stderr, "%s yashd[%s:%d]: INFO: Sending SIGTSTP to "
-					"child process\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+			fprintf(stderr, "%s yashd[%s:%d]: INFO: Sent %s to process group "
+					"%d\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 					inet_ntoa(shell_info->th_args.from.sin_addr),
-					ntohs(shell_info->th_args.from.sin_port));
+					ntohs(shell_info->th_args.from.sin_port),
+					(sig == SIGINT) ? "SIGINT" : "SIGTSTP", pgid);
 		}
-		kill(pid_job, SIGTSTP);
-		break;
+		return true;
 	case MSG_CTL_EOF:
 		// Disconnect from client
 		// Close resources, remove thread from the thread table and exit safely
@@ -1007,17 +1190,28 @@ void handleCTLMessages(char arg, shell_info_t *shell_info) {
 					inet_ntoa(shell_info->th_args.from.sin_addr),
 					ntohs(shell_info->th_args.from.sin_port));
 		}
-		pthread_mutex_unlock(&shell_info_lock);
-		exitServantThreadSafely();
-		break;
+		shard = shell_info->th_args.shard;
+		releaseShellInfo(shell_info);
+		exitServantThreadSafely(shard);
+		return false;
 	default:
 		fprintf(stderr, "%s yashd[%s:%d]: ERROR: Unknown CTL message argument "
 				"received: %c\n",
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(shell_info->th_args.from.sin_addr),
 				ntohs(shell_info->th_args.from.sin_port), arg);
+		return false;
 	}
-	pthread_mutex_unlock(&shell_info_lock);
+}
+
+
+/**
+ * @brief Get the max number of jobs of a session, for the shell engine
+ *
+ * @return	Max jobs per session in the current config
+ */
+static int sessionMaxJobs() {
+	return getConfig()->max_jobs;
 }
 
 
@@ -1034,12 +1228,25 @@ void *jobThread(void *job_thread_args) {
 	job_th_args_l.job_th_idx = j_th_args->job_th_idx;
 	job_th_args_l.shell_info = j_th_args->shell_info;
 	job_thread_args_t *job_th_args = &job_th_args_l;
-	//pthread_mutex_lock(&shell_info_lock);
+	free(j_th_args);
+	//pthread_mutex_lock(&shell_info->lock);
 	bool verbose = args.verbose;
-	//pthread_mutex_unlock(&shell_info_lock);
+	//pthread_mutex_unlock(&shell_info->lock);
 	char buf_time[BUFF_SIZE_TIMESTAMP];
 	int rc = 0;
 	char *prompt = CMD_PROMPT;
+	shard_t *shard = job_th_args->shell_info->th_args.shard;
+	unsigned int cpu, node;
+
+	// Count whether the job runs on the NUMA node of the CPU picked for the
+	// session, which holds its buffers. Unpinned sessions have no such node.
+	if (job_th_args->shell_info->numa_node >= 0 && getcpu(&cpu, &node) == 0) {
+		if ((int) node == job_th_args->shell_info->numa_node) {
+			__atomic_fetch_add(&shard->numa_local, 1, __ATOMIC_RELAXED);
+		} else {
+			__atomic_fetch_add(&shard->numa_remote, 1, __ATOMIC_RELAXED);
+		}
+	}
 
 	if (verbose) {
 		fprintf(stderr, "%s yashd[%s:%d]: INFO: Starting job thread for: %s\n",
@@ -1064,6 +1271,8 @@ void *jobThread(void *job_thread_args) {
 	if (send(job_th_args->shell_info->th_args.ps, prompt, (size_t) rc, 0) < 0) {
 		perror("ERROR: Sending stream message");
 	}
+	touchSession(job_th_args->shell_info->th_args.shard,
+			job_th_args->shell_info->th_args.idx);
 
 	if (verbose) {
 		fprintf(stderr, "%s yashd[%s:%d]: INFO: Stopping job thread for: %s\n",
@@ -1095,20 +1304,41 @@ void handleCMDMessages(char *arguments, shell_info_t *shell_info) {
 				ntohs(shell_info->th_args.from.sin_port), arguments);
 	}
 
+	// Count the command in the shard counters
+	__atomic_fetch_add(&shell_info->th_args.shard->cmds, 1, __ATOMIC_RELAXED);
+
 	// Start job thread
 	int rc;
+	int slot;
+	int max_jobs = sessionMaxJobs();
+	char buf[MAX_ERROR_LEN];
 	pthread_t th_job;
-	job_thread_args_t job_th_args;
-	strcpy(job_th_args.args, arguments);
-	job_th_args.job_th_idx = shell_info->job_th_table_idx;
-	job_th_args.shell_info = shell_info;
-
-	// Add thread to end of thread table
-	pthread_mutex_lock(&shell_info_lock);
-	shell_info->job_th_table[shell_info->job_th_table_idx].run = true;
-	//pthread_mutex_unlock(&shell_info_lock);
+	job_thread_args_t *job_th_args = malloc(sizeof(job_thread_args_t));
+	strcpy(job_th_args->args, arguments);
+	job_th_args->shell_info = shell_info;
+
+	// Add thread to the first free entry of the thread table. A job thread
+	// leaves the table after sending its prompt, so the client's next command
+	// may arrive before the entry is free. The limit is the configured one, the
+	// same the shell engine enforces on the job table.
+	pthread_mutex_lock(&shell_info->lock);
+	for (slot=0; slot<shell_info->job_th_table_idx &&
+			shell_info->job_th_table[slot].run; slot++);
+	if (slot >= max_jobs) {
+		pthread_mutex_unlock(&shell_info->lock);
+		free(job_th_args);
+		snprintf(buf, sizeof(buf), "-yash: max number of concurrent jobs "
+				"reached: %d%s", max_jobs, CMD_PROMPT);
+		if (send(shell_info->th_args.ps, buf, strlen(buf), 0) < 0) {
+			perror("ERROR: Sending stream message");
+		}
+		return;
+	}
+	job_th_args->job_th_idx = slot;
+	shell_info->job_th_table[slot].run = true;
+	//pthread_mutex_unlock(&shell_info->lock);
 
-	if ((rc = pthread_create(&th_job, NULL, jobThread, &job_th_args))) {
+	if ((rc = pthread_create(&th_job, NULL, jobThread, job_th_args))) {
 		fprintf(stderr, "%s yashd[%s:%d]: ERROR: stdinThread pthread_create "
 				"failed, rc: %d\n", timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(shell_info->th_args.from.sin_addr),
@@ -1118,16 +1348,20 @@ void handleCMDMessages(char *arguments, shell_info_t *shell_info) {
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(shell_info->th_args.from.sin_addr),
 				ntohs(shell_info->th_args.from.sin_port));
+		shell_info->job_th_table[slot].run = false;
+		pthread_mutex_unlock(&shell_info->lock);
+		free(job_th_args);
 		return;
 	}
 
 	// Add thread's TID
-	//pthread_mutex_lock(&shell_info_lock);
-	shell_info->job_th_table[shell_info->job_th_table_idx].tid = th_job;
-	shell_info->job_th_table[shell_info->job_th_table_idx].jobno =
-			shell_info->job_table_idx+1;
-	shell_info->job_th_table_idx++;
-	pthread_mutex_unlock(&shell_info_lock);
+	//pthread_mutex_lock(&shell_info->lock);
+	shell_info->job_th_table[slot].tid = th_job;
+	shell_info->job_th_table[slot].jobno = shell_info->job_table_idx+1;
+	if (slot == shell_info->job_th_table_idx) {
+		shell_info->job_th_table_idx++;
+	}
+	pthread_mutex_unlock(&shell_info->lock);
 
 	// Print thread table
 	if (args.verbose) {
@@ -1143,38 +1377,193 @@ void handleCMDMessages(char *arguments, shell_info_t *shell_info) {
 }
 
 
+/**
+ * @brief Allocate the shell info struct of a new session
+ *
+ * The struct gets its own mapping. With an affinity policy, the servant thread
+ * is already pinned when it calls this function, so touching the pages here
+ * places them on the thread's NUMA node (the kernel's first-touch policy).
+ *
+ * @param	cpu	CPU picked for the session, or -1 if it is not pinned
+ * @return	Zeroed shell info struct, or NULL on error
+ */
+shell_info_t *allocShellInfo(int cpu) {
+	shell_info_t *shell_info;
+
+	shell_info = mmap(NULL, sizeof(shell_info_t), PROT_READ|PROT_WRITE,
+			MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (shell_info == MAP_FAILED) {
+		return NULL;
+	}
+
+	if (args.affinity != AFFINITY_NONE) {
+		memset(shell_info, 0, sizeof(shell_info_t));
+	}
+	shell_info->numa_node = cpuNode(cpu);
+
+	return shell_info;
+}
+
+
+/**
+ * @brief Release the shell info struct of a session
+ *
+ * Kill the session's jobs and join their threads before unmapping the struct,
+ * since the job threads use it.
+ *
+ * @param	shell_info	Shell info struct pointer
+ */
+void freeShellInfo(shell_info_t *shell_info) {
+	// Jobs being started from now on kill themselves
+	pthread_mutex_lock(&shell_info->lock);
+	shell_info->closing = true;
+	pthread_mutex_unlock(&shell_info->lock);
+
+	killAllJobs(shell_info);
+	stopAllJobThreads(shell_info);
+	if (shell_info->stdin_pipe_fd[0] >= 0) {
+		close(shell_info->stdin_pipe_fd[0]);
+	}
+	close(shell_info->stdin_pipe_fd[1]);
+	stopSessionRecording(shell_info);
+	pthread_mutex_destroy(&shell_info->lock);
+	munmap(shell_info, sizeof(shell_info_t));
+}
+
+
+/**
+ * @brief Release the shell info struct of a session that is being served
+ *
+ * The struct is taken out of the session's thread table entry under the
+ * table lock first, so the idle reaper does not read it once it is unmapped.
+ * Every path ending a session releases its shell info with this function.
+ *
+ * @param	shell_info	Shell info struct pointer
+ */
+void releaseShellInfo(shell_info_t *shell_info) {
+	shard_t *shard = shell_info->th_args.shard;
+
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	shard->servant_th_table[shell_info->th_args.idx].shell = NULL;
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
+
+	freeShellInfo(shell_info);
+}
+
+
+/**
+ * @brief Deliver one signal line taken out of a client's input
+ *
+ * @param	arg	CTL message argument
+ * @param	ctx	signal_ctx_t of the input
+ */
+static void deliverSignal(char arg, void *ctx) {
+	signal_ctx_t *sig_ctx = ctx;
+	shell_info_t *shell_info = sig_ctx->shell_info;
+	shard_t *shard = shell_info->th_args.shard;
+	char *prompt = CMD_PROMPT;
+
+	if (handleCTLMessages(arg, shell_info)) {
+		pthread_mutex_lock(&shard->servant_th_table_lock);
+		histAdd(&shard->ctl_latency, nowUs() - sig_ctx->read_us);
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+	}
+	if (send(shell_info->th_args.ps, prompt, strlen(prompt), 0) < 0) {
+		perror("ERROR: Sending stream message");
+	}
+}
+
+
+/**
+ * @brief Deliver the signals in a client's input ahead of the rest of it
+ *
+ * `CTL c` and `CTL z` lines are handled as soon as they are read, and taken
+ * out of the input (see takeCtlLines()), so ctrl-c does not wait behind the
+ * commands sent before it. `CTL d` keeps its place, since the commands before
+ * it must still run. The time from reading the input to sending each signal
+ * is added to the shard's latency histogram.
+ *
+ * @param	buf			Input read, complete lines and maybe a partial one
+ * @param	len			Input length
+ * @param	shell_info	Shell info struct pointer
+ * @param	read_us		Time the input was read (nowUs())
+ * @return	Input length, without the signal lines
+ */
+size_t takeSignals(char *buf, size_t len, shell_info_t *shell_info,
+		uint64_t read_us) {
+	signal_ctx_t ctx = { shell_info, read_us };
+
+	return takeCtlLines(buf, len, deliverSignal, &ctx);
+}
+
+
 /**
  * @brief Thread function to serve the clients
  *
  * TODO: Make threads use async socket I/O
  *
- * @param	thread_args	Arguments passed to the thread as a th_args_t struct
+ * @param	thread_args	Arguments passed to the thread as a th_args_t struct. The
+ * 						thread takes ownership of this heap allocated struct.
  */
 void *servantThread(void *thread_args) {
 	servant_th_args_t th_args_l = *(servant_th_args_t *) thread_args;	// Save to local var
 	servant_th_args_t *th_args = &th_args_l;
+	shard_t *shard = th_args->shard;
 	int ps = th_args->ps;
 	struct sockaddr_in from = th_args->from;
 	bool run_serv = true;
 	char buf_time[BUFF_SIZE_TIMESTAMP];
 	char buf_msg[MAX_CMD_LEN+5];	// Add space for CMD/CTL + <blank> and "\0"
+	char buf_in[SERVANT_INPUT_LEN];	// Input read ahead, up to a partial line
+	size_t in_len = 0;
+	size_t start, end;
+	uint64_t read_us;
+	char *nl;
 	int rc;
 	struct hostent *hp, *gethostbyname();
 	char *prompt = CMD_PROMPT;
-	struct pollfd pollfds[1];
-	shell_info_t sh_info;
+	struct pollfd pollfds[2];
+	shell_info_t *sh_info;
+
+	free(thread_args);
+
+	// Allocate the session's state once the thread runs on its CPU
+	if ((sh_info = allocShellInfo(th_args_l.cpu)) == NULL) {
+		fprintf(stderr, "%s yashd[%s:%d]: ERROR: Could not allocate shell info\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+		exitServantThreadSafely(shard);
+	}
 
 	pollfds[0].fd = ps;
 	pollfds[0].events = POLLIN;
 
-	sh_info.th_args.cmd_args.verbose = th_args_l.cmd_args.verbose;
-	sh_info.th_args.cmd_args.port = th_args_l.cmd_args.port;
-	sh_info.th_args.idx = th_args_l.idx;
-	sh_info.th_args.ps = th_args_l.ps;
-	sh_info.th_args.from = th_args_l.from;
-	sh_info.job_table_idx = 0;
-	sh_info.job_th_table_idx = 0;
-	if (pipe(sh_info.stdin_pipe_fd) == SYSCALL_RETURN_ERR) {
+	// Let the idle reaper see the session's jobs
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	shard->servant_th_table[th_args_l.idx].shell = sh_info;
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
+
+	sh_info->th_args.cmd_args.verbose = th_args_l.cmd_args.verbose;
+	sh_info->th_args.cmd_args.port = th_args_l.cmd_args.port;
+	sh_info->th_args.idx = th_args_l.idx;
+	sh_info->th_args.ps = th_args_l.ps;
+	sh_info->th_args.from = th_args_l.from;
+	sh_info->th_args.shard = shard;
+	sh_info->th_args.cpu = th_args_l.cpu;
+	sh_info->th_args.listener = th_args_l.listener;
+	sh_info->th_args.stream = th_args_l.stream;
+	sh_info->host = (shell_host_t) {
+		th_args_l.ps,			// fd
+		NULL,					// ctx
+		NULL,					// write
+		auditCommand,			// audit
+		jobRegAdd,				// job_started
+		jobRegRemove,			// job_ended
+		sessionMaxJobs			// max_jobs
+	};
+	sh_info->job_table_idx = 0;
+	sh_info->job_th_table_idx = 0;
+	if (pipe2(sh_info->stdin_pipe_fd, O_CLOEXEC) == SYSCALL_RETURN_ERR) {
 		fprintf(stderr, "%s yashd[%s:%d]: ERROR: Could not create stdin pipe: %d\n",
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(from.sin_addr), ntohs(from.sin_port), errno);
@@ -1184,13 +1573,22 @@ void *servantThread(void *thread_args) {
 
 
 	// Initialize job thread table lock
-	if (pthread_mutex_init(&shell_info_lock, NULL) != 0) {
+	if (pthread_mutex_init(&sh_info->lock, NULL) != 0) {
 		fprintf(stderr, "%s yashd[%s:%d]: ERROR: Mutex init has failed\n",
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 		pthread_exit(NULL);
 	}
 
+	// Route the session's output through the recorder
+	if (startSessionRecording(sh_info) < 0) {
+		fprintf(stderr, "%s yashd[%s:%d]: WARN: Could not record session: %d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(from.sin_addr), ntohs(from.sin_port), errno);
+	}
+	pollfds[1].fd = sh_info->rec_fd;
+	pollfds[1].events = POLLIN;
+
 	if (args.verbose) {
 		fprintf(stderr, "%s yashd[%s:%d]: INFO: Serving client on %s:%d\n",
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
@@ -1208,6 +1606,18 @@ void *servantThread(void *thread_args) {
 		}
 	}
 
+	// Clients without HELLO get everything the protocol had before it
+	sh_info->proto_version = 0;
+	sh_info->features = PROTO_FEAT_LEGACY;
+	if (sh_info->th_args.stream) {
+		sh_info->features &= ~PROTO_FEAT_MUX;
+	}
+	sh_info->max_frame = FRAME_MAX_PAYLOAD;
+
+	// Tell a returning client about its jobs left by a crashed daemon
+	newSessionToken(sh_info);
+	reportOrphanJobs(sh_info);
+
 	// Send prompt
 	if (args.verbose) {
 		fprintf(stderr, "%s yashd[%s:%d]: INFO: Sending prompt\n",
@@ -1215,7 +1625,7 @@ void *servantThread(void *thread_args) {
 				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 	}
 	rc = strlen(prompt);
-	if (send(ps, prompt, (size_t) rc, 0) < 0) {
+	if (send(sh_info->th_args.ps, prompt, (size_t) rc, 0) < 0) {
 		perror("ERROR: Sending stream message");
 	}
 
@@ -1229,7 +1639,16 @@ void *servantThread(void *thread_args) {
 					inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 		}
 		*/
-		poll(pollfds, 1, 500);	// Poll for 0.5sec
+		// Sleep until there is input or output, stopping shuts the socket down
+		poll(pollfds, 2, -1);
+		if (pollfds[1].revents & (POLLIN|POLLHUP)) {	// Output to relay
+			pollfds[1].revents = 0;
+			touchSession(shard, th_args_l.idx);
+			if (relaySessionOutput(sh_info) < 0) {
+				run_serv = false;
+				break;
+			}
+		}
 		if (pollfds[0].revents & POLLIN) {	// There is stuff to read
 			pollfds[0].revents = 0;
 
@@ -1239,7 +1658,9 @@ void *servantThread(void *thread_args) {
 						timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 						inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 			}
-			if ((rc = recv(ps, buf_msg, sizeof(buf_msg), 0)) < 0) {
+			touchSession(shard, th_args_l.idx);
+			read_us = nowUs();
+			if ((rc = recv(ps, &buf_in[in_len], sizeof(buf_in) - in_len, 0)) < 0) {
 				perror("ERROR: Receiving stream message");
 				if (args.verbose) {
 					fprintf(stderr, "%s yashd[%s:%d]: ERROR: Reading message\n",
@@ -1252,87 +1673,132 @@ void *servantThread(void *thread_args) {
 
 			// Check if client disconnected or handle message
 			if (rc > 0) {
-				buf_msg[rc] = '\0';	// Add null char to the end of the msg
-				if (args.verbose) {
-					fprintf(stderr, "%s yashd[%s:%d]: INFO: Message received: %s",
-							timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-							inet_ntoa(from.sin_addr), ntohs(from.sin_port),
-							buf_msg);
-				}
-
-				// Parse message
-				msg_args_t msg = parseMessage(buf_msg);
-				if (args.verbose) {
-					fprintf(stderr, "%s yashd[%s:%d]: INFO: Message parsed %s: "
-							"%s\n",
-							timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-							inet_ntoa(from.sin_addr), ntohs(from.sin_port),
-							msg.type, msg.args);
+				// Read whatever else is queued, so signals can jump it
+				recordSessionInput(sh_info, &buf_in[in_len], rc);
+				in_len += rc;
+				while (in_len < sizeof(buf_in) &&
+						(rc = recv(ps, &buf_in[in_len], sizeof(buf_in) - in_len,
+								MSG_DONTWAIT)) > 0) {
+					recordSessionInput(sh_info, &buf_in[in_len], rc);
+					in_len += rc;
 				}
-
-				/*
-				 * TODO: Check if there is a foreground process running. If
-				 * there is not the message must be of type CMD, or it is
-				 * garbage. If there is, the message can be of type CTL or stdin
-				 * for the foreground process. Hnadle the message appropriately.
-				 */
-				if (!strcmp(msg.type, MSG_TYPE_CMD)) {
-					// Refresh the pipe
-					pthread_mutex_lock(&shell_info_lock);
-					close(sh_info.stdin_pipe_fd[0]);
-					close(sh_info.stdin_pipe_fd[1]);
-					if (pipe(sh_info.stdin_pipe_fd) == SYSCALL_RETURN_ERR) {
-						fprintf(stderr, "%s yashd[%s:%d]: ERROR: Could not refresh stdin pipe: %d\n",
-								timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-								inet_ntoa(from.sin_addr), ntohs(from.sin_port), errno);
-						pthread_exit(NULL);
+				in_len = takeSignals(buf_in, in_len, sh_info, read_us);
+
+				// Handle the complete lines in order. A line filling the whole
+				// buffer is cut down to a message.
+				for (start = 0; run_serv && start < in_len; start = end) {
+					nl = memchr(&buf_in[start], '\n', in_len - start);
+					if (nl == NULL && (start > 0 || in_len < sizeof(buf_in))) {
+						break;
 					}
-					pthread_mutex_unlock(&shell_info_lock);
-
-					// Handle CMD messages
-					handleCMDMessages(msg.args, &sh_info);
-					fprintf(stderr, "%s yashd[%s:%d]: %s\n",
-							timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-							inet_ntoa(from.sin_addr), ntohs(from.sin_port),
-							msg.args);
-				} else if (!strcmp(msg.type, MSG_TYPE_CTL)) {
+					end = (nl != NULL) ? (size_t) (nl - buf_in) + 1 : in_len;
+					rc = (end - start < sizeof(buf_msg)) ? end - start :
+							sizeof(buf_msg) - 1;
+					memcpy(buf_msg, &buf_in[start], rc);
+					buf_msg[rc] = '\0';	// Add null char to the end of the msg
 					if (args.verbose) {
-						fprintf(stderr, "%s yashd[%s:%d]: INFO: Signal received: "
-								"%s\n",
+						fprintf(stderr, "%s yashd[%s:%d]: INFO: Message received: %s",
 								timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 								inet_ntoa(from.sin_addr), ntohs(from.sin_port),
-								msg.args);
+								buf_msg);
 					}
 
-					// Handle CTL messages
-					handleCTLMessages(msg.args[0], &sh_info);
+					// Switch the connection to multiplexed sessions, unless the
+					// client's HELLO left them out
+					if (!strcmp(buf_msg, MSG_TYPE_MUX) &&
+							(sh_info->features & PROTO_FEAT_MUX)) {
+						stopSessionRecording(sh_info);	// Streams are recorded
+						runMux(sh_info);
+						run_serv = false;
+						break;
+					}
 
-					// Send prompt
+					// Parse message
+					msg_args_t msg = parseMessage(buf_msg);
 					if (args.verbose) {
-						fprintf(stderr, "%s yashd[%s:%d]: INFO: Sending prompt\n",
+						fprintf(stderr, "%s yashd[%s:%d]: INFO: Message parsed %s: "
+								"%s\n",
 								timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-								inet_ntoa(from.sin_addr), ntohs(from.sin_port));
-					}
-					rc = strlen(prompt);
-					if (send(ps, prompt, (size_t) rc, 0) < 0) {
-						perror("ERROR: Sending stream message");
+								inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+								msg.type, msg.args);
 					}
-				} else {	// This is input to be sent to the stdin pipe
+
 					/*
-					if (args.verbose) {
-						fprintf(stderr, "%s yashd[%s:%d]: ERROR: Unknown message "
-								"received: %s\n",
+					 * TODO: Check if there is a foreground process running. If
+					 * there is not the message must be of type CMD, or it is
+					 * garbage. If there is, the message can be of type CTL or stdin
+					 * for the foreground process. Hnadle the message appropriately.
+					 */
+					if (!strcmp(msg.type, MSG_TYPE_CMD)) {
+						// Refresh the pipe
+						pthread_mutex_lock(&sh_info->lock);
+						if (sh_info->stdin_pipe_fd[0] >= 0) {	// Closed by the last job
+							close(sh_info->stdin_pipe_fd[0]);
+						}
+						close(sh_info->stdin_pipe_fd[1]);
+						if (pipe2(sh_info->stdin_pipe_fd, O_CLOEXEC) == SYSCALL_RETURN_ERR) {
+							fprintf(stderr, "%s yashd[%s:%d]: ERROR: Could not refresh stdin pipe: %d\n",
+									timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+									inet_ntoa(from.sin_addr), ntohs(from.sin_port), errno);
+							pthread_exit(NULL);
+						}
+						pthread_mutex_unlock(&sh_info->lock);
+
+						// Handle CMD messages
+						handleCMDMessages(msg.args, sh_info);
+						fprintf(stderr, "%s yashd[%s:%d]: %s\n",
 								timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
 								inet_ntoa(from.sin_addr), ntohs(from.sin_port),
-								buf_msg);
-					}
-					*/
-					/*
-					if (write(sh_info.stdin_pipe_fd[1], buf_msg, rc)) {
-						perror("ERROR: Sending input to stdin pipe");
+								msg.args);
+					} else if (!strcmp(msg.type, MSG_TYPE_CTL)) {
+						if (args.verbose) {
+							fprintf(stderr, "%s yashd[%s:%d]: INFO: Signal received: "
+									"%s\n",
+									timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+									inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+									msg.args);
+						}
+
+						// Handle CTL messages
+						handleCTLMessages(msg.args[0], sh_info);
+
+						// Send prompt
+						if (args.verbose) {
+							fprintf(stderr, "%s yashd[%s:%d]: INFO: Sending prompt\n",
+									timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+									inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+						}
+						rc = strlen(prompt);
+						if (send(sh_info->th_args.ps, prompt, (size_t) rc, 0) < 0) {
+							perror("ERROR: Sending stream message");
+						}
+					} else if (!strcmp(msg.type, MSG_TYPE_HELLO_TOK)) {
+						handleHelloMessages(msg.args, sh_info);
+
+						// Send prompt
+						rc = strlen(prompt);
+						if (send(sh_info->th_args.ps, prompt, (size_t) rc, 0) < 0) {
+							perror("ERROR: Sending stream message");
+						}
+					} else {	// This is input to be sent to the stdin pipe
+						/*
+						if (args.verbose) {
+							fprintf(stderr, "%s yashd[%s:%d]: ERROR: Unknown message "
+									"received: %s\n",
+									timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+									inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+									buf_msg);
+						}
+						*/
+						/*
+						if (write(sh_info->stdin_pipe_fd[1], buf_msg, rc)) {
+							perror("ERROR: Sending input to stdin pipe");
+						}
+						*/
 					}
-					*/
 				}
+				memmove(buf_in, &buf_in[start], in_len - start);
+				in_len -= start;
 			} else {
 				if (args.verbose) {
 					fprintf(stderr, "%s yashd[%s:%d]: INFO: Client disconnected\n",
@@ -1342,7 +1808,7 @@ void *servantThread(void *thread_args) {
 				run_serv = false;	// Exit loop
 				break;
 			}
-		} else if (pollfds[0].revents & POLLHUP) {	// Client hanged up
+		} else if (pollfds[0].revents & (POLLHUP|POLLERR)) {	// Client hanged up
 			if (args.verbose) {
 				fprintf(stderr, "%s yashd[%s:%d]: INFO: Client disconnected\n",
 						timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
@@ -1360,7 +1826,7 @@ void *servantThread(void *thread_args) {
 					inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 		}
 		*/
-		if (!servant_th_table[th_args_l.idx].run) {
+		if (!shard->servant_th_table[th_args_l.idx].run) {
 			if (args.verbose) {
 				fprintf(stderr, "%s yashd[%s:%d]: INFO: Received signal to "
 						"stop thread\n",
@@ -1379,15 +1845,139 @@ void *servantThread(void *thread_args) {
 				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
 	}
 
-	/* TODO: Ensure all child processes are dead on exit
-	 * killAllJobs();
-	 */
+	// Ensure all child processes and job threads are dead on exit
+	releaseShellInfo(sh_info);
 
-	exitServantThreadSafely();
+	exitServantThreadSafely(shard);
 	pthread_exit(NULL);
 }
 
 
+/**
+ * @brief Start a servant thread to serve a new client connection
+ *
+ * The thread is added to the first free entry of the shard's servant thread
+ * table. If the shard is already serving its share of clients, the connection
+ * is closed.
+ *
+ * @param	shard	Shard that accepted the connection
+ * @param	ps		Client socket fd
+ * @param	from	Client connection information
+ * @param	listener	Listener the connection came from
+ * @param	stream	Whether the session is a stream of a multiplexed connection
+ * @return	0 on success, -1 if the connection was rejected
+ */
+int startServantThread(shard_t *shard, int ps, struct sockaddr_in from,
+		int listener, bool stream) {
+	char buf_time[BUFF_SIZE_TIMESTAMP];
+	servant_th_args_t *th_args;
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	pthread_t th;
+	int reason = ADMIT_REJECT_FULL;
+	int idx = -1;
+	int active = 0;
+	int port = -1;
+	int rc;
+
+	// Spawn thread to handle new connection
+	if (args.verbose) {
+		fprintf(stderr, "%s yashd[daemon]: INFO: Spawning thread to handle "
+				"new client at %s:%d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+	}
+
+	// Find a free entry in the thread table, and count the active sessions
+	pthread_mutex_lock(&shard->servant_th_table_lock);
+	for (int i=0; i<shard->servant_th_table_idx; i++) {
+		if (shard->servant_th_table[i].run) {
+			active++;
+		} else if (idx < 0) {
+			idx = i;
+		}
+	}
+	if (idx < 0 && shard->servant_th_table_idx < MAX_CONCURRENT_CLIENTS) {
+		idx = shard->servant_th_table_idx;
+	}
+	// Send the client to a less loaded peer, rather than load this shard more.
+	// The line is sent once the table is unlocked.
+	if (getConfig()->listeners[listener].priority != LISTENER_HIGH &&
+			(port = pickRedirect(ps, active)) >= 0) {
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+		redirectSession(shard, ps, port);
+		return 0;
+	}
+	if (idx < 0 || !admitSession(listener, active, &reason)) {
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+		__atomic_fetch_add(&shard->rejected, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "%s yashd[daemon]: WARN: %s (shard %d, listener %d), "
+				"rejecting client at %s:%d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				reason == ADMIT_REJECT_CAP ? "Session cap reached" :
+				"Shard or listener full", shard->id, listener,
+				inet_ntoa(from.sin_addr), ntohs(from.sin_port));
+		rejectConnection(ps, reason);
+		return -1;
+	}
+
+	th_args = malloc(sizeof(servant_th_args_t));
+	th_args->cmd_args = args;
+	th_args->from = from;
+	th_args->ps = ps;
+	th_args->idx = idx;
+	th_args->shard = shard;
+	th_args->cpu = pickSessionCpu(shard);
+	th_args->listener = listener;
+	th_args->stream = stream;
+
+	// Start the thread on the session's CPU, so its stack is local too
+	pthread_attr_init(&attr);
+	if (th_args->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(th_args->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+	}
+
+	// Add thread to the thread table
+	shard->servant_th_table[idx].run = true;
+	shard->servant_th_table[idx].socket = ps;
+	shard->servant_th_table[idx].listener = listener;
+	armIdleTimer(shard, idx);
+
+	// Create new thread
+	rc = pthread_create(&th, &attr, servantThread, th_args);
+	pthread_attr_destroy(&attr);
+	if (rc) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: serverThread "
+				"pthread_create failed, rc: %d\n",
+				timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
+				(int)rc);
+
+		// Release resources
+		wheelDel(&shard->wheel, &shard->servant_th_table[idx].idle_timer);
+		releaseSession(listener);
+		shard->servant_th_table[idx].listener = -1;
+		shard->servant_th_table[idx].run = false;
+		shard->servant_th_table[idx].socket = 0;
+		pthread_mutex_unlock(&shard->servant_th_table_lock);
+		free(th_args);
+		close(ps);
+		return -1;
+	}
+
+	// Add thread's TID
+	shard->servant_th_table[idx].tid = th;
+	if (idx >= shard->servant_th_table_idx) {
+		shard->servant_th_table_idx = idx+1;
+	}
+	__atomic_fetch_add(&shard->sessions, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shard->servant_th_table_lock);
+
+	return 0;
+}
+
+
 /**
  * @brief Point of entry
  *
@@ -1396,115 +1986,54 @@ void *servantThread(void *thread_args) {
  * @return	Error code
  */
 int main(int argc, char **argv) {
-	bool run = true;
 	char buf_time[BUFF_SIZE_TIMESTAMP];
-	int s, ps;
-	socklen_t fromlen;
-	struct sockaddr_in from;
 
 	// Process command line arguments
 	args = parseArgs(argc, argv);
+	if (startConfig(args.config) < 0) {
+		exit(EXIT_ERR_ARG);
+	}
 
-	// Initialize the daemon
-	strcpy(log_path, DAEMON_LOG_PATH);
-	strcpy(pid_path, DAEMON_PID_PATH);
+	// Initialize the daemon, daemons on other ports get their own files
+	strcpy(log_path, getConfig()->log);
+	if (args.port == DEFAULT_TCP_PORT) {
+		strcpy(pid_path, DAEMON_PID_PATH);
+	} else {
+		snprintf(pid_path, PATHMAX, DAEMON_PID_PATH_PORT, args.port);
+	}
 	daemonInit(DAEMON_DIR, DAEMON_UMASK);
 
-	// Initialize thread table lock
-	if (pthread_mutex_init(&servant_th_table_lock, NULL) != 0) {
-		fprintf(stderr, "%s yashd[daemon]: ERROR: Mutex init has failed\n",
+	// Set up the shards, each with its own server socket
+	if (args.workers > 0) {
+		runMaster(args.workers, args.port);
+		exit(EXIT_OK);
+	}
+	if (initShards(args.shards, NULL) < 0) {
+		fprintf(stderr, "%s yashd[daemon]: ERROR: Could not set up shards\n",
 				timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
 		exit(EXIT_ERR_THREAD);
 	}
 
-	// Set up server socket
-	s = createSocket(args.port);
-
-	// Accept connections from clients and serve them on a new thread
-	fromlen = sizeof(from);
-	while(run) {
-		if (args.verbose) {
-			fprintf(stderr, "%s yashd[daemon]: INFO: Started iteration in "
-					"main loop\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
-		}
-
-		pthread_t th;
-		ssize_t rc;
-
-		// Accept connection
-		if (args.verbose) {
-			fprintf(stderr, "%s yashd[daemon]: INFO: Accepting connections\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
-		}
-
-		ps  = accept(s, (struct sockaddr *)&from, &fromlen);
-
-		// Put the new socket into non-blocking mode
-		//fcntl(ps, F_SETFL, O_NONBLOCK);
-
-		// Spawn thread to handle new connection
-		if (args.verbose) {
-			fprintf(stderr, "%s yashd[daemon]: INFO: Spawning thread to handle "
-					"new client at %s:%d\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-					inet_ntoa(from.sin_addr), ntohs(from.sin_port));
-		}
-
-		servant_th_args_t th_args;
-		th_args.cmd_args.verbose = args.verbose;
-		th_args.cmd_args.port = args.port;
-		th_args.from = from;
-		th_args.ps = ps;
-		th_args.idx = servant_th_table_idx;
-
-		// Add thread to end of thread table
-		pthread_mutex_lock(&servant_th_table_lock);
-		servant_th_table[servant_th_table_idx].run = true;
-		servant_th_table[servant_th_table_idx].socket = ps;
-
-		// Create new thread
-		if ((rc = pthread_create(&th, NULL, servantThread, &th_args))) {
-			fprintf(stderr, "%s yashd[daemon]: ERROR: serverThread "
-					"pthread_create failed, rc: %d\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP),
-					(int)rc);
-
-			// Release resources and exit
-			close(ps);
-			close(s);
-			pthread_mutex_unlock(&servant_th_table_lock);
-			pthread_mutex_destroy(&servant_th_table_lock);
-			exit(EXIT_ERR_THREAD);
-		}
-
-		// Add thread's TID
-		servant_th_table[servant_th_table_idx].tid = th;
-		servant_th_table_idx++;
-		pthread_mutex_unlock(&servant_th_table_lock);
-
-		// Sleep
-		//sleep(MAIN_LOOP_SLEEP_TIME);
-
-		// Print thread table
-		if (args.verbose) {
-			printServantThTable();
-		}
-
-		if (args.verbose) {
-			fprintf(stderr, "%s yashd[daemon]: INFO: Finished iteration in "
-					"main loop\n",
-					timeStr(buf_time, BUFF_SIZE_TIMESTAMP));
+	// Let the other daemons on this host see our load
+	if (args.redirect > 0) {
+		startRegistry();
+	}
+	if (args.record[0] != '\0') {
+		startRecorder(args.record);
+	}
+	if (args.audit[0] != '\0' && startAudit(args.audit) < 0) {
+		exit(EXIT_ERR_DAEMON);	// Commands must not run unaudited
+	}
+	startJobRegistry(args.port);	// Jobs still run untracked if this fails
+
+	// Run the single shard on this thread, or wait for all the shard threads
+	if (shard_count == 1) {
+		runShard(&shards[0]);
+	} else {
+		for (int i=0; i<shard_count; i++) {
+			pthread_join(shards[i].tid, NULL);
 		}
 	}
 
-	// Ensure all threads and child processes are dead on exit
-	// TODO: This might not be needed since the threads are killed when the
-	// calling main function returns
-	stopAllServantThreads();
-
-	// Release resources and exit
-	close(s);
-	pthread_mutex_destroy(&servant_th_table_lock);
 	exit(EXIT_OK);
 }
@@ -10,13 +10,17 @@
 #ifndef YASHD_H
 #define YASHD_H
 
+#define _GNU_SOURCE	// CPU affinity and SO_REUSEPORT helpers
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
 #include <fcntl.h>
@@ -33,13 +37,37 @@
 #include <ctype.h>
 #include <time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "yashd_defs.h"
+#include "frame.h"
+#include "yash_time.h"
+#include "record.h"
 
 #define PATHMAX 255			//! Max length of a path
 #define MAX_CONCURRENT_CLIENTS 50	//! Max number of clients connected
 #define MAX_CONNECT_QUEUE 5	//! Max queue of pending connections
+#define MAX_SHARDS 256		//! Max number of shards (one per CPU at most)
+#define MAX_WORKERS 256		//! Max number of prefork worker processes
+#define WORKER_RESPAWN_DELAY 1	//! Min seconds between respawns of a crashing worker
+
+#define MAX_LISTENERS 8		//! Max number of listeners, the server port included
+#define UNIX_PATH_LEN 108	//! Max length of a Unix socket path
+#define LISTENER_NORMAL 0	//! Listener priority class: interactive sessions
+#define LISTENER_HIGH 1		//! Listener priority class: accepted first, exempt from max_clients
+#define LISTENER_BURST 16	//! Max connections accepted at once from a high priority listener
+#define ADMIT_SOURCES 1024	//! Sources tracked by the connection rate limiter
+#define ADMIT_PROBE 8		//! Slots a source may take in the rate limiter
+#define ADMIT_RATE 20		//! Connections per second a source may open
+#define ADMIT_BURST 40		//! Connections a source may open at once
+#define ADMIT_REJECT_RATE 0	//! Rejection reason: source over its rate
+#define ADMIT_REJECT_CAP 1	//! Rejection reason: process at its session cap
+#define ADMIT_REJECT_FULL 2	//! Rejection reason: shard or listener full
+#define ADMIT_REASONS 3		//! Number of rejection reasons
+#define AFFINITY_NONE 0		//! Affinity policy: let the scheduler place sessions
+#define AFFINITY_RR 1		//! Affinity policy: pin sessions to CPUs round-robin
+#define AFFINITY_ACCEPTOR 2	//! Affinity policy: pin sessions to the acceptor's CPU
 #define MAIN_LOOP_SLEEP_TIME 0.5	//! Main loop time to sleep between iters
 #define MAX_STATUS_LEN 8	//! Max status string length
 /**
@@ -65,17 +93,23 @@
 #define DAEMON_DIR "/tmp/"					//! Daemon safe directory
 #define DAEMON_LOG_PATH "/tmp/yashd.log"	//! Daemon log path
 #define DAEMON_PID_PATH "/tmp/yashd.pid"	//! Daemon PID file path
+#define DAEMON_LOG_PATH_PORT "/tmp/yashd-%d.log"	//! Log path of a daemon on a non-default port
+#define DAEMON_PID_PATH_PORT "/tmp/yashd-%d.pid"	//! PID file path of a daemon on a non-default port
 #define DAEMON_UMASK 0						//! Daemon umask
 
 #define MSG_START_DELIMITER 0x02	//! Start-message delimiter
 #define MSG_END_DELIMITER 0x03		//! End-message delimiter
 #define MSG_TYPE_CTL "CTL\0"	//! Control message token
 #define MSG_TYPE_CMD "CMD\0"	//! Command message token
+#define MSG_TYPE_HELLO_TOK "HELLO\0"	//! Handshake message token
+#define HELLO_REPLY_LEN (sizeof(MSG_TYPE_HELLO) + 11 + 1 + 8 + 1 + 10 + 1 + 16 + 1)	//! HELLO reply "HELLO %d %x %u %016lx\n" and its NUL
 #define MSG_CTL_SIGINT 'c'		//! Control message argument for SIGINT (ctrl+c)
 #define MSG_CTL_SIGTSTP 'z'		//! Control message argument for SIGTSTP (ctrl+z)
 #define MSG_CTL_EOF 'd'			//! Control message argument for EOF (ctrl+d)
 #define MSG_TYPE_DELIM " "		//! Type (1st word) token delimiter
 #define MSG_ARGS_DELIM "\0"		//! Arguments token delimiter
+#define SERVANT_INPUT_LEN (8 * (MAX_CMD_LEN+6))	//! Client input read ahead, so signals can jump it
+#define MUX_PENDING_MAX (4 * FRAME_MAX_PAYLOAD)	//! Client input a stalled stream may hold back
 
 #define CMD_PROMPT "\n# \0"	//! Shell prompt
 #define CMD_BG "bg\0"		//! Shell command bg, @sa bg()
@@ -86,6 +120,49 @@
 #define JOB_STATUS_STOPPED "Stopped\0"	//! Shell job status stopped
 #define JOB_STATUS_DONE "Done\0"		//! Shell job status done
 
+#define SHARD_MSG_STATS 1	//! Shard message: log the shard table and counters
+#define SHARD_MSG_STOP 2	//! Shard message: stop accepting and exit
+#define SHARD_MSG_RELOAD 3	//! Shard message: reload the config file
+#define SHARD_MSG_WAKE 4	//! Shard message: a timer was added to an empty wheel
+#define SHARD_MSG_RELISTEN 5	//! Shard message: apply the reloaded backlogs to the shard's sockets
+
+#define WHEEL_BITS 6		//! Bits of a timer wheel level's slot index
+#define WHEEL_SLOTS (1 << WHEEL_BITS)	//! Slots per level of a timer wheel
+#define WHEEL_LEVELS 4		//! Levels of a timer wheel, for 2^24 seconds of range
+#define WHEEL_MAX_WAIT 3600	//! Max seconds a wheel's owner sleeps for
+#define IDLE_TIMEOUT 1800	//! Seconds a session without jobs may be silent
+#define KEEPALIVE 60		//! Seconds a connection may be silent before it is probed
+#define KEEPALIVE_INTVL 10	//! Seconds between keepalive probes
+#define KEEPALIVE_CNT 3		//! Unanswered keepalive probes before a peer is dead
+
+#define REGISTRY_NAME "/yashd-registry-%u"	//! Shared memory name of the peer registry, per user
+#define REGISTRY_SLOTS 64		//! Max number of daemon processes in the registry
+#define REGISTRY_HEARTBEAT 1	//! Seconds between registry updates
+#define REGISTRY_STALE 3		//! Seconds without updates before a slot is ignored
+
+#define RECORD_BUFFERS 4		//! Blocks being filled or waiting to be written
+#define RECORD_FLUSH 1			//! Max seconds an event waits in a partial block
+#define RECORD_RELAY_LEN 4096	//! Max session output relayed (and recorded) at once, bounds `relay_len`
+
+#define AUDIT_WINDOW_US 200		//! Max microseconds a record waits for others to share its fdatasync()
+#define AUDIT_BUF_LEN 65536		//! Max bytes of records committed by one fdatasync()
+#define AUDIT_MAX_RECORD (MAX_CMD_LEN+128)	//! Max length of an audit record
+
+#define HIST_BUCKETS 32			//! Buckets of a histogram, one per power of 2
+
+#define JOBREG_DIR "/tmp/yashd-%u"			//! Job registry directory of a user without $XDG_RUNTIME_DIR
+#define JOBREG_FILE "yashd-jobs.reg"		//! Job registry file name
+#define JOBREG_FILE_PORT "yashd-jobs-%d.reg"	//! Job registry file name of a daemon on a non-default port
+#define JOBREG_MAGIC 0x4752424aU	//! Job registry magic ("JBRG")
+#define JOBREG_SLOTS 4096		//! Max number of jobs in the registry
+#define JOBREG_CMD_LEN 80		//! Max length of a command in the registry
+#define JOBREG_START_SLACK 2	//! Max seconds between a job's start and its leader's
+#define JOBREG_FREE 0			//! Job registry entry state: free
+#define JOBREG_BUSY 1			//! Job registry entry state: being written
+#define JOBREG_LIVE 2			//! Job registry entry state: job of a running daemon
+#define JOBREG_ORPHAN 3			//! Job registry entry state: job adopted after a crash
+#define JOBREG_KILLED 4			//! Job registry entry state: job killed after a crash
+
 
 /**
  * \brief Struct to organize all the command line arguments.
@@ -93,22 +170,140 @@
  * Arguments:
  *   - verbose: enable debugging log output
  *   - port: port of the TCP server
+ *   - shards: number of shards to run (0 means one per online CPU)
+ *   - workers: number of prefork worker processes (0 disables prefork)
+ *   - recycle: sessions served by a worker before it is recycled (0 never)
+ *   - affinity: CPU affinity policy for sessions (AFFINITY_*)
+ *   - redirect: load (percent of a shard's capacity) from which new sessions
+ *     are redirected to a less loaded peer (0 never)
+ *   - record: directory to record session transcripts in (empty to not record)
+ *   - audit: file to log the commands to before they run (empty to not audit)
+ *   - config: config file with the runtime limits (empty to use the defaults)
+ *   - jobs: directory of the job registry (empty to use the default)
+ *   - foreground: stay in the foreground and log to stderr, instead of
+ *     daemonizing
+ *   - capture: record only the sessions' input (with `record`), for
+ *     yash-replay
  */
 typedef struct _cmd_args_t {
 	bool verbose;	// Logger verbose output
 	int port;		// Server port
+	int shards;		// Number of shards
+	int workers;	// Number of prefork workers
+	int recycle;	// Sessions per worker before recycling it
+	int affinity;	// Session CPU affinity policy
+	int redirect;	// Load to start redirecting sessions at
+	char record[PATHMAX+1];	// Session transcripts directory
+	char audit[PATHMAX+1];	// Audit log path
+	char config[PATHMAX+1];	// Config file path
+	char jobs[PATHMAX+1];	// Job registry directory
+	bool foreground;	// Do not daemonize
+	bool capture;		// Record the input only
 } cmd_args_t;
 
 
 /**
- * \brief Struct with all the arguments passed to a servant thread
+ * \brief Struct with the configuration of a listener, see listener.c
  */
-typedef struct _servant_th_args_t {
-	cmd_args_t cmd_args;		// Command line arguments
-	int idx;					// Thread table index
-	int ps;						// Socket fd
-	struct sockaddr_in from;	// Client connection information
-} servant_th_args_t;
+typedef struct _listener_conf {
+	char spec[PATHMAX+1];		// Address, as configured
+	int family;					// AF_INET or AF_UNIX
+	struct sockaddr_in in;		// Address of a TCP listener
+	char path[UNIX_PATH_LEN];	// Path of a Unix listener
+	int max_clients;			// Max sessions from the listener, or 0
+	int backlog;				// listen() backlog
+	int priority;				// LISTENER_NORMAL or LISTENER_HIGH
+} listener_conf_t;
+
+
+/**
+ * \brief Struct with the counters of a listener in this process
+ */
+typedef struct _listener {
+	uint32_t active;	// Sessions running
+	uint64_t sessions;	// Sessions accepted
+	uint64_t rejected;	// Sessions rejected (listener or shard full)
+} listener_t;
+
+
+/**
+ * \brief Struct for a source's token bucket, see admit.c
+ */
+typedef struct _admit_source {
+	uint64_t key;		// Source (IP address or UID), or 0 if the slot is free
+	uint64_t last;		// Time of the last connection (us, monotonic)
+	uint64_t tokens;	// Tokens left, in millionths
+} admit_source_t;
+
+
+/**
+ * \brief Struct with the runtime configuration, see config.c
+ *
+ * A snapshot is never modified once published. Reloading the config publishes
+ * a new snapshot, so readers take no lock: they load the current snapshot with
+ * getConfig() each time they need a value. Replaced snapshots are never freed,
+ * so a snapshot stays valid, if stale, for as long as a reader holds it.
+ *
+ * Values:
+ *   - max_clients: max sessions of the process, split between its shards
+ *   - max_jobs: max jobs per session
+ *   - connect_queue: listen() backlog of the listeners
+ *   - worker_respawn_delay: min seconds between respawns of a crashing worker
+ *   - registry_heartbeat: seconds between peer registry updates
+ *   - registry_stale: seconds without updates before a peer is ignored
+ *   - record_flush: max seconds an event waits in a partial recorder block
+ *   - relay_len: max session output relayed (and recorded) at once
+ *   - audit_window_us: max microseconds an audit record waits for others
+ *   - source_rate: connections per second a source may open, or 0
+ *   - source_burst: connections a source may open at once
+ *   - session_cap: max sessions of the process, or 0
+ *   - idle_timeout: seconds a session without jobs may be silent, or 0
+ *   - keepalive: seconds a TCP connection may be silent before it is probed,
+ *     or 0
+ *   - log: log path
+ *   - listeners: the server port, then the `listen` entries
+ */
+typedef struct _config {
+	int max_clients;			// Sessions per process
+	int max_jobs;				// Jobs per session
+	int connect_queue;			// Listener backlog
+	int worker_respawn_delay;	// Seconds between respawns of a crashing worker
+	int registry_heartbeat;		// Seconds between registry updates
+	int registry_stale;			// Seconds before a registry slot is ignored
+	int record_flush;			// Seconds an event may wait in a partial block
+	int relay_len;				// Bytes of session output relayed at once
+	int audit_window_us;		// Microseconds an audit record may wait
+	int source_rate;			// Connections per second per source
+	int source_burst;			// Connections at once per source
+	int session_cap;			// Sessions per process, all listeners
+	int idle_timeout;			// Seconds before a silent session is closed
+	int keepalive;				// Seconds before a silent connection is probed
+	char log[PATHMAX+1];		// Log path
+	int listener_count;			// Number of listeners
+	listener_conf_t listeners[MAX_LISTENERS];	// Listeners
+	const struct _config *retired;	// Snapshot this one replaced, kept for good
+} config_t;
+
+
+/**
+ * \brief Struct for a timer of a timer wheel, see wheel.c
+ */
+typedef struct _wheel_timer {
+	struct _wheel_timer *next;		// Next timer in the slot
+	struct _wheel_timer **pprev;	// Link to this timer, or NULL if not linked
+	uint64_t expires;				// Expiry time (wheelNow() seconds)
+} wheel_timer_t;
+
+
+/**
+ * \brief Struct for a hierarchical timer wheel, see wheel.c
+ */
+typedef struct _wheel {
+	wheel_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];	// Timer lists
+	uint64_t occupied[WHEEL_LEVELS];	// Slots in use, one bit per slot
+	uint64_t now;						// Last tick processed
+	uint32_t count;						// Timers linked
+} wheel_t;
 
 
 /**
@@ -118,11 +313,233 @@ typedef struct _servant_th_info {
 	pthread_t tid;
 	bool run;
 	int socket;
+	int listener;
+	wheel_timer_t idle_timer;		// Idle timer, on the shard's wheel
+	uint64_t last_active;			// Last client message or output (wheelNow())
+	struct _shell_info *shell;		// Session's shell info, once allocated
 	//int pid;
 	//int pthread_pipe_fd[2];
 } servant_th_info_t;
 
 
+/**
+ * \brief Struct for a log2 histogram, see hist.c
+ */
+typedef struct _hist {
+	uint64_t buckets[HIST_BUCKETS];	// Counts, bucket i holds values below 2^i
+	uint64_t count;					// Values added
+	uint64_t sum;					// Sum of the values added
+	uint64_t max;					// Largest value added
+} hist_t;
+
+
+/**
+ * \brief Message posted to a shard's message queue
+ *
+ * Cross-shard operations (admin queries, stop requests) never touch another
+ * shard's tables directly. They are posted to the target shard's queue, and
+ * the shard handles them from its own acceptor loop.
+ */
+typedef struct _shard_msg {
+	uint32_t type;	// SHARD_MSG_*
+	uint32_t arg;	// Message argument
+} shard_msg_t;
+
+
+/**
+ * \brief Struct with all the state owned by a shard
+ *
+ * Each shard owns a listener socket (bound with SO_REUSEPORT so the kernel
+ * balances connections across shards), an acceptor loop, and its own servant
+ * thread table and counters. Nothing in here is shared with other shards, so
+ * the hot path never takes a cross-shard lock. The client limit of the config
+ * is split evenly between shards, see shardMaxClients().
+ */
+typedef struct _shard {
+	int id;										// Shard number
+	int cpu;									// CPU the shard is pinned to, or -1
+	int sd[MAX_LISTENERS];						// Listener socket fds
+	int mq_fd[2];								// Message queue pipe
+	pthread_t tid;								// Acceptor thread
+	cpu_set_t cpus;								// CPUs the acceptor may run on
+	int rr_cpu;									// Last CPU picked round-robin
+	uint64_t max_sessions;						// Sessions before draining, or 0
+	int drain_fd;								// Notice pipe to the prefork master, or -1
+	servant_th_info_t servant_th_table[MAX_CONCURRENT_CLIENTS];	// Thread table
+	int servant_th_table_idx;					// New thread index in table
+	pthread_mutex_t servant_th_table_lock;		// Thread table lock
+	wheel_t wheel;								// Idle timers (table lock)
+	uint64_t reaped;							// Sessions closed for being idle
+	uint64_t lz_raw;							// Output bytes sent compressed, before
+	uint64_t lz_sent;							// Output bytes sent compressed, after
+	hist_t ctl_latency;							// Input to signal sent, for CTL c/z (us, table lock)
+	uint64_t sessions;							// Sessions accepted
+	uint64_t rejected;							// Sessions rejected (shard full)
+	uint64_t redirected;						// Sessions redirected to a peer
+	uint64_t cmds;								// Commands handled
+	uint64_t numa_local;						// Jobs run on the session's node
+	uint64_t numa_remote;						// Jobs run off the session's node
+} __attribute__((aligned(64))) shard_t;
+
+
+/**
+ * \brief Struct with the output compression state of a multiplexed connection
+ */
+typedef struct _mux_lz {
+	bool enabled;	// The client enabled FRAME_FLAG_LZ
+	int fails;		// Payloads in a row that did not compress
+	int skip;		// Payloads left to send raw before trying again
+} mux_lz_t;
+
+
+/**
+ * \brief Struct for a stream of a multiplexed connection
+ */
+typedef struct _mux_stream {
+	uint16_t id;		// Stream ID, chosen by the client
+	int fd;				// Multiplexer's end of the session's socket pair (non-blocking)
+	char *pending;		// Client input the session has not taken yet, or NULL
+	size_t pending_len;	// Bytes in pending
+} mux_stream_t;
+
+
+/**
+ * \brief Struct for a daemon process' entry in the peer registry
+ *
+ * The registry lives in shared memory, so the daemons on a host can see each
+ * other's load. Each process only writes its own slot.
+ */
+typedef struct _registry_slot {
+	pid_t pid;			// Daemon process, or 0 if the slot is free
+	int port;			// Server port
+	uint32_t sessions;	// Active sessions
+	uint32_t load;		// Active sessions, in percent of the capacity
+	time_t heartbeat;	// Time of the last update
+} registry_slot_t;
+
+
+/**
+ * \brief Struct for the header of the job registry file, see jobreg.c
+ */
+typedef struct _jobreg_hdr {
+	uint32_t magic;			// JOBREG_MAGIC, once the layout is set
+	uint32_t slots;			// Number of entries
+	uint32_t entry_size;	// Size of an entry
+	uint32_t orphans;		// Entries adopted or killed, not yet reported
+	uint32_t full;			// Jobs not registered for lack of room
+	uint32_t pad[11];
+} jobreg_hdr_t;
+
+
+/**
+ * \brief Struct for a job in the job registry file
+ *
+ * `state` is written last with a release store, so an entry in any state but
+ * JOBREG_FREE and JOBREG_BUSY is complete.
+ */
+typedef struct _jobreg_entry {
+	uint32_t state;					// JOBREG_FREE, JOBREG_LIVE...
+	pid_t owner;					// Daemon process running the job
+	pid_t pgid;						// Process group of the job
+	pid_t pid;						// Last process of the job
+	uint32_t bg;					// Background job
+	pid_t sid;						// Session of the daemon that started the job
+	uint64_t token;					// Session token (client address, session)
+	uint64_t cmd_hash;				// FNV-1a hash of the command
+	uint64_t start;					// Start time (us since the epoch)
+	char cmd[JOBREG_CMD_LEN];		// Command, truncated
+} jobreg_entry_t;
+
+
+/**
+ * \brief Struct with the state of the audit log
+ *
+ * Records are queued in `bufs[fill]` while the writer thread commits the other
+ * buffer.
+ */
+typedef struct _audit {
+	int fd;								// Audit log file
+	pthread_mutex_t lock;				// Audit log lock
+	pthread_cond_t pending_cond;		// Signaled when a record is queued
+	pthread_cond_t durable_cond;		// Signaled when a batch is committed
+	char bufs[2][AUDIT_BUF_LEN];		// Record buffers
+	int fill;							// Buffer records are queued in
+	size_t len;							// Length of the records queued
+	uint64_t queued_seq;				// Sequence number of the last record queued
+	uint64_t durable_seq;				// Sequence number of the last record durable
+	uint64_t commits;					// Batches committed
+	bool broken;						// A batch could not be committed
+	hist_t latency;						// Commit latency (us)
+	hist_t batch;						// Records per batch
+} audit_t;
+
+
+/**
+ * \brief Struct for a block of the session recorder, being filled or sealed
+ */
+typedef struct _record_buf {
+	uint8_t data[RECORD_BLOCK_SIZE];	// Events
+	uint32_t len;						// Length of the events
+	record_idx_t idx;					// Index entry of the block
+} record_buf_t;
+
+
+/**
+ * \brief Struct with the state of the session recorder
+ *
+ * The blocks form a ring: `bufs[fill]` is being filled, and the `sealed`
+ * blocks before it wait (oldest first) for the recorder thread to write them.
+ */
+typedef struct _recorder {
+	char dir[PATHMAX+1];					// Directory of the files
+	record_buf_t bufs[RECORD_BUFFERS];		// Block ring
+	int fill;								// Block being filled
+	int sealed;								// Blocks waiting to be written
+	pthread_mutex_t lock;					// Block ring lock
+	pthread_cond_t sealed_cond;				// Signaled when a block is sealed
+	pthread_cond_t free_cond;				// Signaled when a block is written
+	uint8_t comp[RECORD_BLOCK_SIZE];		// Compression buffer
+	char day[9];							// Day of the open files (YYYYMMDD)
+	int seg_fd;								// Segment file, or -1
+	int idx_fd;								// Index file, or -1
+	uint64_t seg_off;						// Segment file length
+	uint32_t sessions;						// Sessions recorded
+	uint64_t events;						// Events recorded
+	uint64_t waits;							// Times a session waited for a block
+	uint64_t blocks;						// Blocks written
+	uint64_t raw_bytes;						// Bytes of events written
+	uint64_t stored_bytes;					// Bytes written to segments
+	uint64_t lost;							// Blocks that could not be written
+} recorder_t;
+
+
+/**
+ * \brief Struct with the master's view of a prefork worker process
+ */
+typedef struct _worker_info {
+	pid_t pid;			// PID of the worker accepting, or 0 if none
+	int slot;			// Shard slot of the worker accepting
+	time_t started;		// Time the worker was spawned
+	time_t respawn_at;	// Time a replacement is due, or 0 if none
+	uint64_t spawns;	// Number of times the worker was spawned
+} worker_info_t;
+
+
+/**
+ * \brief Struct with all the arguments passed to a servant thread
+ */
+typedef struct _servant_th_args_t {
+	cmd_args_t cmd_args;		// Command line arguments
+	int idx;					// Thread table index
+	int ps;						// Socket fd
+	struct sockaddr_in from;	// Client connection information
+	shard_t *shard;				// Shard owning the session
+	int cpu;					// CPU the session is pinned to, or -1
+	int listener;				// Listener the session came from
+	bool stream;				// Session is a stream of a multiplexed connection
+} servant_th_args_t;
+
+
 /**
  * \brief Struct to organize all information of a shell command.
  *
@@ -165,6 +582,13 @@ typedef struct _job_info {
 	uint8_t jobno;						// Job number
 	char status[MAX_STATUS_LEN];		// Status of the process group
 	char err_msg[MAX_ERROR_LEN];		// Error message
+	int reg_slot;						// Job registry entry, or -1
+	pid_t last_pid;						// PID of the last process, whose status is the job's
+	uint8_t live;						// Processes not reaped yet (bit 0: first, bit 1: last of a pipe)
+	int wait_status;					// Wait status of the last process, or -1
+	uint64_t start_us;					// Time the job started (monotonic us)
+	uint64_t user_us;					// User CPU time of the processes reaped
+	uint64_t sys_us;					// System CPU time of the processes reaped
 } job_info_t;
 
 
@@ -180,16 +604,49 @@ typedef struct _job_th_info {
 } job_th_info_t;
 
 
+/**
+ * \brief Output sink and hooks of the shell engine
+ *
+ * The engine (shell.c, libyashshell.a) runs jobs without knowing where their
+ * output goes: the jobs get `fd` as their stdout and stderr, and the shell's
+ * own messages go through `write`. The daemon points `fd` at the session
+ * socket; a harness may point it at a file and capture the messages.
+ */
+typedef struct _shell_host {
+	int fd;						// Stdout and stderr of the jobs
+	void *ctx;					// Owner's data, for the hooks
+	ssize_t (*write)(struct _shell_info *shell_info, const void *buf,
+			size_t len);		// Shell messages, or NULL to write() them to `fd`
+	int (*audit)(struct _shell_info *shell_info, const char *cmd);	// Called before a job runs, < 0 to refuse it, or NULL
+	void (*job_started)(struct _shell_info *shell_info, job_info_t *job,
+			pid_t pid);			// Called once a job's processes run, or NULL
+	void (*job_ended)(job_info_t *job);	// Called when a job leaves the table, or NULL
+	int (*max_jobs)(void);		// Max jobs per session, or NULL for MAX_CONCURRENT_JOBS
+} shell_host_t;
+
+
 /**
  * \brief Information necessary for the shell to run jobs
  */
 typedef struct _shell_info {
 	servant_th_args_t th_args;					// Thread arguments pointer
+	shell_host_t host;							// Output sink and hooks of the engine
+	pthread_mutex_t lock;						// Shell info lock
+	int numa_node;								// NUMA node of the session's CPU, or -1
 	int stdin_pipe_fd[2];						// FDs of pipe to the stdin of the foreground process
 	job_info_t job_table[MAX_CONCURRENT_JOBS];	// Jobs table
 	int job_table_idx;							// Number of jobs in table
 	job_th_info_t job_th_table[MAX_CONCURRENT_JOBS];	// Job thread table
 	int job_th_table_idx;							// Number of job threads in table
+	pid_t fg_pgid;								// Process group of the foreground job, or 0 (atomic)
+	bool closing;								// Session ending, no more jobs are started
+	int rec_fd;									// Recorder's end of the output socket pair, or -1
+	int rec_sock;								// Client socket, while recording
+	uint64_t session_id;						// Session ID in the recordings, or 0 if not recorded
+	uint64_t token;								// Session token in the job registry
+	int proto_version;							// Protocol version negotiated, 0 without HELLO
+	uint32_t features;							// PROTO_FEAT_* the session may use
+	uint32_t max_frame;							// Max frame payload the client takes
 } shell_info_t;
 
 
@@ -217,51 +674,67 @@ typedef struct _msg{
  * @brief Struct to organize the received messages from the client
  */
 typedef struct _msg_args {
-	char type[4];				// CMD/CTL
+	char type[8];				// CMD/CTL/HELLO
 	char args[MAX_CMD_LEN+1];	// Message arguments
 } msg_args_t;
 
 
+/**
+ * @brief Struct with the state takeSignals() passes to each signal line
+ */
+typedef struct _signal_ctx {
+	shell_info_t *shell_info;	// Session
+	uint64_t read_us;			// Time the input was read (nowUs())
+} signal_ctx_t;
+
+
 // Globals
-cmd_args_t args;
-pthread_mutex_t shell_info_lock;						//! Shell info lock
+extern cmd_args_t args;
+extern shard_t *shards;
+extern int shard_count;
+extern listener_t listeners[MAX_LISTENERS];
+extern int listener_count;
 
 
 // Functions
 bool ignoreInput(char* input_str);
 void removeJob(int job_idx, shell_info_t *shell_info);
 void printJob(int job_idx, shell_info_t *shell_info);
-void bgExec();
-void fgExec();
+void bgExec(shell_info_t *shell_info);
+void fgExec(shell_info_t *shell_info);
 void jobsExec(shell_info_t *shell_info);
 bool runShellComd(char* input, shell_info_t *shell_info);
 void tokenizeString(job_info_t* cmd_tok);
 void parseJob(char* cmd_str, shell_info_t *shell_info);
 void redirectSimple(job_info_t* cmd);
 void redirectPipe(job_info_t* cmd);
+pid_t reapJobProcess(job_info_t *job, int proc, int options, int *status);
 void waitForChildren(job_info_t* cmd, shell_info_t *shell_info);
+void sendJobExit(job_info_t *job, shell_info_t *shell_info);
 void runJob(shell_info_t *shell_info);
 void handleNewJob(char* input, shell_info_t *shell_info);
 void maintainJobsTable(shell_info_t *shell_info);
 void killAllJobs(shell_info_t *shell_info);
 int startJob(char *job_str, shell_info_t *shell_info);
-
+ssize_t shellOut(shell_info_t *shell_info, const void *buf, size_t len);
 char *timeStr(char *buff, int size);
+
 bool isNumber(char number[]);
 cmd_args_t parseArgs(int argc, char** argv);
 void sigPipe(int n);
-void sigChld(int n);
 void daemonInit(const char *const path, uint mask);
 void reusePort(int sock);
+void setKeepalive(int s);
+void setNoDelay(int s);
 int createSocket(int port);
 int recvMsg(int socket, msg_t *buffer);
 int sendMsg(int socket, msg_t *buffer);
-void printServantThTable();
-int searchServantThByTid(pthread_t tid);
-void removeServantThFromTableByIdx(int idx);
-void removeServantThFromTableByTid(pthread_t tid);
-void stopAllServantThreads();
-void exitServantThreadSafely();
+void printServantThTable(shard_t *shard);
+int searchServantThByTid(pthread_t tid, shard_t *shard);
+void removeServantThFromTableByIdx(int idx, shard_t *shard);
+void removeServantThFromTableByTid(pthread_t tid, shard_t *shard);
+void stopAllServantThreads(shard_t *shard);
+void exitServantThreadSafely(shard_t *shard);
 void printJobThTable(shell_info_t *shell_info);
 int searchJobThByTid(pthread_t tid, shell_info_t *shell_info);
 void removeJobThFromTableByIdx(int idx, shell_info_t *shell_info);
@@ -269,10 +742,105 @@ void removeJobThFromTableByTid(pthread_t tid, shell_info_t *shell_info);
 void stopAllJobThreads(shell_info_t *shell_info);
 void exitJobThreadSafely(shell_info_t *shell_info);
 msg_args_t parseMessage(char *msg);
-void handleCTLMessages(char arg, shell_info_t *shell_info);
+size_t takeCtlLines(char *buf, size_t len, void (*on_signal)(char, void *),
+		void *ctx);
+bool handleCTLMessages(char arg, shell_info_t *shell_info);
+size_t takeSignals(char *buf, size_t len, shell_info_t *shell_info,
+		uint64_t read_us);
+void handleHelloMessages(char *arguments, shell_info_t *shell_info);
 void handleCMDMessages(char *args, shell_info_t *shell_info);
+shell_info_t *allocShellInfo(int cpu);
+void freeShellInfo(shell_info_t *shell_info);
+void releaseShellInfo(shell_info_t *shell_info);
 void *servantThread(void *args);
+int startServantThread(shard_t *shard, int ps, struct sockaddr_in from,
+		int listener, bool stream);
 int main(int argc, char** argv);
 
+int initShards(int count, int *sds);
+void *shardThread(void *shard_arg);
+bool acceptSession(shard_t *shard, int idx);
+void runShard(shard_t *shard);
+void postShardMsg(shard_t *shard, uint32_t type, uint32_t arg);
+void broadcastShardMsg(uint32_t type, uint32_t arg);
+bool handleShardMsg(shard_t *shard, shard_msg_t *msg);
+int pickSessionCpu(shard_t *shard);
+int cpuNode(int cpu);
+int countServantThreads(shard_t *shard);
+int shardMaxClients();
+void sigHup(int sig);
+void drainServantThreads(shard_t *shard);
+void sigUsr1(int sig);
+
+void sigUsr1Master(int sig);
+void sigHupMaster(int sig);
+pid_t spawnWorker(int idx, int slot, int *sds);
+void notifyWorkerDraining(int fd);
+void logWorkerStats();
+void runMaster(int workers, int port);
+
+int startRegistry();
+void updateRegistry();
+void *registryThread(void *thread_args);
+int pickPeer(uint32_t load);
+int pickRedirect(int ps, int active);
+void redirectSession(shard_t *shard, int ps, int port);
+
+int openStream(shell_info_t *shell_info, mux_stream_t *streams, int *count,
+		uint16_t id);
+void closeStream(mux_stream_t *streams, int *count, int idx);
+void runMux(shell_info_t *shell_info);
+
+int startRecorder(const char *dir);
+void *recorderThread(void *thread_args);
+void recordEvent(uint64_t session, uint8_t type, const void *data,
+		uint32_t len);
+void logRecorderStats();
+int startSessionRecording(shell_info_t *shell_info);
+int relaySessionOutput(shell_info_t *shell_info);
+void recordSessionInput(shell_info_t *shell_info, const char *msg, int len);
+void stopSessionRecording(shell_info_t *shell_info);
+
+int startAudit(const char *path);
+void *auditThread(void *thread_args);
+int auditCommand(shell_info_t *shell_info, const char *cmd);
+void logAuditStats();
+
+void histAdd(hist_t *hist, uint64_t value);
+uint64_t histPercentile(const hist_t *hist, int pct);
+void histLog(const char *name, const hist_t *hist);
+
+int startConfig(const char *path);
+config_t *loadConfig(const char *path);
+const config_t *getConfig();
+int reloadConfig();
+
+int parseListener(const char *spec, listener_conf_t *conf);
+int createListener(int idx);
+int openListeners(int *sds, int *shared, bool all);
+bool admitSession(int idx, int active, int *reason);
+void releaseSession(int idx);
+uint32_t activeSessions();
+void logListenerStats();
+bool admitConnection(int ps, const struct sockaddr_storage *addr);
+void rejectConnection(int ps, int reason);
+void logAdmitStats();
+uint64_t wheelNow();
+void wheelAdd(wheel_t *wheel, wheel_timer_t *timer, uint64_t expires);
+void wheelDel(wheel_t *wheel, wheel_timer_t *timer);
+int wheelAdvance(wheel_t *wheel, uint64_t now,
+		void (*expire)(wheel_timer_t *timer, void *arg), void *arg);
+int wheelTimeout(wheel_t *wheel, uint64_t now);
+void armIdleTimer(shard_t *shard, int idx);
+void touchSession(shard_t *shard, int idx);
+int reapIdleSessions(shard_t *shard);
+
+int startJobRegistry(int port);
+void newSessionToken(shell_info_t *shell_info);
+void jobRegAdd(shell_info_t *shell_info, job_info_t *job, pid_t pid);
+void jobRegRemove(job_info_t *job);
+void reportOrphanJobs(shell_info_t *shell_info);
+void logJobRegStats();
+
 #endif
 
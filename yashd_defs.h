@@ -20,6 +20,20 @@
 #define TCP_PORT_LOWER_LIM	1024	//! Lowest TCP port allowed
 #define TCP_PORT_HIGHER_LIM	65535	//! Highest TCP port allowed
 
+#define MSG_TYPE_REDIRECT	"REDIRECT "	//! Redirect line sent instead of the prompt
+#define MAX_REDIRECTS		3			//! Max redirects a client follows
+#define MSG_TYPE_BUSY		"BUSY "		//! Busy line sent instead of the prompt
+
+#define MSG_TYPE_HELLO		"HELLO "	//! Handshake line, see README
+#define PROTO_VERSION		1			//! Protocol version spoken
+#define PROTO_FEAT_MUX		0x01		//! Feature: multiplexed sessions (MUX)
+#define PROTO_FEAT_LZ		0x02		//! Feature: compressed output frames
+#define PROTO_FEAT_EXIT		0x04		//! Feature: EXIT line after each job
+#define PROTO_FEATURES		(PROTO_FEAT_MUX | PROTO_FEAT_LZ | PROTO_FEAT_EXIT)	//! Features supported
+#define PROTO_FEAT_LEGACY	(PROTO_FEAT_MUX | PROTO_FEAT_LZ)	//! Features of clients without HELLO
+#define MSG_TYPE_EXIT		"EXIT "		//! Job status line, see README
+#define EXIT_LINE_LEN		(sizeof(MSG_TYPE_EXIT) + 11 + 1 + 7 + 1 + 11 + 3 * (1 + 20) + 1)	//! EXIT line "EXIT %d %s %d %lu %lu %lu\n" and its NUL
+
 #define EMPTY_STR "\0"
 #define EMPTY_ARRAY -1
 